@@ -1,4 +1,4 @@
-// gcc -o drmgl Linux_DRM_OpenGLES.c `pkg-config --cflags --libs libdrm` -lgbm -lEGL -lGLESv2
+// gcc -o eglstreams eglstreams.c `pkg-config --cflags --libs libdrm` -lEGL -lGLESv2 -lm -pthread
 
 /*
  * Copyright (c) 2012 Arvin Schnell <arvin.schnell@gmail.com>
@@ -27,21 +27,37 @@
 
 /* Based on a egl cube test app originally written by Arvin Schnell */
 
+#define _GNU_SOURCE // memfd_create, accept4
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h> // offsetof
 #include <errno.h>   // errno
 #include <stdbool.h> // bool
+#include <inttypes.h> // PRIx64
 #include <unistd.h>  // close
+#include <pthread.h> // pthread_once
+#include <getopt.h>  // getopt_long
+#include <poll.h>    // poll
+#include <signal.h>  // sigprocmask
+#include <stdatomic.h> // atomic_bool
+#include <time.h>    // clock_gettime
 
 #include <sys/mman.h> // mmap
+#include <sys/eventfd.h> // eventfd
+#include <sys/signalfd.h> // signalfd
+#include <sys/uio.h> // writev
+#include <sys/sysmacros.h> // major, minor
+#include <dirent.h> // opendir
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <libdrm/drm_mode.h> // DRM_MODE_XXX
+#include <libdrm/drm_fourcc.h> // DRM_FORMAT_XXX
 
 #define GL_GLEXT_PROTOTYPES 1
 #include <GLES2/gl2.h>
@@ -50,6 +66,10 @@
 #include <EGL/eglext.h>
 
 #include <assert.h>
+#include <math.h> // powf
+
+#include "myy_recording.h"
+#include "myy_frame_export.h"
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
@@ -66,25 +86,523 @@
 	fprintf(stderr, fmt "\n", ##__VA_ARGS__); \
 } while(0)
 
+/* Memory.
+ *
+ * Building a frame must never touch malloc : a malloc that happens to
+ * take a lock, or to ask the kernel for more pages, in the middle of
+ * a frame, is a missed vblank waiting to happen.
+ *
+ * - Data that only lives during one frame (draw commands, vertices,
+ *   sort scratch...) comes from the frame arena. A bump allocator
+ *   reset at the start of every frame.
+ *   When a frame asks for more than the arena holds, the extra memory
+ *   comes from the heap, and the arena is resized at the next reset
+ *   to fit the new high-water mark. Only the first frames pay that.
+ * - Objects living longer, but created and destroyed while running,
+ *   come from fixed-size pools allocated at setup.
+ * - The heap allocations done by the render thread while building a
+ *   frame are counted, and reported by the telemetry.
+ *   With --assert-zero-alloc, any such allocation after the warm-up
+ *   frames aborts the program.
+ */
+#define MYY_FRAME_ARENA_DEFAULT_SIZE (1u << 20)
+#define MYY_ARENA_ALIGNMENT (32)
+
+struct myy_arena_overflow {
+	struct myy_arena_overflow * next;
+	/* The allocation follows */
+};
+
+struct myy_arena {
+	uint8_t * base;
+	size_t size;
+	size_t used;
+	/* Memory needed by the biggest frame since the last reset */
+	size_t needed;
+	size_t high_water;
+	struct myy_arena_overflow * overflows;
+	/* Statistics since the last reset */
+	uint32_t allocations;
+	uint32_t overflow_allocations;
+};
+
+struct myy_heap_counters {
+	uint64_t allocations;
+	uint64_t bytes;
+};
+
+/* Only the render thread, only while building a frame */
+static __thread bool myy_heap_counting;
+static __thread struct myy_heap_counters myy_heap_counters;
+
+/* Build with -DMYY_HEAP_COUNTERS to count the heap allocations.
+ * The libc allocator entry points are then replaced, so that the
+ * allocations done by libraries on our behalf (libdrm, qsort, ...)
+ * are counted too. This relies on glibc internals, so it's not
+ * built by default.
+ * The sanitizers have their own malloc, so leave them alone. */
+#if defined(MYY_HEAP_COUNTERS) && (!defined(__GLIBC__) \
+    || defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__))
+#warning "Heap counters need glibc, without sanitizers. Disabled."
+#undef MYY_HEAP_COUNTERS
+#endif
+
+#if defined(MYY_HEAP_COUNTERS)
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t n, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void * __libc_memalign(size_t alignment, size_t size);
+
+static inline void myy_heap_count(size_t const size)
+{
+	if (myy_heap_counting) {
+		myy_heap_counters.allocations++;
+		myy_heap_counters.bytes += size;
+	}
+}
+
+void * malloc(size_t size)
+{
+	myy_heap_count(size);
+	return __libc_malloc(size);
+}
+
+void * calloc(size_t n, size_t size)
+{
+	myy_heap_count(n * size);
+	return __libc_calloc(n, size);
+}
+
+void * realloc(void * ptr, size_t size)
+{
+	myy_heap_count(size);
+	return __libc_realloc(ptr, size);
+}
+
+void * aligned_alloc(size_t alignment, size_t size)
+{
+	myy_heap_count(size);
+	return __libc_memalign(alignment, size);
+}
+
+void * memalign(size_t alignment, size_t size)
+{
+	myy_heap_count(size);
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void ** memptr, size_t alignment, size_t size)
+{
+	if ((alignment == 0)
+	    | ((alignment & (alignment - 1)) != 0)
+	    | ((alignment % sizeof(void *)) != 0))
+		return EINVAL;
+
+	myy_heap_count(size);
+	void * const ptr = __libc_memalign(alignment, size);
+	if (ptr == NULL)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+#endif
+
+/* Returns the previous state, to restore it afterwards.
+ * Driver calls are excluded from the count : what the driver does
+ * in there is its own business. The myy_gl_* wrappers do it on
+ * their own. Direct GL and EGL calls made while building a frame
+ * must be put between two calls of this function. */
+static bool myy_heap_counting_set(bool const enabled)
+{
+	bool const previous = myy_heap_counting;
+	myy_heap_counting = enabled;
+	return previous;
+}
+
+static int myy_arena_init(
+	struct myy_arena * __restrict const arena,
+	size_t const size)
+{
+	memset(arena, 0, sizeof(*arena));
+	arena->base = aligned_alloc(MYY_ARENA_ALIGNMENT, size);
+	if (arena->base == NULL) {
+		LOG_ERROR("Could not allocate a %zu bytes arena", size);
+		return -1;
+	}
+	arena->size = size;
+	return 0;
+}
+
+static void myy_arena_free_overflows(struct myy_arena * __restrict const arena)
+{
+	struct myy_arena_overflow * __restrict overflow = arena->overflows;
+	while (overflow != NULL) {
+		struct myy_arena_overflow * __restrict const next = overflow->next;
+		free(overflow);
+		overflow = next;
+	}
+	arena->overflows = NULL;
+}
+
+static void myy_arena_deinit(struct myy_arena * __restrict const arena)
+{
+	myy_arena_free_overflows(arena);
+	free(arena->base);
+	memset(arena, 0, sizeof(*arena));
+}
+
+/* Forgets every allocation. If the last frame didn't fit, the arena
+ * grows now, between two frames. */
+static void myy_arena_reset(struct myy_arena * __restrict const arena)
+{
+	if (arena->overflows != NULL) {
+		size_t size = arena->size;
+		while (size < arena->needed)
+			size *= 2;
+
+		uint8_t * __restrict const base =
+			aligned_alloc(MYY_ARENA_ALIGNMENT, size);
+		if (base != NULL) {
+			free(arena->base);
+			arena->base = base;
+			arena->size = size;
+			LOGF("Frame arena grown to %zu KiB", size / 1024);
+		}
+		myy_arena_free_overflows(arena);
+	}
+
+	arena->high_water = (arena->needed > arena->high_water)
+		? arena->needed
+		: arena->high_water;
+	arena->used = 0;
+	arena->needed = 0;
+	arena->allocations = 0;
+	arena->overflow_allocations = 0;
+}
+
+static void * myy_arena_alloc(
+	struct myy_arena * __restrict const arena,
+	size_t const size)
+{
+	size_t const aligned_size =
+		(size + MYY_ARENA_ALIGNMENT - 1) & ~(size_t) (MYY_ARENA_ALIGNMENT - 1);
+
+	arena->allocations++;
+	arena->needed += aligned_size;
+
+	if (arena->size - arena->used >= aligned_size) {
+		void * const allocation = arena->base + arena->used;
+		arena->used += aligned_size;
+		return allocation;
+	}
+
+	/* Doesn't fit. Take it from the heap for this frame. */
+	struct myy_arena_overflow * __restrict const overflow = aligned_alloc(
+		MYY_ARENA_ALIGNMENT, MYY_ARENA_ALIGNMENT + aligned_size);
+	if (overflow == NULL)
+		return NULL;
+	overflow->next = arena->overflows;
+	arena->overflows = overflow;
+	arena->overflow_allocations++;
+	return ((uint8_t *) overflow) + MYY_ARENA_ALIGNMENT;
+}
+
+/* Grows the last allocation in place when possible. Otherwise, moves
+ * it to a new allocation. The old one is lost until the next reset. */
+static void * myy_arena_grow(
+	struct myy_arena * __restrict const arena,
+	void * const allocation,
+	size_t const old_size,
+	size_t const new_size)
+{
+	size_t const aligned_old =
+		(old_size + MYY_ARENA_ALIGNMENT - 1) & ~(size_t) (MYY_ARENA_ALIGNMENT - 1);
+	size_t const aligned_new =
+		(new_size + MYY_ARENA_ALIGNMENT - 1) & ~(size_t) (MYY_ARENA_ALIGNMENT - 1);
+	bool const is_last =
+		(allocation != NULL)
+		&& ((uint8_t *) allocation + aligned_old == arena->base + arena->used);
+
+	if (is_last && (arena->size - arena->used) >= (aligned_new - aligned_old)) {
+		arena->used   += aligned_new - aligned_old;
+		arena->needed += aligned_new - aligned_old;
+		return allocation;
+	}
+
+	void * const moved = myy_arena_alloc(arena, new_size);
+	if (moved != NULL && allocation != NULL)
+		memcpy(moved, allocation, old_size);
+	return moved;
+}
+
+static struct myy_arena myy_frame_arena;
+
+/* Fixed-size objects pool. Every object is allocated at setup.
+ * Getting and putting back objects is O(1) and never allocates. */
+struct myy_pool {
+	uint8_t * objects;
+	uint32_t * free_list;
+	size_t object_size;
+	uint32_t capacity;
+	uint32_t n_free;
+	uint32_t high_water;
+	uint32_t exhausted;
+};
+
+static int myy_pool_init(
+	struct myy_pool * __restrict const pool,
+	size_t const object_size,
+	uint32_t const capacity)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->object_size =
+		(object_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	pool->objects = calloc(capacity, pool->object_size);
+	pool->free_list = malloc(capacity * sizeof(uint32_t));
+	if (pool->objects == NULL || pool->free_list == NULL) {
+		free(pool->objects);
+		free(pool->free_list);
+		memset(pool, 0, sizeof(*pool));
+		return -1;
+	}
+
+	/* Hand out the first objects first */
+	for (uint32_t o = 0; o < capacity; o++)
+		pool->free_list[o] = capacity - 1 - o;
+	pool->capacity = capacity;
+	pool->n_free = capacity;
+	return 0;
+}
+
+static void myy_pool_deinit(struct myy_pool * __restrict const pool)
+{
+	free(pool->objects);
+	free(pool->free_list);
+	memset(pool, 0, sizeof(*pool));
+}
+
+static inline void * myy_pool_object(
+	struct myy_pool const * __restrict const pool,
+	uint32_t const index)
+{
+	return pool->objects + index * pool->object_size;
+}
+
+/* Returns NULL when every object is in use */
+static void * myy_pool_get(struct myy_pool * __restrict const pool)
+{
+	if (pool->n_free == 0) {
+		pool->exhausted++;
+		return NULL;
+	}
+
+	uint32_t const index = pool->free_list[--pool->n_free];
+	uint32_t const in_use = pool->capacity - pool->n_free;
+	pool->high_water = (in_use > pool->high_water) ? in_use : pool->high_water;
+	return myy_pool_object(pool, index);
+}
+
+static void myy_pool_put(
+	struct myy_pool * __restrict const pool,
+	void * const object)
+{
+	size_t const index =
+		((uint8_t *) object - pool->objects) / pool->object_size;
+	assert(index < pool->capacity && pool->n_free < pool->capacity);
+	pool->free_list[pool->n_free++] = (uint32_t) index;
+}
+
+/* The EGL extensions we know about, and might check for.
+ * See myy_egl_caps_parse. */
+#define MYY_EGL_EXTENSIONS(X) \
+	X(EGL_EXT_device_base) \
+	X(EGL_EXT_device_enumeration) \
+	X(EGL_EXT_device_query) \
+	X(EGL_EXT_device_drm) \
+	X(EGL_EXT_device_query_name) \
+	X(EGL_EXT_device_persistent_id) \
+	X(EGL_EXT_platform_base) \
+	X(EGL_EXT_platform_device) \
+	X(EGL_EXT_output_base) \
+	X(EGL_EXT_output_drm) \
+	X(EGL_KHR_stream) \
+	X(EGL_KHR_stream_attrib) \
+	X(EGL_KHR_stream_cross_process_fd) \
+	X(EGL_KHR_stream_producer_eglsurface) \
+	X(EGL_EXT_stream_consumer_egloutput) \
+	X(EGL_EXT_stream_acquire_mode) \
+	X(EGL_NV_stream_metadata) \
+	X(EGL_NV_output_drm_flip_event) \
+	X(EGL_KHR_fence_sync) \
+	X(EGL_KHR_wait_sync) \
+	X(EGL_KHR_surfaceless_context) \
+	X(EGL_KHR_no_config_context) \
+	X(EGL_KHR_create_context) \
+	X(EGL_KHR_image_base) \
+	X(EGL_EXT_image_dma_buf_import) \
+	X(EGL_EXT_image_dma_buf_import_modifiers) \
+	X(EGL_MESA_image_dma_buf_export)
+
+#define MYY_EGL_EXT_ENUM(name) MYY_##name,
+enum myy_egl_extension {
+	MYY_EGL_EXTENSIONS(MYY_EGL_EXT_ENUM)
+	MYY_EGL_EXTENSIONS_COUNT
+};
+#undef MYY_EGL_EXT_ENUM
+
+#define MYY_EGL_EXT_NAME(name) #name,
+static char const * const myy_egl_extension_names[] = {
+	MYY_EGL_EXTENSIONS(MYY_EGL_EXT_NAME)
+};
+#undef MYY_EGL_EXT_NAME
+
+struct myy_egl_caps {
+	uint64_t bits[(MYY_EGL_EXTENSIONS_COUNT + 63) / 64];
+};
+
+/* What the application actually needs from the framebuffer.
+ * Everything not asked for is memory bandwidth wasted on every
+ * frame, so ask only for what's really used. */
+struct myy_egl_config_needs {
+	EGLint depth_bits;
+	EGLint stencil_bits;
+	EGLint samples;
+	bool alpha;
+	bool allow_rgb565;
+	/* Pbuffers instead of EGLStreams. For a render-only device. */
+	bool offscreen;
+};
+
 struct myy_opengl_infos {
 	EGLDisplay display;
 	EGLConfig config;
 	EGLContext context;
 	EGLSurface surface;
 	EGLStreamKHR stream;
+	struct myy_egl_config_needs config_needs;
+	struct myy_egl_caps display_caps;
 };
 typedef struct myy_opengl_infos myy_opengl_infos_t;
 
+struct myy_drm_atomic_props_ids {
+	struct {
+		uint32_t mode_id;
+		uint32_t active;
+		/* Optional colour management properties */
+		uint32_t degamma_lut;
+		uint32_t ctm;
+		uint32_t gamma_lut;
+	} crtc;
+	struct {
+		uint32_t crtc_id;
+	} connector;
+	struct myy_drm_plane_props_ids {
+		uint32_t src_x;
+		uint32_t src_y;
+		uint32_t src_w;
+		uint32_t src_h;
+		uint32_t crtc_x;
+		uint32_t crtc_y;
+		uint32_t crtc_w;
+		uint32_t crtc_h;
+		uint32_t fb_id;
+		uint32_t crtc_id;
+		uint32_t alpha;
+	} plane;
+};
+
+/* Colour correction done by the display engine, on the way out.
+ *
+ * The CRTC colour pipeline is :
+ *   pixels -> DEGAMMA_LUT -> CTM -> GAMMA_LUT -> connector
+ * Doing it there is free, while doing it in a fullscreen shader pass
+ * costs a read and a write of every pixel, every frame.
+ *
+ * A gamma (or degamma) of 0 means "leave that LUT alone".
+ */
+struct myy_color_profile {
+	float degamma;
+	float gamma;
+	bool has_ctm;
+	float ctm[9]; /* Row-major 3x3 matrix */
+};
+
+/* The LUT and CTM blobs are small, but creating one is still an ioctl
+ * and a copy into the kernel.
+ * So remember the blobs we created, indexed by the hash of their
+ * content, and reuse them when the same content shows up again.
+ */
+#define MYY_DRM_BLOB_CACHE_SIZE (8)
+struct myy_drm_blob_cache_entry {
+	uint64_t hash;
+	uint32_t size;
+	uint32_t blob_id;
+};
+
+struct myy_drm_blob_cache {
+	uint32_t next_victim;
+	struct myy_drm_blob_cache_entry entries[MYY_DRM_BLOB_CACHE_SIZE];
+};
+
+struct myy_drm_color {
+	struct myy_color_profile profile;
+	uint32_t degamma_lut_size;
+	uint32_t gamma_lut_size;
+	/* Also set when the CRTC has no LUT at all, so that it isn't
+	 * queried again on every commit. */
+	bool lut_sizes_known;
+	struct myy_drm_blob_cache blobs;
+};
+
+/* What a plane can scan out, as (fourcc, modifier) pairs, read from
+ * the plane "IN_FORMATS" blob.
+ * The pairs are stored in an open-addressing hash table, so that
+ * "Can this plane scan out NV12 with that modifier ?" doesn't require
+ * walking the blob again.
+ * A fourcc of 0 marks an empty slot.
+ */
+struct myy_drm_format_pair {
+	uint32_t fourcc;
+	uint64_t modifier;
+};
+
+struct myy_drm_plane_formats {
+	uint32_t plane_id;
+	uint32_t n_pairs;
+	uint32_t capacity; /* Power of two */
+	struct myy_drm_format_pair * pairs;
+};
+
 struct myy_drm_infos {
 	int fd;
 	drmModeModeInfo mode;
 	uint32_t crtc_id;
+	/* Planes refer to CRTCs by index (possible_crtcs) */
+	uint32_t crtc_index;
 	uint32_t plane_id;
 	uint32_t connector_id;
+	/* A writeback connector that can be fed by our CRTC. 0 if none. */
+	uint32_t writeback_connector_id;
 	uint32_t width;
 	uint32_t height;
 	uint32_t framebuffer_id;
 	uint32_t has_alpha;
+	/* The dumb buffer behind framebuffer_id, and the blob of the
+	 * mode set on the CRTC. Kept to be released by
+	 * nvidia_drm_close. */
+	uint32_t dumb_handle;
+	uint32_t dumb_pitch;
+	uint64_t dumb_size;
+	uint8_t * dumb_map;
+	uint32_t mode_blob_id;
+	struct myy_drm_atomic_props_ids props_ids;
+	struct myy_drm_color color;
+	struct myy_drm_plane_formats plane_formats;
+	struct myy_pool atomic_requests;
+	/* Held around every atomic commit. With a render device, the
+	 * capture writer thread flips the scanout buffers. */
+	pthread_mutex_t commit_lock;
 };
 typedef struct myy_drm_infos myy_drm_infos_t;
 
@@ -190,141 +708,123 @@ static void myy_drm_mode_props_dump(
  * 
  *     EGL_EXT_Blablabla EGL_EXT_Nyanyanya EGL_EXT_Doubidoubidou
  * 
- * If you want to check that your extension is supported, you'll
- * have to do a string search (not kidding) on the list.
- * 
- * This... is our strstr implementation, that gives nice error
- * messages and check for false positives.
+ * Instead of running strstr on the whole list every time we want
+ * to know something, we parse each list once into a bitmask of the
+ * extensions we know about. The list of known extensions
+ * (MYY_EGL_EXTENSIONS) generates both the enum and the names table.
+ * Checking for an extension is then a bit test.
  */
-int egl_strstr(
-	char const * __restrict const extensions_list,
-	char const * __restrict const * __restrict const extensions,
-	char const * __restrict const extension_type)
+/* name -> enum lookup table, open addressing.
+ * 0 means empty, otherwise the enum value + 1. */
+#define MYY_EGL_EXT_TABLE_SIZE (128)
+static uint8_t myy_egl_ext_table[MYY_EGL_EXT_TABLE_SIZE];
+static pthread_once_t myy_egl_ext_table_once = PTHREAD_ONCE_INIT;
+
+static uint32_t myy_egl_ext_hash(
+	char const * __restrict const name,
+	size_t const length)
 {
-	int ret = 0;
-
-	char const * __restrict const * __restrict cursor =
-		extensions;
-
-	/* Let's be clear, if your EGL driver return non 0
-	 * terminated strings, it's time to terminate your
-	 * EGL driver, or the people who wrote them.
-	 * If you're concerned about your security, you should
-	 * rewrite this entire codebase anyway.
-	 */
-	char const * __restrict const list_end =
-		extensions_list + strlen(extensions_list);
-
-	printf("Supported extensions on %s :\n%s\n",
-		extension_type, extensions_list);
+	uint32_t hash = 0x811c9dc5;
+	for (size_t c = 0; c < length; c++) {
+		hash ^= (uint8_t) name[c];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
 
-	while(*cursor != 0) {
-		char const * __restrict const ext_name =
-			*cursor;
-		size_t const ext_name_length = strlen(ext_name);
+static void myy_egl_ext_table_init(void)
+{
+	for (uint32_t e = 0; e < MYY_EGL_EXTENSIONS_COUNT; e++) {
+		char const * __restrict const name = myy_egl_extension_names[e];
+		uint32_t slot = myy_egl_ext_hash(name, strlen(name))
+			& (MYY_EGL_EXT_TABLE_SIZE - 1);
+		while (myy_egl_ext_table[slot] != 0)
+			slot = (slot + 1) & (MYY_EGL_EXT_TABLE_SIZE - 1);
+		myy_egl_ext_table[slot] = (uint8_t) (e + 1);
+	}
+}
 
-		/* Search for the character address where the extension
-		 * name starts, in the long list returned by EGL.
-		 */
-		char const * __restrict const pos =
-			strstr(extensions_list, ext_name);
+/* Returns the extension index or -1 if we don't know about it */
+static int myy_egl_ext_lookup(
+	char const * __restrict const name,
+	size_t const length)
+{
+	uint32_t slot = myy_egl_ext_hash(name, length)
+		& (MYY_EGL_EXT_TABLE_SIZE - 1);
+	while (myy_egl_ext_table[slot] != 0) {
+		uint32_t const e = myy_egl_ext_table[slot] - 1;
+		char const * __restrict const known = myy_egl_extension_names[e];
+		if (strncmp(known, name, length) == 0 && known[length] == '\0')
+			return (int) e;
+		slot = (slot + 1) & (MYY_EGL_EXT_TABLE_SIZE - 1);
+	}
+	return -1;
+}
 
-		bool const extension_might_be_found = 
-			(pos != NULL) /* strstr returns NULL on failure */
-			& ((pos+ext_name_length) <= list_end); /* OOB */
-		bool extension_found = false;
+static inline bool myy_egl_caps_has(
+	struct myy_egl_caps const * __restrict const caps,
+	enum myy_egl_extension const ext)
+{
+	return (caps->bits[ext / 64] >> (ext % 64)) & 1;
+}
 
-		/* Check for false positives like
-		 * 'EGL_EXT_device_baseless_unit' instead of
-		 * 'EGL_EXT_device_base' for example.
-		 */
-		if (extension_might_be_found) {
-			char const * __restrict const after_ext_name =
-				pos+ext_name_length;
-			char const after_char = *after_ext_name;
-			extension_found =
-				(after_char == ' ') | (after_char == '\0');
+/* Parse the space-separated extensions list once. */
+static void myy_egl_caps_parse(
+	struct myy_egl_caps * __restrict const caps,
+	char const * __restrict extensions_list,
+	char const * __restrict const extension_type)
+{
+	uint32_t n_extensions = 0;
+
+	pthread_once(&myy_egl_ext_table_once, myy_egl_ext_table_init);
+	memset(caps, 0, sizeof(*caps));
+
+	/* Some drivers return NULL instead of an empty list. */
+	if (extensions_list == NULL)
+		extensions_list = "";
+
+	while (*extensions_list != '\0') {
+		size_t const length = strcspn(extensions_list, " ");
+		if (length > 0) {
+			int const e = myy_egl_ext_lookup(extensions_list, length);
+			if (e >= 0)
+				caps->bits[e / 64] |= 1ull << (e % 64);
+			n_extensions++;
 		}
+		extensions_list += length;
+		extensions_list += (*extensions_list == ' ');
+	}
+
+	LOGF("%u extensions supported on %s. Known ones :",
+		n_extensions, extension_type);
+	for (uint32_t e = 0; e < MYY_EGL_EXTENSIONS_COUNT; e++) {
+		if (myy_egl_caps_has(caps, e))
+			LOGF("\t%s", myy_egl_extension_names[e]);
+	}
+}
 
-		if (!extension_found) {
+/* Returns 0 if every extension in required is supported, -1 otherwise.
+ * The user gets alerted about EVERY SINGLE missing extension, not
+ * just the first one. */
+static int myy_egl_caps_require(
+	struct myy_egl_caps const * __restrict const caps,
+	enum myy_egl_extension const * __restrict const required,
+	size_t const n_required,
+	char const * __restrict const extension_type)
+{
+	int ret = 0;
+	for (size_t r = 0; r < n_required; r++) {
+		if (!myy_egl_caps_has(caps, required[r])) {
 			ret = -1;
-			/* We'll continue to check other extensions
-			 * in order to alert the user of EVERY SINGLE
-			 * extension he needs on his client.
-			 */
 			fprintf(
 				stderr,
-				"EGL Client extension %s not found !\n",
-				ext_name);
+				"EGL %s extension %s not found !\n",
+				extension_type, myy_egl_extension_names[required[r]]);
 		}
-
-		cursor++;
 	}
-
 	return ret;
 }
 
-static void egl_print_config_attribs(
-	EGLDisplay egl_display,
-	EGLConfig const config)
-{
-	EGLint value;
-	eglGetConfigAttrib(egl_display, config, EGL_ALPHA_SIZE, &value);
-	LOGF("\tEGL_ALPHA_SIZE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_BIND_TO_TEXTURE_RGB, &value);
-	LOGF("\tEGL_BIND_TO_TEXTURE_RGB : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_BIND_TO_TEXTURE_RGBA, &value);
-	LOGF("\tEGL_BIND_TO_TEXTURE_RGBA : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_BLUE_SIZE, &value);
-	LOGF("\tEGL_BLUE_SIZE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_BUFFER_SIZE, &value);
-	LOGF("\tEGL_BUFFER_SIZE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_CONFIG_CAVEAT, &value);
-	LOGF("\tEGL_CONFIG_CAVEAT : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_CONFIG_ID, &value);
-	LOGF("\tEGL_CONFIG_ID : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_DEPTH_SIZE, &value);
-	LOGF("\tEGL_DEPTH_SIZE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_GREEN_SIZE, &value);
-	LOGF("\tEGL_GREEN_SIZE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_LEVEL, &value);
-	LOGF("\tEGL_LEVEL : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_MAX_PBUFFER_WIDTH, &value);
-	LOGF("\tEGL_MAX_PBUFFER_WIDTH : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_MAX_PBUFFER_HEIGHT, &value);
-	LOGF("\tEGL_MAX_PBUFFER_HEIGHT : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_MAX_PBUFFER_PIXELS, &value);
-	LOGF("\tEGL_MAX_PBUFFER_PIXELS : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_MAX_SWAP_INTERVAL, &value);
-	LOGF("\tEGL_MAX_SWAP_INTERVAL : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_MIN_SWAP_INTERVAL, &value);
-	LOGF("\tEGL_MIN_SWAP_INTERVAL : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_NATIVE_RENDERABLE, &value);
-	LOGF("\tEGL_NATIVE_RENDERABLE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_NATIVE_VISUAL_ID, &value);
-	LOGF("\tEGL_NATIVE_VISUAL_ID : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_NATIVE_VISUAL_TYPE, &value);
-	LOGF("\tEGL_NATIVE_VISUAL_TYPE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_RED_SIZE, &value);
-	LOGF("\tEGL_RED_SIZE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_SAMPLE_BUFFERS, &value);
-	LOGF("\tEGL_SAMPLE_BUFFERS : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_SAMPLES, &value);
-	LOGF("\tEGL_SAMPLES : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_STENCIL_SIZE, &value);
-	LOGF("\tEGL_STENCIL_SIZE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_SURFACE_TYPE, &value);
-	LOGF("\tEGL_SURFACE_TYPE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_TRANSPARENT_TYPE, &value);
-	LOGF("\tEGL_TRANSPARENT_TYPE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_TRANSPARENT_RED_VALUE, &value);
-	LOGF("\tEGL_TRANSPARENT_RED_VALUE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_TRANSPARENT_GREEN_VALUE, &value);
-	LOGF("\tEGL_TRANSPARENT_GREEN_VALUE : %d", value);
-	eglGetConfigAttrib(egl_display, config, EGL_TRANSPARENT_BLUE_VALUE, &value);
-	LOGF("\tEGL_TRANSPARENT_BLUE_VALUE : %d", value);
-}
-
 #define NO_CRTC_FOUND (0)
 static uint32_t drm_encoder_find_crtc(
 	drmModeRes const * __restrict const resources,
@@ -432,24 +932,35 @@ static bool drm_connector_seems_valid(
 		& (connector->count_encoders > 0));
 }
 
+/* Writeback connectors look connected and have modes. They're only
+ * listed with DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, and the first one
+ * is returned through writeback_id, 0 if there's none. */
 static drmModeConnector * drm_get_connector(
 	int const drm_fd,
-	drmModeRes * __restrict const resources)
+	drmModeRes * __restrict const resources,
+	uint32_t * __restrict const writeback_id)
 {
 	drmModeConnector * __restrict connector = NULL;
 	/* find a connected connector: */
 	uint32_t const n_connectors =
 		resources->count_connectors;
+
+	*writeback_id = 0;
 	for (uint32_t i = 0; i < n_connectors; i++) {
-		connector = drmModeGetConnector(
-			drm_fd, resources->connectors[i]);
-		if (drm_connector_seems_valid(connector)) {
-			break;
+		drmModeConnector * __restrict const current =
+			drmModeGetConnector(drm_fd, resources->connectors[i]);
+		if (current == NULL)
+			continue;
+
+		if (current->connector_type == DRM_MODE_CONNECTOR_WRITEBACK) {
+			if (*writeback_id == 0)
+				*writeback_id = current->connector_id;
 		}
-		else {
-			drmModeFreeConnector(connector);
-		    connector = NULL;
+		else if (connector == NULL && drm_connector_seems_valid(current)) {
+			connector = current;
+			continue;
 		}
+		drmModeFreeConnector(current);
 	}
 
 	if (!connector) {
@@ -598,6 +1109,17 @@ static uint64_t drm_get_property(
 	return value;
 }
 
+static void myy_fourcc_to_str(
+	uint32_t const fourcc,
+	char * __restrict const str)
+{
+	str[0] = (char) (fourcc       & 0xff);
+	str[1] = (char) (fourcc >> 8  & 0xff);
+	str[2] = (char) (fourcc >> 16 & 0xff);
+	str[3] = (char) (fourcc >> 24 & 0xff);
+	str[4] = '\0';
+}
+
 static void myy_drm_plane_dump(
 	int const drm_fd,
 	int const plane_i)
@@ -623,10 +1145,9 @@ static void myy_drm_plane_dump(
 			plane->gamma_size);
 		LOGF("\t[Dumping plane formats]\n");
 		for (uint32_t i = 0; i < plane->count_formats; i++) {
-			char const * __restrict const fmt_name =
-				(char const * __restrict) plane->formats+i;
-			LOGF("\t\tFormat : %c%c%c%c",
-				 fmt_name[0], fmt_name[1], fmt_name[2], fmt_name[3]);
+			char fmt_name[5];
+			myy_fourcc_to_str(plane->formats[i], fmt_name);
+			LOGF("\t\tFormat : %s", fmt_name);
 		}
 		drmModeFreePlane(plane);
 	}
@@ -651,88 +1172,474 @@ static void myy_drm_planes_dump(
 	}
 }
 
-#define NO_PLANE_FOUND (0)
-static uint32_t drm_get_primary_plane_for_crtc(
-	int drm_fd,
-	uint32_t const selected_crtc_index)
+static uint32_t myy_drm_format_pair_hash(
+	uint32_t const fourcc,
+	uint64_t const modifier)
 {
-	uint32_t plane_id = NO_PLANE_FOUND;
-	drmModePlaneRes * __restrict const planes_resources =
-		drmModeGetPlaneResources(drm_fd);
-
-	if (planes_resources != NULL) {
-		myy_drm_planes_dump(drm_fd, planes_resources);
-		uint32_t const n_planes = planes_resources->count_planes;
+	uint64_t const key = ((uint64_t) fourcc << 32) ^ modifier;
+	uint64_t hash = key * 0x9e3779b97f4a7c15ull;
+	return (uint32_t) (hash >> 32);
+}
 
-		for (uint32_t i = 0;
-			(plane_id == NO_PLANE_FOUND) & (i < n_planes);
-			i++)
-		{
-			uint32_t const plane_i =
-				planes_resources->planes[i];
-			drmModePlane * __restrict const plane =
-				drmModeGetPlane(drm_fd, plane_i);
+static void myy_drm_plane_formats_insert(
+	struct myy_drm_plane_formats * __restrict const formats,
+	uint32_t const fourcc,
+	uint64_t const modifier)
+{
+	uint32_t const mask = formats->capacity - 1;
+	uint32_t slot = myy_drm_format_pair_hash(fourcc, modifier) & mask;
+
+	while (formats->pairs[slot].fourcc != 0) {
+		struct myy_drm_format_pair const pair = formats->pairs[slot];
+		if ((pair.fourcc == fourcc) & (pair.modifier == modifier))
+			return;
+		slot = (slot + 1) & mask;
+	}
 
-			if (plane == NULL) {
-				LOGF("Plane %d leads to a NULL pointer ! WHAT !!?\n",
-					i);
-				break;
-			}
+	formats->pairs[slot].fourcc   = fourcc;
+	formats->pairs[slot].modifier = modifier;
+	formats->n_pairs++;
+}
 
-			uint32_t const crtcs = plane->possible_crtcs;
-			drmModeFreePlane(plane);
+static bool myy_drm_plane_formats_supports(
+	struct myy_drm_plane_formats const * __restrict const formats,
+	uint32_t const fourcc,
+	uint64_t const modifier)
+{
+	if (formats->capacity == 0)
+		return false;
 
-			if ((crtcs & (1 << selected_crtc_index)) == 0) {
-				/* This is not the plane you're looking for */
-				continue;
-			}
+	uint32_t const mask = formats->capacity - 1;
+	uint32_t slot = myy_drm_format_pair_hash(fourcc, modifier) & mask;
 
-			int type_found = 0;
-			uint64_t const type = drm_get_property(
-				drm_fd,
-				plane_i,
-				DRM_MODE_OBJECT_PLANE,
-				"type",
-				&type_found);
+	while (formats->pairs[slot].fourcc != 0) {
+		struct myy_drm_format_pair const pair = formats->pairs[slot];
+		if ((pair.fourcc == fourcc) & (pair.modifier == modifier))
+			return true;
+		slot = (slot + 1) & mask;
+	}
 
-			int alpha_found = 0;
-			uint64_t const alpha = drm_get_property(
-				drm_fd,
-				plane_i,
-				DRM_MODE_OBJECT_PLANE,
-				"alpha",
-				&alpha_found);
-			if (((type_found) & (type == DRM_PLANE_TYPE_PRIMARY)))
-			{
-				plane_id = plane_i;
-			}
-		}
+	return false;
+}
 
-		drmModeFreePlaneResources(planes_resources);
+/* How nice a memory layout is to the memory bus, when scanning out.
+ * Compressed > Tiled > Linear > "Whatever the driver picks".
+ * Vendor modifiers that we can't decode are assumed to be tiled. */
+static int myy_drm_modifier_score(uint64_t const modifier)
+{
+	uint64_t const vendor = modifier >> 56;
+	if (modifier == DRM_FORMAT_MOD_INVALID)
+		return 0;
+	if (modifier == DRM_FORMAT_MOD_LINEAR)
+		return 1;
+	if (vendor == DRM_FORMAT_MOD_VENDOR_NVIDIA) {
+		/* Block-linear modifiers store the compression type in
+		 * bits 23-25 */
+		uint32_t const compression = (modifier >> 23) & 0x7;
+		return (compression != 0) ? 3 : 2;
 	}
-	else {
-		LOGF("No planes resources for this DRM node ??\n");
+	return 2;
+}
+
+/* Returns the modifier with the best score for this format,
+ * or DRM_FORMAT_MOD_INVALID if the format is not supported at all
+ * (or only with an implicit layout). */
+static uint64_t myy_drm_plane_formats_best_modifier(
+	struct myy_drm_plane_formats const * __restrict const formats,
+	uint32_t const fourcc,
+	int * __restrict const best_score)
+{
+	uint64_t best_modifier = DRM_FORMAT_MOD_INVALID;
+	int score = -1;
+
+	for (uint32_t slot = 0; slot < formats->capacity; slot++) {
+		struct myy_drm_format_pair const pair = formats->pairs[slot];
+		if (pair.fourcc != fourcc)
+			continue;
+		int const pair_score = myy_drm_modifier_score(pair.modifier);
+		if (pair_score > score) {
+			score = pair_score;
+			best_modifier = pair.modifier;
+		}
 	}
 
-	return plane_id;
+	if (best_score)
+		*best_score = score;
+	return best_modifier;
 }
 
+static bool myy_drm_plane_formats_has_format(
+	struct myy_drm_plane_formats const * __restrict const formats,
+	uint32_t const fourcc)
+{
+	int score = -1;
+	myy_drm_plane_formats_best_modifier(formats, fourcc, &score);
+	return score >= 0;
+}
 
-static int drm_init(
-	char const * __restrict const drm_device_file,
-	myy_drm_infos_t * __restrict const myy_drm_conf)
+static void myy_drm_plane_formats_free(
+	struct myy_drm_plane_formats * __restrict const formats)
 {
-	drmModeRes *resources;
-	drmModeConnector *connector = NULL;
-	drmModeModeInfo * mode = NULL;
-	struct myy_drm_caps const requested_caps[] = {
-		{
-			"DRM_CLIENT_CAP_UNIVERSAL_PLANES",
-			DRM_CLIENT_CAP_UNIVERSAL_PLANES,
-			1
-		},
-		{
-			"DRM_CLIENT_CAP_ATOMIC",
+	free(formats->pairs);
+	memset(formats, 0, sizeof(*formats));
+}
+
+static void myy_drm_plane_formats_dump(
+	struct myy_drm_plane_formats const * __restrict const formats)
+{
+	LOGF("[Plane %u formats index] %u pairs",
+		formats->plane_id, formats->n_pairs);
+	for (uint32_t slot = 0; slot < formats->capacity; slot++) {
+		struct myy_drm_format_pair const pair = formats->pairs[slot];
+		if (pair.fourcc != 0) {
+			char fmt_name[5];
+			myy_fourcc_to_str(pair.fourcc, fmt_name);
+			LOGF("\t%s - 0x%016" PRIx64, fmt_name, pair.modifier);
+		}
+	}
+}
+
+/* Parses the IN_FORMATS blob of a plane into a formats index.
+ * Planes without IN_FORMATS only get their formats list indexed,
+ * with DRM_FORMAT_MOD_INVALID as modifier (implicit layout). */
+/* The blob comes from the kernel, but its offsets and counts are still
+ * checked against its length before anything gets indexed with them. */
+static bool myy_drm_in_formats_blob_valid(
+	drmModePropertyBlobRes const * __restrict const blob)
+{
+	struct drm_format_modifier_blob const * __restrict const header =
+		blob->data;
+	uint64_t const length = blob->length;
+
+	if (length < sizeof(*header))
+		return false;
+
+	uint64_t const formats_end =
+		(uint64_t) header->formats_offset
+		+ (uint64_t) header->count_formats * sizeof(uint32_t);
+	uint64_t const modifiers_end =
+		(uint64_t) header->modifiers_offset
+		+ (uint64_t) header->count_modifiers
+		* sizeof(struct drm_format_modifier);
+
+	return (formats_end <= length)
+		&& (modifiers_end <= length)
+		&& ((header->modifiers_offset
+		     % _Alignof(struct drm_format_modifier)) == 0)
+		&& ((header->formats_offset % _Alignof(uint32_t)) == 0);
+}
+
+static bool myy_drm_plane_formats_load(
+	int const drm_fd,
+	uint32_t const plane_id,
+	struct myy_drm_plane_formats * __restrict const formats)
+{
+	int in_formats_found = 0;
+	drmModePropertyBlobRes * __restrict blob = NULL;
+	drmModePlane * __restrict const plane =
+		drmModeGetPlane(drm_fd, plane_id);
+	uint32_t n_pairs = 0;
+
+	memset(formats, 0, sizeof(*formats));
+
+	if (plane == NULL) {
+		LOG_ERROR("Could not get plane %u", plane_id);
+		goto no_plane;
+	}
+
+	uint64_t const blob_id = drm_get_property(
+		drm_fd, plane_id, DRM_MODE_OBJECT_PLANE,
+		"IN_FORMATS", &in_formats_found);
+
+	if (in_formats_found)
+		blob = drmModeGetPropertyBlob(drm_fd, (uint32_t) blob_id);
+
+	if (blob && !myy_drm_in_formats_blob_valid(blob)) {
+		LOG_ERROR(
+			"The IN_FORMATS blob of plane %u is malformed. "
+			"Using its format list only.", plane_id);
+		drmModeFreePropertyBlob(blob);
+		blob = NULL;
+	}
+
+	struct drm_format_modifier_blob const * __restrict const header =
+		blob ? blob->data : NULL;
+	uint32_t const * __restrict in_formats = NULL;
+	struct drm_format_modifier const * __restrict in_modifiers = NULL;
+
+	if (header) {
+		in_formats = (uint32_t const *)
+			((uint8_t const *) header + header->formats_offset);
+		in_modifiers = (struct drm_format_modifier const *)
+			((uint8_t const *) header + header->modifiers_offset);
+		/* Upper bound. Each modifier applies to 64 formats at most */
+		uint64_t pairs = (uint64_t) header->count_modifiers * 64;
+		uint64_t const all_pairs =
+			(uint64_t) header->count_formats * header->count_modifiers;
+		if (pairs > all_pairs)
+			pairs = all_pairs;
+		n_pairs = (uint32_t) pairs;
+	}
+	n_pairs += plane->count_formats;
+
+	/* Keep the load factor under 50% */
+	uint32_t capacity = 16;
+	while (capacity < n_pairs * 2)
+		capacity <<= 1;
+
+	formats->pairs = calloc(capacity, sizeof(struct myy_drm_format_pair));
+	if (formats->pairs == NULL) {
+		LOG_ERROR("Could not allocate the formats index");
+		goto no_memory;
+	}
+	formats->plane_id = plane_id;
+	formats->capacity = capacity;
+
+	if (header) {
+		for (uint32_t m = 0; m < header->count_modifiers; m++) {
+			struct drm_format_modifier const mod = in_modifiers[m];
+			for (uint32_t bit = 0; bit < 64; bit++) {
+				uint32_t const format_index = mod.offset + bit;
+				if (((mod.formats >> bit) & 1)
+				    && (format_index < header->count_formats))
+				{
+					myy_drm_plane_formats_insert(
+						formats, in_formats[format_index], mod.modifier);
+				}
+			}
+		}
+	}
+
+	for (uint32_t f = 0; f < plane->count_formats; f++) {
+		myy_drm_plane_formats_insert(
+			formats, plane->formats[f], DRM_FORMAT_MOD_INVALID);
+	}
+
+	if (blob)
+		drmModeFreePropertyBlob(blob);
+	drmModeFreePlane(plane);
+	return true;
+
+no_memory:
+	if (blob)
+		drmModeFreePropertyBlob(blob);
+	drmModeFreePlane(plane);
+no_plane:
+	return false;
+}
+
+/* Best score of the 32 bpp formats, which is what we'll render to.
+ * The plane must also take the linear XRGB8888 dumb buffer that is
+ * scanned out before the first EGLStream frame, so planes that can't
+ * come last. */
+static int myy_drm_plane_formats_scanout_score(
+	struct myy_drm_plane_formats const * __restrict const formats)
+{
+	int xrgb_score = -1, argb_score = -1;
+	myy_drm_plane_formats_best_modifier(
+		formats, DRM_FORMAT_XRGB8888, &xrgb_score);
+	myy_drm_plane_formats_best_modifier(
+		formats, DRM_FORMAT_ARGB8888, &argb_score);
+	bool const takes_dumb_buffer =
+		myy_drm_plane_formats_supports(
+			formats, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR)
+		| myy_drm_plane_formats_supports(
+			formats, DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_INVALID);
+	int const best = (xrgb_score > argb_score) ? xrgb_score : argb_score;
+	return takes_dumb_buffer ? best + 8 : best;
+}
+
+#define NO_PLANE_FOUND (0)
+/* Finds a plane of the requested type, usable with the selected CRTC,
+ * that can scan out fourcc with modifier.
+ * Use DRM_FORMAT_MOD_INVALID as modifier if you don't care about the
+ * modifier, and 0 as fourcc if you don't care about the format.
+ * Planes whose ID is in excluded_planes are skipped. */
+static uint32_t drm_find_plane(
+	int const drm_fd,
+	uint32_t const selected_crtc_index,
+	uint64_t const plane_type,
+	uint32_t const fourcc,
+	uint64_t const modifier,
+	uint32_t const * __restrict const excluded_planes,
+	uint32_t const n_excluded_planes)
+{
+	uint32_t plane_id = NO_PLANE_FOUND;
+	drmModePlaneRes * __restrict const planes_resources =
+		drmModeGetPlaneResources(drm_fd);
+
+	if (planes_resources == NULL)
+		return NO_PLANE_FOUND;
+
+	for (uint32_t i = 0;
+	     (plane_id == NO_PLANE_FOUND) & (i < planes_resources->count_planes);
+	     i++)
+	{
+		uint32_t const plane_i = planes_resources->planes[i];
+		bool excluded = false;
+		for (uint32_t e = 0; e < n_excluded_planes; e++)
+			excluded |= (excluded_planes[e] == plane_i);
+		if (excluded)
+			continue;
+
+		drmModePlane * __restrict const plane =
+			drmModeGetPlane(drm_fd, plane_i);
+		if (plane == NULL)
+			continue;
+		uint32_t const crtcs = plane->possible_crtcs;
+		drmModeFreePlane(plane);
+		if ((crtcs & (1 << selected_crtc_index)) == 0)
+			continue;
+
+		int type_found = 0;
+		uint64_t const type = drm_get_property(
+			drm_fd, plane_i, DRM_MODE_OBJECT_PLANE, "type", &type_found);
+		if (!type_found || type != plane_type)
+			continue;
+
+		if (fourcc == 0) {
+			plane_id = plane_i;
+			continue;
+		}
+
+		struct myy_drm_plane_formats formats;
+		if (!myy_drm_plane_formats_load(drm_fd, plane_i, &formats))
+			continue;
+
+		bool const supported = (modifier == DRM_FORMAT_MOD_INVALID)
+			? myy_drm_plane_formats_has_format(&formats, fourcc)
+			: myy_drm_plane_formats_supports(&formats, fourcc, modifier);
+		myy_drm_plane_formats_free(&formats);
+
+		if (supported)
+			plane_id = plane_i;
+	}
+
+	drmModeFreePlaneResources(planes_resources);
+	return plane_id;
+}
+
+static uint32_t drm_get_primary_plane_for_crtc(
+	int drm_fd,
+	uint32_t const selected_crtc_index,
+	struct myy_drm_plane_formats * __restrict const plane_formats)
+{
+	int best_score = -2;
+	uint32_t plane_id = NO_PLANE_FOUND;
+	drmModePlaneRes * __restrict const planes_resources =
+		drmModeGetPlaneResources(drm_fd);
+
+	if (planes_resources != NULL) {
+		myy_drm_planes_dump(drm_fd, planes_resources);
+		uint32_t const n_planes = planes_resources->count_planes;
+
+		/* There's usually only one primary plane per CRTC, but
+		 * when there are several, take the one that can scan out
+		 * our 32 bpp buffers with the least memory bandwidth. */
+		for (uint32_t i = 0; i < n_planes; i++)
+		{
+			uint32_t const plane_i =
+				planes_resources->planes[i];
+			drmModePlane * __restrict const plane =
+				drmModeGetPlane(drm_fd, plane_i);
+
+			if (plane == NULL) {
+				LOGF("Plane %d leads to a NULL pointer ! WHAT !!?\n",
+					i);
+				break;
+			}
+
+			uint32_t const crtcs = plane->possible_crtcs;
+			drmModeFreePlane(plane);
+
+			if ((crtcs & (1 << selected_crtc_index)) == 0) {
+				/* This is not the plane you're looking for */
+				continue;
+			}
+
+			int type_found = 0;
+			uint64_t const type = drm_get_property(
+				drm_fd,
+				plane_i,
+				DRM_MODE_OBJECT_PLANE,
+				"type",
+				&type_found);
+
+			if (!((type_found) & (type == DRM_PLANE_TYPE_PRIMARY)))
+				continue;
+
+			struct myy_drm_plane_formats formats;
+			if (!myy_drm_plane_formats_load(drm_fd, plane_i, &formats))
+				continue;
+
+			int const score =
+				myy_drm_plane_formats_scanout_score(&formats);
+			if (score > best_score) {
+				myy_drm_plane_formats_free(plane_formats);
+				*plane_formats = formats;
+				best_score = score;
+				plane_id = plane_i;
+			}
+			else {
+				myy_drm_plane_formats_free(&formats);
+			}
+		}
+
+		drmModeFreePlaneResources(planes_resources);
+	}
+	else {
+		LOGF("No planes resources for this DRM node ??\n");
+	}
+
+	return plane_id;
+}
+
+
+static bool drm_writeback_reaches_crtc(
+	int const drm_fd,
+	uint32_t const writeback_id,
+	uint32_t const crtc_index)
+{
+	bool reaches = false;
+
+	if (writeback_id == 0)
+		return false;
+
+	drmModeConnector * __restrict const connector =
+		drmModeGetConnector(drm_fd, writeback_id);
+	if (connector == NULL)
+		return false;
+
+	for (int e = 0; e < connector->count_encoders && !reaches; e++) {
+		drmModeEncoder * __restrict const encoder =
+			drmModeGetEncoder(drm_fd, connector->encoders[e]);
+		if (encoder == NULL)
+			continue;
+		reaches = (encoder->possible_crtcs >> crtc_index) & 1;
+		drmModeFreeEncoder(encoder);
+	}
+	drmModeFreeConnector(connector);
+
+	if (reaches)
+		LOGF("Writeback connector %u available", writeback_id);
+	return reaches;
+}
+
+static int drm_init(
+	char const * __restrict const drm_device_file,
+	myy_drm_infos_t * __restrict const myy_drm_conf)
+{
+	drmModeRes *resources;
+	drmModeConnector *connector = NULL;
+	drmModeModeInfo * mode = NULL;
+	struct myy_drm_caps const requested_caps[] = {
+		{
+			"DRM_CLIENT_CAP_UNIVERSAL_PLANES",
+			DRM_CLIENT_CAP_UNIVERSAL_PLANES,
+			1
+		},
+		{
+			"DRM_CLIENT_CAP_ATOMIC",
 			DRM_CLIENT_CAP_ATOMIC,
 			1
 		},
@@ -745,6 +1652,7 @@ static int drm_init(
 	uint32_t crtc_index = 0;
 	uint32_t crtc_id = NO_CRTC_FOUND;
 	uint32_t plane_id = 0;
+	uint32_t writeback_id = 0;
 
 	drm_fd = open(drm_device_file, O_RDWR);
 	
@@ -762,13 +1670,19 @@ static int drm_init(
 		goto required_caps_not_available;
 	}
 
+	/* Optional, most drivers don't have writeback connectors.
+	 * Must be set before listing the connectors. */
+	if (drmSetClientCap(drm_fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1) == 0)
+		LOGVF("DRM_CLIENT_CAP_WRITEBACK_CONNECTORS (%d) = 1 -> 0",
+			DRM_CLIENT_CAP_WRITEBACK_CONNECTORS);
+
 	resources = drmModeGetResources(drm_fd);
 	if (!resources) {
 		printf("drmModeGetResources failed: %s\n", strerror(errno));
 		goto no_drm_resources;
 	}
 
-	connector = drm_get_connector(drm_fd, resources);
+	connector = drm_get_connector(drm_fd, resources, &writeback_id);
 	if (connector == NULL) {
 		LOGF("No DRM connector...");
 		goto no_drm_connector;
@@ -787,21 +1701,32 @@ static int drm_init(
 		goto no_drm_crtc_available;
 	}
 
-	plane_id = drm_get_primary_plane_for_crtc(drm_fd, crtc_index);
+	memset(&myy_drm_conf->plane_formats, 0,
+		sizeof(myy_drm_conf->plane_formats));
+	plane_id = drm_get_primary_plane_for_crtc(
+		drm_fd, crtc_index, &myy_drm_conf->plane_formats);
 	if (plane_id == NO_PLANE_FOUND) {
 		LOGF("No primary plane found !?");
 		goto no_drm_primary_plane;
 	}
-
-	drmModeFreeResources(resources);
+	myy_drm_plane_formats_dump(&myy_drm_conf->plane_formats);
 
 	myy_drm_conf->fd           = drm_fd;
 	myy_drm_conf->mode         = *mode;
 	myy_drm_conf->crtc_id      = crtc_id;
+	myy_drm_conf->crtc_index   = crtc_index;
 	myy_drm_conf->plane_id     = plane_id;
 	myy_drm_conf->connector_id = connector->connector_id;
+	myy_drm_conf->writeback_connector_id =
+		drm_writeback_reaches_crtc(drm_fd, writeback_id, crtc_index)
+		? writeback_id : 0;
 	myy_drm_conf->width        = mode->hdisplay;
 	myy_drm_conf->height       = mode->vdisplay;
+	pthread_mutex_init(&myy_drm_conf->commit_lock, NULL);
+
+	/* mode pointed inside the connector. It has been copied. */
+	drmModeFreeConnector(connector);
+	drmModeFreeResources(resources);
 
 	return 0;
 
@@ -837,29 +1762,55 @@ static uint32_t drm_create_mode_id(
 	}
 	return mode_id;
 }
-static bool drm_map_framebuffer(
-	myy_drm_infos_t * __restrict const myy_drm_conf)
+static void drm_destroy_dumb_buffer(
+	int const drm_fd,
+	uint32_t const handle)
+{
+	struct drm_mode_destroy_dumb dumb_destroy_req = { .handle = handle };
+	if (drmIoctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dumb_destroy_req))
+		LOG_ERROR("Could not destroy dumb buffer %u : %m", handle);
+}
+
+/* A dumb buffer, added as an NV12 or a 32 bits RGB framebuffer
+ * (XRGB8888, XBGR8888, ...).
+ * NV12 buffers hold the Y plane, then the interleaved U,V plane at
+ * chroma_offset, both with the same pitch.
+ * Only mapped with cpu_access. */
+struct myy_drm_dumb_buffer {
+	uint32_t fb_id;
+	uint32_t handle;
+	uint32_t pitch;
+	uint32_t chroma_offset;
+	uint64_t size;
+	uint8_t * map;
+};
+
+static bool drm_dumb_buffer_create(
+	int const drm_fd,
+	uint32_t const width,
+	uint32_t const height,
+	uint32_t const fourcc,
+	bool const cpu_access,
+	struct myy_drm_dumb_buffer * __restrict const buffer)
 {
 	struct drm_mode_create_dumb dumb_create_req = { 0 };
 	struct drm_mode_map_dumb dumb_map_req = { 0 };
-
-	/* We won't use it. Go figure.
-	 * It's a CPU mapped buffer.
-	 * Why would would we use it with a GPU ?
-	 * Got zero idea.
-	 * But without it, nothing works.
-	 */
-	uint8_t * __restrict framebuffer;
+	uint8_t * __restrict framebuffer = NULL;
+	bool const nv12 = (fourcc == DRM_FORMAT_NV12);
 
 	uint32_t fb = 0;
 	int ret;
-	int const drm_fd = myy_drm_conf->fd;
-	uint32_t const width = myy_drm_conf->width;
-	uint32_t const height = myy_drm_conf->height;
 
-	dumb_create_req.width  = myy_drm_conf->width;
-	dumb_create_req.height = myy_drm_conf->height;
-	dumb_create_req.bpp    = 32;
+	if (nv12 && ((width | height) & 1)) {
+		LOG_ERROR("NV12 needs even dimensions, not %ux%u", width, height);
+		goto create_dumb_buffer_failed;
+	}
+
+	/* Dumb buffers are single plane. NV12 is 1.5 rows of 8 bits
+	 * per row of pixels. */
+	dumb_create_req.width  = width;
+	dumb_create_req.height = nv12 ? height + height / 2 : height;
+	dumb_create_req.bpp    = nv12 ? 8 : 32;
 
 	ret = drmIoctl(drm_fd,
 		DRM_IOCTL_MODE_CREATE_DUMB,
@@ -869,15 +1820,29 @@ static bool drm_map_framebuffer(
 		goto create_dumb_buffer_failed;
 	}
 
-	ret = drmModeAddFB(
-		drm_fd, width, height, 24, 32,
-		dumb_create_req.pitch, dumb_create_req.handle,
-		&fb);
+	if (fourcc != DRM_FORMAT_XRGB8888) {
+		uint32_t const pitch = dumb_create_req.pitch;
+		uint32_t const handles[4] = {
+			dumb_create_req.handle, nv12 ? dumb_create_req.handle : 0 };
+		uint32_t const pitches[4] = { pitch, nv12 ? pitch : 0 };
+		uint32_t const offsets[4] = { 0, nv12 ? pitch * height : 0 };
+		ret = drmModeAddFB2(drm_fd, width, height, fourcc,
+			handles, pitches, offsets, &fb, 0);
+	}
+	else {
+		ret = drmModeAddFB(
+			drm_fd, width, height, 24, 32,
+			dumb_create_req.pitch, dumb_create_req.handle,
+			&fb);
+	}
 	if (ret < 0) {
 		LOG_ERROR("No framebuffer ?");
 		goto no_frame_buffer;
 	}
 
+	if (!cpu_access)
+		goto mapped;
+
 	dumb_map_req.handle = dumb_create_req.handle;
 
 	ret = drmIoctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB,
@@ -897,19 +1862,133 @@ static bool drm_map_framebuffer(
 
 	memset(framebuffer, 0, dumb_create_req.size);
 
-	myy_drm_conf->framebuffer_id = fb;
+mapped:
+	buffer->fb_id  = fb;
+	buffer->handle = dumb_create_req.handle;
+	buffer->pitch  = dumb_create_req.pitch;
+	buffer->chroma_offset = nv12 ? dumb_create_req.pitch * height : 0;
+	buffer->size   = dumb_create_req.size;
+	buffer->map    = framebuffer;
 	return true;
 
-/* TODO Unmap framebuffer ? */
 could_not_mmap_frame_buffer:
-/* TODO Unmap dumb buffer ! */
+	/* MAP_DUMB only computes an offset. Nothing to undo. */
 could_not_map_dumb_buffer:
-/* TODO Remove FB */
+	drmModeRmFB(drm_fd, fb);
 no_frame_buffer:
-/* TODO Destroy dumb buffer ! */
+	drm_destroy_dumb_buffer(drm_fd, dumb_create_req.handle);
 create_dumb_buffer_failed:
 	return false;
-	
+}
+
+static void drm_dumb_buffer_destroy(
+	int const drm_fd,
+	struct myy_drm_dumb_buffer * __restrict const buffer)
+{
+	if (buffer->map != NULL)
+		munmap(buffer->map, buffer->size);
+	/* Removing the FB the plane is scanning out turns the plane off */
+	if (buffer->fb_id != 0)
+		drmModeRmFB(drm_fd, buffer->fb_id);
+	if (buffer->handle != 0)
+		drm_destroy_dumb_buffer(drm_fd, buffer->handle);
+	memset(buffer, 0, sizeof(*buffer));
+}
+
+/* drmModeAtomicCommit, serialised with the commits of other threads */
+static int myy_drm_atomic_commit(
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	drmModeAtomicReq * __restrict const request,
+	uint32_t const flags,
+	void * const user_data)
+{
+	pthread_mutex_lock(&myy_drm_conf->commit_lock);
+	int const ret = drmModeAtomicCommit(
+		myy_drm_conf->fd, request, flags, user_data);
+	pthread_mutex_unlock(&myy_drm_conf->commit_lock);
+	return ret;
+}
+
+/* The placeholder framebuffer.
+ * The first atomic commit needs a framebuffer on the plane, and the
+ * EGLStream only delivers one with the first frame. So a dumb buffer
+ * is scanned out until then.
+ * It is only mapped when something is painted into it (the splash).
+ * Otherwise, nothing touches it : the kernel hands out cleared
+ * buffers, so it's black anyway, and we spare the writes of a whole
+ * frame (33 MB in 4K, 132 MB in 8K).
+ * It can't be smaller than the mode and scaled by the plane : the
+ * plane source rectangle is the NVIDIA head "ViewPortIn", that the
+ * EGLStream frames inherit.
+ * Once the stream has taken over the plane, drm_placeholder_release
+ * frees it. */
+static bool drm_map_framebuffer(
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	bool const cpu_access)
+{
+	struct myy_drm_dumb_buffer buffer;
+
+	if (!drm_dumb_buffer_create(myy_drm_conf->fd,
+		myy_drm_conf->width, myy_drm_conf->height, DRM_FORMAT_XRGB8888,
+		cpu_access, &buffer))
+		return false;
+
+	myy_drm_conf->framebuffer_id = buffer.fb_id;
+	myy_drm_conf->dumb_handle    = buffer.handle;
+	myy_drm_conf->dumb_pitch     = buffer.pitch;
+	myy_drm_conf->dumb_size      = buffer.size;
+	myy_drm_conf->dumb_map       = buffer.map;
+	return true;
+}
+
+static void drm_unmap_framebuffer(
+	myy_drm_infos_t * __restrict const myy_drm_conf)
+{
+	struct myy_drm_dumb_buffer buffer = {
+		.fb_id  = myy_drm_conf->framebuffer_id,
+		.handle = myy_drm_conf->dumb_handle,
+		.pitch  = myy_drm_conf->dumb_pitch,
+		.size   = myy_drm_conf->dumb_size,
+		.map    = myy_drm_conf->dumb_map,
+	};
+
+	drm_dumb_buffer_destroy(myy_drm_conf->fd, &buffer);
+
+	myy_drm_conf->dumb_map       = NULL;
+	myy_drm_conf->dumb_size      = 0;
+	myy_drm_conf->dumb_pitch     = 0;
+	myy_drm_conf->dumb_handle    = 0;
+	myy_drm_conf->framebuffer_id = 0;
+}
+
+#define MYY_DRM_PLACEHOLDER_EARLY_CHECKS (8)
+#define MYY_DRM_PLACEHOLDER_CHECK_FRAMES (60)
+
+/* Frees the placeholder framebuffer, once the plane scans out
+ * something else. */
+static void drm_placeholder_release(
+	myy_drm_infos_t * __restrict const myy_drm_conf)
+{
+	if (myy_drm_conf->framebuffer_id == 0)
+		return;
+
+	/* Removing a framebuffer still on the plane turns the plane off.
+	 * No commit must land between the check and the removal. */
+	pthread_mutex_lock(&myy_drm_conf->commit_lock);
+	drmModePlane * __restrict const plane =
+		drmModeGetPlane(myy_drm_conf->fd, myy_drm_conf->plane_id);
+	bool const taken_over = (plane != NULL)
+		&& (plane->fb_id != 0)
+		&& (plane->fb_id != myy_drm_conf->framebuffer_id);
+	drmModeFreePlane(plane);
+
+	if (taken_over) {
+		LOGVF("The stream took over the plane. "
+			"Releasing the placeholder FB %u",
+			myy_drm_conf->framebuffer_id);
+		drm_unmap_framebuffer(myy_drm_conf);
+	}
+	pthread_mutex_unlock(&myy_drm_conf->commit_lock);
 }
 
 struct myy_kms_prop_id {
@@ -947,9 +2026,10 @@ static bool myy_drm_kms_get_prop_ids(
 
 		for (uint32_t m = 0; m < n_props; m++) {
 			struct myy_kms_prop_id looked_up_prop = myy_props[m];
-			/* The longest property names we have are "MODE_ID" and
-			 * "CRTC_ID". So that's 8 chars, '\0' accounted. */
-			if (strncmp(looked_up_prop.name, prop->name, 8) == 0)
+			/* Compare the whole name. Some properties are prefixes
+			 * of others, like "GAMMA_LUT" and "GAMMA_LUT_SIZE". */
+			if (strncmp(looked_up_prop.name, prop->name,
+			            DRM_PROP_NAME_LEN) == 0)
 			{
 				
 				*looked_up_prop.id = prop->prop_id;
@@ -963,6 +2043,8 @@ static bool myy_drm_kms_get_prop_ids(
 		drmModeFreeProperty(prop);
 	}
 
+	drmModeFreeObjectProperties(drm_mode_props);
+
 	/* NOTE: This assumes that properties were initialized to 0
 	 * before calling this function.
 	 */
@@ -987,28 +2069,6 @@ no_props:
 	return false;
 }
 
-struct myy_drm_atomic_props_ids {
-	struct {
-		uint32_t mode_id;
-		uint32_t active;
-	} crtc;
-	struct {
-		uint32_t crtc_id;
-	} connector;
-	struct {
-		uint32_t src_x;
-		uint32_t src_y;
-		uint32_t src_w;
-		uint32_t src_h;
-		uint32_t crtc_x;
-		uint32_t crtc_y;
-		uint32_t crtc_w;
-		uint32_t crtc_h;
-		uint32_t fb_id;
-		uint32_t crtc_id;
-		uint32_t alpha;
-	} plane;
-};
 
 static void myy_drm_atomic_props_ids_dump(
 	struct myy_drm_atomic_props_ids * __restrict const ids)
@@ -1017,6 +2077,9 @@ static void myy_drm_atomic_props_ids_dump(
 		"[myy_drm_atomic_props_ids]\n"
 		"\tcrtc.mode_id      = %d\n"
 		"\tcrtc.active       = %d\n"
+		"\tcrtc.degamma_lut  = %d\n"
+		"\tcrtc.ctm          = %d\n"
+		"\tcrtc.gamma_lut    = %d\n"
 		"\tconnector.crtc_id = %d\n"
 		"\tplane.src_x       = %d\n"
 		"\tplane.src_y       = %d\n"
@@ -1030,6 +2093,9 @@ static void myy_drm_atomic_props_ids_dump(
 		"\tplane.crtc_id     = %d\n",
 		ids->crtc.mode_id     ,
 		ids->crtc.active      ,
+		ids->crtc.degamma_lut ,
+		ids->crtc.ctm         ,
+		ids->crtc.gamma_lut   ,
 		ids->connector.crtc_id,
 		ids->plane.src_x      ,
 		ids->plane.src_y      ,
@@ -1074,6 +2140,12 @@ static bool myy_drm_atomic_get_props_ids(
 		{ "alpha",   &prop_ids->plane.alpha       },
 	};
 
+	struct myy_kms_prop_id const crtc_optional_props[] = {
+		{ "DEGAMMA_LUT", &prop_ids->crtc.degamma_lut },
+		{ "CTM",         &prop_ids->crtc.ctm         },
+		{ "GAMMA_LUT",   &prop_ids->crtc.gamma_lut   },
+	};
+
 	bool const got_main_props =
 		myy_drm_kms_get_prop_ids(
 			drm_fd, myy_drm_conf->crtc_id,
@@ -1094,53 +2166,483 @@ static bool myy_drm_atomic_get_props_ids(
 			drm_fd, myy_drm_conf->plane_id,
 			DRM_MODE_OBJECT_PLANE,
 			plane_optional_props, ARRAY_SIZE(plane_optional_props));
+		/* And the colour management ones */
+		myy_drm_kms_get_prop_ids(
+			drm_fd, myy_drm_conf->crtc_id,
+			DRM_MODE_OBJECT_CRTC,
+			crtc_optional_props, ARRAY_SIZE(crtc_optional_props));
 	}
 
 	return got_main_props;
 }
 
-#define myy_set_atomic_add_prop(request, element_id, prop_id, prop_val) \
-	{\
-		LOGF("drmModeAtomicAddProperty(\n"\
-			"\t" #request    " : %p,\n"\
-			"\t" #element_id " : %u,\n"\
-			"\t" #prop_id    " : %u,\n"\
-			"\t" #prop_val   " : %u);\n",\
-			request, element_id, prop_id, prop_val); \
-		int const ret_val = drmModeAtomicAddProperty(\
-			request, element_id, prop_id, prop_val); \
-		LOGF("-> %d", ret_val);\
-	}
+/* Atomic requests are reused, instead of being allocated and freed
+ * for every commit. libdrm keeps the properties storage of a request
+ * when its cursor is rewound, so once a request has grown to the
+ * size of our biggest commit, it never allocates again. */
+#define MYY_DRM_ATOMIC_REQUESTS (4)
 
+struct myy_drm_atomic_slot {
+	drmModeAtomicReq * request;
+};
 
-static bool drm_setup_atomic_mode_for_streams(
-	myy_drm_infos_t const * __restrict const myy_drm_conf,
-	uint32_t const mode_blob_id)
+static int myy_drm_atomic_pool_init(
+	myy_drm_infos_t * __restrict const myy_drm_conf)
 {
-	/* Cache all the props. They will all be used, beside the
-	 * CPU framebuffer address that we allocated for... no reason ? */
-	myy_drm_infos_t const drm_conf = *myy_drm_conf;
-	
-	int const drm_fd              = drm_conf.fd;
-	bool ret;
-	int i_ret;
+	struct myy_pool * __restrict const pool = &myy_drm_conf->atomic_requests;
 
-	drmModeAtomicReq * __restrict const atomic_request =
-		drmModeAtomicAlloc();
-	struct myy_drm_atomic_props_ids props_ids = { 0 };
+	if (myy_pool_init(pool,
+		sizeof(struct myy_drm_atomic_slot), MYY_DRM_ATOMIC_REQUESTS) != 0)
+	{
+		return -1;
+	}
 
-	if (atomic_request == NULL) {
-		LOG_ERROR("NO ATOMIC REQUEST ! OH NO !");
+	for (uint32_t r = 0; r < MYY_DRM_ATOMIC_REQUESTS; r++) {
+		struct myy_drm_atomic_slot * __restrict const slot =
+			myy_pool_object(pool, r);
+		slot->request = drmModeAtomicAlloc();
+		if (slot->request == NULL)
+			goto no_request;
+	}
+	return 0;
+
+no_request:
+	for (uint32_t r = 0; r < MYY_DRM_ATOMIC_REQUESTS; r++) {
+		struct myy_drm_atomic_slot * __restrict const slot =
+			myy_pool_object(pool, r);
+		if (slot->request)
+			drmModeAtomicFree(slot->request);
+	}
+	myy_pool_deinit(pool);
+	return -1;
+}
+
+static void myy_drm_atomic_pool_deinit(
+	myy_drm_infos_t * __restrict const myy_drm_conf)
+{
+	struct myy_pool * __restrict const pool = &myy_drm_conf->atomic_requests;
+	for (uint32_t r = 0; r < pool->capacity; r++) {
+		struct myy_drm_atomic_slot * __restrict const slot =
+			myy_pool_object(pool, r);
+		drmModeAtomicFree(slot->request);
+	}
+	myy_pool_deinit(pool);
+}
+
+/* Returns an empty atomic request, or NULL if all are in use */
+static struct myy_drm_atomic_slot * myy_drm_atomic_get(
+	myy_drm_infos_t * __restrict const myy_drm_conf)
+{
+	struct myy_drm_atomic_slot * __restrict const slot =
+		myy_pool_get(&myy_drm_conf->atomic_requests);
+	if (slot == NULL) {
+		LOG_ERROR("Every atomic request is in use !");
+		return NULL;
+	}
+	drmModeAtomicSetCursor(slot->request, 0);
+	return slot;
+}
+
+static void myy_drm_atomic_put(
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	struct myy_drm_atomic_slot * __restrict const slot)
+{
+	myy_pool_put(&myy_drm_conf->atomic_requests, slot);
+}
+
+#define myy_set_atomic_add_prop(request, element_id, prop_id, prop_val) \
+	{\
+		LOGF("drmModeAtomicAddProperty(\n"\
+			"\t" #request    " : %p,\n"\
+			"\t" #element_id " : %u,\n"\
+			"\t" #prop_id    " : %u,\n"\
+			"\t" #prop_val   " : %u);\n",\
+			request, element_id, prop_id, prop_val); \
+		int const ret_val = drmModeAtomicAddProperty(\
+			request, element_id, prop_id, prop_val); \
+		LOGF("-> %d", ret_val);\
+	}
+
+
+/* Overlay planes.
+ * Planes stacked above the one fed by the EGLStream, for buffers that
+ * are scanned out as they are, without going through GL.
+ * The display engine converts and scales them on the way out. */
+struct myy_drm_overlay {
+	uint32_t plane_id;
+	struct myy_drm_plane_props_ids props;
+	struct myy_drm_plane_formats formats;
+};
+
+/* Finds an overlay plane of our CRTC that can scan out fourcc with
+ * modifier (DRM_FORMAT_MOD_INVALID : any layout). */
+static bool drm_overlay_find(
+	myy_drm_infos_t const * __restrict const myy_drm_conf,
+	uint32_t const fourcc,
+	uint64_t const modifier,
+	struct myy_drm_overlay * __restrict const overlay)
+{
+	int const drm_fd = myy_drm_conf->fd;
+	struct myy_drm_plane_props_ids * __restrict const ids = &overlay->props;
+	struct myy_kms_prop_id const plane_props[] = {
+		{ "SRC_X",   &ids->src_x   },
+		{ "SRC_Y",   &ids->src_y   },
+		{ "SRC_W",   &ids->src_w   },
+		{ "SRC_H",   &ids->src_h   },
+		{ "CRTC_X",  &ids->crtc_x  },
+		{ "CRTC_Y",  &ids->crtc_y  },
+		{ "CRTC_W",  &ids->crtc_w  },
+		{ "CRTC_H",  &ids->crtc_h  },
+		{ "FB_ID",   &ids->fb_id   },
+		{ "CRTC_ID", &ids->crtc_id },
+	};
+
+	memset(overlay, 0, sizeof(*overlay));
+	overlay->plane_id = drm_find_plane(drm_fd, myy_drm_conf->crtc_index,
+		DRM_PLANE_TYPE_OVERLAY, fourcc, modifier,
+		&myy_drm_conf->plane_id, 1);
+	if (overlay->plane_id == NO_PLANE_FOUND)
+		return false;
+
+	if (!myy_drm_kms_get_prop_ids(drm_fd, overlay->plane_id,
+		DRM_MODE_OBJECT_PLANE, plane_props, ARRAY_SIZE(plane_props))
+	    || !myy_drm_plane_formats_load(drm_fd, overlay->plane_id,
+		&overlay->formats))
+	{
+		memset(overlay, 0, sizeof(*overlay));
+		return false;
+	}
+
+	return true;
+}
+
+static void drm_overlay_release(struct myy_drm_overlay * __restrict const overlay)
+{
+	myy_drm_plane_formats_free(&overlay->formats);
+	memset(overlay, 0, sizeof(*overlay));
+}
+
+/* Scans out src_w x src_h pixels of fb_id, scaled to the CRTC
+ * rectangle. fb_id 0 turns the overlay off.
+ * user_data comes back with the flip event, when flags ask for one.
+ * Returns the drmModeAtomicCommit result. */
+static int drm_overlay_commit(
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	struct myy_drm_overlay const * __restrict const overlay,
+	uint32_t const fb_id,
+	uint32_t const src_w,
+	uint32_t const src_h,
+	int32_t const crtc_x,
+	int32_t const crtc_y,
+	uint32_t const crtc_w,
+	uint32_t const crtc_h,
+	uint32_t const flags,
+	void * const user_data)
+{
+	struct myy_drm_plane_props_ids const * __restrict const ids =
+		&overlay->props;
+	uint32_t const plane_id = overlay->plane_id;
+	bool const on = (fb_id != 0);
+	struct myy_drm_atomic_slot * __restrict const slot =
+		myy_drm_atomic_get(myy_drm_conf);
+	if (slot == NULL)
+		return -ENOMEM;
+
+	/* Not myy_set_atomic_add_prop : this runs once per client frame */
+	drmModeAtomicReq * __restrict const req = slot->request;
+	drmModeAtomicAddProperty(req, plane_id, ids->fb_id, fb_id);
+	drmModeAtomicAddProperty(req, plane_id, ids->crtc_id,
+		on ? myy_drm_conf->crtc_id : 0);
+	/* Source coordinates are 16.16 fixed point */
+	drmModeAtomicAddProperty(req, plane_id, ids->src_x, 0);
+	drmModeAtomicAddProperty(req, plane_id, ids->src_y, 0);
+	drmModeAtomicAddProperty(req, plane_id, ids->src_w,
+		on ? (uint64_t) src_w << 16 : 0);
+	drmModeAtomicAddProperty(req, plane_id, ids->src_h,
+		on ? (uint64_t) src_h << 16 : 0);
+	drmModeAtomicAddProperty(req, plane_id, ids->crtc_x, on ? crtc_x : 0);
+	drmModeAtomicAddProperty(req, plane_id, ids->crtc_y, on ? crtc_y : 0);
+	drmModeAtomicAddProperty(req, plane_id, ids->crtc_w, on ? crtc_w : 0);
+	drmModeAtomicAddProperty(req, plane_id, ids->crtc_h, on ? crtc_h : 0);
+
+	int const ret = myy_drm_atomic_commit(
+		myy_drm_conf, req, flags, user_data);
+	myy_drm_atomic_put(myy_drm_conf, slot);
+	return ret;
+}
+
+/* FNV-1a. Good enough to tell LUTs apart. */
+static uint64_t myy_hash_bytes(
+	void const * __restrict const data,
+	size_t const size)
+{
+	uint8_t const * __restrict const bytes = data;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t b = 0; b < size; b++) {
+		hash ^= bytes[b];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/* Returns a blob ID with the provided content, creating the blob
+ * only if no identical blob was created before.
+ * Returns 0 on failure. */
+static uint32_t myy_drm_blob_cache_get(
+	int const drm_fd,
+	struct myy_drm_blob_cache * __restrict const cache,
+	void const * __restrict const data,
+	uint32_t const size)
+{
+	uint64_t const hash = myy_hash_bytes(data, size);
+	uint32_t blob_id = 0;
+
+	for (uint32_t e = 0; e < MYY_DRM_BLOB_CACHE_SIZE; e++) {
+		struct myy_drm_blob_cache_entry const entry =
+			cache->entries[e];
+		if ((entry.blob_id != 0)
+		    & (entry.hash == hash)
+		    & (entry.size == size))
+		{
+			return entry.blob_id;
+		}
+	}
+
+	if (drmModeCreatePropertyBlob(drm_fd, data, size, &blob_id) != 0) {
+		LOG_ERROR("Could not create a property blob of %u bytes : %m",
+			size);
+		return 0;
+	}
+
+	/* Round-robin eviction. The kernel keeps a reference on blobs
+	 * that are still used by the current state, so destroying our
+	 * handle on an evicted blob is always safe. */
+	struct myy_drm_blob_cache_entry * __restrict const victim =
+		cache->entries + cache->next_victim;
+	if (victim->blob_id != 0)
+		drmModeDestroyPropertyBlob(drm_fd, victim->blob_id);
+
+	victim->hash    = hash;
+	victim->size    = size;
+	victim->blob_id = blob_id;
+	cache->next_victim =
+		(cache->next_victim + 1) % MYY_DRM_BLOB_CACHE_SIZE;
+
+	return blob_id;
+}
+
+static void myy_drm_blob_cache_clear(
+	int const drm_fd,
+	struct myy_drm_blob_cache * __restrict const cache)
+{
+	for (uint32_t e = 0; e < MYY_DRM_BLOB_CACHE_SIZE; e++) {
+		if (cache->entries[e].blob_id != 0)
+			drmModeDestroyPropertyBlob(drm_fd, cache->entries[e].blob_id);
+	}
+	memset(cache, 0, sizeof(*cache));
+}
+
+static void myy_drm_color_build_lut(
+	struct drm_color_lut * __restrict const lut,
+	uint32_t const lut_size,
+	float const exponent)
+{
+	float const last = (float) (lut_size - 1);
+	for (uint32_t i = 0; i < lut_size; i++) {
+		uint16_t const value = (uint16_t)
+			(powf((float) i / last, exponent) * 65535.0f + 0.5f);
+		lut[i].red      = value;
+		lut[i].green    = value;
+		lut[i].blue     = value;
+		lut[i].reserved = 0;
+	}
+}
+
+/* The CTM coefficients are in S31.32 sign-magnitude format */
+static uint64_t myy_drm_color_ctm_coeff(float const value)
+{
+	double const magnitude = (value < 0) ? -value : value;
+	uint64_t const coeff = (uint64_t) (magnitude * 4294967296.0);
+	return (value < 0) ? (coeff | (1ull << 63)) : coeff;
+}
+
+/* Builds a LUT with the CRTC own size and returns its blob ID.
+ * Returns 0 on failure. */
+static uint32_t myy_drm_color_lut_blob(
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	uint32_t const lut_size,
+	float const exponent)
+{
+	uint32_t blob_id = 0;
+	size_t const lut_bytes = lut_size * sizeof(struct drm_color_lut);
+	struct drm_color_lut * __restrict const lut = malloc(lut_bytes);
+
+	if (lut != NULL) {
+		myy_drm_color_build_lut(lut, lut_size, exponent);
+		blob_id = myy_drm_blob_cache_get(
+			myy_drm_conf->fd, &myy_drm_conf->color.blobs,
+			lut, lut_bytes);
+		free(lut);
+	}
+
+	return blob_id;
+}
+
+static void myy_drm_color_get_lut_sizes(
+	myy_drm_infos_t * __restrict const myy_drm_conf)
+{
+	int found = 0;
+	struct myy_drm_color * __restrict const color = &myy_drm_conf->color;
+
+	color->degamma_lut_size = 0;
+	color->gamma_lut_size   = 0;
+
+	if (myy_drm_conf->props_ids.crtc.degamma_lut) {
+		uint64_t const size = drm_get_property(
+			myy_drm_conf->fd, myy_drm_conf->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "DEGAMMA_LUT_SIZE", &found);
+		color->degamma_lut_size = found ? (uint32_t) size : 0;
+	}
+
+	if (myy_drm_conf->props_ids.crtc.gamma_lut) {
+		uint64_t const size = drm_get_property(
+			myy_drm_conf->fd, myy_drm_conf->crtc_id,
+			DRM_MODE_OBJECT_CRTC, "GAMMA_LUT_SIZE", &found);
+		color->gamma_lut_size = found ? (uint32_t) size : 0;
+	}
+
+	color->lut_sizes_known = true;
+}
+
+/* Adds the colour management properties, built from the current
+ * colour profile, to an atomic request.
+ * Blocks not supported by the CRTC are skipped silently, since
+ * they're optional anyway. A blob ID of 0 resets the block to
+ * its bypass state. */
+static void myy_drm_color_stage(
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	drmModeAtomicReq * __restrict const atomic_request)
+{
+	struct myy_drm_color * __restrict const color = &myy_drm_conf->color;
+	struct myy_color_profile const profile = color->profile;
+	struct myy_drm_atomic_props_ids const props_ids =
+		myy_drm_conf->props_ids;
+	uint32_t const crtc_id = myy_drm_conf->crtc_id;
+
+	if (!color->lut_sizes_known)
+		myy_drm_color_get_lut_sizes(myy_drm_conf);
+
+	if (props_ids.crtc.degamma_lut && color->degamma_lut_size > 1) {
+		uint32_t const blob_id = (profile.degamma > 0)
+			? myy_drm_color_lut_blob(
+				myy_drm_conf, color->degamma_lut_size,
+				profile.degamma)
+			: 0;
+		myy_set_atomic_add_prop(
+			atomic_request, crtc_id,
+			props_ids.crtc.degamma_lut, blob_id);
+	}
+
+	if (props_ids.crtc.ctm) {
+		uint32_t blob_id = 0;
+		if (profile.has_ctm) {
+			struct drm_color_ctm ctm;
+			for (uint32_t c = 0; c < 9; c++)
+				ctm.matrix[c] = myy_drm_color_ctm_coeff(profile.ctm[c]);
+			blob_id = myy_drm_blob_cache_get(
+				myy_drm_conf->fd, &color->blobs, &ctm, sizeof(ctm));
+		}
+		myy_set_atomic_add_prop(
+			atomic_request, crtc_id,
+			props_ids.crtc.ctm, blob_id);
+	}
+
+	if (props_ids.crtc.gamma_lut && color->gamma_lut_size > 1) {
+		/* Gamma "correction" means applying the inverse curve */
+		uint32_t const blob_id = (profile.gamma > 0)
+			? myy_drm_color_lut_blob(
+				myy_drm_conf, color->gamma_lut_size,
+				1.0f / profile.gamma)
+			: 0;
+		myy_set_atomic_add_prop(
+			atomic_request, crtc_id,
+			props_ids.crtc.gamma_lut, blob_id);
+	}
+}
+
+/* Switch to another colour profile, while running.
+ * Only touches the CRTC colour properties, so no modeset involved. */
+static bool myy_drm_color_apply(
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	struct myy_color_profile const * __restrict const profile)
+{
+	bool ret = false;
+	struct myy_drm_atomic_slot * __restrict const slot =
+		myy_drm_atomic_get(myy_drm_conf);
+
+	if (slot == NULL)
+		goto no_atomic_request;
+
+	drmModeAtomicReq * __restrict const atomic_request = slot->request;
+	/* Staging reads the profile from the configuration, so swap it in
+	 * and put the previous one back if the hardware refuses it.
+	 * Otherwise every later commit would re-stage a rejected profile. */
+	struct myy_color_profile const previous = myy_drm_conf->color.profile;
+	myy_drm_conf->color.profile = *profile;
+	myy_drm_color_stage(myy_drm_conf, atomic_request);
+
+	if (myy_drm_atomic_commit(myy_drm_conf, atomic_request, 0, NULL)
+	    != 0)
+	{
+		LOG_ERROR("Could not commit the new colour profile : %m");
+		myy_drm_conf->color.profile = previous;
+		goto could_not_commit;
+	}
+
+	ret = true;
+
+could_not_commit:
+	myy_drm_atomic_put(myy_drm_conf, slot);
+no_atomic_request:
+	return ret;
+}
+
+
+static bool drm_setup_atomic_mode_for_streams(
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	uint32_t const mode_blob_id)
+{
+	int const drm_fd = myy_drm_conf->fd;
+	bool ret;
+	int i_ret;
+
+	if (myy_drm_conf->atomic_requests.capacity == 0
+	    && myy_drm_atomic_pool_init(myy_drm_conf) != 0)
+	{
+		LOG_ERROR("NO ATOMIC REQUEST ! OH NO !");
 		goto no_atomic_request;
 	}
 
+	struct myy_drm_atomic_slot * __restrict const slot =
+		myy_drm_atomic_get(myy_drm_conf);
+	if (slot == NULL)
+		goto no_atomic_request;
+	drmModeAtomicReq * __restrict const atomic_request = slot->request;
+
+	memset(&myy_drm_conf->props_ids, 0, sizeof(myy_drm_conf->props_ids));
 	ret = myy_drm_atomic_get_props_ids(
-		drm_fd, myy_drm_conf, &props_ids);
+		drm_fd, myy_drm_conf, &myy_drm_conf->props_ids);
 	if (ret == false) {
 		LOG_ERROR("Some required DRM properties were not found :C");
 		goto some_props_not_found;
 	}
 
+	/* Cache all the props. They will all be used, beside the
+	 * CPU framebuffer address that we allocated for... no reason ? */
+	myy_drm_infos_t const drm_conf = *myy_drm_conf;
+	struct myy_drm_atomic_props_ids const props_ids =
+		drm_conf.props_ids;
+
 	/* TODO Some checks should be performed here */
 	/* Copying NVIDIA comments */
 	/* Myy : CRTC props */
@@ -1231,8 +2733,11 @@ static bool drm_setup_atomic_mode_for_streams(
 		}
 	}
 
-	i_ret = drmModeAtomicCommit(
-		drm_fd, atomic_request,
+	/* Myy : Colour management, if the CRTC can do it */
+	myy_drm_color_stage(myy_drm_conf, atomic_request);
+
+	i_ret = myy_drm_atomic_commit(
+		myy_drm_conf, atomic_request,
 		DRM_MODE_ATOMIC_ALLOW_MODESET,
 		NULL);
 	if (i_ret != 0) {
@@ -1241,19 +2746,24 @@ static bool drm_setup_atomic_mode_for_streams(
 		goto could_not_commit;
 	}
 
-	drmModeAtomicFree(atomic_request);
+	myy_drm_atomic_put(myy_drm_conf, slot);
 	return true;
 
 could_not_commit:
 some_props_not_found:
-	drmModeAtomicFree(atomic_request);
+	myy_drm_atomic_put(myy_drm_conf, slot);
 no_atomic_request:
 	return false;
 }
 	
 
+/* The dumb buffer is displayed by the modeset, and stays on screen
+ * until the EGLStream delivers its first frame.
+ * It is black, and only mapped when cpu_access is set, to be painted
+ * once on screen (dumb_map). */
 static int nvidia_prepare_drm_for_streams(
-	myy_drm_infos_t * __restrict const myy_drm_conf)
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	bool const cpu_access)
 {
 	uint32_t const mode_blob_id =
 		drm_create_mode_id(myy_drm_conf);
@@ -1261,7 +2771,7 @@ static int nvidia_prepare_drm_for_streams(
 		goto no_mode_blob_id;
 	}
 
-	if (!drm_map_framebuffer(myy_drm_conf)) {
+	if (!drm_map_framebuffer(myy_drm_conf, cpu_access)) {
 		LOG_ERROR("Could not map frame_buffer");
 		goto could_not_map_framebuffer;
 	}
@@ -1273,14 +2783,53 @@ static int nvidia_prepare_drm_for_streams(
 		goto could_not_setup_atomic_mode_for_streams;
 	}
 
+	myy_drm_conf->mode_blob_id = mode_blob_id;
 	return 0;
 
 could_not_setup_atomic_mode_for_streams:
-/* TODO Unmap framebuffer */
+	drm_unmap_framebuffer(myy_drm_conf);
 could_not_map_framebuffer:
+	drmModeDestroyPropertyBlob(myy_drm_conf->fd, mode_blob_id);
 no_mode_blob_id:
 	return -1;
 }
+
+/* Everything drm_init acquired, plus what was created afterwards
+ * with the DRM node (colour blobs, atomic requests).
+ * The framebuffer must have been released before. */
+static void drm_deinit(
+	myy_drm_infos_t * __restrict const myy_drm_conf)
+{
+	if (myy_drm_conf->fd < 0)
+		return;
+
+	myy_drm_blob_cache_clear(myy_drm_conf->fd, &myy_drm_conf->color.blobs);
+	if (myy_drm_conf->atomic_requests.capacity)
+		myy_drm_atomic_pool_deinit(myy_drm_conf);
+	myy_drm_plane_formats_free(&myy_drm_conf->plane_formats);
+	/* The next CRTC might not have the same LUTs */
+	myy_drm_conf->color.degamma_lut_size = 0;
+	myy_drm_conf->color.gamma_lut_size   = 0;
+	myy_drm_conf->color.lut_sizes_known  = false;
+	pthread_mutex_destroy(&myy_drm_conf->commit_lock);
+	close(myy_drm_conf->fd);
+	myy_drm_conf->fd = -1;
+}
+
+static void nvidia_release_drm_for_streams(
+	myy_drm_infos_t * __restrict const myy_drm_conf)
+{
+	drm_unmap_framebuffer(myy_drm_conf);
+	/* The CRTC is still using it, until the next modeset.
+	 * The kernel keeps it alive as long as it is needed. */
+	if (myy_drm_conf->mode_blob_id != 0)
+		drmModeDestroyPropertyBlob(
+			myy_drm_conf->fd, myy_drm_conf->mode_blob_id);
+	myy_drm_conf->mode_blob_id = 0;
+}
+/* Opens the DRM node of the EGL device and selects the connector,
+ * CRTC and plane. Nothing is displayed until
+ * nvidia_prepare_drm_for_streams. */
 static int nvidia_drm_open(
 	struct myy_nvidia_functions const * __restrict const myy_nvidia,
 	EGLDeviceEXT egl_device,
@@ -1311,63 +2860,285 @@ static int nvidia_drm_open(
 		goto could_not_initialise_drm;
 	}
 
-	ret = nvidia_prepare_drm_for_streams(myy_drm_conf);
-	if (ret == -1) {
-		LOG_ERROR(
-			"Could not connect NVIDIA EGL Streams to the DRM "
-			"subsystem");
-		goto could_not_attach_streams_to_kms;
-	}
-
 	return ret;
 
-could_not_attach_streams_to_kms:
-/* TODO drm_deinit */
 could_not_initialise_drm:
 no_drm_device_filepath:
 	return -1;
 }
 
+static void nvidia_drm_close(
+	myy_drm_infos_t * __restrict const myy_drm_conf)
+{
+	nvidia_release_drm_for_streams(myy_drm_conf);
+	drm_deinit(myy_drm_conf);
+}
+
+
+
+/* Everything we want to know about an EGLConfig, queried once.
+ * eglGetConfigAttrib is one call per attribute, and there are
+ * dozens of configs on NVIDIA drivers. Doing it once per display
+ * is enough. */
+struct myy_egl_config_desc {
+	EGLConfig config;
+	EGLint id;
+	EGLint red, green, blue, alpha;
+	EGLint buffer_size;
+	EGLint depth, stencil;
+	EGLint sample_buffers, samples;
+	EGLint surface_type;
+	EGLint renderable_type;
+	EGLint caveat;
+	uint32_t fourcc;
+};
+
+#define MYY_EGL_CONFIG_CACHES (4)
+struct myy_egl_config_cache {
+	EGLDisplay display;
+	EGLint n_configs;
+	struct myy_egl_config_desc * descs;
+};
+
+static struct myy_egl_config_cache
+	myy_egl_config_caches[MYY_EGL_CONFIG_CACHES];
+
+/* The DRM format a surface created with this config will be
+ * scanned out as. 0 if there's no obvious match. */
+static uint32_t egl_config_scanout_fourcc(
+	struct myy_egl_config_desc const * __restrict const desc)
+{
+	uint32_t fourcc = 0;
+	EGLint const red = desc->red, green = desc->green, blue = desc->blue;
+	EGLint const alpha = desc->alpha;
+
+	if ((red == 8) & (green == 8) & (blue == 8))
+		fourcc = alpha ? DRM_FORMAT_ARGB8888 : DRM_FORMAT_XRGB8888;
+	else if ((red == 10) & (green == 10) & (blue == 10))
+		fourcc = alpha ? DRM_FORMAT_ARGB2101010 : DRM_FORMAT_XRGB2101010;
+	else if ((red == 5) & (green == 6) & (blue == 5))
+		fourcc = DRM_FORMAT_RGB565;
+
+	return fourcc;
+}
+
+static void egl_config_desc_dump(
+	struct myy_egl_config_desc const * __restrict const desc)
+{
+	char fourcc_name[5];
+	myy_fourcc_to_str(desc->fourcc, fourcc_name);
+	LOGF("[EGL Config %d]\n"
+		"\tRGBA            : %d %d %d %d (%s)\n"
+		"\tBuffer size     : %d\n"
+		"\tDepth / Stencil : %d / %d\n"
+		"\tSamples         : %d (%d buffers)\n"
+		"\tSurface type    : 0x%x\n"
+		"\tRenderable type : 0x%x\n"
+		"\tCaveat          : 0x%x",
+		desc->id,
+		desc->red, desc->green, desc->blue, desc->alpha,
+		desc->fourcc ? fourcc_name : "????",
+		desc->buffer_size,
+		desc->depth, desc->stencil,
+		desc->samples, desc->sample_buffers,
+		desc->surface_type,
+		desc->renderable_type,
+		desc->caveat);
+}
+
+static struct myy_egl_config_cache const * egl_config_cache_get(
+	EGLDisplay const egl_display)
+{
+	struct myy_egl_config_cache * __restrict free_slot = NULL;
+
+	for (uint32_t c = 0; c < MYY_EGL_CONFIG_CACHES; c++) {
+		struct myy_egl_config_cache * __restrict const cache =
+			myy_egl_config_caches + c;
+		if (cache->display == egl_display)
+			return cache;
+		if ((cache->display == EGL_NO_DISPLAY) & (free_slot == NULL))
+			free_slot = cache;
+	}
+
+	if (free_slot == NULL) {
+		LOG_ERROR("Too many EGL displays to cache their configs");
+		return NULL;
+	}
+
+	EGLint n_configs = 0;
+	EGLConfig * __restrict configs = NULL;
+	struct myy_egl_config_desc * __restrict descs = NULL;
+
+	if (!eglGetConfigs(egl_display, NULL, 0, &n_configs) || n_configs <= 0)
+		goto no_configs;
+
+	configs = calloc(n_configs, sizeof(EGLConfig));
+	descs   = calloc(n_configs, sizeof(struct myy_egl_config_desc));
+	if ((configs == NULL) | (descs == NULL))
+		goto no_memory;
+
+	if (!eglGetConfigs(egl_display, configs, n_configs, &n_configs))
+		goto no_memory;
+
+	for (EGLint c = 0; c < n_configs; c++) {
+		struct myy_egl_config_desc * __restrict const desc = descs + c;
+		struct { EGLint attrib; EGLint * value; } const queries[] = {
+			{ EGL_CONFIG_ID,       &desc->id              },
+			{ EGL_RED_SIZE,        &desc->red             },
+			{ EGL_GREEN_SIZE,      &desc->green           },
+			{ EGL_BLUE_SIZE,       &desc->blue            },
+			{ EGL_ALPHA_SIZE,      &desc->alpha           },
+			{ EGL_BUFFER_SIZE,     &desc->buffer_size     },
+			{ EGL_DEPTH_SIZE,      &desc->depth           },
+			{ EGL_STENCIL_SIZE,    &desc->stencil         },
+			{ EGL_SAMPLE_BUFFERS,  &desc->sample_buffers  },
+			{ EGL_SAMPLES,         &desc->samples         },
+			{ EGL_SURFACE_TYPE,    &desc->surface_type    },
+			{ EGL_RENDERABLE_TYPE, &desc->renderable_type },
+			{ EGL_CONFIG_CAVEAT,   &desc->caveat          },
+		};
+
+		desc->config = configs[c];
+		for (uint32_t q = 0; q < ARRAY_SIZE(queries); q++)
+			eglGetConfigAttrib(
+				egl_display, configs[c], queries[q].attrib,
+				queries[q].value);
+		desc->fourcc = egl_config_scanout_fourcc(desc);
+	}
+
+	free(configs);
+	free_slot->display   = egl_display;
+	free_slot->n_configs = n_configs;
+	free_slot->descs     = descs;
+	LOGF("Cached %d EGL configs for display %p", n_configs, egl_display);
+	return free_slot;
+
+no_memory:
+	free(configs);
+	free(descs);
+no_configs:
+	LOG_EGL_ERROR("Could not enumerate the EGL configs");
+	return NULL;
+}
+
+static void egl_config_cache_forget(EGLDisplay const egl_display)
+{
+	for (uint32_t c = 0; c < MYY_EGL_CONFIG_CACHES; c++) {
+		struct myy_egl_config_cache * __restrict const cache =
+			myy_egl_config_caches + c;
+		if (cache->display == egl_display) {
+			free(cache->descs);
+			cache->descs     = NULL;
+			cache->n_configs = 0;
+			cache->display   = EGL_NO_DISPLAY;
+		}
+	}
+}
+
+/* Bytes written per pixel when rendering with this config.
+ * Multisampled buffers store every sample. */
+static uint32_t egl_config_bytes_per_pixel(
+	struct myy_egl_config_desc const * __restrict const desc)
+{
+	uint32_t const samples = (desc->samples > 1) ? desc->samples : 1;
+	uint32_t const color_bits =
+		desc->red + desc->green + desc->blue + desc->alpha;
+	uint32_t const ds_bits = desc->depth + desc->stencil;
+	/* Round to what the hardware actually stores */
+	uint32_t const color_bytes = (color_bits <= 16) ? 2 : 4;
+	uint32_t const ds_bytes =
+		(ds_bits == 0) ? 0 : ((ds_bits <= 16) ? 2 : 4);
+	return (color_bytes + ds_bytes) * samples;
+}
 
+/* Returns -1 if the config cannot be used.
+ * Otherwise, the higher the better. */
+static int64_t egl_config_score(
+	struct myy_egl_config_desc const * __restrict const desc,
+	struct myy_egl_config_needs const * __restrict const needs,
+	struct myy_drm_plane_formats const * __restrict const plane_formats)
+{
+	EGLint const surface_bit =
+		needs->offscreen ? EGL_PBUFFER_BIT : EGL_STREAM_BIT_KHR;
+	bool const usable =
+		((desc->surface_type & surface_bit) != 0)
+		& ((desc->renderable_type & EGL_OPENGL_ES2_BIT) != 0)
+		& (desc->depth >= needs->depth_bits)
+		& (desc->stencil >= needs->stencil_bits)
+		& (desc->samples >= needs->samples)
+		& (!needs->alpha | (desc->alpha > 0))
+		& ((desc->fourcc != DRM_FORMAT_RGB565) | needs->allow_rgb565)
+		& (desc->red >= 5);
+
+	if (!usable)
+		return -1;
+
+	int plane_score = -1;
+	if (desc->fourcc != 0)
+		myy_drm_plane_formats_best_modifier(
+			plane_formats, desc->fourcc, &plane_score);
+
+	/* When we know what the plane can scan out, a config it can't
+	 * display would only fail later, when attaching the stream. */
+	if ((plane_formats->n_pairs != 0) & (plane_score < 0))
+		return -1;
+
+	/* Fewer bytes per pixel first. Then, the best scanout layout.
+	 * Then, no caveat. And finally, the smallest config ID, so that
+	 * the choice stays stable between runs. */
+	int64_t score =
+		(int64_t) (1024 - egl_config_bytes_per_pixel(desc)) << 32;
+	score += (int64_t) (plane_score + 1) << 24;
+	score += (desc->caveat == EGL_NONE) ? (1 << 20) : 0;
+	score += (1 << 16) - (desc->id & 0xffff);
+	return score;
+}
 
 static EGLBoolean egl_nvidia_get_config(
 	EGLDisplay const egl_display,
+	struct myy_egl_config_needs const * __restrict const needs,
+	struct myy_drm_plane_formats const * __restrict const plane_formats,
 	EGLConfig * __restrict const egl_config)
 {
-	/* The desired minimal configuration */
-	static const EGLint config_attribs[] = {
-		EGL_SURFACE_TYPE, EGL_STREAM_BIT_KHR, // Important one
-		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT, // We want GLES 2.x
-		EGL_RED_SIZE, 1,   // With RGB output
-		EGL_GREEN_SIZE, 1,
-		EGL_BLUE_SIZE, 1,
-		EGL_ALPHA_SIZE, 0, // With alpha
-		EGL_DEPTH_SIZE, 1, // And a depth buffer
-		EGL_NONE
-	};
-	/* Will be malloced */
-	EGLConfig the_chosen_one;
-	/* Will receive the number of available configurations */
-	EGLint n_configs = 0;
-	EGLBoolean ret = EGL_FALSE;
+	struct myy_egl_config_cache const * __restrict const cache =
+		egl_config_cache_get(egl_display);
+	struct myy_egl_config_desc const * __restrict the_chosen_one = NULL;
+	int64_t best_score = -1;
+
+	if (cache == NULL)
+		return EGL_FALSE;
+
+	for (EGLint c = 0; c < cache->n_configs; c++) {
+		int64_t const score =
+			egl_config_score(cache->descs + c, needs, plane_formats);
+		if (score > best_score) {
+			best_score = score;
+			the_chosen_one = cache->descs + c;
+		}
+	}
 
-	ret = eglChooseConfig(
-		egl_display, config_attribs, &the_chosen_one, 1, &n_configs);
-	if (!ret || n_configs == 0) {
+	if (the_chosen_one == NULL) {
 		LOG_EGL_ERROR(
 			"Could not find a configuration with at least :\n"
-			"- EGL Streams support\n"
+			"- %s support\n"
 			"- OpenGL ES 2.x support\n"
 			"- RGB support\n"
-			"- Alpha and Depth buffers support\n"
-			"Call the police");
-	}
-	else {
-		egl_print_config_attribs(egl_display, the_chosen_one);
-		*egl_config = the_chosen_one;
+			"- %d bits of depth, %d bits of stencil, %d samples%s%s\n"
+			"Call the police",
+			needs->offscreen ? "Pbuffer" : "EGL Streams",
+			needs->depth_bits, needs->stencil_bits, needs->samples,
+			needs->alpha ? "\n- An alpha channel" : "",
+			(plane_formats->n_pairs != 0)
+				? "\n- A format the plane can scan out" : "");
+		return EGL_FALSE;
 	}
 
-	return ret;
+	LOGF("Selected EGL config %d : %u bytes per pixel",
+		the_chosen_one->id, egl_config_bytes_per_pixel(the_chosen_one));
+	egl_config_desc_dump(the_chosen_one);
+	*egl_config = the_chosen_one->config;
+
+	return EGL_TRUE;
 }
 
 static EGLDisplay egl_nvidia_get_display(
@@ -1391,20 +3162,45 @@ static EGLDisplay egl_nvidia_get_display(
 		(void*) nvidia_device, attribs);
 }
 
-static EGLBoolean nvidia_egl_create_surface(
+/* The EGLOutputLayer that corresponds to the DRM KMS plane */
+static EGLBoolean nvidia_egl_get_plane_layer(
 	struct myy_nvidia_functions const * __restrict const nvidia,
 	EGLDisplay egl_display,
-	EGLConfig egl_config,
 	myy_drm_infos_t const * __restrict const myy_drm_conf,
-	EGLSurface * __restrict const egl_surface,
-	EGLStreamKHR * __restrict const egl_stream)
+	EGLOutputLayerEXT * __restrict const egl_layer)
 {
 	EGLAttrib const layer_attribs[] = {
 		EGL_DRM_PLANE_EXT,
 		myy_drm_conf->plane_id,
 		EGL_NONE,
 	};
+	EGLint n;
+
+	LOGF(
+		"layer_attribs[] = { EGL_DRM_PLANE_EXT, %ld, 0 }",
+		layer_attribs[1]);
+
+	EGLBoolean const ret = nvidia->eglGetOutputLayers(
+		egl_display, layer_attribs, egl_layer, 1, &n);
+
+	if (!ret || n == 0)
+	{
+		LOG_EGL_ERROR(
+			"Unable to get EGLOutputLayer for plane 0x%08x\n",
+			myy_drm_conf->plane_id);
+		return EGL_FALSE;
+	}
+	return EGL_TRUE;
+}
 
+static EGLBoolean nvidia_egl_create_surface(
+	struct myy_nvidia_functions const * __restrict const nvidia,
+	EGLDisplay egl_display,
+	EGLConfig egl_config,
+	myy_drm_infos_t const * __restrict const myy_drm_conf,
+	EGLSurface * __restrict const egl_surface,
+	EGLStreamKHR * __restrict const egl_stream)
+{
 	EGLint const surface_attribs[] = {
 		EGL_WIDTH, myy_drm_conf->width,
 		EGL_HEIGHT, myy_drm_conf->height,
@@ -1417,25 +3213,15 @@ static EGLBoolean nvidia_egl_create_surface(
 	EGLStreamKHR stream;
 	EGLBoolean ret = EGL_FALSE;
 	EGLSurface surface = EGL_NO_SURFACE;
-	EGLint n;
 
-	LOGF(
-		"layer_attribs[] = { EGL_DRM_PLANE_EXT, %ld, 0 }",
-		layer_attribs[1]);
 	LOGF("surface_attribs[] = { EGL_WIDTH, %d, EGL_HEIGHT, %d, 0 }",
 		 surface_attribs[1], surface_attribs[3]);
-	
-	 /* Find the EGLOutputLayer that corresponds to the DRM KMS plane. */
-	ret = nvidia->eglGetOutputLayers(
-		egl_display, layer_attribs, &egl_layer, 1, &n);
 
-    if (!ret || n == 0)
-	{
-		LOG_EGL_ERROR(
-			"Unable to get EGLOutputLayer for plane 0x%08x\n",
-			myy_drm_conf->plane_id);
+	 /* Find the EGLOutputLayer that corresponds to the DRM KMS plane. */
+	ret = nvidia_egl_get_plane_layer(
+		nvidia, egl_display, myy_drm_conf, &egl_layer);
+	if (!ret)
 		goto no_egl_output_layers;
-	}
 
 	/* Create an EGLStream. */
 	stream = nvidia->eglCreateStream(egl_display, stream_attribs);
@@ -1503,7 +3289,7 @@ static EGLBoolean nvidia_egl_create_surface(
 
 no_egl_surface:
 no_egl_stream_consumer_output:
-	nvidia->eglDestroyStream(egl_display, egl_stream);
+	nvidia->eglDestroyStream(egl_display, stream);
 no_egl_stream:
 no_egl_output_layers:
 	return EGL_FALSE;
@@ -1515,11 +3301,17 @@ static void nvidia_egl_destroy_surface(
 	EGLSurface egl_surface,
 	EGLStreamKHR egl_stream)
 {
-	nvidia->eglDestroyStream(egl_display, egl_stream);
+	/* Producer first, then the stream it feeds */
 	eglDestroySurface(egl_display, egl_surface);
+	/* Offscreen contexts have no stream */
+	if (egl_stream != EGL_NO_STREAM_KHR)
+		nvidia->eglDestroyStream(egl_display, egl_stream);
 }
 
-static int egl_prepare_opengl_context(
+/* The display and the context, left not current. The stream and its
+ * producer surface need the CRTC to run, so they're created by
+ * egl_attach_stream_surface, after nvidia_prepare_drm_for_streams. */
+static int egl_prepare_display_context(
 	struct myy_nvidia_functions const * __restrict const nvidia,
 	EGLDeviceEXT const nvidia_device,
 	myy_drm_infos_t * __restrict const myy_drm_conf,
@@ -1530,8 +3322,6 @@ static int egl_prepare_opengl_context(
 	EGLDisplay display;
 	EGLConfig config;
 	EGLContext context;
-	EGLSurface surface;
-	EGLStreamKHR stream;
 
 	EGLint const context_attribs[] = {
 		EGL_CONTEXT_CLIENT_VERSION, 2,
@@ -1555,7 +3345,16 @@ static int egl_prepare_opengl_context(
 
 	LOGF("EGL Version \"%s\"", eglQueryString(display, EGL_VERSION));
 	LOGF("EGL Vendor \"%s\"", eglQueryString(display, EGL_VENDOR));
-	LOGF("EGL Extensions \"%s\"", eglQueryString(display, EGL_EXTENSIONS));
+	myy_egl_caps_parse(&myy_gl_conf->display_caps,
+		eglQueryString(display, EGL_EXTENSIONS), "display");
+	LOGF("Optional stream features : "
+		"acquire mode %s, metadata %s, cross-process %s",
+		myy_egl_caps_has(&myy_gl_conf->display_caps,
+			MYY_EGL_EXT_stream_acquire_mode) ? "yes" : "no",
+		myy_egl_caps_has(&myy_gl_conf->display_caps,
+			MYY_EGL_NV_stream_metadata) ? "yes" : "no",
+		myy_egl_caps_has(&myy_gl_conf->display_caps,
+			MYY_EGL_KHR_stream_cross_process_fd) ? "yes" : "no");
 
 	if (!eglBindAPI(EGL_OPENGL_ES_API)) {
 		LOG_EGL_ERROR(
@@ -1563,7 +3362,9 @@ static int egl_prepare_opengl_context(
 		goto no_opengl_es_api;
 	}
 
-	egl_ret = egl_nvidia_get_config(display, &config);
+	egl_ret = egl_nvidia_get_config(
+		display, &myy_gl_conf->config_needs,
+		&myy_drm_conf->plane_formats, &config);
 	if (egl_ret == EGL_FALSE) {
 		LOGF("No config :C");
 		goto no_egl_config;
@@ -1577,193 +3378,9414 @@ static int egl_prepare_opengl_context(
 		goto no_egl_context;
 	}
 
-	egl_ret = nvidia_egl_create_surface(
-		nvidia, display, config, myy_drm_conf, &surface, &stream);
-
-	if (!egl_ret) {
+	myy_gl_conf->display = display;
+	myy_gl_conf->config  = config;
+	myy_gl_conf->context = context;
+	myy_gl_conf->surface = EGL_NO_SURFACE;
+	myy_gl_conf->stream  = EGL_NO_STREAM_KHR;
+	return 0;
+
+no_egl_context:
+no_egl_config:
+no_opengl_es_api:
+	egl_config_cache_forget(display);
+	eglTerminate(display);
+cannot_initialize_egl:
+no_egl_display:
+	return -1;
+}
+
+/* The CRTC must be running (nvidia_prepare_drm_for_streams).
+ * Connects a stream to the plane, creates its producer surface and
+ * makes it current with the context. */
+static int egl_attach_stream_surface(
+	struct myy_nvidia_functions const * __restrict const nvidia,
+	myy_drm_infos_t const * __restrict const myy_drm_conf,
+	myy_opengl_infos_t * __restrict const myy_gl_conf)
+{
+	EGLDisplay const display = myy_gl_conf->display;
+	EGLSurface surface;
+	EGLStreamKHR stream;
+
+	if (!nvidia_egl_create_surface(nvidia, display,
+		myy_gl_conf->config, myy_drm_conf, &surface, &stream))
+	{
 		LOG_ERROR("No surface !?");
+		return -1;
+	}
+
+	if (!eglMakeCurrent(display, surface, surface, myy_gl_conf->context)) {
+		LOG_ERROR(
+			"Could not the surface current... ???");
+		nvidia_egl_destroy_surface(nvidia, display, surface, stream);
+		return -1;
+	}
+
+	myy_gl_conf->surface = surface;
+	myy_gl_conf->stream  = stream;
+	return 0;
+}
+
+/* A context rendering into a pbuffer, on a device that displays
+ * nothing. See the render/scanout split. */
+static int egl_prepare_offscreen_context(
+	struct myy_nvidia_functions const * __restrict const nvidia,
+	EGLDeviceEXT const render_device,
+	uint32_t const width,
+	uint32_t const height,
+	myy_opengl_infos_t * __restrict const myy_gl_conf)
+{
+	EGLint major, minor;
+	EGLDisplay display;
+	EGLConfig config;
+	EGLContext context;
+	EGLSurface surface;
+	struct myy_drm_plane_formats const no_plane = {0};
+
+	EGLint const display_attribs[] = { EGL_NONE };
+	EGLint const context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+	EGLint const pbuffer_attribs[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
+
+	display = nvidia->eglGetPlatformDisplay(
+		EGL_PLATFORM_DEVICE_EXT, (void *) render_device, display_attribs);
+	if (display == EGL_NO_DISPLAY) {
+		LOG_EGL_ERROR("No display for the render device");
+		goto no_egl_display;
+	}
+
+	if (!eglInitialize(display, &major, &minor)) {
+		LOG_EGL_ERROR("Could not initialize the render display");
+		goto cannot_initialize_egl;
+	}
+
+	LOGF("Render device : EGL %d.%d, \"%s\"",
+		major, minor, eglQueryString(display, EGL_VENDOR));
+	myy_egl_caps_parse(&myy_gl_conf->display_caps,
+		eglQueryString(display, EGL_EXTENSIONS), "render display");
+
+	if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+		LOG_EGL_ERROR("Failed to bind api EGL_OPENGL_ES_API");
+		goto no_opengl_es_api;
+	}
+
+	myy_gl_conf->config_needs.offscreen = true;
+	if (!egl_nvidia_get_config(
+		display, &myy_gl_conf->config_needs, &no_plane, &config))
+	{
+		LOGF("No config :C");
+		goto no_egl_config;
+	}
+
+	context = eglCreateContext(display, config,
+		EGL_NO_CONTEXT, context_attribs);
+	if (context == EGL_NO_CONTEXT) {
+		LOG_EGL_ERROR("Failed to create an OpenGL ES 2.x context");
+		goto no_egl_context;
+	}
+
+	surface = eglCreatePbufferSurface(display, config, pbuffer_attribs);
+	if (surface == EGL_NO_SURFACE) {
+		LOG_EGL_ERROR("Could not create a %ux%u pbuffer", width, height);
+		goto no_egl_surface;
+	}
+
+	if (!eglMakeCurrent(display, surface, surface, context)) {
+		LOG_EGL_ERROR("Could not make the pbuffer current");
+		goto no_egl_make_current;
+	}
+
+	myy_gl_conf->display = display;
+	myy_gl_conf->config  = config;
+	myy_gl_conf->context = context;
+	myy_gl_conf->surface = surface;
+	myy_gl_conf->stream  = EGL_NO_STREAM_KHR;
+	return 0;
+
+no_egl_make_current:
+	eglDestroySurface(display, surface);
+no_egl_surface:
+	eglDestroyContext(display, context);
+no_egl_context:
+no_egl_config:
+no_opengl_es_api:
+	egl_config_cache_forget(display);
+	eglTerminate(display);
+cannot_initialize_egl:
+no_egl_display:
+	return -1;
+}
+
+/* A context rendering into a stream created by another process (the
+ * compositor), received as a file descriptor.
+ * The display has no DRM fd : the client doesn't touch KMS. */
+static int egl_prepare_client_context(
+	struct myy_nvidia_functions const * __restrict const nvidia,
+	EGLDeviceEXT const device,
+	int const stream_fd,
+	uint32_t const width,
+	uint32_t const height,
+	myy_opengl_infos_t * __restrict const myy_gl_conf)
+{
+	EGLint major, minor;
+	EGLDisplay display;
+	EGLConfig config;
+	EGLContext context;
+	EGLSurface surface;
+	EGLStreamKHR stream;
+	PFNEGLCREATESTREAMFROMFILEDESCRIPTORKHRPROC eglCreateStreamFromFd;
+	struct myy_drm_plane_formats const no_plane = {0};
+
+	EGLint const display_attribs[] = { EGL_NONE };
+	EGLint const context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+	EGLint const surface_attribs[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
+
+	display = nvidia->eglGetPlatformDisplay(
+		EGL_PLATFORM_DEVICE_EXT, (void *) device, display_attribs);
+	if (display == EGL_NO_DISPLAY) {
+		LOG_EGL_ERROR("No display for the client");
+		goto no_egl_display;
+	}
+
+	if (!eglInitialize(display, &major, &minor)) {
+		LOG_EGL_ERROR("Could not initialize the client display");
+		goto cannot_initialize_egl;
+	}
+
+	myy_egl_caps_parse(&myy_gl_conf->display_caps,
+		eglQueryString(display, EGL_EXTENSIONS), "client display");
+	eglCreateStreamFromFd = (PFNEGLCREATESTREAMFROMFILEDESCRIPTORKHRPROC)
+		eglGetProcAddress("eglCreateStreamFromFileDescriptorKHR");
+	if (!myy_egl_caps_has(&myy_gl_conf->display_caps,
+		MYY_EGL_KHR_stream_cross_process_fd)
+	    || eglCreateStreamFromFd == NULL)
+	{
+		LOG_ERROR("No EGL_KHR_stream_cross_process_fd on this display");
+		goto no_cross_process;
+	}
+
+	if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+		LOG_EGL_ERROR("Failed to bind api EGL_OPENGL_ES_API");
+		goto no_opengl_es_api;
+	}
+
+	/* The compositor knows the plane, we don't.
+	 * The stream converts anyway. */
+	myy_gl_conf->config_needs.offscreen = false;
+	if (!egl_nvidia_get_config(
+		display, &myy_gl_conf->config_needs, &no_plane, &config))
+	{
+		LOGF("No config :C");
+		goto no_egl_config;
+	}
+
+	context = eglCreateContext(display, config,
+		EGL_NO_CONTEXT, context_attribs);
+	if (context == EGL_NO_CONTEXT) {
+		LOG_EGL_ERROR("Failed to create an OpenGL ES 2.x context");
+		goto no_egl_context;
+	}
+
+	stream = eglCreateStreamFromFd(display, stream_fd);
+	if (stream == EGL_NO_STREAM_KHR) {
+		LOG_EGL_ERROR("Could not open the stream of the compositor");
+		goto no_egl_stream;
+	}
+
+	surface = nvidia->eglCreateStreamProducerSurface(
+		display, config, stream, surface_attribs);
+	if (surface == EGL_NO_SURFACE) {
+		LOG_EGL_ERROR("Could not produce frames for the compositor");
 		goto no_egl_surface;
 	}
 
-	egl_ret = eglMakeCurrent(
-		display, surface, surface, context);
+	if (!eglMakeCurrent(display, surface, surface, context)) {
+		LOG_EGL_ERROR("Could not make the stream surface current");
+		goto no_egl_make_current;
+	}
+
+	myy_gl_conf->display = display;
+	myy_gl_conf->config  = config;
+	myy_gl_conf->context = context;
+	myy_gl_conf->surface = surface;
+	myy_gl_conf->stream  = stream;
+	return 0;
+
+no_egl_make_current:
+	eglDestroySurface(display, surface);
+no_egl_surface:
+	nvidia->eglDestroyStream(display, stream);
+no_egl_stream:
+	eglDestroyContext(display, context);
+no_egl_context:
+no_egl_config:
+no_opengl_es_api:
+no_cross_process:
+	egl_config_cache_forget(display);
+	eglTerminate(display);
+cannot_initialize_egl:
+no_egl_display:
+	return -1;
+}
+
+static void egl_destroy_opengl_context(
+	struct myy_nvidia_functions const * __restrict const nvidia,
+	myy_opengl_infos_t * __restrict const myy_gl_conf)
+{
+	EGLDisplay const display = myy_gl_conf->display;
+
+	if (display == EGL_NO_DISPLAY)
+		return;
+
+	/* A current surface or context is only marked for deletion
+	 * by eglDestroy*. Release them for real. */
+	eglMakeCurrent(display,
+		EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	nvidia_egl_destroy_surface(
+		nvidia,
+		display,
+		myy_gl_conf->surface,
+		myy_gl_conf->stream);
+	eglDestroyContext(
+		display,
+		myy_gl_conf->context);
+	egl_config_cache_forget(display);
+	eglTerminate(display);
+	/* The per-thread EGL state (current API, last error) */
+	eglReleaseThread();
+
+	myy_gl_conf->display = EGL_NO_DISPLAY;
+	myy_gl_conf->config  = NULL;
+	myy_gl_conf->context = EGL_NO_CONTEXT;
+	myy_gl_conf->surface = EGL_NO_SURFACE;
+	myy_gl_conf->stream  = EGL_NO_STREAM_KHR;
+}
+
+/* The context and the stream at once, for when the CRTC already runs */
+static int egl_prepare_opengl_context(
+	struct myy_nvidia_functions const * __restrict const nvidia,
+	EGLDeviceEXT const nvidia_device,
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	myy_opengl_infos_t * __restrict const myy_gl_conf)
+{
+	if (egl_prepare_display_context(
+		nvidia, nvidia_device, myy_drm_conf, myy_gl_conf) != 0)
+		return -1;
+
+	if (egl_attach_stream_surface(nvidia, myy_drm_conf, myy_gl_conf) != 0) {
+		egl_destroy_opengl_context(nvidia, myy_gl_conf);
+		return -1;
+	}
+	return 0;
+}
+
+
+static uint64_t myy_clock_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* Runtime mode switches.
+ * Only the CRTC mode changes. The EGL display and context, and
+ * everything the scene uploaded, stay. The EGLStream and its producer
+ * surface are recreated only if the rendering size changes.
+ * When scaled is true, the rendering size is kept and the plane
+ * scales the frames to the new mode instead.
+ * On failure, the previous mode stays, unless the stream couldn't be
+ * recreated after the commit. The surface is then EGL_NO_SURFACE, and
+ * nothing can be drawn anymore. */
+static void drm_list_modes(
+	myy_drm_infos_t const * __restrict const myy_drm_conf)
+{
+	drmModeConnector * __restrict const connector =
+		drmModeGetConnector(myy_drm_conf->fd, myy_drm_conf->connector_id);
+
+	if (connector == NULL) {
+		LOG_ERROR("Could not get connector %u", myy_drm_conf->connector_id);
+		return;
+	}
+
+	for (int m = 0; m < connector->count_modes; m++) {
+		drmModeModeInfo const * __restrict const mode =
+			connector->modes + m;
+		bool const current =
+			memcmp(mode, &myy_drm_conf->mode, sizeof(*mode)) == 0;
+		LOGF("%c %2d : %ux%u@%u %s",
+			current ? '*' : ' ', m,
+			mode->hdisplay, mode->vdisplay, mode->vrefresh,
+			mode->name);
+	}
+
+	drmModeFreeConnector(connector);
+}
+
+static int myy_display_set_mode(
+	struct myy_nvidia_functions const * __restrict const nvidia,
+	myy_drm_infos_t * __restrict const myy_drm_conf,
+	myy_opengl_infos_t * __restrict const myy_gl_conf,
+	uint32_t const mode_index,
+	bool const scaled)
+{
+	int const drm_fd = myy_drm_conf->fd;
+	uint64_t const start = myy_clock_ns();
+	drmModeModeInfo mode;
+	uint32_t blob_id = 0;
+	struct myy_drm_atomic_slot * __restrict slot = NULL;
+
+	/* Modes are only copied out of the connector by drm_init */
+	drmModeConnector * __restrict const connector =
+		drmModeGetConnector(drm_fd, myy_drm_conf->connector_id);
+	if (connector == NULL) {
+		LOG_ERROR("Could not get connector %u", myy_drm_conf->connector_id);
+		goto no_connector;
+	}
+	if (mode_index >= (uint32_t) connector->count_modes) {
+		LOG_ERROR("No mode %u. The connector has %d modes",
+			mode_index, connector->count_modes);
+		drmModeFreeConnector(connector);
+		goto no_connector;
+	}
+	mode = connector->modes[mode_index];
+	drmModeFreeConnector(connector);
+
+	/* What we render, and what the CRTC displays */
+	uint32_t const width  = scaled ? myy_drm_conf->width  : mode.hdisplay;
+	uint32_t const height = scaled ? myy_drm_conf->height : mode.vdisplay;
+	bool const resize =
+		(width != myy_drm_conf->width) | (height != myy_drm_conf->height);
+	/* The plane needs a framebuffer for the modeset, and the
+	 * placeholder is gone once the stream took over */
+	bool const new_placeholder =
+		resize | (myy_drm_conf->framebuffer_id == 0);
+
+	/* The current framebuffer stays on until the new mode is on */
+	uint32_t const previous_fb_id     = myy_drm_conf->framebuffer_id;
+	uint32_t const previous_handle    = myy_drm_conf->dumb_handle;
+	uint64_t const previous_size      = myy_drm_conf->dumb_size;
+	uint8_t * __restrict const previous_map = myy_drm_conf->dumb_map;
+	uint32_t const previous_width     = myy_drm_conf->width;
+	uint32_t const previous_height    = myy_drm_conf->height;
+
+	if (drmModeCreatePropertyBlob(
+		drm_fd, &mode, sizeof(mode), &blob_id) != 0)
+	{
+		LOG_ERROR("Could not create the mode blob : %m");
+		goto no_mode_blob;
+	}
+
+	if (new_placeholder) {
+		myy_drm_conf->width  = width;
+		myy_drm_conf->height = height;
+		if (!drm_map_framebuffer(myy_drm_conf, false)) {
+			LOG_ERROR("Could not allocate a %ux%u framebuffer",
+				width, height);
+			goto no_framebuffer;
+		}
+	}
+
+	slot = myy_drm_atomic_get(myy_drm_conf);
+	if (slot == NULL)
+		goto no_atomic_request;
+
+	drmModeAtomicReq * __restrict const atomic_request = slot->request;
+	struct myy_drm_atomic_props_ids const props_ids =
+		myy_drm_conf->props_ids;
+	uint32_t const crtc_id  = myy_drm_conf->crtc_id;
+	uint32_t const plane_id = myy_drm_conf->plane_id;
+
+	myy_set_atomic_add_prop(atomic_request, crtc_id,
+		props_ids.crtc.mode_id, blob_id);
+	myy_set_atomic_add_prop(atomic_request, crtc_id,
+		props_ids.crtc.active, 1);
+	myy_set_atomic_add_prop(atomic_request, plane_id,
+		props_ids.plane.src_w, width << 16);
+	myy_set_atomic_add_prop(atomic_request, plane_id,
+		props_ids.plane.src_h, height << 16);
+	myy_set_atomic_add_prop(atomic_request, plane_id,
+		props_ids.plane.crtc_w, mode.hdisplay);
+	myy_set_atomic_add_prop(atomic_request, plane_id,
+		props_ids.plane.crtc_h, mode.vdisplay);
+	myy_set_atomic_add_prop(atomic_request, plane_id,
+		props_ids.plane.fb_id, myy_drm_conf->framebuffer_id);
+
+	/* Nothing changes if the driver refuses. Scaling, for one,
+	 * is optional. */
+	if (myy_drm_atomic_commit(myy_drm_conf, atomic_request,
+		DRM_MODE_ATOMIC_TEST_ONLY | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL))
+	{
+		LOG_ERROR("The driver refused %ux%u@%u%s : %m",
+			mode.hdisplay, mode.vdisplay, mode.vrefresh,
+			scaled ? " (scaled)" : "");
+		goto refused;
+	}
+
+	if (myy_drm_atomic_commit(myy_drm_conf, atomic_request,
+		DRM_MODE_ATOMIC_ALLOW_MODESET, NULL))
+	{
+		LOG_ERROR("Could not commit the new mode : %m");
+		goto refused;
+	}
+
+	myy_drm_atomic_put(myy_drm_conf, slot);
+
+	drmModeDestroyPropertyBlob(drm_fd, myy_drm_conf->mode_blob_id);
+	myy_drm_conf->mode_blob_id = blob_id;
+	myy_drm_conf->mode         = mode;
+
+	if (new_placeholder && previous_fb_id != 0) {
+		if (previous_map != NULL)
+			munmap(previous_map, previous_size);
+		drmModeRmFB(drm_fd, previous_fb_id);
+		drm_destroy_dumb_buffer(drm_fd, previous_handle);
+	}
+
+	if (resize) {
+		EGLDisplay const display = myy_gl_conf->display;
+		EGLSurface surface;
+		EGLStreamKHR stream;
+
+		eglMakeCurrent(display,
+			EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		nvidia_egl_destroy_surface(nvidia, display,
+			myy_gl_conf->surface, myy_gl_conf->stream);
+		myy_gl_conf->surface = EGL_NO_SURFACE;
+		myy_gl_conf->stream  = EGL_NO_STREAM_KHR;
+
+		if (!nvidia_egl_create_surface(nvidia, display,
+			myy_gl_conf->config, myy_drm_conf, &surface, &stream))
+		{
+			LOG_ERROR("Could not recreate the stream at %ux%u",
+				width, height);
+			return -1;
+		}
+		myy_gl_conf->surface = surface;
+		myy_gl_conf->stream  = stream;
+
+		if (!eglMakeCurrent(display, surface, surface,
+			myy_gl_conf->context))
+		{
+			LOG_EGL_ERROR("Could not make the new surface current");
+			nvidia_egl_destroy_surface(nvidia, display, surface, stream);
+			myy_gl_conf->surface = EGL_NO_SURFACE;
+			myy_gl_conf->stream  = EGL_NO_STREAM_KHR;
+			return -1;
+		}
+	}
+
+	LOGF("Mode %ux%u@%u, rendering at %ux%u, switched in %.2f ms",
+		mode.hdisplay, mode.vdisplay, mode.vrefresh, width, height,
+		(myy_clock_ns() - start) / 1e6);
+	return 0;
+
+refused:
+	myy_drm_atomic_put(myy_drm_conf, slot);
+no_atomic_request:
+	if (new_placeholder)
+		drm_unmap_framebuffer(myy_drm_conf);
+no_framebuffer:
+	myy_drm_conf->framebuffer_id = previous_fb_id;
+	myy_drm_conf->dumb_handle    = previous_handle;
+	myy_drm_conf->dumb_size      = previous_size;
+	myy_drm_conf->dumb_map       = previous_map;
+	myy_drm_conf->width          = previous_width;
+	myy_drm_conf->height         = previous_height;
+	drmModeDestroyPropertyBlob(drm_fd, blob_id);
+no_mode_blob:
+no_connector:
+	return -1;
+}
+
+/* Small matrix toolbox. Column-major, like OpenGL wants them. */
+struct myy_mat4 {
+	float m[16];
+};
+
+static struct myy_mat4 myy_mat4_identity(void)
+{
+	struct myy_mat4 const identity = {{
+		1, 0, 0, 0,
+		0, 1, 0, 0,
+		0, 0, 1, 0,
+		0, 0, 0, 1
+	}};
+	return identity;
+}
+
+static struct myy_mat4 myy_mat4_multiply(
+	struct myy_mat4 const * __restrict const a,
+	struct myy_mat4 const * __restrict const b)
+{
+	struct myy_mat4 result;
+	for (uint32_t col = 0; col < 4; col++) {
+		for (uint32_t row = 0; row < 4; row++) {
+			float sum = 0;
+			for (uint32_t k = 0; k < 4; k++)
+				sum += a->m[k*4+row] * b->m[col*4+k];
+			result.m[col*4+row] = sum;
+		}
+	}
+	return result;
+}
+
+static struct myy_mat4 myy_mat4_perspective(
+	float const fovy_radians,
+	float const aspect,
+	float const near,
+	float const far)
+{
+	float const f = 1.0f / tanf(fovy_radians / 2.0f);
+	struct myy_mat4 result = {{ 0 }};
+	result.m[0]  = f / aspect;
+	result.m[5]  = f;
+	result.m[10] = (far + near) / (near - far);
+	result.m[11] = -1.0f;
+	result.m[14] = (2.0f * far * near) / (near - far);
+	return result;
+}
+
+/* Rotation around Y, then around X, then translation */
+static struct myy_mat4 myy_mat4_model(
+	float const angle_x,
+	float const angle_y,
+	float const tx,
+	float const ty,
+	float const tz)
+{
+	float const cx = cosf(angle_x), sx = sinf(angle_x);
+	float const cy = cosf(angle_y), sy = sinf(angle_y);
+	struct myy_mat4 const result = {{
+		cy,       sx*sy,  -cx*sy, 0,
+		0,        cx,      sx,    0,
+		sy,      -sx*cy,   cx*cy, 0,
+		tx,       ty,      tz,    1
+	}};
+	return result;
+}
+
+/* GL state tracker.
+ *
+ * Every GL call goes through the driver, which has to validate it,
+ * even when it doesn't change anything. Binding the same program
+ * twice is not free.
+ * So the render thread goes through these thin wrappers, which
+ * remember the current state and drop the calls that wouldn't
+ * change it. They also count how many calls were dropped, so that
+ * we know how much we're saving.
+ *
+ * This tracks the state of ONE context : the render thread one.
+ * Other contexts (loaders, ...) must call GL directly.
+ * Call myy_gl_state_reset() whenever the context changes, or after
+ * any GL call that bypassed the tracker.
+ */
+#define MYY_GL_STATE_TEXTURE_UNITS (8)
+#define MYY_GL_STATE_VERTEX_ATTRIBS (16)
+#define MYY_GL_STATE_UNIFORMS (256)
+
+enum myy_gl_capability {
+	MYY_GL_CAP_BLEND,
+	MYY_GL_CAP_DEPTH_TEST,
+	MYY_GL_CAP_CULL_FACE,
+	MYY_GL_CAP_SCISSOR_TEST,
+	MYY_GL_CAP_COUNT
+};
+
+struct myy_gl_uniform_entry {
+	GLuint program;
+	GLint location;
+	uint32_t size;
+	float value[16];
+};
+
+struct myy_gl_state_stats {
+	uint32_t calls;
+	uint32_t redundant;
+};
+
+struct myy_gl_state {
+	bool valid;
+	GLuint program;
+	GLuint array_buffer;
+	GLuint element_array_buffer;
+	GLenum active_texture;
+	GLuint textures[MYY_GL_STATE_TEXTURE_UNITS];
+	int8_t capabilities[MYY_GL_CAP_COUNT]; /* -1 : unknown */
+	GLenum blend_src, blend_dst;
+	GLint scissor[4];
+	GLint viewport[4];
+	GLfloat clear_color[4];
+	uint32_t vertex_attribs_enabled;
+	uint32_t vertex_attribs_known;
+	struct myy_gl_uniform_entry uniforms[MYY_GL_STATE_UNIFORMS];
+	struct myy_gl_state_stats frame;
+	struct myy_gl_state_stats total;
+};
+
+static struct myy_gl_state myy_gl;
+
+static GLenum const myy_gl_capabilities_enums[MYY_GL_CAP_COUNT] = {
+	[MYY_GL_CAP_BLEND]        = GL_BLEND,
+	[MYY_GL_CAP_DEPTH_TEST]   = GL_DEPTH_TEST,
+	[MYY_GL_CAP_CULL_FACE]    = GL_CULL_FACE,
+	[MYY_GL_CAP_SCISSOR_TEST] = GL_SCISSOR_TEST,
+};
+
+/* Forget everything. The next calls will all reach the driver. */
+static void myy_gl_state_reset(void)
+{
+	struct myy_gl_state_stats const total = myy_gl.total;
+	memset(&myy_gl, 0, sizeof(myy_gl));
+	myy_gl.total = total;
+	/* 0 is a valid value for most of these, so use values that
+	 * the application will never use. */
+	myy_gl.program              = (GLuint) -1;
+	myy_gl.array_buffer         = (GLuint) -1;
+	myy_gl.element_array_buffer = (GLuint) -1;
+	myy_gl.active_texture       = 0;
+	for (uint32_t t = 0; t < MYY_GL_STATE_TEXTURE_UNITS; t++)
+		myy_gl.textures[t] = (GLuint) -1;
+	for (uint32_t c = 0; c < MYY_GL_CAP_COUNT; c++)
+		myy_gl.capabilities[c] = -1;
+	myy_gl.clear_color[0] = -1.0f;
+	myy_gl.scissor[2]     = -1;
+	myy_gl.viewport[2]    = -1;
+	myy_gl.valid = true;
+}
+
+/* Keeps the driver out of the heap counters, wherever the wrapper
+ * is called from */
+#define MYY_GL_DRIVER(call) do { \
+	bool const counting_ = myy_heap_counting_set(false); \
+	call; \
+	myy_heap_counting_set(counting_); \
+} while (0)
+
+static inline bool myy_gl_state_count(bool const redundant)
+{
+	myy_gl.frame.calls++;
+	myy_gl.frame.redundant += redundant;
+	return !redundant;
+}
+
+static void myy_gl_state_frame_begin(void)
+{
+	myy_gl.total.calls     += myy_gl.frame.calls;
+	myy_gl.total.redundant += myy_gl.frame.redundant;
+	myy_gl.frame.calls     = 0;
+	myy_gl.frame.redundant = 0;
+}
+
+static void myy_gl_use_program(GLuint const program)
+{
+	if (myy_gl_state_count(myy_gl.program == program)) {
+		MYY_GL_DRIVER(glUseProgram(program));
+		myy_gl.program = program;
+	}
+}
+
+/* The tracker must know about deleted programs, since their names
+ * can be reused by the driver.
+ * The uniforms cache is open addressed, so emptying only the slots of
+ * this program would cut the probe chains of the other programs.
+ * Programs are rarely deleted, so just flush the whole cache. */
+static void myy_gl_delete_program(GLuint const program)
+{
+	MYY_GL_DRIVER(glDeleteProgram(program));
+	if (myy_gl.program == program)
+		myy_gl.program = (GLuint) -1;
+	memset(myy_gl.uniforms, 0, sizeof(myy_gl.uniforms));
+}
+
+static void myy_gl_bind_buffer(GLenum const target, GLuint const buffer)
+{
+	GLuint * __restrict const current = (target == GL_ARRAY_BUFFER)
+		? &myy_gl.array_buffer
+		: &myy_gl.element_array_buffer;
+	if (myy_gl_state_count(*current == buffer)) {
+		MYY_GL_DRIVER(glBindBuffer(target, buffer));
+		*current = buffer;
+	}
+}
+
+static void myy_gl_delete_buffers(GLsizei const n, GLuint const * buffers)
+{
+	MYY_GL_DRIVER(glDeleteBuffers(n, buffers));
+	for (GLsizei b = 0; b < n; b++) {
+		if (myy_gl.array_buffer == buffers[b])
+			myy_gl.array_buffer = (GLuint) -1;
+		if (myy_gl.element_array_buffer == buffers[b])
+			myy_gl.element_array_buffer = (GLuint) -1;
+	}
+}
+
+static void myy_gl_active_texture(GLenum const unit)
+{
+	if (myy_gl_state_count(myy_gl.active_texture == unit)) {
+		MYY_GL_DRIVER(glActiveTexture(unit));
+		myy_gl.active_texture = unit;
+	}
+}
+
+/* Only GL_TEXTURE_2D is tracked */
+static void myy_gl_bind_texture(GLuint const texture)
+{
+	uint32_t const unit = (myy_gl.active_texture - GL_TEXTURE0)
+		% MYY_GL_STATE_TEXTURE_UNITS;
+	if (myy_gl_state_count(myy_gl.textures[unit] == texture)) {
+		MYY_GL_DRIVER(glBindTexture(GL_TEXTURE_2D, texture));
+		myy_gl.textures[unit] = texture;
+	}
+}
+
+static void myy_gl_delete_texture(GLuint const texture)
+{
+	MYY_GL_DRIVER(glDeleteTextures(1, &texture));
+	for (uint32_t t = 0; t < MYY_GL_STATE_TEXTURE_UNITS; t++) {
+		if (myy_gl.textures[t] == texture)
+			myy_gl.textures[t] = (GLuint) -1;
+	}
+}
+
+static void myy_gl_set_capability(
+	enum myy_gl_capability const cap,
+	bool const enabled)
+{
+	if (myy_gl_state_count(myy_gl.capabilities[cap] == enabled)) {
+		if (enabled)
+			MYY_GL_DRIVER(glEnable(myy_gl_capabilities_enums[cap]));
+		else
+			MYY_GL_DRIVER(glDisable(myy_gl_capabilities_enums[cap]));
+		myy_gl.capabilities[cap] = enabled;
+	}
+}
+
+static void myy_gl_blend_func(GLenum const src, GLenum const dst)
+{
+	if (myy_gl_state_count(
+		(myy_gl.blend_src == src) & (myy_gl.blend_dst == dst)))
+	{
+		MYY_GL_DRIVER(glBlendFunc(src, dst));
+		myy_gl.blend_src = src;
+		myy_gl.blend_dst = dst;
+	}
+}
+
+static void myy_gl_scissor(
+	GLint const x, GLint const y, GLsizei const w, GLsizei const h)
+{
+	GLint const box[4] = { x, y, w, h };
+	if (myy_gl_state_count(memcmp(myy_gl.scissor, box, sizeof(box)) == 0)) {
+		MYY_GL_DRIVER(glScissor(x, y, w, h));
+		memcpy(myy_gl.scissor, box, sizeof(box));
+	}
+}
+
+static void myy_gl_viewport(
+	GLint const x, GLint const y, GLsizei const w, GLsizei const h)
+{
+	GLint const box[4] = { x, y, w, h };
+	if (myy_gl_state_count(memcmp(myy_gl.viewport, box, sizeof(box)) == 0)) {
+		MYY_GL_DRIVER(glViewport(x, y, w, h));
+		memcpy(myy_gl.viewport, box, sizeof(box));
+	}
+}
+
+static void myy_gl_clear_color(
+	GLfloat const r, GLfloat const g, GLfloat const b, GLfloat const a)
+{
+	GLfloat const color[4] = { r, g, b, a };
+	if (myy_gl_state_count(
+		memcmp(myy_gl.clear_color, color, sizeof(color)) == 0))
+	{
+		MYY_GL_DRIVER(glClearColor(r, g, b, a));
+		memcpy(myy_gl.clear_color, color, sizeof(color));
+	}
+}
+
+static void myy_gl_enable_vertex_attrib(GLuint const index)
+{
+	uint32_t const bit = 1u << (index % MYY_GL_STATE_VERTEX_ATTRIBS);
+	bool const redundant =
+		(myy_gl.vertex_attribs_known & myy_gl.vertex_attribs_enabled & bit)
+		!= 0;
+	if (myy_gl_state_count(redundant)) {
+		MYY_GL_DRIVER(glEnableVertexAttribArray(index));
+		myy_gl.vertex_attribs_enabled |= bit;
+		myy_gl.vertex_attribs_known   |= bit;
+	}
+}
+
+/* Returns true if the value must be sent to the driver.
+ * Uniforms are stored per program, so the cache is keyed by
+ * (current program, location). */
+static bool myy_gl_uniform_changed(
+	GLint const location,
+	float const * __restrict const value,
+	uint32_t const size)
+{
+	if (location < 0)
+		return false;
+
+	GLuint const program = myy_gl.program;
+	uint32_t const first_slot =
+		((program * 31u) ^ (uint32_t) location) % MYY_GL_STATE_UNIFORMS;
+	uint32_t slot = first_slot;
+
+	do {
+		struct myy_gl_uniform_entry * __restrict const entry =
+			myy_gl.uniforms + slot;
+		if (entry->size == 0 ||
+		    ((entry->program == program) & (entry->location == location)))
+		{
+			bool const same =
+				(entry->size == size)
+				&& (memcmp(entry->value, value, size * sizeof(float)) == 0);
+			if (!same) {
+				entry->program  = program;
+				entry->location = location;
+				entry->size     = size;
+				memcpy(entry->value, value, size * sizeof(float));
+			}
+			return myy_gl_state_count(same);
+		}
+		slot = (slot + 1) % MYY_GL_STATE_UNIFORMS;
+	} while (slot != first_slot);
+
+	/* Cache full. Let the driver deal with it. */
+	myy_gl_state_count(false);
+	return true;
+}
+
+static void myy_gl_uniform_matrix4fv(
+	GLint const location,
+	GLfloat const * __restrict const matrix)
+{
+	if (myy_gl_uniform_changed(location, matrix, 16))
+		MYY_GL_DRIVER(glUniformMatrix4fv(location, 1, GL_FALSE, matrix));
+}
+
+static void myy_gl_uniform4fv(
+	GLint const location,
+	GLfloat const * __restrict const vec)
+{
+	if (myy_gl_uniform_changed(location, vec, 4))
+		MYY_GL_DRIVER(glUniform4fv(location, 1, vec));
+}
+
+static void myy_gl_uniform1i(GLint const location, GLint const value)
+{
+	float const as_float = (float) value;
+	if (myy_gl_uniform_changed(location, &as_float, 1))
+		MYY_GL_DRIVER(glUniform1i(location, value));
+}
+
+/* Batched renderer.
+ *
+ * Instead of drawing things as they come, draw commands are recorded
+ * in a per-frame list. At the end of the frame, the list is sorted
+ * by (program, texture, state), so that commands sharing the same
+ * setup end up next to each other.
+ * The list, the sort scratch and the staging buffer all come from
+ * the frame arena.
+ * Their vertices are then written back to back into a CPU staging
+ * buffer, uploaded once into the next VBO of a small ring, and each
+ * batch of identical setup is drawn with ONE draw call.
+ *
+ * The VBOs are "orphaned" (glBufferData with NULL) before being
+ * refilled, so that the driver can hand us fresh memory instead of
+ * waiting for the GPU to be done with the previous content.
+ * GLES 2.x has no instancing, so "instances" are pre-transformed on
+ * the CPU while being written into the staging buffer.
+ */
+struct myy_vertex {
+	float x, y, z;
+	uint8_t r, g, b, a;
+};
+
+/* A mesh with one colour per face. Faces are made of
+ * vertices_per_face consecutive vertices. */
+struct myy_mesh {
+	float const * positions;
+	float const * face_normals;
+	uint32_t n_vertices;
+	uint32_t vertices_per_face;
+};
+
+enum myy_render_state {
+	MYY_RENDER_STATE_DEPTH_TEST = 1 << 0,
+	MYY_RENDER_STATE_BLEND      = 1 << 1,
+	MYY_RENDER_STATE_CULL_FACE  = 1 << 2,
+	/* Restrict drawing to the renderer clip box */
+	MYY_RENDER_STATE_SCISSOR    = 1 << 3,
+};
+
+/* Instance store, for scenes with thousands of copies of the
+ * same mesh.
+ *
+ * The data is stored as a "structure of arrays" : one array per
+ * field, 32 bytes aligned, so that the SIMD kernels can load 4 or 8
+ * instances worth of one field with a single instruction.
+ * Model matrices are stored the same way, one array per matrix
+ * element.
+ *
+ * Two kinds of kernels run on these arrays :
+ * - Frustum culling. Every instance bounding sphere (or AABB) is
+ *   tested against the 6 frustum planes, and the indices of the
+ *   visible instances are written, compacted, into a list.
+ * - Transform. The mesh vertices of every visible instance are
+ *   transformed by its model matrix and written directly into the
+ *   renderer vertex stream.
+ *
+ * Each kernel has an AVX2, SSE4.1 or NEON version, and a scalar one.
+ * The best version supported by the CPU is selected at runtime.
+ * MYY_SIMD=scalar|sse4.1|avx2|neon in the environment forces a
+ * specific version.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MYY_SIMD_X86 1
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define MYY_SIMD_NEON 1
+#endif
+
+#define MYY_INSTANCES_ALIGNMENT (32)
+
+struct myy_instances {
+	uint32_t count;
+	uint32_t capacity;
+	/* Bounds. Sphere : center + radius.
+	 * AABB : center + half extents. */
+	float * x;
+	float * y;
+	float * z;
+	float * radius;
+	float * extent_x;
+	float * extent_y;
+	float * extent_z;
+	/* Column-major model matrices. m[4*column + row][instance] */
+	float * m[16];
+	uint32_t * colors; /* RGBA8, as laid out in myy_vertex */
+	/* Output of the culling kernels */
+	uint32_t * visible;
+	uint32_t n_visible;
+};
+
+enum myy_cull_bounds {
+	MYY_CULL_SPHERES,
+	MYY_CULL_AABBS,
+};
+
+/* The 6 frustum planes, as a.x + b.y + c.z + d >= 0 when inside.
+ * Stored as 4 arrays, so that the kernels can broadcast them. */
+struct myy_frustum {
+	float a[6], b[6], c[6], d[6];
+};
+
+typedef uint32_t (*myy_cull_kernel)(
+	struct myy_frustum const * __restrict frustum,
+	struct myy_instances const * __restrict instances,
+	enum myy_cull_bounds bounds,
+	uint32_t * __restrict visible);
+
+typedef void (*myy_transform_kernel)(
+	struct myy_instances const * __restrict instances,
+	uint32_t const * __restrict visible,
+	uint32_t n_visible,
+	struct myy_mesh const * __restrict mesh,
+	struct myy_vertex * __restrict vertices);
+
+/* Pixel format conversion.
+ * Row kernels, dispatched like the instance kernels above.
+ * Pixels are 4 bytes. Their byte order is described by
+ * myy_pixel_order, and folded into the YUV coefficients, so that
+ * the same kernels handle RGBA (glReadPixels) and XRGB8888
+ * (dumb buffers, which are B,G,R,X in memory). */
+enum myy_pixel_order {
+	MYY_PIXELS_RGBX, /* R,G,B,X in memory. GL_RGBA, DRM XBGR8888 */
+	MYY_PIXELS_BGRX, /* B,G,R,X in memory. DRM XRGB8888, BGRA */
+};
+
+enum myy_yuv_matrix {
+	MYY_YUV_BT601,
+	MYY_YUV_BT709,
+};
+
+/* Limited range ("TV") coefficients, * 256, indexed by the byte
+ * position in the source pixel. Chroma coefficients sum to 0. */
+struct myy_yuv_coefs {
+	int16_t y[3];
+	int16_t u[3];
+	int16_t v[3];
+};
+
+/* Swaps the bytes 0 and 2 of every pixel. RGBA <-> BGRA.
+ * src and dst can be the same. */
+typedef void (*myy_swizzle_kernel)(
+	uint8_t const * src,
+	uint8_t * dst,
+	uint32_t n_pixels);
+
+/* B,G,R,X (XRGB8888) to R,G,B (RGB24) */
+typedef void (*myy_rgb24_kernel)(
+	uint8_t const * __restrict src,
+	uint8_t * __restrict dst,
+	uint32_t n_pixels);
+
+/* Two rows of pixels to two rows of luma and one row of chroma
+ * (2x2 subsampled). u and v are written every chroma_step bytes :
+ * 1 for I420 planes, 2 with v = u + 1 for NV12.
+ * width must be even. */
+typedef void (*myy_yuv420_kernel)(
+	uint8_t const * __restrict row0,
+	uint8_t const * __restrict row1,
+	uint32_t width,
+	struct myy_yuv_coefs const * __restrict coefs,
+	uint8_t * __restrict y0,
+	uint8_t * __restrict y1,
+	uint8_t * u,
+	uint8_t * v,
+	uint32_t chroma_step);
+
+struct myy_simd_kernels {
+	char const * name;
+	myy_cull_kernel cull;
+	myy_transform_kernel transform;
+	myy_swizzle_kernel swizzle;
+	myy_rgb24_kernel rgb24;
+	myy_yuv420_kernel yuv420;
+};
+
+/* Gribb & Hartmann. Planes extracted from the rows of the
+ * view-projection matrix, then normalised so that the distances
+ * can be compared with the radii. */
+static void myy_frustum_from_matrix(
+	struct myy_frustum * __restrict const frustum,
+	struct myy_mat4 const * __restrict const view_projection)
+{
+	float const * __restrict const m = view_projection->m;
+
+	for (uint32_t p = 0; p < 6; p++) {
+		uint32_t const row = p / 2;
+		float const sign = (p & 1) ? -1.0f : 1.0f;
+		float const a = m[3]  + sign * m[row];
+		float const b = m[7]  + sign * m[row+4];
+		float const c = m[11] + sign * m[row+8];
+		float const d = m[15] + sign * m[row+12];
+		float const inverse_length = 1.0f / sqrtf(a*a + b*b + c*c);
+		frustum->a[p] = a * inverse_length;
+		frustum->b[p] = b * inverse_length;
+		frustum->c[p] = c * inverse_length;
+		frustum->d[p] = d * inverse_length;
+	}
+}
+
+static void * myy_aligned_array(size_t const element_size, uint32_t const n)
+{
+	size_t const size = (element_size * n + MYY_INSTANCES_ALIGNMENT - 1)
+		& ~(size_t) (MYY_INSTANCES_ALIGNMENT - 1);
+	return aligned_alloc(MYY_INSTANCES_ALIGNMENT, size ? size : MYY_INSTANCES_ALIGNMENT);
+}
+
+static void myy_instances_free(struct myy_instances * __restrict const instances)
+{
+	free(instances->x);
+	free(instances->y);
+	free(instances->z);
+	free(instances->radius);
+	free(instances->extent_x);
+	free(instances->extent_y);
+	free(instances->extent_z);
+	for (uint32_t e = 0; e < 16; e++)
+		free(instances->m[e]);
+	free(instances->colors);
+	free(instances->visible);
+	memset(instances, 0, sizeof(*instances));
+}
+
+static int myy_instances_init(
+	struct myy_instances * __restrict const instances,
+	uint32_t const capacity)
+{
+	bool allocated = true;
+
+	memset(instances, 0, sizeof(*instances));
+	float ** const arrays[] = {
+		&instances->x, &instances->y, &instances->z, &instances->radius,
+		&instances->extent_x, &instances->extent_y, &instances->extent_z,
+	};
+	for (uint32_t a = 0; a < sizeof(arrays) / sizeof(arrays[0]); a++) {
+		*arrays[a] = myy_aligned_array(sizeof(float), capacity);
+		allocated &= (*arrays[a] != NULL);
+	}
+	for (uint32_t e = 0; e < 16; e++) {
+		instances->m[e] = myy_aligned_array(sizeof(float), capacity);
+		allocated &= (instances->m[e] != NULL);
+	}
+	instances->colors  = myy_aligned_array(sizeof(uint32_t), capacity);
+	instances->visible = myy_aligned_array(sizeof(uint32_t), capacity);
+	allocated &= (instances->colors != NULL) & (instances->visible != NULL);
+
+	if (!allocated) {
+		LOG_ERROR("Could not allocate %u instances", capacity);
+		myy_instances_free(instances);
+		return -1;
+	}
+
+	instances->capacity = capacity;
+	return 0;
+}
+
+static inline void myy_instances_set_matrix(
+	struct myy_instances * __restrict const instances,
+	uint32_t const index,
+	struct myy_mat4 const * __restrict const model)
+{
+	for (uint32_t e = 0; e < 16; e++)
+		instances->m[e][index] = model->m[e];
+}
+
+static inline uint32_t myy_pack_rgba(
+	uint8_t const r, uint8_t const g, uint8_t const b, uint8_t const a)
+{
+	uint8_t const bytes[4] = { r, g, b, a };
+	uint32_t packed;
+	memcpy(&packed, bytes, sizeof(packed));
+	return packed;
+}
+
+/* Light coming from the top-left, behind the camera */
+static uint8_t myy_shade(
+	uint8_t const channel,
+	float const nx, float const ny, float const nz)
+{
+	float const lambert = -0.4f * nx + 0.6f * ny + 0.7f * nz;
+	float const light = 0.3f + 0.7f * ((lambert > 0) ? lambert : 0);
+	return (uint8_t) (channel * light);
+}
+
+/* Per face colours of one instance. Only a handful per mesh, so
+ * every kernel does this part the scalar way. */
+static inline void myy_instance_face_colors(
+	struct myy_instances const * __restrict const instances,
+	uint32_t const index,
+	struct myy_mesh const * __restrict const mesh,
+	uint32_t * __restrict const face_colors,
+	uint32_t const n_faces)
+{
+	float const * const * __restrict const m = (float const * const *) instances->m;
+	uint8_t color[4];
+	memcpy(color, instances->colors + index, sizeof(color));
+
+	for (uint32_t f = 0; f < n_faces; f++) {
+		float const * __restrict const n = mesh->face_normals + f * 3;
+		float const nx = m[0][index]*n[0] + m[4][index]*n[1] + m[8][index]*n[2];
+		float const ny = m[1][index]*n[0] + m[5][index]*n[1] + m[9][index]*n[2];
+		float const nz = m[2][index]*n[0] + m[6][index]*n[1] + m[10][index]*n[2];
+		face_colors[f] = myy_pack_rgba(
+			myy_shade(color[0], nx, ny, nz),
+			myy_shade(color[1], nx, ny, nz),
+			myy_shade(color[2], nx, ny, nz),
+			color[3]);
+	}
+}
+
+#define MYY_MESH_MAX_FACES (64)
+
+static inline bool myy_cull_test_scalar(
+	struct myy_frustum const * __restrict const frustum,
+	struct myy_instances const * __restrict const instances,
+	enum myy_cull_bounds const bounds,
+	uint32_t const i)
+{
+	bool inside = true;
+	for (uint32_t p = 0; p < 6; p++) {
+		float const a = frustum->a[p], b = frustum->b[p], c = frustum->c[p];
+		float const distance =
+			a * instances->x[i] + b * instances->y[i]
+			+ c * instances->z[i] + frustum->d[p];
+		float const extent = (bounds == MYY_CULL_SPHERES)
+			? instances->radius[i]
+			: fabsf(a) * instances->extent_x[i]
+			  + fabsf(b) * instances->extent_y[i]
+			  + fabsf(c) * instances->extent_z[i];
+		inside &= (distance >= -extent);
+	}
+	return inside;
+}
+
+static uint32_t myy_cull_scalar(
+	struct myy_frustum const * __restrict const frustum,
+	struct myy_instances const * __restrict const instances,
+	enum myy_cull_bounds const bounds,
+	uint32_t * __restrict const visible)
+{
+	uint32_t n_visible = 0;
+	for (uint32_t i = 0; i < instances->count; i++) {
+		/* Branchless compaction : always write, only advance
+		 * when visible. */
+		visible[n_visible] = i;
+		n_visible += myy_cull_test_scalar(frustum, instances, bounds, i);
+	}
+	return n_visible;
+}
+
+static void myy_transform_scalar(
+	struct myy_instances const * __restrict const instances,
+	uint32_t const * __restrict const visible,
+	uint32_t const n_visible,
+	struct myy_mesh const * __restrict const mesh,
+	struct myy_vertex * __restrict vertices)
+{
+	uint32_t const n_faces = mesh->n_vertices / mesh->vertices_per_face;
+	uint32_t face_colors[MYY_MESH_MAX_FACES];
+
+	for (uint32_t v = 0; v < n_visible; v++) {
+		uint32_t const i = visible[v];
+		float m[16];
+		for (uint32_t e = 0; e < 16; e++)
+			m[e] = instances->m[e][i];
+
+		myy_instance_face_colors(instances, i, mesh, face_colors, n_faces);
+
+		float const * __restrict positions = mesh->positions;
+		for (uint32_t f = 0; f < n_faces; f++) {
+			for (uint32_t fv = 0; fv < mesh->vertices_per_face; fv++) {
+				float const px = positions[0];
+				float const py = positions[1];
+				float const pz = positions[2];
+				vertices->x = m[0]*px + m[4]*py + m[8]*pz  + m[12];
+				vertices->y = m[1]*px + m[5]*py + m[9]*pz  + m[13];
+				vertices->z = m[2]*px + m[6]*py + m[10]*pz + m[14];
+				memcpy(&vertices->r, face_colors + f, 4);
+				vertices++;
+				positions += 3;
+			}
+		}
+	}
+}
+
+#if defined(MYY_SIMD_X86)
+
+/* Appends the indices of the lanes set in mask */
+static inline uint32_t myy_compact_mask(
+	uint32_t * __restrict const visible,
+	uint32_t n_visible,
+	uint32_t const base,
+	uint32_t mask)
+{
+	while (mask) {
+		visible[n_visible++] = base + __builtin_ctz(mask);
+		mask &= mask - 1;
+	}
+	return n_visible;
+}
+
+__attribute__((target("avx2,fma")))
+static uint32_t myy_cull_avx2(
+	struct myy_frustum const * __restrict const frustum,
+	struct myy_instances const * __restrict const instances,
+	enum myy_cull_bounds const bounds,
+	uint32_t * __restrict const visible)
+{
+	uint32_t const count = instances->count;
+	uint32_t n_visible = 0;
+	uint32_t i = 0;
+	__m256 const abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+
+	for (; i + 8 <= count; i += 8) {
+		__m256 const x = _mm256_load_ps(instances->x + i);
+		__m256 const y = _mm256_load_ps(instances->y + i);
+		__m256 const z = _mm256_load_ps(instances->z + i);
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+		for (uint32_t p = 0; p < 6; p++) {
+			__m256 const a = _mm256_set1_ps(frustum->a[p]);
+			__m256 const b = _mm256_set1_ps(frustum->b[p]);
+			__m256 const c = _mm256_set1_ps(frustum->c[p]);
+			__m256 distance = _mm256_fmadd_ps(a, x, _mm256_set1_ps(frustum->d[p]));
+			distance = _mm256_fmadd_ps(b, y, distance);
+			distance = _mm256_fmadd_ps(c, z, distance);
+
+			__m256 extent;
+			if (bounds == MYY_CULL_SPHERES) {
+				extent = _mm256_load_ps(instances->radius + i);
+			}
+			else {
+				extent = _mm256_mul_ps(_mm256_and_ps(a, abs_mask),
+					_mm256_load_ps(instances->extent_x + i));
+				extent = _mm256_fmadd_ps(_mm256_and_ps(b, abs_mask),
+					_mm256_load_ps(instances->extent_y + i), extent);
+				extent = _mm256_fmadd_ps(_mm256_and_ps(c, abs_mask),
+					_mm256_load_ps(instances->extent_z + i), extent);
+			}
+			/* distance + extent >= 0 */
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(
+				_mm256_add_ps(distance, extent), _mm256_setzero_ps(), _CMP_GE_OQ));
+		}
+
+		n_visible = myy_compact_mask(
+			visible, n_visible, i, _mm256_movemask_ps(inside));
+	}
+
+	for (; i < count; i++) {
+		visible[n_visible] = i;
+		n_visible += myy_cull_test_scalar(frustum, instances, bounds, i);
+	}
+	return n_visible;
+}
+
+/* One vertex per 128 bits lane : x y z rgba.
+ * The last lane of the transformed position is replaced by the
+ * colour, so each vertex is a single 16 bytes store. */
+__attribute__((target("avx2,fma")))
+static void myy_transform_avx2(
+	struct myy_instances const * __restrict const instances,
+	uint32_t const * __restrict const visible,
+	uint32_t const n_visible,
+	struct myy_mesh const * __restrict const mesh,
+	struct myy_vertex * __restrict vertices)
+{
+	uint32_t const n_faces = mesh->n_vertices / mesh->vertices_per_face;
+	uint32_t const per_face = mesh->vertices_per_face;
+	uint32_t face_colors[MYY_MESH_MAX_FACES];
+
+	for (uint32_t v = 0; v < n_visible; v++) {
+		uint32_t const i = visible[v];
+		/* Each column, twice : one per 128 bits lane */
+		__m256 const c0 = _mm256_broadcast_ps(&(__m128 const) {
+			instances->m[0][i], instances->m[1][i], instances->m[2][i], 0 });
+		__m256 const c1 = _mm256_broadcast_ps(&(__m128 const) {
+			instances->m[4][i], instances->m[5][i], instances->m[6][i], 0 });
+		__m256 const c2 = _mm256_broadcast_ps(&(__m128 const) {
+			instances->m[8][i], instances->m[9][i], instances->m[10][i], 0 });
+		__m256 const c3 = _mm256_broadcast_ps(&(__m128 const) {
+			instances->m[12][i], instances->m[13][i], instances->m[14][i], 0 });
+
+		myy_instance_face_colors(instances, i, mesh, face_colors, n_faces);
+
+		float const * __restrict positions = mesh->positions;
+		for (uint32_t f = 0; f < n_faces; f++) {
+			__m256 const color = _mm256_castsi256_ps(
+				_mm256_set1_epi32((int) face_colors[f]));
+			uint32_t fv = 0;
+			for (; fv + 2 <= per_face; fv += 2) {
+				__m256 const px = _mm256_setr_m128(
+					_mm_set1_ps(positions[0]), _mm_set1_ps(positions[3]));
+				__m256 const py = _mm256_setr_m128(
+					_mm_set1_ps(positions[1]), _mm_set1_ps(positions[4]));
+				__m256 const pz = _mm256_setr_m128(
+					_mm_set1_ps(positions[2]), _mm_set1_ps(positions[5]));
+				__m256 out = _mm256_fmadd_ps(c0, px, c3);
+				out = _mm256_fmadd_ps(c1, py, out);
+				out = _mm256_fmadd_ps(c2, pz, out);
+				out = _mm256_blend_ps(out, color, 0x88);
+				_mm256_storeu_ps((float *) vertices, out);
+				vertices += 2;
+				positions += 6;
+			}
+			for (; fv < per_face; fv++) {
+				__m128 out = _mm_fmadd_ps(_mm256_castps256_ps128(c0),
+					_mm_set1_ps(positions[0]), _mm256_castps256_ps128(c3));
+				out = _mm_fmadd_ps(_mm256_castps256_ps128(c1),
+					_mm_set1_ps(positions[1]), out);
+				out = _mm_fmadd_ps(_mm256_castps256_ps128(c2),
+					_mm_set1_ps(positions[2]), out);
+				out = _mm_blend_ps(out, _mm256_castps256_ps128(color), 0x8);
+				_mm_storeu_ps((float *) vertices, out);
+				vertices++;
+				positions += 3;
+			}
+		}
+	}
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t myy_cull_sse41(
+	struct myy_frustum const * __restrict const frustum,
+	struct myy_instances const * __restrict const instances,
+	enum myy_cull_bounds const bounds,
+	uint32_t * __restrict const visible)
+{
+	uint32_t const count = instances->count;
+	uint32_t n_visible = 0;
+	uint32_t i = 0;
+	__m128 const abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+	for (; i + 4 <= count; i += 4) {
+		__m128 const x = _mm_load_ps(instances->x + i);
+		__m128 const y = _mm_load_ps(instances->y + i);
+		__m128 const z = _mm_load_ps(instances->z + i);
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+		for (uint32_t p = 0; p < 6; p++) {
+			__m128 const a = _mm_set1_ps(frustum->a[p]);
+			__m128 const b = _mm_set1_ps(frustum->b[p]);
+			__m128 const c = _mm_set1_ps(frustum->c[p]);
+			__m128 const distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(a, x), _mm_mul_ps(b, y)),
+				_mm_add_ps(_mm_mul_ps(c, z), _mm_set1_ps(frustum->d[p])));
+
+			__m128 extent;
+			if (bounds == MYY_CULL_SPHERES) {
+				extent = _mm_load_ps(instances->radius + i);
+			}
+			else {
+				extent = _mm_add_ps(
+					_mm_add_ps(
+						_mm_mul_ps(_mm_and_ps(a, abs_mask),
+							_mm_load_ps(instances->extent_x + i)),
+						_mm_mul_ps(_mm_and_ps(b, abs_mask),
+							_mm_load_ps(instances->extent_y + i))),
+					_mm_mul_ps(_mm_and_ps(c, abs_mask),
+						_mm_load_ps(instances->extent_z + i)));
+			}
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(
+				_mm_add_ps(distance, extent), _mm_setzero_ps()));
+		}
+
+		n_visible = myy_compact_mask(
+			visible, n_visible, i, _mm_movemask_ps(inside));
+	}
+
+	for (; i < count; i++) {
+		visible[n_visible] = i;
+		n_visible += myy_cull_test_scalar(frustum, instances, bounds, i);
+	}
+	return n_visible;
+}
+
+__attribute__((target("sse4.1")))
+static void myy_transform_sse41(
+	struct myy_instances const * __restrict const instances,
+	uint32_t const * __restrict const visible,
+	uint32_t const n_visible,
+	struct myy_mesh const * __restrict const mesh,
+	struct myy_vertex * __restrict vertices)
+{
+	uint32_t const n_faces = mesh->n_vertices / mesh->vertices_per_face;
+	uint32_t face_colors[MYY_MESH_MAX_FACES];
+
+	for (uint32_t v = 0; v < n_visible; v++) {
+		uint32_t const i = visible[v];
+		__m128 const c0 = _mm_setr_ps(
+			instances->m[0][i], instances->m[1][i], instances->m[2][i], 0);
+		__m128 const c1 = _mm_setr_ps(
+			instances->m[4][i], instances->m[5][i], instances->m[6][i], 0);
+		__m128 const c2 = _mm_setr_ps(
+			instances->m[8][i], instances->m[9][i], instances->m[10][i], 0);
+		__m128 const c3 = _mm_setr_ps(
+			instances->m[12][i], instances->m[13][i], instances->m[14][i], 0);
+
+		myy_instance_face_colors(instances, i, mesh, face_colors, n_faces);
+
+		float const * __restrict positions = mesh->positions;
+		for (uint32_t f = 0; f < n_faces; f++) {
+			__m128 const color = _mm_castsi128_ps(
+				_mm_set1_epi32((int) face_colors[f]));
+			for (uint32_t fv = 0; fv < mesh->vertices_per_face; fv++) {
+				__m128 out = _mm_add_ps(
+					_mm_add_ps(
+						_mm_mul_ps(c0, _mm_set1_ps(positions[0])),
+						_mm_mul_ps(c1, _mm_set1_ps(positions[1]))),
+					_mm_add_ps(
+						_mm_mul_ps(c2, _mm_set1_ps(positions[2])), c3));
+				out = _mm_blend_ps(out, color, 0x8);
+				_mm_storeu_ps((float *) vertices, out);
+				vertices++;
+				positions += 3;
+			}
+		}
+	}
+}
+
+#endif /* MYY_SIMD_X86 */
+
+#if defined(MYY_SIMD_NEON)
+
+static uint32_t myy_cull_neon(
+	struct myy_frustum const * __restrict const frustum,
+	struct myy_instances const * __restrict const instances,
+	enum myy_cull_bounds const bounds,
+	uint32_t * __restrict const visible)
+{
+	uint32_t const count = instances->count;
+	uint32_t n_visible = 0;
+	uint32_t i = 0;
+
+	for (; i + 4 <= count; i += 4) {
+		float32x4_t const x = vld1q_f32(instances->x + i);
+		float32x4_t const y = vld1q_f32(instances->y + i);
+		float32x4_t const z = vld1q_f32(instances->z + i);
+		uint32x4_t inside = vdupq_n_u32(~0u);
+
+		for (uint32_t p = 0; p < 6; p++) {
+			float32x4_t distance = vdupq_n_f32(frustum->d[p]);
+			distance = vmlaq_n_f32(distance, x, frustum->a[p]);
+			distance = vmlaq_n_f32(distance, y, frustum->b[p]);
+			distance = vmlaq_n_f32(distance, z, frustum->c[p]);
+
+			float32x4_t extent;
+			if (bounds == MYY_CULL_SPHERES) {
+				extent = vld1q_f32(instances->radius + i);
+			}
+			else {
+				extent = vmulq_n_f32(
+					vld1q_f32(instances->extent_x + i), fabsf(frustum->a[p]));
+				extent = vmlaq_n_f32(extent,
+					vld1q_f32(instances->extent_y + i), fabsf(frustum->b[p]));
+				extent = vmlaq_n_f32(extent,
+					vld1q_f32(instances->extent_z + i), fabsf(frustum->c[p]));
+			}
+			inside = vandq_u32(inside, vcgeq_f32(
+				vaddq_f32(distance, extent), vdupq_n_f32(0)));
+		}
+
+		/* No movemask on NEON. Write the 4 candidates and
+		 * advance by the lane results. */
+		uint32_t lanes[4];
+		vst1q_u32(lanes, inside);
+		for (uint32_t l = 0; l < 4; l++) {
+			visible[n_visible] = i + l;
+			n_visible += lanes[l] & 1;
+		}
+	}
+
+	for (; i < count; i++) {
+		visible[n_visible] = i;
+		n_visible += myy_cull_test_scalar(frustum, instances, bounds, i);
+	}
+	return n_visible;
+}
+
+static void myy_transform_neon(
+	struct myy_instances const * __restrict const instances,
+	uint32_t const * __restrict const visible,
+	uint32_t const n_visible,
+	struct myy_mesh const * __restrict const mesh,
+	struct myy_vertex * __restrict vertices)
+{
+	uint32_t const n_faces = mesh->n_vertices / mesh->vertices_per_face;
+	uint32_t face_colors[MYY_MESH_MAX_FACES];
+	uint32x4_t const color_lane = { 0, 0, 0, ~0u };
+
+	for (uint32_t v = 0; v < n_visible; v++) {
+		uint32_t const i = visible[v];
+		float32x4_t const c0 = {
+			instances->m[0][i], instances->m[1][i], instances->m[2][i], 0 };
+		float32x4_t const c1 = {
+			instances->m[4][i], instances->m[5][i], instances->m[6][i], 0 };
+		float32x4_t const c2 = {
+			instances->m[8][i], instances->m[9][i], instances->m[10][i], 0 };
+		float32x4_t const c3 = {
+			instances->m[12][i], instances->m[13][i], instances->m[14][i], 0 };
+
+		myy_instance_face_colors(instances, i, mesh, face_colors, n_faces);
+
+		float const * __restrict positions = mesh->positions;
+		for (uint32_t f = 0; f < n_faces; f++) {
+			uint32x4_t const color = vdupq_n_u32(face_colors[f]);
+			for (uint32_t fv = 0; fv < mesh->vertices_per_face; fv++) {
+				float32x4_t out = vmlaq_n_f32(c3, c0, positions[0]);
+				out = vmlaq_n_f32(out, c1, positions[1]);
+				out = vmlaq_n_f32(out, c2, positions[2]);
+				vst1q_u32((uint32_t *) vertices, vbslq_u32(
+					color_lane, color, vreinterpretq_u32_f32(out)));
+				vertices++;
+				positions += 3;
+			}
+		}
+	}
+}
+
+#endif /* MYY_SIMD_NEON */
+
+/* Pixel conversion kernels */
+
+static void myy_swizzle_scalar(
+	uint8_t const * src,
+	uint8_t * dst,
+	uint32_t const n_pixels)
+{
+	for (uint32_t p = 0; p < n_pixels; p++, src += 4, dst += 4) {
+		uint8_t const b0 = src[0], b1 = src[1], b2 = src[2], b3 = src[3];
+		dst[0] = b2;
+		dst[1] = b1;
+		dst[2] = b0;
+		dst[3] = b3;
+	}
+}
+
+static void myy_rgb24_scalar(
+	uint8_t const * __restrict src,
+	uint8_t * __restrict dst,
+	uint32_t const n_pixels)
+{
+	for (uint32_t p = 0; p < n_pixels; p++, src += 4, dst += 3) {
+		dst[0] = src[2];
+		dst[1] = src[1];
+		dst[2] = src[0];
+	}
+}
+
+static inline uint8_t myy_clamp_u8(int32_t const value)
+{
+	return (value < 0) ? 0 : ((value > 255) ? 255 : value);
+}
+
+static inline uint8_t myy_luma(
+	struct myy_yuv_coefs const * __restrict const coefs,
+	uint8_t const * __restrict const pixel)
+{
+	int32_t const sum =
+		coefs->y[0] * pixel[0] + coefs->y[1] * pixel[1] + coefs->y[2] * pixel[2];
+	return myy_clamp_u8(((sum + 128) >> 8) + 16);
+}
+
+/* s are the sums of each byte over the 2x2 block */
+static inline uint8_t myy_chroma(
+	int16_t const * __restrict const c,
+	int32_t const * __restrict const s)
+{
+	int32_t const sum = c[0] * s[0] + c[1] * s[1] + c[2] * s[2];
+	return myy_clamp_u8(((sum + 512) >> 10) + 128);
+}
+
+/* The SIMD kernels must give the exact same bytes.
+ * They use the same integer arithmetic, and call this one for
+ * the last pixels. */
+static void myy_yuv420_scalar(
+	uint8_t const * __restrict const row0,
+	uint8_t const * __restrict const row1,
+	uint32_t const width,
+	struct myy_yuv_coefs const * __restrict const coefs,
+	uint8_t * __restrict const y0,
+	uint8_t * __restrict const y1,
+	uint8_t * u,
+	uint8_t * v,
+	uint32_t const chroma_step)
+{
+	for (uint32_t x = 0; x < width; x += 2) {
+		uint8_t const * __restrict const p00 = row0 + x * 4;
+		uint8_t const * __restrict const p10 = row1 + x * 4;
+		int32_t sums[3];
+
+		y0[x]   = myy_luma(coefs, p00);
+		y0[x+1] = myy_luma(coefs, p00 + 4);
+		y1[x]   = myy_luma(coefs, p10);
+		y1[x+1] = myy_luma(coefs, p10 + 4);
+
+		for (uint32_t b = 0; b < 3; b++)
+			sums[b] = p00[b] + p00[b+4] + p10[b] + p10[b+4];
+
+		*u = myy_chroma(coefs->u, sums);
+		*v = myy_chroma(coefs->v, sums);
+		u += chroma_step;
+		v += chroma_step;
+	}
+}
+
+#if defined(MYY_SIMD_X86)
+
+/* Every pixel as two 16 bits pairs : (b0, b2) and (b1, b3).
+ * madd then gives c0.b0 + c2.b2 and c1.b1 per pixel, in 32 bits. */
+static inline uint32_t myy_coefs_pair(int16_t const a, int16_t const b)
+{
+	return (uint16_t) a | ((uint32_t) (uint16_t) b << 16);
+}
+
+__attribute__((target("avx2")))
+static void myy_swizzle_avx2(
+	uint8_t const * src,
+	uint8_t * dst,
+	uint32_t const n_pixels)
+{
+	__m256i const shuffle = _mm256_setr_epi8(
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	uint32_t p = 0;
+
+	for (; p + 8 <= n_pixels; p += 8) {
+		__m256i const pixels =
+			_mm256_loadu_si256((__m256i const *) (src + p * 4));
+		_mm256_storeu_si256((__m256i *) (dst + p * 4),
+			_mm256_shuffle_epi8(pixels, shuffle));
+	}
+	myy_swizzle_scalar(src + p * 4, dst + p * 4, n_pixels - p);
+}
+
+__attribute__((target("avx2")))
+static void myy_rgb24_avx2(
+	uint8_t const * __restrict src,
+	uint8_t * __restrict dst,
+	uint32_t const n_pixels)
+{
+	/* 12 bytes in each 128 bits lane, then the two lanes glued */
+	__m256i const shuffle = _mm256_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	__m256i const glue = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+	uint32_t p = 0;
+
+	for (; p + 8 <= n_pixels; p += 8) {
+		__m256i const pixels =
+			_mm256_loadu_si256((__m256i const *) (src + p * 4));
+		__m256i const packed = _mm256_permutevar8x32_epi32(
+			_mm256_shuffle_epi8(pixels, shuffle), glue);
+		_mm_storeu_si128((__m128i *) (dst + p * 3),
+			_mm256_castsi256_si128(packed));
+		_mm_storel_epi64((__m128i *) (dst + p * 3 + 16),
+			_mm256_extracti128_si256(packed, 1));
+	}
+	myy_rgb24_scalar(src + p * 4, dst + p * 3, n_pixels - p);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i myy_luma_avx2(
+	__m256i const pixels,
+	__m256i const even_bytes,
+	__m256i const c02,
+	__m256i const c1)
+{
+	__m256i const b02 = _mm256_and_si256(pixels, even_bytes);
+	__m256i const b13 = _mm256_srli_epi16(pixels, 8);
+	__m256i const sum = _mm256_add_epi32(
+		_mm256_madd_epi16(b02, c02), _mm256_madd_epi16(b13, c1));
+	return _mm256_add_epi32(
+		_mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8),
+		_mm256_set1_epi32(16));
+}
+
+/* b02 and b13 are the 2 rows sums. 8 pixels in, 4 chroma values out,
+ * in the lanes 0, 1 of each 128 bits half after the horizontal add. */
+__attribute__((target("avx2")))
+static inline __m256i myy_chroma_avx2(
+	__m256i const b02_a, __m256i const b13_a,
+	__m256i const b02_b, __m256i const b13_b,
+	__m256i const c02,
+	__m256i const c1)
+{
+	__m256i const a = _mm256_add_epi32(
+		_mm256_madd_epi16(b02_a, c02), _mm256_madd_epi16(b13_a, c1));
+	__m256i const b = _mm256_add_epi32(
+		_mm256_madd_epi16(b02_b, c02), _mm256_madd_epi16(b13_b, c1));
+	/* [a01 a23 b01 b23 | a45 a67 b45 b67] -> a01 a23 a45 a67 b01 ... */
+	__m256i const sums = _mm256_permute4x64_epi64(
+		_mm256_hadd_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+	return _mm256_add_epi32(
+		_mm256_srai_epi32(_mm256_add_epi32(sums, _mm256_set1_epi32(512)), 10),
+		_mm256_set1_epi32(128));
+}
+
+/* 8 + 8 int32 to 16 ordered bytes */
+__attribute__((target("avx2")))
+static inline __m128i myy_pack_u8_avx2(__m256i const a, __m256i const b)
+{
+	__m256i const shorts = _mm256_permute4x64_epi64(
+		_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+	return _mm_packus_epi16(
+		_mm256_castsi256_si128(shorts), _mm256_extracti128_si256(shorts, 1));
+}
+
+__attribute__((target("avx2")))
+static void myy_yuv420_avx2(
+	uint8_t const * __restrict const row0,
+	uint8_t const * __restrict const row1,
+	uint32_t const width,
+	struct myy_yuv_coefs const * __restrict const coefs,
+	uint8_t * __restrict const y0,
+	uint8_t * __restrict const y1,
+	uint8_t * u,
+	uint8_t * v,
+	uint32_t const chroma_step)
+{
+	__m256i const even_bytes = _mm256_set1_epi32(0x00ff00ff);
+	__m256i const y02 = _mm256_set1_epi32(myy_coefs_pair(coefs->y[0], coefs->y[2]));
+	__m256i const y1c = _mm256_set1_epi32(myy_coefs_pair(coefs->y[1], 0));
+	__m256i const u02 = _mm256_set1_epi32(myy_coefs_pair(coefs->u[0], coefs->u[2]));
+	__m256i const u1c = _mm256_set1_epi32(myy_coefs_pair(coefs->u[1], 0));
+	__m256i const v02 = _mm256_set1_epi32(myy_coefs_pair(coefs->v[0], coefs->v[2]));
+	__m256i const v1c = _mm256_set1_epi32(myy_coefs_pair(coefs->v[1], 0));
+	uint32_t x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m256i const r0a = _mm256_loadu_si256((__m256i const *) (row0 + x * 4));
+		__m256i const r0b = _mm256_loadu_si256((__m256i const *) (row0 + x * 4 + 32));
+		__m256i const r1a = _mm256_loadu_si256((__m256i const *) (row1 + x * 4));
+		__m256i const r1b = _mm256_loadu_si256((__m256i const *) (row1 + x * 4 + 32));
+
+		_mm_storeu_si128((__m128i *) (y0 + x), myy_pack_u8_avx2(
+			myy_luma_avx2(r0a, even_bytes, y02, y1c),
+			myy_luma_avx2(r0b, even_bytes, y02, y1c)));
+		_mm_storeu_si128((__m128i *) (y1 + x), myy_pack_u8_avx2(
+			myy_luma_avx2(r1a, even_bytes, y02, y1c),
+			myy_luma_avx2(r1b, even_bytes, y02, y1c)));
+
+		/* At most 4 * 255, no overflow in 16 bits */
+		__m256i const b02_a = _mm256_add_epi16(
+			_mm256_and_si256(r0a, even_bytes), _mm256_and_si256(r1a, even_bytes));
+		__m256i const b13_a = _mm256_add_epi16(
+			_mm256_srli_epi16(r0a, 8), _mm256_srli_epi16(r1a, 8));
+		__m256i const b02_b = _mm256_add_epi16(
+			_mm256_and_si256(r0b, even_bytes), _mm256_and_si256(r1b, even_bytes));
+		__m256i const b13_b = _mm256_add_epi16(
+			_mm256_srli_epi16(r0b, 8), _mm256_srli_epi16(r1b, 8));
+
+		__m256i const u32 = myy_chroma_avx2(b02_a, b13_a, b02_b, b13_b, u02, u1c);
+		__m256i const v32 = myy_chroma_avx2(b02_a, b13_a, b02_b, b13_b, v02, v1c);
+		/* [u0-3 v0-3 | u4-7 v4-7] */
+		__m256i const uv = _mm256_packs_epi32(u32, v32);
+		__m128i const uv_low  = _mm256_castsi256_si128(uv);
+		__m128i const uv_high = _mm256_extracti128_si256(uv, 1);
+
+		if (chroma_step == 1) {
+			__m128i const planar = _mm_packus_epi16(
+				_mm_unpacklo_epi64(uv_low, uv_high),
+				_mm_unpackhi_epi64(uv_low, uv_high));
+			_mm_storel_epi64((__m128i *) u, planar);
+			_mm_storel_epi64((__m128i *) v, _mm_srli_si128(planar, 8));
+		}
+		else {
+			_mm_storeu_si128((__m128i *) u, _mm_packus_epi16(
+				_mm_unpacklo_epi16(uv_low, _mm_srli_si128(uv_low, 8)),
+				_mm_unpacklo_epi16(uv_high, _mm_srli_si128(uv_high, 8))));
+		}
+		u += 8 * chroma_step;
+		v += 8 * chroma_step;
+	}
+
+	myy_yuv420_scalar(row0 + x * 4, row1 + x * 4, width - x, coefs,
+		y0 + x, y1 + x, u, v, chroma_step);
+}
+
+__attribute__((target("sse4.1")))
+static void myy_swizzle_sse41(
+	uint8_t const * src,
+	uint8_t * dst,
+	uint32_t const n_pixels)
+{
+	__m128i const shuffle = _mm_setr_epi8(
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	uint32_t p = 0;
+
+	for (; p + 4 <= n_pixels; p += 4) {
+		__m128i const pixels = _mm_loadu_si128((__m128i const *) (src + p * 4));
+		_mm_storeu_si128((__m128i *) (dst + p * 4),
+			_mm_shuffle_epi8(pixels, shuffle));
+	}
+	myy_swizzle_scalar(src + p * 4, dst + p * 4, n_pixels - p);
+}
+
+__attribute__((target("sse4.1")))
+static void myy_rgb24_sse41(
+	uint8_t const * __restrict src,
+	uint8_t * __restrict dst,
+	uint32_t const n_pixels)
+{
+	__m128i const shuffle = _mm_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	uint32_t p = 0;
+
+	/* 16 pixels : 4 * 12 bytes, stored as 3 * 16 bytes */
+	for (; p + 16 <= n_pixels; p += 16) {
+		__m128i const * __restrict const in = (__m128i const *) (src + p * 4);
+		__m128i * __restrict const out = (__m128i *) (dst + p * 3);
+		__m128i const a = _mm_shuffle_epi8(_mm_loadu_si128(in), shuffle);
+		__m128i const b = _mm_shuffle_epi8(_mm_loadu_si128(in + 1), shuffle);
+		__m128i const c = _mm_shuffle_epi8(_mm_loadu_si128(in + 2), shuffle);
+		__m128i const d = _mm_shuffle_epi8(_mm_loadu_si128(in + 3), shuffle);
+		_mm_storeu_si128(out,
+			_mm_or_si128(a, _mm_slli_si128(b, 12)));
+		_mm_storeu_si128(out + 1,
+			_mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+		_mm_storeu_si128(out + 2,
+			_mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+	}
+	myy_rgb24_scalar(src + p * 4, dst + p * 3, n_pixels - p);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i myy_luma_sse41(
+	__m128i const pixels,
+	__m128i const even_bytes,
+	__m128i const c02,
+	__m128i const c1)
+{
+	__m128i const b02 = _mm_and_si128(pixels, even_bytes);
+	__m128i const b13 = _mm_srli_epi16(pixels, 8);
+	__m128i const sum = _mm_add_epi32(
+		_mm_madd_epi16(b02, c02), _mm_madd_epi16(b13, c1));
+	return _mm_add_epi32(
+		_mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8),
+		_mm_set1_epi32(16));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i myy_chroma_sse41(
+	__m128i const b02_a, __m128i const b13_a,
+	__m128i const b02_b, __m128i const b13_b,
+	__m128i const c02,
+	__m128i const c1)
+{
+	__m128i const a = _mm_add_epi32(
+		_mm_madd_epi16(b02_a, c02), _mm_madd_epi16(b13_a, c1));
+	__m128i const b = _mm_add_epi32(
+		_mm_madd_epi16(b02_b, c02), _mm_madd_epi16(b13_b, c1));
+	__m128i const sums = _mm_hadd_epi32(a, b);
+	return _mm_add_epi32(
+		_mm_srai_epi32(_mm_add_epi32(sums, _mm_set1_epi32(512)), 10),
+		_mm_set1_epi32(128));
+}
+
+__attribute__((target("sse4.1")))
+static void myy_yuv420_sse41(
+	uint8_t const * __restrict const row0,
+	uint8_t const * __restrict const row1,
+	uint32_t const width,
+	struct myy_yuv_coefs const * __restrict const coefs,
+	uint8_t * __restrict const y0,
+	uint8_t * __restrict const y1,
+	uint8_t * u,
+	uint8_t * v,
+	uint32_t const chroma_step)
+{
+	__m128i const even_bytes = _mm_set1_epi32(0x00ff00ff);
+	__m128i const y02 = _mm_set1_epi32(myy_coefs_pair(coefs->y[0], coefs->y[2]));
+	__m128i const y1c = _mm_set1_epi32(myy_coefs_pair(coefs->y[1], 0));
+	__m128i const u02 = _mm_set1_epi32(myy_coefs_pair(coefs->u[0], coefs->u[2]));
+	__m128i const u1c = _mm_set1_epi32(myy_coefs_pair(coefs->u[1], 0));
+	__m128i const v02 = _mm_set1_epi32(myy_coefs_pair(coefs->v[0], coefs->v[2]));
+	__m128i const v1c = _mm_set1_epi32(myy_coefs_pair(coefs->v[1], 0));
+	uint32_t x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i const r0a = _mm_loadu_si128((__m128i const *) (row0 + x * 4));
+		__m128i const r0b = _mm_loadu_si128((__m128i const *) (row0 + x * 4 + 16));
+		__m128i const r1a = _mm_loadu_si128((__m128i const *) (row1 + x * 4));
+		__m128i const r1b = _mm_loadu_si128((__m128i const *) (row1 + x * 4 + 16));
+
+		__m128i const luma0 = _mm_packs_epi32(
+			myy_luma_sse41(r0a, even_bytes, y02, y1c),
+			myy_luma_sse41(r0b, even_bytes, y02, y1c));
+		__m128i const luma1 = _mm_packs_epi32(
+			myy_luma_sse41(r1a, even_bytes, y02, y1c),
+			myy_luma_sse41(r1b, even_bytes, y02, y1c));
+		__m128i const luma = _mm_packus_epi16(luma0, luma1);
+		_mm_storel_epi64((__m128i *) (y0 + x), luma);
+		_mm_storel_epi64((__m128i *) (y1 + x), _mm_srli_si128(luma, 8));
+
+		__m128i const b02_a = _mm_add_epi16(
+			_mm_and_si128(r0a, even_bytes), _mm_and_si128(r1a, even_bytes));
+		__m128i const b13_a = _mm_add_epi16(
+			_mm_srli_epi16(r0a, 8), _mm_srli_epi16(r1a, 8));
+		__m128i const b02_b = _mm_add_epi16(
+			_mm_and_si128(r0b, even_bytes), _mm_and_si128(r1b, even_bytes));
+		__m128i const b13_b = _mm_add_epi16(
+			_mm_srli_epi16(r0b, 8), _mm_srli_epi16(r1b, 8));
+
+		/* u0-3 v0-3 */
+		__m128i const uv = _mm_packs_epi32(
+			myy_chroma_sse41(b02_a, b13_a, b02_b, b13_b, u02, u1c),
+			myy_chroma_sse41(b02_a, b13_a, b02_b, b13_b, v02, v1c));
+
+		if (chroma_step == 1) {
+			uint32_t const planar[2] = {
+				_mm_cvtsi128_si32(_mm_packus_epi16(uv, uv)),
+				_mm_extract_epi32(_mm_packus_epi16(uv, uv), 1)
+			};
+			memcpy(u, planar, 4);
+			memcpy(v, planar + 1, 4);
+		}
+		else {
+			_mm_storel_epi64((__m128i *) u, _mm_packus_epi16(
+				_mm_unpacklo_epi16(uv, _mm_srli_si128(uv, 8)), uv));
+		}
+		u += 4 * chroma_step;
+		v += 4 * chroma_step;
+	}
+
+	myy_yuv420_scalar(row0 + x * 4, row1 + x * 4, width - x, coefs,
+		y0 + x, y1 + x, u, v, chroma_step);
+}
+
+#endif /* MYY_SIMD_X86 */
+
+#if defined(MYY_SIMD_NEON)
+
+static void myy_swizzle_neon(
+	uint8_t const * src,
+	uint8_t * dst,
+	uint32_t const n_pixels)
+{
+	uint32_t p = 0;
+
+	for (; p + 16 <= n_pixels; p += 16) {
+		uint8x16x4_t pixels = vld4q_u8(src + p * 4);
+		uint8x16_t const b0 = pixels.val[0];
+		pixels.val[0] = pixels.val[2];
+		pixels.val[2] = b0;
+		vst4q_u8(dst + p * 4, pixels);
+	}
+	myy_swizzle_scalar(src + p * 4, dst + p * 4, n_pixels - p);
+}
+
+static void myy_rgb24_neon(
+	uint8_t const * __restrict src,
+	uint8_t * __restrict dst,
+	uint32_t const n_pixels)
+{
+	uint32_t p = 0;
+
+	for (; p + 16 <= n_pixels; p += 16) {
+		uint8x16x4_t const pixels = vld4q_u8(src + p * 4);
+		uint8x16x3_t const rgb = {{
+			pixels.val[2], pixels.val[1], pixels.val[0]
+		}};
+		vst3q_u8(dst + p * 3, rgb);
+	}
+	myy_rgb24_scalar(src + p * 4, dst + p * 3, n_pixels - p);
+}
+
+static inline uint8x8_t myy_luma_neon(
+	uint8x8x4_t const pixels,
+	struct myy_yuv_coefs const * __restrict const coefs)
+{
+	int16x8_t const b0 = vreinterpretq_s16_u16(vmovl_u8(pixels.val[0]));
+	int16x8_t const b1 = vreinterpretq_s16_u16(vmovl_u8(pixels.val[1]));
+	int16x8_t const b2 = vreinterpretq_s16_u16(vmovl_u8(pixels.val[2]));
+	int32x4_t low  = vmull_n_s16(vget_low_s16(b0), coefs->y[0]);
+	int32x4_t high = vmull_n_s16(vget_high_s16(b0), coefs->y[0]);
+	low  = vmlal_n_s16(low,  vget_low_s16(b1),  coefs->y[1]);
+	high = vmlal_n_s16(high, vget_high_s16(b1), coefs->y[1]);
+	low  = vmlal_n_s16(low,  vget_low_s16(b2),  coefs->y[2]);
+	high = vmlal_n_s16(high, vget_high_s16(b2), coefs->y[2]);
+	low  = vaddq_s32(vshrq_n_s32(vaddq_s32(low,  vdupq_n_s32(128)), 8),
+		vdupq_n_s32(16));
+	high = vaddq_s32(vshrq_n_s32(vaddq_s32(high, vdupq_n_s32(128)), 8),
+		vdupq_n_s32(16));
+	return vqmovn_u16(vcombine_u16(vqmovun_s32(low), vqmovun_s32(high)));
+}
+
+static inline uint16x4_t myy_chroma_neon(
+	int32x4_t const s0, int32x4_t const s1, int32x4_t const s2,
+	int16_t const * __restrict const c)
+{
+	int32x4_t sum = vmulq_n_s32(s0, c[0]);
+	sum = vmlaq_n_s32(sum, s1, c[1]);
+	sum = vmlaq_n_s32(sum, s2, c[2]);
+	return vqmovun_s32(vaddq_s32(
+		vshrq_n_s32(vaddq_s32(sum, vdupq_n_s32(512)), 10),
+		vdupq_n_s32(128)));
+}
+
+static void myy_yuv420_neon(
+	uint8_t const * __restrict const row0,
+	uint8_t const * __restrict const row1,
+	uint32_t const width,
+	struct myy_yuv_coefs const * __restrict const coefs,
+	uint8_t * __restrict const y0,
+	uint8_t * __restrict const y1,
+	uint8_t * u,
+	uint8_t * v,
+	uint32_t const chroma_step)
+{
+	uint32_t x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		uint8x8x4_t const p0 = vld4_u8(row0 + x * 4);
+		uint8x8x4_t const p1 = vld4_u8(row1 + x * 4);
+
+		vst1_u8(y0 + x, myy_luma_neon(p0, coefs));
+		vst1_u8(y1 + x, myy_luma_neon(p1, coefs));
+
+		/* Vertical sums, then horizontal pairs : 4 blocks */
+		int32x4_t const s0 = vreinterpretq_s32_u32(
+			vpaddlq_u16(vaddl_u8(p0.val[0], p1.val[0])));
+		int32x4_t const s1 = vreinterpretq_s32_u32(
+			vpaddlq_u16(vaddl_u8(p0.val[1], p1.val[1])));
+		int32x4_t const s2 = vreinterpretq_s32_u32(
+			vpaddlq_u16(vaddl_u8(p0.val[2], p1.val[2])));
+
+		/* u0-3 v0-3 */
+		uint8x8_t const uv = vqmovn_u16(vcombine_u16(
+			myy_chroma_neon(s0, s1, s2, coefs->u),
+			myy_chroma_neon(s0, s1, s2, coefs->v)));
+
+		if (chroma_step == 1) {
+			vst1_lane_u32((uint32_t *) u, vreinterpret_u32_u8(uv), 0);
+			vst1_lane_u32((uint32_t *) v, vreinterpret_u32_u8(uv), 1);
+		}
+		else {
+			vst1_u8(u, vzip_u8(uv, vext_u8(uv, uv, 4)).val[0]);
+		}
+		u += 4 * chroma_step;
+		v += 4 * chroma_step;
+	}
+
+	myy_yuv420_scalar(row0 + x * 4, row1 + x * 4, width - x, coefs,
+		y0 + x, y1 + x, u, v, chroma_step);
+}
+
+#endif /* MYY_SIMD_NEON */
+
+static struct myy_simd_kernels const myy_simd_kernels_available[] = {
+#if defined(MYY_SIMD_X86)
+	{ "avx2",   myy_cull_avx2,  myy_transform_avx2,
+	  myy_swizzle_avx2,  myy_rgb24_avx2,  myy_yuv420_avx2  },
+	{ "sse4.1", myy_cull_sse41, myy_transform_sse41,
+	  myy_swizzle_sse41, myy_rgb24_sse41, myy_yuv420_sse41 },
+#endif
+#if defined(MYY_SIMD_NEON)
+	{ "neon",   myy_cull_neon,  myy_transform_neon,
+	  myy_swizzle_neon,  myy_rgb24_neon,  myy_yuv420_neon  },
+#endif
+	{ "scalar", myy_cull_scalar, myy_transform_scalar,
+	  myy_swizzle_scalar, myy_rgb24_scalar, myy_yuv420_scalar },
+};
+
+#define MYY_SIMD_KERNELS_COUNT \
+	(sizeof(myy_simd_kernels_available) / sizeof(myy_simd_kernels_available[0]))
+
+static bool myy_simd_kernels_supported(
+	struct myy_simd_kernels const * __restrict const kernels)
+{
+#if defined(MYY_SIMD_X86)
+	if (strcmp(kernels->name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	if (strcmp(kernels->name, "sse4.1") == 0)
+		return __builtin_cpu_supports("sse4.1");
+#endif
+	(void) kernels;
+	return true;
+}
+
+static struct myy_simd_kernels const * myy_simd;
+static pthread_once_t myy_simd_once = PTHREAD_ONCE_INIT;
+
+static void myy_simd_select(void)
+{
+	char const * __restrict const forced = getenv("MYY_SIMD");
+
+	for (uint32_t k = 0; k < MYY_SIMD_KERNELS_COUNT; k++) {
+		struct myy_simd_kernels const * __restrict const kernels =
+			myy_simd_kernels_available + k;
+		if (!myy_simd_kernels_supported(kernels))
+			continue;
+		if (forced && strcmp(forced, kernels->name) != 0)
+			continue;
+		myy_simd = kernels;
+		break;
+	}
+
+	if (myy_simd == NULL) {
+		LOG_ERROR("MYY_SIMD=%s is not available here. Using scalar kernels.",
+			forced);
+		myy_simd = myy_simd_kernels_available + MYY_SIMD_KERNELS_COUNT - 1;
+	}
+	LOGF("SIMD kernels : %s", myy_simd->name);
+}
+
+static struct myy_simd_kernels const * myy_simd_get(void)
+{
+	pthread_once(&myy_simd_once, myy_simd_select);
+	return myy_simd;
+}
+
+/* Frame level conversions.
+ * Strides are in bytes, and can be negative : pointing src at the
+ * last row with -stride flips the image, for free (OpenGL rows go
+ * bottom to top). */
+enum myy_yuv420_layout {
+	MYY_YUV420_NV12, /* Y plane, then interleaved U,V plane */
+	MYY_YUV420_I420, /* Y plane, U plane, V plane */
+};
+
+struct myy_yuv420_image {
+	uint8_t * y;
+	uint8_t * u;
+	uint8_t * v;
+	ptrdiff_t y_stride;
+	ptrdiff_t uv_stride;
+	uint32_t chroma_step;
+};
+
+static void myy_yuv_coefs_get(
+	struct myy_yuv_coefs * __restrict const coefs,
+	enum myy_yuv_matrix const matrix,
+	enum myy_pixel_order const order)
+{
+	/* R, G, B order */
+	static int16_t const bt601[3][3] = {
+		{  66, 129,  25 },
+		{ -38, -74, 112 },
+		{ 112, -94, -18 },
+	};
+	static int16_t const bt709[3][3] = {
+		{  47, 157,  16 },
+		{ -26, -86, 112 },
+		{ 112, -102, -10 },
+	};
+	int16_t const (* __restrict const m)[3] =
+		(matrix == MYY_YUV_BT709) ? bt709 : bt601;
+	/* Byte position of R, G and B */
+	uint32_t const r = (order == MYY_PIXELS_RGBX) ? 0 : 2;
+	uint32_t const b = 2 - r;
+
+	for (uint32_t row = 0; row < 3; row++) {
+		int16_t * __restrict const out =
+			(row == 0) ? coefs->y : ((row == 1) ? coefs->u : coefs->v);
+		out[r] = m[row][0];
+		out[1] = m[row][1];
+		out[b] = m[row][2];
+	}
+}
+
+/* Returns the size of the whole image. buffer can be NULL, to only
+ * get the size. */
+static size_t myy_yuv420_image_layout(
+	struct myy_yuv420_image * __restrict const image,
+	enum myy_yuv420_layout const layout,
+	uint8_t * __restrict const buffer,
+	uint32_t const width,
+	uint32_t const height)
+{
+	size_t const luma_size = (size_t) width * height;
+	size_t const chroma_size = luma_size / 4;
+
+	image->y = buffer;
+	image->y_stride = width;
+	if (layout == MYY_YUV420_NV12) {
+		image->u = buffer ? buffer + luma_size : NULL;
+		image->v = buffer ? buffer + luma_size + 1 : NULL;
+		image->uv_stride = width;
+		image->chroma_step = 2;
+	}
+	else {
+		image->u = buffer ? buffer + luma_size : NULL;
+		image->v = buffer ? buffer + luma_size + chroma_size : NULL;
+		image->uv_stride = width / 2;
+		image->chroma_step = 1;
+	}
+	return luma_size + 2 * chroma_size;
+}
+
+static void myy_convert_swizzle(
+	uint8_t const * src, ptrdiff_t const src_stride,
+	uint8_t * dst, ptrdiff_t const dst_stride,
+	uint32_t const width, uint32_t const height)
+{
+	myy_swizzle_kernel const swizzle = myy_simd_get()->swizzle;
+
+	for (uint32_t row = 0; row < height; row++) {
+		swizzle(src, dst, width);
+		src += src_stride;
+		dst += dst_stride;
+	}
+}
+
+static void myy_convert_xrgb_to_rgb24(
+	uint8_t const * src, ptrdiff_t const src_stride,
+	uint8_t * dst, ptrdiff_t const dst_stride,
+	uint32_t const width, uint32_t const height)
+{
+	myy_rgb24_kernel const rgb24 = myy_simd_get()->rgb24;
+
+	for (uint32_t row = 0; row < height; row++) {
+		rgb24(src, dst, width);
+		src += src_stride;
+		dst += dst_stride;
+	}
+}
+
+static int myy_convert_to_yuv420(
+	uint8_t const * src, ptrdiff_t const src_stride,
+	enum myy_pixel_order const order,
+	enum myy_yuv_matrix const matrix,
+	uint32_t const width, uint32_t const height,
+	struct myy_yuv420_image const * __restrict const image)
+{
+	myy_yuv420_kernel const yuv420 = myy_simd_get()->yuv420;
+	struct myy_yuv_coefs coefs;
+	uint8_t * y = image->y;
+	uint8_t * u = image->u;
+	uint8_t * v = image->v;
+
+	if ((width | height) & 1) {
+		LOG_ERROR("4:2:0 needs even dimensions, not %ux%u", width, height);
+		return -1;
+	}
+
+	myy_yuv_coefs_get(&coefs, matrix, order);
+	for (uint32_t row = 0; row < height; row += 2) {
+		yuv420(src, src + src_stride, width, &coefs,
+			y, y + image->y_stride, u, v, image->chroma_step);
+		src += 2 * src_stride;
+		y   += 2 * image->y_stride;
+		u   += image->uv_stride;
+		v   += image->uv_stride;
+	}
+	return 0;
+}
+
+/* Culls the instances against the frustum, and keeps the compacted
+ * list of visible ones in instances->visible. */
+static uint32_t myy_instances_cull(
+	struct myy_instances * __restrict const instances,
+	struct myy_frustum const * __restrict const frustum,
+	enum myy_cull_bounds const bounds)
+{
+	instances->n_visible = myy_simd_get()->cull(
+		frustum, instances, bounds, instances->visible);
+	return instances->n_visible;
+}
+
+/* Either one mesh with its own model matrix and colour, or every
+ * visible instance of an instance store. */
+struct myy_draw_cmd {
+	uint64_t sort_key;
+	struct myy_mesh const * mesh;
+	struct myy_mat4 model;
+	uint8_t color[4];
+	struct myy_instances const * instances;
+};
+
+static inline uint32_t myy_draw_cmd_vertices(
+	struct myy_draw_cmd const * __restrict const cmd)
+{
+	return cmd->instances
+		? cmd->mesh->n_vertices * cmd->instances->n_visible
+		: cmd->mesh->n_vertices;
+}
+
+#define MYY_RENDERER_MAX_PROGRAMS (8)
+#define MYY_RENDERER_VBO_RING (3)
+
+struct myy_renderer_program {
+	GLuint id;
+	GLint u_view_projection;
+	GLint u_texture;
+	GLint u_tint;
+	GLint a_position;
+	GLint a_color;
+};
+
+struct myy_renderer_stats {
+	uint32_t commands;
+	uint32_t batches;
+	uint32_t vertices;
+};
+
+struct myy_renderer {
+	struct myy_renderer_program programs[MYY_RENDERER_MAX_PROGRAMS];
+	uint32_t n_programs;
+
+	GLuint vbos[MYY_RENDERER_VBO_RING];
+	GLsizeiptr vbos_size[MYY_RENDERER_VBO_RING];
+	uint32_t current_vbo;
+
+	/* Per-frame data comes from there */
+	struct myy_arena * arena;
+	struct myy_draw_cmd * cmds;
+	uint32_t n_cmds;
+	uint32_t cmds_capacity;
+
+	struct myy_mat4 view_projection;
+	/* x, y, width, height of MYY_RENDER_STATE_SCISSOR draws */
+	GLint clip[4];
+	/* Multiplied with every fragment colour */
+	GLfloat tint[4];
+	struct myy_renderer_stats stats;
+};
+
+/* Key layout, from the most expensive switch to the cheapest :
+ * program (8 bits) | texture (24 bits) | state (8 bits) */
+static inline uint64_t myy_draw_sort_key(
+	uint32_t const program_index,
+	GLuint const texture,
+	uint32_t const state)
+{
+	return ((uint64_t) (program_index & 0xff) << 32)
+		| ((uint64_t) (texture & 0xffffff) << 8)
+		| (state & 0xff);
+}
+
+static inline uint32_t myy_draw_key_program(uint64_t const key)
+{
+	return (key >> 32) & 0xff;
+}
+
+static inline GLuint myy_draw_key_texture(uint64_t const key)
+{
+	return (key >> 8) & 0xffffff;
+}
+
+static inline uint32_t myy_draw_key_state(uint64_t const key)
+{
+	return key & 0xff;
+}
+
+static GLuint myy_gl_compile_shader(
+	GLenum const type,
+	char const * const source)
+{
+	GLuint const shader = glCreateShader(type);
+	GLint compiled = GL_FALSE;
+
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (!compiled) {
+		char log[1024];
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		LOG_ERROR("Shader compilation failed :\n%s", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+static GLuint myy_gl_link_program(
+	char const * __restrict const vertex_source,
+	char const * __restrict const fragment_source)
+{
+	GLuint program = 0;
+	GLint linked = GL_FALSE;
+	GLuint const vertex_shader =
+		myy_gl_compile_shader(GL_VERTEX_SHADER, vertex_source);
+	GLuint const fragment_shader =
+		myy_gl_compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+
+	if ((vertex_shader == 0) | (fragment_shader == 0))
+		goto no_shaders;
+
+	program = glCreateProgram();
+	glAttachShader(program, vertex_shader);
+	glAttachShader(program, fragment_shader);
+	glLinkProgram(program);
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked) {
+		char log[1024];
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		LOG_ERROR("Program link failed :\n%s", log);
+		glDeleteProgram(program);
+		program = 0;
+	}
+
+no_shaders:
+	/* Flagged for deletion. They'll die with the program. */
+	if (vertex_shader)
+		glDeleteShader(vertex_shader);
+	if (fragment_shader)
+		glDeleteShader(fragment_shader);
+	return program;
+}
+
+/* Program binary cache.
+ *
+ * Compiling and linking shaders from source at every startup easily
+ * costs hundreds of milliseconds with NVIDIA drivers.
+ * When GL_OES_get_program_binary is available, linked programs are
+ * saved on disk and loaded back on the next run.
+ *
+ * The cache key is a hash of the shaders sources, the driver
+ * identity (EGL_VENDOR, EGL_VERSION, GL_RENDERER, GL_VERSION) and
+ * the EGL config ID. A driver update changes the key, so stale
+ * binaries are simply never looked up again.
+ * The files live in $XDG_CACHE_HOME/nvidia-drm-kms/programs-v1/
+ * (or ~/.cache/... when XDG_CACHE_HOME is not set). Bump the version
+ * in the directory name when the file format changes.
+ *
+ * Programs that are not in the cache are compiled on a worker thread,
+ * using a context sharing objects with the render one, while the
+ * render thread shows a splash frame.
+ */
+#define MYY_PROGRAM_CACHE_DIR "nvidia-drm-kms/programs-v1"
+#define MYY_PROGRAM_CACHE_MAGIC "MYYPRGB1"
+
+struct myy_program_cache_header {
+	char magic[8];
+	uint64_t key;
+	uint32_t binary_format;
+	uint32_t binary_length;
+};
+
+struct myy_program_cache {
+	bool binary_supported;
+	char dir[512];
+	uint64_t driver_hash;
+	PFNGLGETPROGRAMBINARYOESPROC glGetProgramBinaryOES;
+	PFNGLPROGRAMBINARYOESPROC glProgramBinaryOES;
+};
+
+/* A program to prepare. Filled with the linked program ID,
+ * or 0 on failure. */
+struct myy_program_request {
+	char const * vertex_source;
+	char const * fragment_source;
+	uint64_t key;
+	GLuint program;
+};
+
+/* The GL extensions list is the same kind of space-separated
+ * string as the EGL ones, but we only check it once or twice,
+ * so no need for a bitmask. */
+static bool myy_gl_has_extension(char const * __restrict const name)
+{
+	char const * __restrict const extensions =
+		(char const *) glGetString(GL_EXTENSIONS);
+	size_t const name_length = strlen(name);
+	char const * __restrict cursor = extensions;
+
+	while (cursor != NULL && (cursor = strstr(cursor, name)) != NULL) {
+		bool const starts_token =
+			(cursor == extensions) || (cursor[-1] == ' ');
+		char const after = cursor[name_length];
+		if (starts_token & ((after == ' ') | (after == '\0')))
+			return true;
+		cursor += name_length;
+	}
+	return false;
+}
+
+static uint64_t myy_hash_string(
+	uint64_t const seed,
+	char const * __restrict const str)
+{
+	uint64_t const str_hash =
+		myy_hash_bytes(str ? str : "", str ? strlen(str) : 0);
+	return (seed ^ str_hash) * 0x100000001b3ull;
+}
+
+/* mkdir -p */
+static bool myy_mkdir_p(char const * __restrict const path)
+{
+	char partial[512];
+	size_t const length = strlen(path);
+
+	if (length >= sizeof(partial))
+		return false;
+
+	memcpy(partial, path, length + 1);
+	for (size_t c = 1; c <= length; c++) {
+		if ((partial[c] == '/') | (partial[c] == '\0')) {
+			char const saved = partial[c];
+			partial[c] = '\0';
+			if (mkdir(partial, 0755) != 0 && errno != EEXIST)
+				return false;
+			partial[c] = saved;
+		}
+	}
+	return true;
+}
+
+static void myy_program_cache_init(
+	struct myy_program_cache * __restrict const cache,
+	myy_opengl_infos_t const * __restrict const gl)
+{
+	EGLint config_id = 0;
+	char const * __restrict const xdg_cache = getenv("XDG_CACHE_HOME");
+	char const * __restrict const home = getenv("HOME");
+	int written = -1;
+
+	memset(cache, 0, sizeof(*cache));
+
+	cache->glGetProgramBinaryOES = (PFNGLGETPROGRAMBINARYOESPROC)
+		eglGetProcAddress("glGetProgramBinaryOES");
+	cache->glProgramBinaryOES = (PFNGLPROGRAMBINARYOESPROC)
+		eglGetProcAddress("glProgramBinaryOES");
+
+	GLint n_binary_formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &n_binary_formats);
+
+	if (xdg_cache && xdg_cache[0] == '/')
+		written = snprintf(cache->dir, sizeof(cache->dir), "%s/%s",
+			xdg_cache, MYY_PROGRAM_CACHE_DIR);
+	else if (home)
+		written = snprintf(cache->dir, sizeof(cache->dir), "%s/.cache/%s",
+			home, MYY_PROGRAM_CACHE_DIR);
+
+	cache->binary_supported =
+		myy_gl_has_extension("GL_OES_get_program_binary")
+		& (cache->glGetProgramBinaryOES != NULL)
+		& (cache->glProgramBinaryOES != NULL)
+		& (n_binary_formats > 0)
+		& (written > 0) & (written < (int) sizeof(cache->dir))
+		&& myy_mkdir_p(cache->dir);
+
+	eglGetConfigAttrib(gl->display, gl->config, EGL_CONFIG_ID, &config_id);
+	uint64_t hash = 0xcbf29ce484222325ull;
+	hash = myy_hash_string(hash, eglQueryString(gl->display, EGL_VENDOR));
+	hash = myy_hash_string(hash, eglQueryString(gl->display, EGL_VERSION));
+	hash = myy_hash_string(hash, (char const *) glGetString(GL_RENDERER));
+	hash = myy_hash_string(hash, (char const *) glGetString(GL_VERSION));
+	cache->driver_hash = hash ^ ((uint64_t) config_id << 48);
+
+	LOGF("Program binary cache : %s (%s)",
+		cache->binary_supported ? "enabled" : "disabled",
+		cache->binary_supported ? cache->dir : "no GL_OES_get_program_binary");
+}
+
+static uint64_t myy_program_cache_key(
+	struct myy_program_cache const * __restrict const cache,
+	struct myy_program_request const * __restrict const request)
+{
+	uint64_t key = cache->driver_hash;
+	key = myy_hash_string(key, request->vertex_source);
+	key = myy_hash_string(key, request->fragment_source);
+	return key;
+}
+
+static void myy_program_cache_path(
+	struct myy_program_cache const * __restrict const cache,
+	uint64_t const key,
+	char * __restrict const path,
+	size_t const path_size)
+{
+	snprintf(path, path_size, "%s/%016" PRIx64 ".bin", cache->dir, key);
+}
+
+/* Returns the program ID, or 0 if not in the cache (or not usable
+ * anymore, in which case the file is removed). */
+static GLuint myy_program_cache_load(
+	struct myy_program_cache const * __restrict const cache,
+	uint64_t const key)
+{
+	char path[600];
+	struct myy_program_cache_header header;
+	GLuint program = 0;
+	void * __restrict binary = NULL;
+	int fd;
+
+	if (!cache->binary_supported)
+		return 0;
+
+	myy_program_cache_path(cache, key, path, sizeof(path));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if ((read(fd, &header, sizeof(header)) != sizeof(header))
+	    || (memcmp(header.magic, MYY_PROGRAM_CACHE_MAGIC, 8) != 0)
+	    || (header.key != key)
+	    || (header.binary_length == 0)
+	    || (header.binary_length > (64u << 20)))
+	{
+		goto invalid_file;
+	}
+
+	binary = malloc(header.binary_length);
+	if (binary == NULL)
+		goto invalid_file;
+
+	if (read(fd, binary, header.binary_length)
+	    != (ssize_t) header.binary_length)
+	{
+		goto invalid_file;
+	}
+
+	GLint linked = GL_FALSE;
+	program = glCreateProgram();
+	cache->glProgramBinaryOES(
+		program, header.binary_format, binary, header.binary_length);
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked) {
+		/* Driver changed in a way our key didn't catch */
+		glDeleteProgram(program);
+		program = 0;
+		goto invalid_file;
+	}
+
+	free(binary);
+	close(fd);
+	return program;
+
+invalid_file:
+	LOGF("Removing unusable cached program %s", path);
+	free(binary);
+	close(fd);
+	unlink(path);
+	return 0;
+}
+
+static void myy_program_cache_store(
+	struct myy_program_cache const * __restrict const cache,
+	uint64_t const key,
+	GLuint const program)
+{
+	char path[600], tmp_path[620];
+	GLint length = 0;
+	GLsizei written_length = 0;
+	GLenum binary_format = 0;
+	void * __restrict binary;
+
+	if (!cache->binary_supported)
+		return;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	if (binary == NULL)
+		return;
+
+	cache->glGetProgramBinaryOES(
+		program, length, &written_length, &binary_format, binary);
+
+	struct myy_program_cache_header header = {
+		.key           = key,
+		.binary_format = binary_format,
+		.binary_length = (uint32_t) written_length,
+	};
+	memcpy(header.magic, MYY_PROGRAM_CACHE_MAGIC, 8);
+
+	/* Write then rename, so that readers never see half a file */
+	myy_program_cache_path(cache, key, path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, getpid());
+	int const fd = open(tmp_path,
+		O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		bool const ok =
+			(write(fd, &header, sizeof(header)) == sizeof(header))
+			&& (write(fd, binary, written_length) == written_length);
+		close(fd);
+		if (!ok || rename(tmp_path, path) != 0)
+			unlink(tmp_path);
+	}
+
+	free(binary);
+}
+
+struct myy_program_warm_up_job {
+	struct myy_program_cache const * cache;
+	myy_opengl_infos_t const * gl;
+	EGLContext context;
+	struct myy_program_request * requests;
+	uint32_t n_requests;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+	bool done;
+};
+
+/* Compiles every request that has no program yet, and stores the
+ * results in the cache. Expects a current context. */
+static void myy_program_compile_missing(
+	struct myy_program_cache const * __restrict const cache,
+	struct myy_program_request * __restrict const requests,
+	uint32_t const n_requests)
+{
+	for (uint32_t r = 0; r < n_requests; r++) {
+		struct myy_program_request * __restrict const request =
+			requests + r;
+		if (request->program != 0)
+			continue;
+
+		request->program = myy_gl_link_program(
+			request->vertex_source, request->fragment_source);
+		if (request->program != 0)
+			myy_program_cache_store(cache, request->key, request->program);
+	}
+}
+
+static void * myy_program_warm_up_thread(void * user_data)
+{
+	struct myy_program_warm_up_job * __restrict const job = user_data;
+
+	if (eglMakeCurrent(job->gl->display,
+		EGL_NO_SURFACE, EGL_NO_SURFACE, job->context))
+	{
+		myy_program_compile_missing(
+			job->cache, job->requests, job->n_requests);
+		/* Programs are shared objects, but the render context
+		 * must not use them before they're actually built. */
+		glFinish();
+		eglMakeCurrent(job->gl->display,
+			EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	}
+	else {
+		LOG_EGL_ERROR("Could not bind the warm-up context : 0x%x",
+			eglGetError());
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->done = true;
+	pthread_cond_signal(&job->done_cond);
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+/* A context sharing textures, buffers and programs with the render
+ * context. Used without any surface, so EGL_KHR_surfaceless_context
+ * is required. Returns EGL_NO_CONTEXT on failure. */
+static EGLContext egl_create_shared_context(
+	myy_opengl_infos_t const * __restrict const gl)
+{
+	EGLint const context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+
+	if (!myy_egl_caps_has(&gl->display_caps,
+		MYY_EGL_KHR_surfaceless_context))
+	{
+		LOGF("No EGL_KHR_surfaceless_context. No shared contexts.");
+		return EGL_NO_CONTEXT;
+	}
+
+	return eglCreateContext(
+		gl->display, gl->config, gl->context, context_attribs);
+}
+
+/* Fills every request with a linked program.
+ * Cached programs are loaded right away. The others are compiled on
+ * a worker thread while the render thread keeps showing a splash
+ * frame, or on the render thread itself if no shared context can
+ * be created.
+ * Returns the number of requests that could not be satisfied. */
+static uint32_t myy_program_cache_warm_up(
+	struct myy_program_cache const * __restrict const cache,
+	myy_opengl_infos_t const * __restrict const gl,
+	struct myy_program_request * __restrict const requests,
+	uint32_t const n_requests)
+{
+	uint32_t n_missing = 0;
+	uint32_t n_failed = 0;
+	uint64_t const start_ns = myy_clock_ns();
+
+	for (uint32_t r = 0; r < n_requests; r++) {
+		requests[r].key = myy_program_cache_key(cache, requests + r);
+		requests[r].program = myy_program_cache_load(cache, requests[r].key);
+		n_missing += (requests[r].program == 0);
+	}
+
+	if (n_missing > 0) {
+		struct myy_program_warm_up_job job = {
+			.cache      = cache,
+			.gl         = gl,
+			.context    = egl_create_shared_context(gl),
+			.requests   = requests,
+			.n_requests = n_requests,
+			.done       = false,
+		};
+		pthread_t thread;
+		pthread_mutex_init(&job.lock, NULL);
+		pthread_cond_init(&job.done_cond, NULL);
+
+		if (job.context != EGL_NO_CONTEXT
+		    && pthread_create(&thread, NULL,
+		                      myy_program_warm_up_thread, &job) == 0)
+		{
+			/* The splash frame, so the display isn't left with
+			 * whatever garbage was there before. The plane keeps
+			 * scanning it out, so it's presented once and the
+			 * render thread sleeps until the worker is done.
+			 * At startup, the stream isn't there yet, and the
+			 * dumb buffer is shown instead. */
+			if (gl->surface != EGL_NO_SURFACE) {
+				glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+				glClear(GL_COLOR_BUFFER_BIT);
+				eglSwapBuffers(gl->display, gl->surface);
+			}
+
+			pthread_mutex_lock(&job.lock);
+			while (!job.done)
+				pthread_cond_wait(&job.done_cond, &job.lock);
+			pthread_mutex_unlock(&job.lock);
+			pthread_join(thread, NULL);
+			/* The splash frame bypassed the GL state tracker */
+			myy_gl_state_reset();
+		}
+
+		if (job.context != EGL_NO_CONTEXT)
+			eglDestroyContext(gl->display, job.context);
+		pthread_cond_destroy(&job.done_cond);
+		pthread_mutex_destroy(&job.lock);
+
+		/* No worker, or the worker couldn't bind its context */
+		myy_program_compile_missing(cache, requests, n_requests);
+	}
+
+	for (uint32_t r = 0; r < n_requests; r++)
+		n_failed += (requests[r].program == 0);
+
+	LOGF("Programs ready in %.1f ms (%u from cache, %u compiled)",
+		(myy_clock_ns() - start_ns) / 1e6,
+		n_requests - n_missing, n_missing - n_failed);
+
+	return n_failed;
+}
+
+/* Hands a linked program over to the renderer.
+ * Returns the program index to use in draw commands, or -1 */
+static int myy_renderer_add_program(
+	struct myy_renderer * __restrict const renderer,
+	GLuint const id)
+{
+	if ((renderer->n_programs >= MYY_RENDERER_MAX_PROGRAMS) | (id == 0))
+		return -1;
+
+	struct myy_renderer_program * __restrict const program =
+		renderer->programs + renderer->n_programs;
+	program->id                = id;
+	program->u_view_projection =
+		glGetUniformLocation(id, "u_view_projection");
+	program->u_texture         = glGetUniformLocation(id, "u_texture");
+	program->u_tint            = glGetUniformLocation(id, "u_tint");
+	program->a_position        = glGetAttribLocation(id, "a_position");
+	program->a_color           = glGetAttribLocation(id, "a_color");
+
+	return (int) renderer->n_programs++;
+}
+
+static bool myy_renderer_reserve_cmds(
+	struct myy_renderer * __restrict const renderer,
+	uint32_t const n_cmds)
+{
+	if (n_cmds <= renderer->cmds_capacity)
+		return true;
+
+	uint32_t capacity = renderer->cmds_capacity ? renderer->cmds_capacity : 64;
+	while (capacity < n_cmds)
+		capacity *= 2;
+
+	struct myy_draw_cmd * __restrict const cmds = myy_arena_grow(
+		renderer->arena, renderer->cmds,
+		renderer->cmds_capacity * sizeof(struct myy_draw_cmd),
+		capacity * sizeof(struct myy_draw_cmd));
+	if (cmds == NULL) {
+		LOG_ERROR("Could not grow the draw commands list");
+		return false;
+	}
+
+	renderer->cmds = cmds;
+	renderer->cmds_capacity = capacity;
+	return true;
+}
+
+static int myy_renderer_init(
+	struct myy_renderer * __restrict const renderer,
+	struct myy_arena * __restrict const arena)
+{
+	memset(renderer, 0, sizeof(*renderer));
+	myy_gl_state_reset();
+	glGenBuffers(MYY_RENDERER_VBO_RING, renderer->vbos);
+	renderer->view_projection = myy_mat4_identity();
+	for (uint32_t c = 0; c < 4; c++)
+		renderer->tint[c] = 1.0f;
+	renderer->arena = arena;
+	return 0;
+}
+
+static void myy_renderer_deinit(
+	struct myy_renderer * __restrict const renderer)
+{
+	for (uint32_t p = 0; p < renderer->n_programs; p++)
+		myy_gl_delete_program(renderer->programs[p].id);
+	myy_gl_delete_buffers(MYY_RENDERER_VBO_RING, renderer->vbos);
+	memset(renderer, 0, sizeof(*renderer));
+}
+
+static void myy_renderer_set_clip(
+	struct myy_renderer * __restrict const renderer,
+	GLint const x, GLint const y, GLsizei const w, GLsizei const h)
+{
+	renderer->clip[0] = x;
+	renderer->clip[1] = y;
+	renderer->clip[2] = w;
+	renderer->clip[3] = h;
+}
+
+static void myy_renderer_set_tint(
+	struct myy_renderer * __restrict const renderer,
+	GLfloat const r, GLfloat const g, GLfloat const b, GLfloat const a)
+{
+	renderer->tint[0] = r;
+	renderer->tint[1] = g;
+	renderer->tint[2] = b;
+	renderer->tint[3] = a;
+}
+
+/* The arena must have been reset since the previous frame */
+static void myy_renderer_begin(
+	struct myy_renderer * __restrict const renderer,
+	struct myy_mat4 const * __restrict const view_projection)
+{
+	renderer->cmds = NULL;
+	renderer->n_cmds = 0;
+	renderer->cmds_capacity = 0;
+	renderer->view_projection = *view_projection;
+	memset(&renderer->stats, 0, sizeof(renderer->stats));
+}
+
+static void myy_renderer_draw_mesh(
+	struct myy_renderer * __restrict const renderer,
+	uint64_t const sort_key,
+	struct myy_mesh const * __restrict const mesh,
+	struct myy_mat4 const * __restrict const model,
+	uint8_t const color[4])
+{
+	if (!myy_renderer_reserve_cmds(renderer, renderer->n_cmds + 1))
+		return;
+
+	struct myy_draw_cmd * __restrict const cmd =
+		renderer->cmds + renderer->n_cmds++;
+	cmd->sort_key  = sort_key;
+	cmd->mesh      = mesh;
+	cmd->model     = *model;
+	cmd->instances = NULL;
+	memcpy(cmd->color, color, 4);
+}
+
+/* Draws every visible instance. The instances must stay untouched
+ * until the renderer is flushed. */
+static void myy_renderer_draw_instances(
+	struct myy_renderer * __restrict const renderer,
+	uint64_t const sort_key,
+	struct myy_mesh const * __restrict const mesh,
+	struct myy_instances const * __restrict const instances)
+{
+	if (instances->n_visible == 0
+	    || !myy_renderer_reserve_cmds(renderer, renderer->n_cmds + 1))
+	{
+		return;
+	}
+
+	struct myy_draw_cmd * __restrict const cmd =
+		renderer->cmds + renderer->n_cmds++;
+	cmd->sort_key  = sort_key;
+	cmd->mesh      = mesh;
+	cmd->instances = instances;
+}
+
+struct myy_draw_order {
+	uint64_t key;
+	uint32_t cmd;
+};
+
+/* Stable bottom-up merge sort of the commands keys.
+ * qsort is not stable, and glibc's one mallocs its scratch space
+ * for anything bigger than a few entries.
+ * Returns the sorted order, or NULL if the arena is out of memory. */
+static struct myy_draw_order * myy_renderer_sort(
+	struct myy_renderer * __restrict const renderer)
+{
+	uint32_t const n_cmds = renderer->n_cmds;
+	struct myy_draw_order * __restrict order = myy_arena_alloc(
+		renderer->arena, n_cmds * sizeof(struct myy_draw_order));
+	struct myy_draw_order * __restrict scratch = myy_arena_alloc(
+		renderer->arena, n_cmds * sizeof(struct myy_draw_order));
+
+	if (order == NULL || scratch == NULL)
+		return NULL;
+
+	for (uint32_t c = 0; c < n_cmds; c++) {
+		order[c].key = renderer->cmds[c].sort_key;
+		order[c].cmd = c;
+	}
+
+	for (uint32_t width = 1; width < n_cmds; width *= 2) {
+		for (uint32_t left = 0; left < n_cmds; left += 2 * width) {
+			uint32_t const middle =
+				(left + width < n_cmds) ? left + width : n_cmds;
+			uint32_t const right =
+				(left + 2 * width < n_cmds) ? left + 2 * width : n_cmds;
+			uint32_t a = left, b = middle, out = left;
+			while ((a < middle) & (b < right))
+				scratch[out++] = (order[b].key < order[a].key)
+					? order[b++]
+					: order[a++];
+			while (a < middle)
+				scratch[out++] = order[a++];
+			while (b < right)
+				scratch[out++] = order[b++];
+		}
+		struct myy_draw_order * __restrict const swap = order;
+		order = scratch;
+		scratch = swap;
+	}
+
+	return order;
+}
+
+/* Writes the command mesh vertices, transformed in world space, into
+ * the staging buffer. */
+static void myy_renderer_emit_cmd(
+	struct myy_vertex * __restrict vertices,
+	struct myy_draw_cmd const * __restrict const cmd)
+{
+	struct myy_mesh const * __restrict const mesh = cmd->mesh;
+	float const * __restrict const m = cmd->model.m;
+	float const * __restrict positions = mesh->positions;
+	uint32_t const n_faces = mesh->n_vertices / mesh->vertices_per_face;
+
+	for (uint32_t f = 0; f < n_faces; f++) {
+		float const * __restrict const n = mesh->face_normals + f * 3;
+		float const nx = m[0]*n[0] + m[4]*n[1] + m[8]*n[2];
+		float const ny = m[1]*n[0] + m[5]*n[1] + m[9]*n[2];
+		float const nz = m[2]*n[0] + m[6]*n[1] + m[10]*n[2];
+		uint8_t const r = myy_shade(cmd->color[0], nx, ny, nz);
+		uint8_t const g = myy_shade(cmd->color[1], nx, ny, nz);
+		uint8_t const b = myy_shade(cmd->color[2], nx, ny, nz);
+
+		for (uint32_t v = 0; v < mesh->vertices_per_face; v++) {
+			float const px = positions[0];
+			float const py = positions[1];
+			float const pz = positions[2];
+			vertices->x = m[0]*px + m[4]*py + m[8]*pz  + m[12];
+			vertices->y = m[1]*px + m[5]*py + m[9]*pz  + m[13];
+			vertices->z = m[2]*px + m[6]*py + m[10]*pz + m[14];
+			vertices->r = r;
+			vertices->g = g;
+			vertices->b = b;
+			vertices->a = cmd->color[3];
+			vertices++;
+			positions += 3;
+		}
+	}
+}
+
+static void myy_renderer_apply_state(
+	struct myy_renderer const * __restrict const renderer,
+	uint32_t const state)
+{
+	myy_gl_set_capability(MYY_GL_CAP_DEPTH_TEST,
+		(state & MYY_RENDER_STATE_DEPTH_TEST) != 0);
+	myy_gl_set_capability(MYY_GL_CAP_BLEND,
+		(state & MYY_RENDER_STATE_BLEND) != 0);
+	if (state & MYY_RENDER_STATE_BLEND)
+		myy_gl_blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	myy_gl_set_capability(MYY_GL_CAP_CULL_FACE,
+		(state & MYY_RENDER_STATE_CULL_FACE) != 0);
+	myy_gl_set_capability(MYY_GL_CAP_SCISSOR_TEST,
+		(state & MYY_RENDER_STATE_SCISSOR) != 0);
+	if (state & MYY_RENDER_STATE_SCISSOR)
+		myy_gl_scissor(renderer->clip[0], renderer->clip[1],
+			renderer->clip[2], renderer->clip[3]);
+}
+
+/* Sort, batch, upload and draw everything recorded this frame */
+static void myy_renderer_flush(
+	struct myy_renderer * __restrict const renderer)
+{
+	uint32_t const n_cmds = renderer->n_cmds;
+	uint32_t n_vertices = 0;
+
+	if (n_cmds == 0)
+		return;
+
+	struct myy_draw_order const * __restrict const order =
+		myy_renderer_sort(renderer);
+
+	for (uint32_t c = 0; c < n_cmds; c++)
+		n_vertices += myy_draw_cmd_vertices(renderer->cmds + c);
+
+	struct myy_vertex * __restrict const staging = myy_arena_alloc(
+		renderer->arena, n_vertices * sizeof(struct myy_vertex));
+	if (order == NULL || staging == NULL) {
+		LOG_ERROR("Out of memory for this frame. Skipping it.");
+		return;
+	}
+
+	/* Write every vertex of the frame, in sorted order, so that each
+	 * batch is a contiguous range of the buffer. */
+	struct myy_vertex * __restrict vertices = staging;
+	for (uint32_t c = 0; c < n_cmds; c++) {
+		struct myy_draw_cmd const * __restrict const cmd =
+			renderer->cmds + order[c].cmd;
+		if (cmd->instances) {
+			myy_simd_get()->transform(cmd->instances,
+				cmd->instances->visible, cmd->instances->n_visible,
+				cmd->mesh, vertices);
+		}
+		else {
+			myy_renderer_emit_cmd(vertices, cmd);
+		}
+		vertices += myy_draw_cmd_vertices(cmd);
+	}
+
+	bool const counting = myy_heap_counting_set(false);
+
+	/* Upload into the next VBO of the ring, orphaning its storage */
+	uint32_t const vbo_index = renderer->current_vbo;
+	GLsizeiptr const upload_size = n_vertices * sizeof(struct myy_vertex);
+	renderer->current_vbo = (vbo_index + 1) % MYY_RENDERER_VBO_RING;
+
+	myy_gl_bind_buffer(GL_ARRAY_BUFFER, renderer->vbos[vbo_index]);
+	if (upload_size > renderer->vbos_size[vbo_index])
+		renderer->vbos_size[vbo_index] = upload_size;
+	glBufferData(GL_ARRAY_BUFFER, renderer->vbos_size[vbo_index],
+		NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, upload_size, staging);
+
+	/* One draw call per run of identical keys */
+	uint32_t first_vertex = 0;
+	uint32_t c = 0;
+	while (c < n_cmds) {
+		uint64_t const key = order[c].key;
+		uint32_t batch_vertices = 0;
+		while ((c < n_cmds) && (order[c].key == key)) {
+			batch_vertices +=
+				myy_draw_cmd_vertices(renderer->cmds + order[c].cmd);
+			c++;
+		}
+
+		struct myy_renderer_program const program =
+			renderer->programs[myy_draw_key_program(key)];
+		GLuint const texture = myy_draw_key_texture(key);
+
+		myy_gl_use_program(program.id);
+		myy_gl_uniform_matrix4fv(program.u_view_projection,
+			renderer->view_projection.m);
+		myy_gl_uniform4fv(program.u_tint, renderer->tint);
+		if (texture) {
+			myy_gl_active_texture(GL_TEXTURE0);
+			myy_gl_bind_texture(texture);
+			myy_gl_uniform1i(program.u_texture, 0);
+		}
+		myy_renderer_apply_state(renderer, myy_draw_key_state(key));
+
+		/* The VBO changes every frame, so the pointers have to be
+		 * set again anyway. */
+		myy_gl_enable_vertex_attrib(program.a_position);
+		glVertexAttribPointer(program.a_position, 3, GL_FLOAT, GL_FALSE,
+			sizeof(struct myy_vertex),
+			(void const *) offsetof(struct myy_vertex, x));
+		myy_gl_enable_vertex_attrib(program.a_color);
+		glVertexAttribPointer(program.a_color, 4, GL_UNSIGNED_BYTE, GL_TRUE,
+			sizeof(struct myy_vertex),
+			(void const *) offsetof(struct myy_vertex, r));
+
+		glDrawArrays(GL_TRIANGLES, first_vertex, batch_vertices);
+
+		first_vertex += batch_vertices;
+		renderer->stats.batches++;
+	}
+
+	renderer->stats.commands = n_cmds;
+	renderer->stats.vertices = n_vertices;
+	myy_heap_counting_set(counting);
+}
+
+/* The cube. 6 faces, 2 triangles each, counter-clockwise. */
+static float const myy_cube_positions[] = {
+	/* Front (+Z) */
+	-1,-1, 1,   1,-1, 1,   1, 1, 1,  -1,-1, 1,   1, 1, 1,  -1, 1, 1,
+	/* Back (-Z) */
+	 1,-1,-1,  -1,-1,-1,  -1, 1,-1,   1,-1,-1,  -1, 1,-1,   1, 1,-1,
+	/* Left (-X) */
+	-1,-1,-1,  -1,-1, 1,  -1, 1, 1,  -1,-1,-1,  -1, 1, 1,  -1, 1,-1,
+	/* Right (+X) */
+	 1,-1, 1,   1,-1,-1,   1, 1,-1,   1,-1, 1,   1, 1,-1,   1, 1, 1,
+	/* Top (+Y) */
+	-1, 1, 1,   1, 1, 1,   1, 1,-1,  -1, 1, 1,   1, 1,-1,  -1, 1,-1,
+	/* Bottom (-Y) */
+	-1,-1,-1,   1,-1,-1,   1,-1, 1,  -1,-1,-1,   1,-1, 1,  -1,-1, 1,
+};
+
+static float const myy_cube_normals[] = {
+	 0, 0, 1,
+	 0, 0,-1,
+	-1, 0, 0,
+	 1, 0, 0,
+	 0, 1, 0,
+	 0,-1, 0,
+};
+
+static struct myy_mesh const myy_cube_mesh = {
+	.positions         = myy_cube_positions,
+	.face_normals      = myy_cube_normals,
+	.n_vertices        = 36,
+	.vertices_per_face = 6,
+};
+
+static char const myy_color_vertex_shader[] =
+	"uniform mat4 u_view_projection;\n"
+	"attribute vec3 a_position;\n"
+	"attribute vec4 a_color;\n"
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	gl_Position = u_view_projection * vec4(a_position, 1.0);\n"
+	"	v_color = a_color;\n"
+	"}\n";
+
+static char const myy_color_fragment_shader[] =
+	"precision mediump float;\n"
+	"uniform vec4 u_tint;\n"
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	gl_FragColor = v_color * u_tint;\n"
+	"}\n";
+
+/* Asynchronous texture loader.
+ *
+ * Decoding a big image, then pushing it to the GPU with one
+ * glTexImage2D, on the render thread, is a guaranteed missed vblank.
+ * So :
+ * - Decoding is done by worker threads, into RGBA8 buffers.
+ * - Uploading is done by another thread, owning a context that shares
+ *   its objects with the render context, bound without any surface.
+ *   Pixels are sent with glTexSubImage2D, a few rows at a time, and
+ *   the number of bytes sent is capped per rendered frame, so that
+ *   the copies never compete too much with the frame being drawn.
+ *   When the render loop is idle (on-demand mode), the budget is
+ *   refilled periodically anyway.
+ * - Once the last rows are sent, an EGL fence is inserted after them.
+ *   The render thread checks the fence without blocking, every frame,
+ *   and only uses the texture once the fence is signaled.
+ *
+ * Sources are either PPM files (P6, 8 bits) or procedural images :
+ * "checker:SIZE" and "gradient:SIZE".
+ *
+ * The loader thread must NOT use the myy_gl_* wrappers : the GL state
+ * tracker follows the render context only.
+ */
+#define MYY_TEXTURE_LOADER_MAX_JOBS (8)
+#define MYY_TEXTURE_LOADER_DECODERS (2)
+#define MYY_TEXTURE_LOADER_FRAME_BUDGET (2u << 20)
+#define MYY_TEXTURE_LOADER_IDLE_REFILL_MS (16)
+#define MYY_TEXTURE_MAX_SIZE (8192)
+
+enum myy_texture_job_state {
+	MYY_TEXTURE_JOB_FREE,
+	MYY_TEXTURE_JOB_QUEUED,
+	MYY_TEXTURE_JOB_DECODING,
+	MYY_TEXTURE_JOB_DECODED,
+	MYY_TEXTURE_JOB_UPLOADING,
+	MYY_TEXTURE_JOB_FENCED,
+};
+
+struct myy_texture_job {
+	enum myy_texture_job_state state;
+	uint64_t sequence;
+	char source[256];
+	uint32_t width, height;
+	uint8_t * pixels;
+	uint32_t uploaded_rows;
+	GLuint texture;
+	EGLSyncKHR fence;
+};
+
+struct myy_texture_loader {
+	bool enabled;
+	bool quit;
+	EGLDisplay display;
+	EGLContext context;
+	PFNEGLCREATESYNCKHRPROC eglCreateSyncKHR;
+	PFNEGLDESTROYSYNCKHRPROC eglDestroySyncKHR;
+	PFNEGLCLIENTWAITSYNCKHRPROC eglClientWaitSyncKHR;
+
+	pthread_mutex_t lock;
+	pthread_cond_t decode_cond;
+	pthread_cond_t upload_cond;
+	pthread_t decoders[MYY_TEXTURE_LOADER_DECODERS];
+	uint32_t n_decoders;
+	pthread_t uploader;
+	bool uploader_started;
+
+	uint64_t next_sequence;
+	/* Sequence of the last texture handed to the render thread.
+	 * Anything older that completes later is stale. */
+	uint64_t delivered_sequence;
+	/* Bytes the uploader may still send for the current frame */
+	size_t upload_budget;
+	struct myy_texture_job jobs[MYY_TEXTURE_LOADER_MAX_JOBS];
+
+	/* Called from the uploader thread when a fence has been
+	 * inserted, so that an idle render loop wakes up to check it. */
+	void (*wake)(void * wake_data);
+	void * wake_data;
+};
+
+static bool myy_texture_read_ppm_token(
+	FILE * __restrict const file,
+	uint32_t * __restrict const value)
+{
+	int c;
+	/* Skip whitespaces and comments */
+	while ((c = fgetc(file)) != EOF) {
+		if (c == '#') {
+			while ((c = fgetc(file)) != EOF && c != '\n');
+		}
+		else if (c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+			break;
+		}
+	}
+	if (c < '0' || c > '9')
+		return false;
+
+	uint32_t result = 0;
+	while (c >= '0' && c <= '9' && result < 1000000) {
+		result = result * 10 + (c - '0');
+		c = fgetc(file);
+	}
+	/* c is the single whitespace following the token */
+	*value = result;
+	return true;
+}
+
+static bool myy_texture_decode_ppm(
+	struct myy_texture_job * __restrict const job)
+{
+	uint32_t width, height, max_value;
+	char magic[2];
+	uint8_t * __restrict rgb = NULL;
+	bool decoded = false;
+	FILE * __restrict const file = fopen(job->source, "rb");
+
+	if (file == NULL) {
+		LOG_ERROR("Could not open %s : %m", job->source);
+		return false;
+	}
+
+	if (fread(magic, 1, 2, file) != 2 || magic[0] != 'P' || magic[1] != '6'
+	    || !myy_texture_read_ppm_token(file, &width)
+	    || !myy_texture_read_ppm_token(file, &height)
+	    || !myy_texture_read_ppm_token(file, &max_value)
+	    || (max_value != 255)
+	    || (width == 0) || (width > MYY_TEXTURE_MAX_SIZE)
+	    || (height == 0) || (height > MYY_TEXTURE_MAX_SIZE))
+	{
+		LOG_ERROR("%s is not a supported PPM file (P6, 8 bits)",
+			job->source);
+		goto out;
+	}
+
+	size_t const n_pixels = (size_t) width * height;
+	rgb = malloc(n_pixels * 3);
+	job->pixels = malloc(n_pixels * 4);
+	if (rgb == NULL || job->pixels == NULL)
+		goto out;
+
+	if (fread(rgb, 3, n_pixels, file) != n_pixels) {
+		LOG_ERROR("%s is truncated", job->source);
+		goto out;
+	}
+
+	for (size_t p = 0; p < n_pixels; p++) {
+		job->pixels[p*4+0] = rgb[p*3+0];
+		job->pixels[p*4+1] = rgb[p*3+1];
+		job->pixels[p*4+2] = rgb[p*3+2];
+		job->pixels[p*4+3] = 255;
+	}
+	job->width  = width;
+	job->height = height;
+	decoded = true;
+
+out:
+	if (!decoded) {
+		free(job->pixels);
+		job->pixels = NULL;
+	}
+	free(rgb);
+	fclose(file);
+	return decoded;
+}
+
+static bool myy_texture_decode_procedural(
+	struct myy_texture_job * __restrict const job)
+{
+	char const * __restrict const separator = strchr(job->source, ':');
+	uint32_t const size = strtoul(separator + 1, NULL, 10);
+	bool const checker = (strncmp(job->source, "checker:", 8) == 0);
+
+	if ((size == 0) | (size > MYY_TEXTURE_MAX_SIZE))
+		return false;
+
+	job->pixels = malloc((size_t) size * size * 4);
+	if (job->pixels == NULL)
+		return false;
+
+	uint8_t * __restrict pixel = job->pixels;
+	uint32_t const square = (size >= 8) ? size / 8 : 1;
+	for (uint32_t y = 0; y < size; y++) {
+		for (uint32_t x = 0; x < size; x++) {
+			if (checker) {
+				uint8_t const value =
+					(((x / square) ^ (y / square)) & 1) ? 230 : 40;
+				pixel[0] = value;
+				pixel[1] = value;
+				pixel[2] = value;
+			}
+			else {
+				pixel[0] = (uint8_t) (x * 255 / size);
+				pixel[1] = (uint8_t) (y * 255 / size);
+				pixel[2] = 160;
+			}
+			pixel[3] = 255;
+			pixel += 4;
+		}
+	}
+	job->width  = size;
+	job->height = size;
+	return true;
+}
+
+static bool myy_texture_decode(struct myy_texture_job * __restrict const job)
+{
+	if ((strncmp(job->source, "checker:", 8) == 0)
+	    | (strncmp(job->source, "gradient:", 9) == 0))
+	{
+		return myy_texture_decode_procedural(job);
+	}
+	return myy_texture_decode_ppm(job);
+}
+
+static void * myy_texture_decoder_thread(void * user_data)
+{
+	struct myy_texture_loader * __restrict const loader = user_data;
+
+	pthread_mutex_lock(&loader->lock);
+	while (!loader->quit) {
+		struct myy_texture_job * __restrict job = NULL;
+		for (uint32_t j = 0; j < MYY_TEXTURE_LOADER_MAX_JOBS; j++) {
+			if (loader->jobs[j].state == MYY_TEXTURE_JOB_QUEUED) {
+				job = loader->jobs + j;
+				break;
+			}
+		}
+
+		if (job == NULL) {
+			pthread_cond_wait(&loader->decode_cond, &loader->lock);
+			continue;
+		}
+
+		job->state = MYY_TEXTURE_JOB_DECODING;
+		pthread_mutex_unlock(&loader->lock);
+
+		uint64_t const start_ns = myy_clock_ns();
+		bool const decoded = myy_texture_decode(job);
+		if (decoded) {
+			LOGF("Decoded %s (%ux%u) in %.1f ms",
+				job->source, job->width, job->height,
+				(myy_clock_ns() - start_ns) / 1e6);
+		}
+
+		pthread_mutex_lock(&loader->lock);
+		job->state = decoded ? MYY_TEXTURE_JOB_DECODED : MYY_TEXTURE_JOB_FREE;
+		pthread_cond_signal(&loader->upload_cond);
+	}
+	pthread_mutex_unlock(&loader->lock);
+
+	return NULL;
+}
+
+/* Oldest job waiting for its pixels to be sent. Lock held. */
+static struct myy_texture_job * myy_texture_loader_next_upload(
+	struct myy_texture_loader * __restrict const loader)
+{
+	struct myy_texture_job * __restrict next = NULL;
+	for (uint32_t j = 0; j < MYY_TEXTURE_LOADER_MAX_JOBS; j++) {
+		struct myy_texture_job * __restrict const job = loader->jobs + j;
+		bool const pending =
+			(job->state == MYY_TEXTURE_JOB_DECODED)
+			| (job->state == MYY_TEXTURE_JOB_UPLOADING);
+		if (pending && (next == NULL || job->sequence < next->sequence))
+			next = job;
+	}
+	return next;
+}
+
+/* Sends the next rows of the job. Called without the lock.
+ * Returns the number of bytes sent. */
+static size_t myy_texture_upload_chunk(
+	struct myy_texture_job * __restrict const job,
+	size_t const budget)
+{
+	size_t const row_size = (size_t) job->width * 4;
+	uint32_t const remaining_rows = job->height - job->uploaded_rows;
+	uint32_t rows = budget / row_size;
+
+	/* Always make progress, even with rows larger than the budget */
+	rows = (rows == 0) ? 1 : rows;
+	rows = (rows > remaining_rows) ? remaining_rows : rows;
+
+	if (job->texture == 0) {
+		glGenTextures(1, &job->texture);
+		glBindTexture(GL_TEXTURE_2D, job->texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, job->width, job->height,
+			0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, job->texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0,
+		0, job->uploaded_rows, job->width, rows,
+		GL_RGBA, GL_UNSIGNED_BYTE,
+		job->pixels + job->uploaded_rows * row_size);
+	/* Get the copy started now, instead of whenever the driver
+	 * feels like it. */
+	glFlush();
+
+	job->uploaded_rows += rows;
+	return rows * row_size;
+}
+
+static void * myy_texture_uploader_thread(void * user_data)
+{
+	struct myy_texture_loader * __restrict const loader = user_data;
+
+	if (!eglMakeCurrent(loader->display,
+		EGL_NO_SURFACE, EGL_NO_SURFACE, loader->context))
+	{
+		LOG_EGL_ERROR("Could not bind the texture loader context : 0x%x",
+			eglGetError());
+		return NULL;
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	pthread_mutex_lock(&loader->lock);
+	while (!loader->quit) {
+		struct myy_texture_job * __restrict const job =
+			myy_texture_loader_next_upload(loader);
+
+		if (job == NULL) {
+			pthread_cond_wait(&loader->upload_cond, &loader->lock);
+			continue;
+		}
+
+		if (loader->upload_budget == 0) {
+			/* Wait for the next frame. If the render loop is
+			 * sleeping, there's no frame to protect, so go on
+			 * after a short while. */
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += MYY_TEXTURE_LOADER_IDLE_REFILL_MS * 1000000L;
+			deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			if (pthread_cond_timedwait(&loader->upload_cond,
+				&loader->lock, &deadline) == ETIMEDOUT)
+			{
+				loader->upload_budget = MYY_TEXTURE_LOADER_FRAME_BUDGET;
+			}
+			continue;
+		}
+
+		size_t const budget = loader->upload_budget;
+		job->state = MYY_TEXTURE_JOB_UPLOADING;
+		pthread_mutex_unlock(&loader->lock);
+
+		size_t const sent = myy_texture_upload_chunk(job, budget);
+		bool const complete = (job->uploaded_rows == job->height);
+		EGLSyncKHR fence = EGL_NO_SYNC_KHR;
+		if (complete) {
+			free(job->pixels);
+			job->pixels = NULL;
+			fence = loader->eglCreateSyncKHR(
+				loader->display, EGL_SYNC_FENCE_KHR, NULL);
+			/* The fence must reach the GPU, or the render thread
+			 * could wait on it forever. */
+			glFlush();
+		}
+
+		pthread_mutex_lock(&loader->lock);
+		loader->upload_budget =
+			(sent >= loader->upload_budget) ? 0 : loader->upload_budget - sent;
+		if (complete) {
+			job->fence = fence;
+			job->state = MYY_TEXTURE_JOB_FENCED;
+			if (loader->wake)
+				loader->wake(loader->wake_data);
+		}
+	}
+	pthread_mutex_unlock(&loader->lock);
+
+	eglMakeCurrent(loader->display,
+		EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	return NULL;
+}
+
+/* Returns 0 on success, -1 if the loader can't work with this
+ * driver. In that case, requests are simply refused. */
+static int myy_texture_loader_init(
+	struct myy_texture_loader * __restrict const loader,
+	myy_opengl_infos_t const * __restrict const gl)
+{
+	memset(loader, 0, sizeof(*loader));
+	loader->display = gl->display;
+	loader->next_sequence = 1;
+	loader->upload_budget = MYY_TEXTURE_LOADER_FRAME_BUDGET;
+
+	if (!myy_egl_caps_has(&gl->display_caps, MYY_EGL_KHR_fence_sync)) {
+		LOGF("No EGL_KHR_fence_sync. Textures can't be loaded "
+		     "asynchronously.");
+		goto no_fences;
+	}
+
+	loader->eglCreateSyncKHR = (PFNEGLCREATESYNCKHRPROC)
+		eglGetProcAddress("eglCreateSyncKHR");
+	loader->eglDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC)
+		eglGetProcAddress("eglDestroySyncKHR");
+	loader->eglClientWaitSyncKHR = (PFNEGLCLIENTWAITSYNCKHRPROC)
+		eglGetProcAddress("eglClientWaitSyncKHR");
+	if (!loader->eglCreateSyncKHR || !loader->eglDestroySyncKHR
+	    || !loader->eglClientWaitSyncKHR)
+	{
+		goto no_fences;
+	}
+
+	loader->context = egl_create_shared_context(gl);
+	if (loader->context == EGL_NO_CONTEXT)
+		goto no_context;
+
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->decode_cond, NULL);
+	pthread_cond_init(&loader->upload_cond, NULL);
+
+	if (pthread_create(&loader->uploader, NULL,
+		myy_texture_uploader_thread, loader) != 0)
+	{
+		LOG_ERROR("Could not start the texture upload thread");
+		goto no_uploader;
+	}
+	loader->uploader_started = true;
+
+	for (uint32_t d = 0; d < MYY_TEXTURE_LOADER_DECODERS; d++) {
+		if (pthread_create(loader->decoders + loader->n_decoders, NULL,
+			myy_texture_decoder_thread, loader) == 0)
+		{
+			loader->n_decoders++;
+		}
+	}
+	if (loader->n_decoders == 0) {
+		LOG_ERROR("Could not start any texture decoding thread");
+		goto no_decoders;
+	}
+
+	loader->enabled = true;
+	return 0;
+
+no_decoders:
+	pthread_mutex_lock(&loader->lock);
+	loader->quit = true;
+	pthread_cond_broadcast(&loader->upload_cond);
+	pthread_mutex_unlock(&loader->lock);
+	pthread_join(loader->uploader, NULL);
+	loader->uploader_started = false;
+no_uploader:
+	pthread_cond_destroy(&loader->upload_cond);
+	pthread_cond_destroy(&loader->decode_cond);
+	pthread_mutex_destroy(&loader->lock);
+	eglDestroyContext(loader->display, loader->context);
+	loader->context = EGL_NO_CONTEXT;
+no_context:
+no_fences:
+	return -1;
+}
+
+/* The render context must be current. */
+static void myy_texture_loader_deinit(
+	struct myy_texture_loader * __restrict const loader)
+{
+	if (!loader->enabled)
+		return;
+
+	pthread_mutex_lock(&loader->lock);
+	loader->quit = true;
+	pthread_cond_broadcast(&loader->decode_cond);
+	pthread_cond_broadcast(&loader->upload_cond);
+	pthread_mutex_unlock(&loader->lock);
+
+	for (uint32_t d = 0; d < loader->n_decoders; d++)
+		pthread_join(loader->decoders[d], NULL);
+	pthread_join(loader->uploader, NULL);
+
+	for (uint32_t j = 0; j < MYY_TEXTURE_LOADER_MAX_JOBS; j++) {
+		struct myy_texture_job * __restrict const job = loader->jobs + j;
+		if (job->fence != EGL_NO_SYNC_KHR)
+			loader->eglDestroySyncKHR(loader->display, job->fence);
+		if (job->texture)
+			myy_gl_delete_texture(job->texture);
+		free(job->pixels);
+	}
+
+	pthread_cond_destroy(&loader->upload_cond);
+	pthread_cond_destroy(&loader->decode_cond);
+	pthread_mutex_destroy(&loader->lock);
+	eglDestroyContext(loader->display, loader->context);
+	memset(loader, 0, sizeof(*loader));
+}
+
+/* Queues an image to load. Returns false if the loader is disabled
+ * or too busy. Render thread only. */
+static bool myy_texture_loader_request(
+	struct myy_texture_loader * __restrict const loader,
+	char const * __restrict const source)
+{
+	bool queued = false;
+
+	if (!loader->enabled)
+		return false;
+
+	pthread_mutex_lock(&loader->lock);
+	for (uint32_t j = 0; j < MYY_TEXTURE_LOADER_MAX_JOBS; j++) {
+		struct myy_texture_job * __restrict const job = loader->jobs + j;
+		if (job->state == MYY_TEXTURE_JOB_FREE) {
+			memset(job, 0, sizeof(*job));
+			snprintf(job->source, sizeof(job->source), "%s", source);
+			job->sequence = loader->next_sequence++;
+			job->state = MYY_TEXTURE_JOB_QUEUED;
+			pthread_cond_signal(&loader->decode_cond);
+			queued = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&loader->lock);
+
+	if (!queued)
+		LOG_ERROR("Too many textures loading. Dropping %s", source);
+	return queued;
+}
+
+/* To call once per rendered frame, on the render thread.
+ * Gives the uploader its budget for this frame, and checks the
+ * pending fences without waiting on them.
+ * Returns the most recently requested texture that became usable
+ * since the last call, or 0. Textures superseded by a more recent
+ * request are deleted.
+ * *fenced is set to true if uploaded textures are still waiting for
+ * the GPU, in which case another frame should be scheduled to check
+ * them again. */
+static GLuint myy_texture_loader_frame(
+	struct myy_texture_loader * __restrict const loader,
+	bool * __restrict const fenced)
+{
+	GLuint ready_texture = 0;
+	uint64_t ready_sequence = 0;
+
+	*fenced = false;
+	if (!loader->enabled)
+		return 0;
+
+	pthread_mutex_lock(&loader->lock);
+	loader->upload_budget = MYY_TEXTURE_LOADER_FRAME_BUDGET;
+	pthread_cond_signal(&loader->upload_cond);
+
+	for (uint32_t j = 0; j < MYY_TEXTURE_LOADER_MAX_JOBS; j++) {
+		struct myy_texture_job * __restrict const job = loader->jobs + j;
+		if (job->state != MYY_TEXTURE_JOB_FENCED)
+			continue;
+
+		EGLint const status = loader->eglClientWaitSyncKHR(
+			loader->display, job->fence, 0, 0);
+		if (status == EGL_TIMEOUT_EXPIRED_KHR) {
+			*fenced = true;
+			continue;
+		}
+
+		loader->eglDestroySyncKHR(loader->display, job->fence);
+		job->fence = EGL_NO_SYNC_KHR;
+		if (status != EGL_CONDITION_SATISFIED_KHR) {
+			LOG_EGL_ERROR("Texture fence for %s failed : 0x%x",
+				job->source, eglGetError());
+			myy_gl_delete_texture(job->texture);
+		}
+		else if (job->sequence > loader->delivered_sequence
+		         && job->sequence > ready_sequence)
+		{
+			if (ready_texture)
+				myy_gl_delete_texture(ready_texture);
+			ready_texture  = job->texture;
+			ready_sequence = job->sequence;
+		}
+		else {
+			myy_gl_delete_texture(job->texture);
+		}
+		job->texture = 0;
+		job->state = MYY_TEXTURE_JOB_FREE;
+	}
+	if (ready_texture)
+		loader->delivered_sequence = ready_sequence;
+	pthread_mutex_unlock(&loader->lock);
+
+	return ready_texture;
+}
+
+/* The backdrop : a textured quad covering the whole screen, behind
+ * everything else. Its positions are already in clip space. */
+static float const myy_backdrop_positions[] = {
+	-1,-1, 0,   1,-1, 0,   1, 1, 0,  -1,-1, 0,   1, 1, 0,  -1, 1, 0,
+};
+
+static float const myy_backdrop_normals[] = {
+	0, 0, 1,
+};
+
+static struct myy_mesh const myy_backdrop_mesh = {
+	.positions         = myy_backdrop_positions,
+	.face_normals      = myy_backdrop_normals,
+	.n_vertices        = 6,
+	.vertices_per_face = 6,
+};
+
+static char const myy_backdrop_vertex_shader[] =
+	"attribute vec3 a_position;\n"
+	"attribute vec4 a_color;\n"
+	"varying vec2 v_uv;\n"
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	gl_Position = vec4(a_position.xy, 0.9999, 1.0);\n"
+	"	v_uv = vec2(0.5, -0.5) * a_position.xy + 0.5;\n"
+	"	v_color = a_color;\n"
+	"}\n";
+
+static char const myy_backdrop_fragment_shader[] =
+	"precision mediump float;\n"
+	"uniform sampler2D u_texture;\n"
+	"varying vec2 v_uv;\n"
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	gl_FragColor = texture2D(u_texture, v_uv) * v_color;\n"
+	"}\n";
+
+/* The client layer : the same quad, in front of everything.
+ * Client buffers that can't go on an overlay plane are drawn with it. */
+static char const myy_layer_vertex_shader[] =
+	"attribute vec3 a_position;\n"
+	"attribute vec4 a_color;\n"
+	"varying vec2 v_uv;\n"
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	gl_Position = vec4(a_position.xy, -0.9999, 1.0);\n"
+	"	v_uv = vec2(0.5, -0.5) * a_position.xy + 0.5;\n"
+	"	v_color = a_color;\n"
+	"}\n";
+
+/* The scene : one spinning cube, or a grid of spinning cubes when
+ * stress testing. In front of a backdrop image, when one is loaded.
+ * Behind the client layer, when a client shows something. */
+struct myy_scene {
+	struct myy_renderer renderer;
+	struct myy_texture_loader textures;
+	struct myy_instances cubes;
+	int color_program;
+	int backdrop_program;
+	GLuint backdrop_texture;
+	int layer_program;
+	/* Owned by whoever provides it (see myy_dmabuf_importer) */
+	GLuint layer_texture;
+	uint32_t n_cubes;
+	uint32_t grid_side;
+	float aspect_ratio;
+	float camera_distance;
+	uint64_t start_ns;
+	/* When paused, the scene is frozen at that time */
+	bool paused;
+	uint64_t paused_ns;
+};
+
+static void myy_scene_resize(
+	struct myy_scene * __restrict const scene,
+	uint32_t const width,
+	uint32_t const height)
+{
+	scene->aspect_ratio = (float) width / (float) (height ? height : 1);
+	myy_gl_viewport(0, 0, width, height);
+	myy_renderer_set_clip(&scene->renderer, 0, 0, width, height);
+}
+
+static int myy_scene_init(
+	struct myy_scene * __restrict const scene,
+	myy_opengl_infos_t const * __restrict const gl,
+	uint32_t const width,
+	uint32_t const height,
+	uint32_t const n_cubes)
+{
+	struct myy_program_cache program_cache;
+	/* The key and program are filled by the warm up */
+	struct myy_program_request programs[] = {
+		{
+			.vertex_source   = myy_color_vertex_shader,
+			.fragment_source = myy_color_fragment_shader,
+			.key             = 0,
+			.program         = 0,
+		},
+		{
+			.vertex_source   = myy_backdrop_vertex_shader,
+			.fragment_source = myy_backdrop_fragment_shader,
+			.key             = 0,
+			.program         = 0,
+		},
+		{
+			.vertex_source   = myy_layer_vertex_shader,
+			.fragment_source = myy_backdrop_fragment_shader,
+			.key             = 0,
+			.program         = 0,
+		},
+	};
+
+	if (myy_renderer_init(&scene->renderer, &myy_frame_arena) != 0) {
+		LOG_ERROR("Could not initialise the renderer");
+		goto no_renderer;
+	}
+
+	myy_program_cache_init(&program_cache, gl);
+	myy_program_cache_warm_up(&program_cache, gl,
+		programs, ARRAY_SIZE(programs));
+
+	scene->color_program = myy_renderer_add_program(
+		&scene->renderer, programs[0].program);
+	if (scene->color_program < 0) {
+		LOG_ERROR("Could not prepare the cube shaders");
+		goto no_program;
+	}
+
+	/* Not fatal. We'll just have no backdrop. */
+	scene->backdrop_program = myy_renderer_add_program(
+		&scene->renderer, programs[1].program);
+	scene->backdrop_texture = 0;
+	scene->layer_program = myy_renderer_add_program(
+		&scene->renderer, programs[2].program);
+	scene->layer_texture = 0;
+	myy_texture_loader_init(&scene->textures, gl);
+
+	scene->n_cubes = n_cubes ? n_cubes : 1;
+	scene->grid_side = 1;
+	while (scene->grid_side * scene->grid_side * scene->grid_side
+	       < scene->n_cubes)
+	{
+		scene->grid_side++;
+	}
+
+	if (myy_instances_init(&scene->cubes, scene->n_cubes) != 0)
+		goto no_instances;
+
+	uint32_t const side = scene->grid_side;
+	float const half_grid = (side - 1) * 2.0f;
+	/* The cubes spin, so their bounds must hold them
+	 * in any orientation */
+	float const cube_radius = sqrtf(3.0f);
+	for (uint32_t c = 0; c < scene->n_cubes; c++) {
+		uint32_t const gx = c % side;
+		uint32_t const gy = (c / side) % side;
+		uint32_t const gz = c / (side * side);
+		scene->cubes.x[c] = gx * 4.0f - half_grid;
+		scene->cubes.y[c] = gy * 4.0f - half_grid;
+		scene->cubes.z[c] = gz * 4.0f - half_grid;
+		scene->cubes.radius[c]   = cube_radius;
+		scene->cubes.extent_x[c] = cube_radius;
+		scene->cubes.extent_y[c] = cube_radius;
+		scene->cubes.extent_z[c] = cube_radius;
+		scene->cubes.colors[c] = myy_pack_rgba(
+			(uint8_t) (128 + gx * 127 / side),
+			(uint8_t) (128 + gy * 127 / side),
+			(uint8_t) (128 + gz * 127 / side),
+			255);
+	}
+	scene->cubes.count = scene->n_cubes;
+	/* Keep the whole grid in view */
+	scene->camera_distance = 6.0f + 4.0f * scene->grid_side;
+	scene->start_ns = myy_clock_ns();
+
+	myy_scene_resize(scene, width, height);
+	return 0;
+
+no_instances:
+	myy_texture_loader_deinit(&scene->textures);
+no_program:
+	myy_renderer_deinit(&scene->renderer);
+no_renderer:
+	return -1;
+}
+
+static void myy_scene_deinit(struct myy_scene * __restrict const scene)
+{
+	myy_texture_loader_deinit(&scene->textures);
+	if (scene->backdrop_texture)
+		myy_gl_delete_texture(scene->backdrop_texture);
+	myy_instances_free(&scene->cubes);
+	myy_renderer_deinit(&scene->renderer);
+}
+
+/* The current backdrop stays on screen until the new one is
+ * completely uploaded. */
+static bool myy_scene_load_backdrop(
+	struct myy_scene * __restrict const scene,
+	char const * __restrict const source)
+{
+	if (scene->backdrop_program < 0)
+		return false;
+	return myy_texture_loader_request(&scene->textures, source);
+}
+
+/* Draw code here.
+ * Returns true if the scene is animated and wants another frame
+ * right after this one, false if what was drawn will stay valid
+ * until someone marks the scene dirty again.
+ */
+static bool draw(
+	struct myy_scene * __restrict const scene,
+	uint32_t i)
+{
+	struct myy_renderer * __restrict const renderer = &scene->renderer;
+	uint64_t const now_ns =
+		scene->paused ? scene->paused_ns : myy_clock_ns();
+	float const seconds = (now_ns - scene->start_ns) / 1e9f;
+	uint64_t const cube_key = myy_draw_sort_key(
+		scene->color_program, 0,
+		MYY_RENDER_STATE_DEPTH_TEST | MYY_RENDER_STATE_CULL_FACE
+		| MYY_RENDER_STATE_SCISSOR);
+
+	struct myy_mat4 const projection = myy_mat4_perspective(
+		0.8f, scene->aspect_ratio, 0.5f, scene->camera_distance * 3.0f);
+	struct myy_mat4 const view = myy_mat4_model(
+		0.3f, seconds * 0.1f, 0.0f, 0.0f, -scene->camera_distance);
+	struct myy_mat4 const view_projection =
+		myy_mat4_multiply(&projection, &view);
+	bool textures_fenced;
+
+	(void) i;
+	myy_gl_state_frame_begin();
+
+	bool const counting = myy_heap_counting_set(false);
+	GLuint const new_backdrop =
+		myy_texture_loader_frame(&scene->textures, &textures_fenced);
+	if (new_backdrop) {
+		if (scene->backdrop_texture)
+			myy_gl_delete_texture(scene->backdrop_texture);
+		scene->backdrop_texture = new_backdrop;
+	}
+
+	myy_gl_clear_color(0.2f, 0.3f, 0.5f, 1.0f);
+	/* glClear honours the scissor box left by the previous frame */
+	myy_gl_set_capability(MYY_GL_CAP_SCISSOR_TEST, false);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	myy_heap_counting_set(counting);
+
+	myy_renderer_begin(renderer, &view_projection);
+	/* Dim the frozen scene, so that a pause doesn't look like a hang */
+	if (scene->paused)
+		myy_renderer_set_tint(renderer, 0.6f, 0.6f, 0.6f, 1.0f);
+	else
+		myy_renderer_set_tint(renderer, 1.0f, 1.0f, 1.0f, 1.0f);
+	if (scene->backdrop_texture) {
+		struct myy_mat4 const identity = myy_mat4_identity();
+		uint8_t const white[4] = { 255, 255, 255, 255 };
+		myy_renderer_draw_mesh(renderer,
+			myy_draw_sort_key(scene->backdrop_program,
+				scene->backdrop_texture, MYY_RENDER_STATE_DEPTH_TEST),
+			&myy_backdrop_mesh, &identity, white);
+	}
+	if (scene->layer_texture && scene->layer_program >= 0) {
+		struct myy_mat4 const identity = myy_mat4_identity();
+		uint8_t const white[4] = { 255, 255, 255, 255 };
+		myy_renderer_draw_mesh(renderer,
+			myy_draw_sort_key(scene->layer_program,
+				scene->layer_texture, MYY_RENDER_STATE_DEPTH_TEST),
+			&myy_backdrop_mesh, &identity, white);
+	}
+
+	struct myy_instances * __restrict const cubes = &scene->cubes;
+	for (uint32_t c = 0; c < cubes->count; c++) {
+		float const phase = (float) c * 0.37f;
+		struct myy_mat4 const model = myy_mat4_model(
+			seconds * 0.9f + phase, seconds * 1.3f + phase,
+			cubes->x[c], cubes->y[c], cubes->z[c]);
+		myy_instances_set_matrix(cubes, c, &model);
+	}
+
+	struct myy_frustum frustum;
+	myy_frustum_from_matrix(&frustum, &view_projection);
+	myy_instances_cull(cubes, &frustum, MYY_CULL_SPHERES);
+	myy_renderer_draw_instances(renderer, cube_key, &myy_cube_mesh, cubes);
+	myy_renderer_flush(renderer);
+
+	/* Fences are only checked when drawing, so keep drawing
+	 * until the GPU is done with the uploads. */
+	return !scene->paused || textures_fenced;
+}
+
+static void myy_scene_set_paused(
+	struct myy_scene * __restrict const scene,
+	bool const paused)
+{
+	uint64_t const now_ns = myy_clock_ns();
+	if (paused & !scene->paused) {
+		scene->paused_ns = now_ns;
+	}
+	else if (!paused & scene->paused) {
+		/* Resume where we left off */
+		scene->start_ns += now_ns - scene->paused_ns;
+	}
+	scene->paused = paused;
+}
+
+int egl_check_extensions_client(
+	struct myy_egl_caps * __restrict const client_caps)
+{
+	enum myy_egl_extension const required[] = {
+		MYY_EGL_EXT_device_base,
+		MYY_EGL_EXT_device_enumeration,
+		MYY_EGL_EXT_device_query,
+		MYY_EGL_EXT_platform_base,
+		MYY_EGL_EXT_platform_device,
+	};
+
+	myy_egl_caps_parse(client_caps,
+		eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS), "client");
+	return myy_egl_caps_require(
+		client_caps, required, ARRAY_SIZE(required), "client");
+}
+
+/* Device probing.
+ * Every EGL device is probed on its own thread : DRM node, PCI bus,
+ * connected outputs and CRTCs. Opening a DRM node and reading its
+ * connectors can take a while (EDID reads, GPUs waking up), so the
+ * probes overlap, and startup only waits for the slowest one.
+ * The extensions are parsed and listed afterwards, on the main
+ * thread, to keep the logs readable. */
+#define MYY_DEVICE_BUS_ID_LENGTH (32)
+
+struct myy_device_probe {
+	pthread_t thread;
+	bool thread_started;
+	struct myy_nvidia_functions const * nvidia;
+	EGLDeviceEXT device;
+	char const * extensions;
+	struct myy_egl_caps caps;
+	char const * drm_path;
+	char bus_id[MYY_DEVICE_BUS_ID_LENGTH];
+	uint32_t n_connected;
+	uint32_t n_crtcs;
+	uint64_t probe_ns;
+};
+
+/* "0000:01:00.0", from /sys/dev/char/MAJOR:MINOR/device */
+static void myy_drm_bus_id(
+	int const drm_fd,
+	char * __restrict const bus_id,
+	size_t const bus_id_size)
+{
+	struct stat node;
+	char sys_path[64];
+	char device_path[PATH_MAX];
+
+	bus_id[0] = '\0';
+	if (fstat(drm_fd, &node) != 0)
+		return;
+	snprintf(sys_path, sizeof(sys_path), "/sys/dev/char/%u:%u/device",
+		major(node.st_rdev), minor(node.st_rdev));
+	if (realpath(sys_path, device_path) == NULL)
+		return;
+	char const * __restrict const last_slash = strrchr(device_path, '/');
+	char const * __restrict const name =
+		last_slash ? last_slash + 1 : device_path;
+	/* Not a bus ID we know. Better no ID than a truncated one. */
+	size_t const length = strlen(name);
+	if (length >= bus_id_size)
+		return;
+	memcpy(bus_id, name, length + 1);
+}
+
+static void * myy_device_probe_thread(void * user_data)
+{
+	struct myy_device_probe * __restrict const probe = user_data;
+	uint64_t const start = myy_clock_ns();
+
+	probe->extensions = probe->nvidia->eglQueryDeviceString(
+		probe->device, EGL_EXTENSIONS);
+	probe->drm_path = probe->nvidia->eglQueryDeviceString(
+		probe->device, EGL_DRM_DEVICE_FILE_EXT);
+	if (probe->drm_path == NULL)
+		goto out;
+
+	/* Only queries. Read-only is enough, and doesn't look like a
+	 * client that wants to drive the device. */
+	int const drm_fd = open(probe->drm_path, O_RDONLY | O_CLOEXEC);
+	if (drm_fd < 0)
+		goto out;
+
+	myy_drm_bus_id(drm_fd, probe->bus_id, sizeof(probe->bus_id));
+
+	drmModeRes * __restrict const resources = drmModeGetResources(drm_fd);
+	if (resources != NULL) {
+		probe->n_crtcs = resources->count_crtcs;
+		for (int c = 0; c < resources->count_connectors; c++) {
+			drmModeConnector * __restrict const connector =
+				drmModeGetConnector(drm_fd, resources->connectors[c]);
+			if (connector == NULL)
+				continue;
+			probe->n_connected += drm_connector_seems_valid(connector);
+			drmModeFreeConnector(connector);
+		}
+		drmModeFreeResources(resources);
+	}
+	close(drm_fd);
+
+out:
+	probe->probe_ns = myy_clock_ns() - start;
+	return NULL;
+}
+
+/* "01:00.0" matches "0000:01:00.0" */
+static bool myy_bus_id_matches(
+	char const * __restrict const bus_id,
+	char const * __restrict const wanted)
+{
+	size_t const length = strlen(bus_id);
+	size_t const wanted_length = strlen(wanted);
+	return (wanted_length > 0) & (wanted_length <= length)
+		&& strcasecmp(bus_id + length - wanted_length, wanted) == 0;
+}
+
+/* wanted_bus_id can be NULL. The first device that can drive a
+ * connected display is then used. */
+int nvidia_egl_get_device(
+	struct myy_nvidia_functions * __restrict const myy_nvidia,
+	char const * __restrict const wanted_bus_id,
+	EGLDeviceEXT * __restrict const ret_device,
+	struct myy_egl_caps * __restrict const ret_device_caps)
+{
+	int ret = 0;
+	EGLint n_devices, i;
+	EGLDeviceEXT *devices = NULL;
+	struct myy_device_probe * __restrict probes = NULL;
+	EGLDeviceEXT device = EGL_NO_DEVICE_EXT;
+	EGLBoolean egl_ret;
+	int chosen_device = -1;
+	uint64_t const start = myy_clock_ns();
+
+	/* Query how many devices are present. */
+	egl_ret = myy_nvidia->eglQueryDevices(0, NULL, &n_devices);
+
+	if (!egl_ret) {
+		LOGF("Failed to query EGL devices.");
+		goto out;
+	}
+
+	if (n_devices < 1) {
+		LOGF("No EGL devices found.");
+		goto out;
+	}
+
+	/* Allocate memory to store that many EGLDeviceEXTs. */
+	devices = calloc(n_devices, sizeof(EGLDeviceEXT));
+	probes  = calloc(n_devices, sizeof(struct myy_device_probe));
+
+	if (devices == NULL || probes == NULL) {
+		LOGF("Memory allocation failure.");
+		goto could_not_query_devices;
+	}
+
+	/* Query the EGLDeviceEXTs. */
+	egl_ret = myy_nvidia->eglQueryDevices(
+		n_devices, devices, &n_devices);
+
+	if (!egl_ret) {
+		LOGF("Failed to query EGL devices.");
+		goto could_not_query_devices;
+	}
+
+	for (i = 0; i < n_devices; i++) {
+		probes[i].nvidia = myy_nvidia;
+		probes[i].device = devices[i];
+		probes[i].thread_started = (pthread_create(&probes[i].thread,
+			NULL, myy_device_probe_thread, probes + i) == 0);
+		/* Then it'll be the slow way */
+		if (!probes[i].thread_started)
+			myy_device_probe_thread(probes + i);
+	}
+
+	for (i = 0; i < n_devices; i++) {
+		if (probes[i].thread_started)
+			pthread_join(probes[i].thread, NULL);
+	}
+
+	enum myy_egl_extension const checked_extensions[] = {
+		MYY_EGL_EXT_device_drm,
+	};
+
+	int first_connected = -1;
+	int first_usable = -1;
+	int wanted = -1;
+	for (i = 0; i < n_devices; i++) {
+		struct myy_device_probe * __restrict const probe = probes + i;
+		char device_name[32];
+
+		snprintf(device_name, sizeof(device_name),
+			"device %d/%d", i, n_devices);
+		myy_egl_caps_parse(&probe->caps, probe->extensions, device_name);
+		LOGF("\tDRM node %s, bus %s, %u CRTCs, "
+			"%u connected outputs. Probed in %.2f ms",
+			probe->drm_path ? probe->drm_path : "(none)",
+			probe->bus_id[0] ? probe->bus_id : "?",
+			probe->n_crtcs, probe->n_connected, probe->probe_ns / 1e6);
+
+		bool const usable = (myy_egl_caps_require(
+			&probe->caps,
+			checked_extensions, ARRAY_SIZE(checked_extensions),
+			device_name) == 0) & (probe->drm_path != NULL);
+		if (!usable)
+			continue;
+
+		if (wanted_bus_id != NULL && wanted < 0
+		    && myy_bus_id_matches(probe->bus_id, wanted_bus_id))
+			wanted = i;
+		if (first_connected < 0 && probe->n_connected > 0)
+			first_connected = i;
+		if (first_usable < 0)
+			first_usable = i;
+	}
+
+	if (wanted_bus_id != NULL) {
+		chosen_device = wanted;
+		if (wanted < 0)
+			LOG_ERROR("No usable device on bus %s", wanted_bus_id);
+	}
+	else {
+		chosen_device = (first_connected >= 0)
+			? first_connected
+			: first_usable;
+	}
+
+	if (chosen_device >= 0) {
+		device = devices[chosen_device];
+		*ret_device_caps = probes[chosen_device].caps;
+	}
+
+could_not_query_devices:
+	free(probes);
+	free(devices);
+
+	if (chosen_device >= 0) {
+		LOGVF("Using device %d. Probing took %.2f ms",
+			chosen_device, (myy_clock_ns() - start) / 1e6);
+		ret = 0;
+	}
+
+out:
+	*ret_device = device;
+	if (device == EGL_NO_DEVICE_EXT) {
+		fprintf(
+			stderr,
+			"No devices supporting the right EGL extensions "
+			"were found.\n");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* Writes everything, even if the kernel only takes part of it.
+ * The iovecs are modified.
+ * Linux accepts up to 1024 iovecs per call (IOV_MAX). */
+#define MYY_WRITEV_BATCH (512)
+static bool myy_writev_all(
+	int const fd,
+	struct iovec * __restrict iov,
+	int n_iov)
+{
+	while (n_iov > 0) {
+		int const batch = (n_iov > MYY_WRITEV_BATCH) ? MYY_WRITEV_BATCH : n_iov;
+		ssize_t written = writev(fd, iov, batch);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		/* Skip what was written, and fix the partially
+		 * written iovec, if any */
+		while (n_iov > 0 && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			n_iov--;
+		}
+		if (n_iov > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return true;
+}
+
+/* Recorder.
+ * Writes captured frames into a myy_recording.h file.
+ * Tiles are compared with the previous frame, and the changed ones
+ * are compressed by a few worker threads, each taking the next tile
+ * to do until none are left. The frame is then written with one
+ * writev.
+ * Called from the capture writer thread only. */
+#define MYY_RECORDER_TILE_SIZE (64)
+#define MYY_RECORDER_KEYFRAME_INTERVAL (120)
+#define MYY_RECORDER_MAX_WORKERS (4)
+
+struct myy_recorder_tile {
+	uint32_t x, y, width, height;
+	bool stored;
+	struct myy_rec_tile header;
+	uint8_t * data; /* myy_lz_bound(tile bytes) */
+};
+
+struct myy_recorder;
+
+struct myy_recorder_worker {
+	struct myy_recorder * recorder;
+	pthread_t thread;
+	uint8_t * scratch; /* One tile */
+};
+
+struct myy_recorder {
+	int fd;
+	uint32_t width, height;
+	uint32_t n_tiles;
+	uint32_t frames;
+	uint64_t offset;
+	uint8_t * previous; /* Top to bottom, width * 4 bytes rows */
+	struct myy_recorder_tile * tiles;
+	struct iovec * iov;
+
+	struct myy_rec_index_entry * index;
+	uint32_t n_keyframes;
+	uint32_t index_capacity;
+
+	struct myy_recorder_worker workers[MYY_RECORDER_MAX_WORKERS];
+	uint32_t n_workers;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	uint32_t generation;
+	uint32_t workers_done;
+	bool quit;
+	atomic_uint next_tile;
+
+	/* The frame being compressed */
+	uint8_t const * src;
+	ptrdiff_t src_stride;
+	bool keyframe;
+	/* previous no longer matches the file */
+	bool force_keyframe;
+
+	uint64_t raw_bytes;
+};
+
+/* Compares the tile with the previous frame and, if it changed,
+ * compresses its content (keyframes) or its XOR with the previous
+ * content (other frames). The previous frame is updated as we go.
+ * Tiles never overlap, so workers never touch the same bytes. */
+static void myy_recorder_do_tile(
+	struct myy_recorder * __restrict const recorder,
+	struct myy_recorder_tile * __restrict const tile,
+	uint8_t * __restrict const scratch)
+{
+	size_t const row_size = tile->width * 4;
+	size_t const tile_size = row_size * tile->height;
+	size_t const previous_stride = (size_t) recorder->width * 4;
+	uint8_t const * __restrict src =
+		recorder->src + tile->y * recorder->src_stride + tile->x * 4;
+	uint8_t * __restrict previous =
+		recorder->previous + tile->y * previous_stride + tile->x * 4;
+	uint32_t row = 0;
+
+	/* Rows identical to the previous frame give zeroes */
+	if (!recorder->keyframe) {
+		while (row < tile->height && memcmp(src, previous, row_size) == 0) {
+			src += recorder->src_stride;
+			previous += previous_stride;
+			row++;
+		}
+		memset(scratch, 0, row * row_size);
+	}
+
+	tile->stored = (row < tile->height);
+	if (!tile->stored)
+		return;
+
+	for (uint8_t * __restrict out = scratch + row * row_size;
+	     row < tile->height;
+	     row++, out += row_size)
+	{
+		if (recorder->keyframe) {
+			memcpy(out, src, row_size);
+		}
+		else {
+			for (size_t b = 0; b < row_size; b++)
+				out[b] = src[b] ^ previous[b];
+		}
+		memcpy(previous, src, row_size);
+		src += recorder->src_stride;
+		previous += previous_stride;
+	}
+
+	size_t const compressed = myy_lz_compress(
+		scratch, tile_size, tile->data, tile_size - 1);
+	if (compressed) {
+		tile->header.mode = MYY_REC_TILE_LZ;
+		tile->header.size = compressed;
+	}
+	else {
+		memcpy(tile->data, scratch, tile_size);
+		tile->header.mode = MYY_REC_TILE_RAW;
+		tile->header.size = tile_size;
+	}
+}
+
+static void * myy_recorder_worker_thread(void * user_data)
+{
+	struct myy_recorder_worker * __restrict const worker = user_data;
+	struct myy_recorder * __restrict const recorder = worker->recorder;
+	uint32_t generation = 0;
+
+	pthread_mutex_lock(&recorder->lock);
+	while (true) {
+		while (!recorder->quit && recorder->generation == generation)
+			pthread_cond_wait(&recorder->work_cond, &recorder->lock);
+		if (recorder->quit)
+			break;
+		generation = recorder->generation;
+		pthread_mutex_unlock(&recorder->lock);
+
+		uint32_t t;
+		while ((t = atomic_fetch_add(&recorder->next_tile, 1))
+		       < recorder->n_tiles)
+		{
+			myy_recorder_do_tile(recorder, recorder->tiles + t, worker->scratch);
+		}
+
+		pthread_mutex_lock(&recorder->lock);
+		recorder->workers_done++;
+		pthread_cond_signal(&recorder->done_cond);
+	}
+	pthread_mutex_unlock(&recorder->lock);
+
+	return NULL;
+}
+
+static int myy_recorder_open(
+	struct myy_recorder * __restrict const recorder,
+	char const * __restrict const path,
+	uint32_t const width,
+	uint32_t const height)
+{
+	uint32_t const tile_size = MYY_RECORDER_TILE_SIZE;
+	uint32_t const tiles_x = (width  + tile_size - 1) / tile_size;
+	uint32_t const tiles_y = (height + tile_size - 1) / tile_size;
+	long const cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct myy_rec_header const header = {
+		.magic = MYY_REC_MAGIC,
+		.width = width,
+		.height = height,
+		.tile_size = tile_size,
+		.format = MYY_REC_FORMAT_RGBA8,
+		.keyframe_interval = MYY_RECORDER_KEYFRAME_INTERVAL,
+	};
+
+	memset(recorder, 0, sizeof(*recorder));
+	recorder->width   = width;
+	recorder->height  = height;
+	recorder->n_tiles = tiles_x * tiles_y;
+	recorder->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (recorder->fd < 0) {
+		LOG_ERROR("Could not create %s : %m", path);
+		return -1;
+	}
+
+	recorder->previous = calloc((size_t) width * height, 4);
+	recorder->tiles = calloc(recorder->n_tiles, sizeof(*recorder->tiles));
+	recorder->iov = malloc((1 + 2 * recorder->n_tiles) * sizeof(struct iovec));
+	if (!recorder->previous || !recorder->tiles || !recorder->iov)
+		goto no_memory;
+
+	for (uint32_t t = 0; t < recorder->n_tiles; t++) {
+		struct myy_recorder_tile * __restrict const tile = recorder->tiles + t;
+		tile->x = (t % tiles_x) * tile_size;
+		tile->y = (t / tiles_x) * tile_size;
+		tile->width  = (width  - tile->x < tile_size) ? width  - tile->x : tile_size;
+		tile->height = (height - tile->y < tile_size) ? height - tile->y : tile_size;
+		tile->header.index = t;
+		tile->data = malloc(myy_lz_bound(tile_size * tile_size * 4));
+		if (tile->data == NULL)
+			goto no_memory;
+	}
+
+	struct iovec iov = { (void *) &header, sizeof(header) };
+	if (!myy_writev_all(recorder->fd, &iov, 1)) {
+		LOG_ERROR("Could not write into %s : %m", path);
+		goto no_memory;
+	}
+	recorder->offset = sizeof(header);
+
+	pthread_mutex_init(&recorder->lock, NULL);
+	pthread_cond_init(&recorder->work_cond, NULL);
+	pthread_cond_init(&recorder->done_cond, NULL);
+	/* Leave one CPU to the renderer */
+	uint32_t const wanted = (cpus > MYY_RECORDER_MAX_WORKERS)
+		? MYY_RECORDER_MAX_WORKERS
+		: ((cpus > 2) ? cpus - 1 : 1);
+	for (uint32_t w = 0; w < wanted; w++) {
+		struct myy_recorder_worker * __restrict const worker =
+			recorder->workers + w;
+		worker->recorder = recorder;
+		worker->scratch = malloc(tile_size * tile_size * 4);
+		if (worker->scratch == NULL
+		    || pthread_create(&worker->thread, NULL,
+		                      myy_recorder_worker_thread, worker) != 0)
+		{
+			free(worker->scratch);
+			break;
+		}
+		recorder->n_workers++;
+	}
+	if (recorder->n_workers == 0) {
+		LOG_ERROR("Could not start the recorder workers");
+		goto no_workers;
+	}
+
+	LOGF("Recording into %s, %u tiles, %u workers",
+		path, recorder->n_tiles, recorder->n_workers);
+	return 0;
+
+no_workers:
+	pthread_cond_destroy(&recorder->done_cond);
+	pthread_cond_destroy(&recorder->work_cond);
+	pthread_mutex_destroy(&recorder->lock);
+no_memory:
+	if (recorder->tiles) {
+		for (uint32_t t = 0; t < recorder->n_tiles; t++)
+			free(recorder->tiles[t].data);
+	}
+	free(recorder->iov);
+	free(recorder->tiles);
+	free(recorder->previous);
+	close(recorder->fd);
+	recorder->fd = -1;
+	return -1;
+}
+
+/* src points to the first row to record. A negative stride
+ * records an OpenGL read back top to bottom. */
+static int myy_recorder_add_frame(
+	struct myy_recorder * __restrict const recorder,
+	uint8_t const * __restrict const src,
+	ptrdiff_t const src_stride,
+	uint32_t const frame,
+	uint64_t const timestamp_ns)
+{
+	bool const keyframe = recorder->force_keyframe
+		| ((recorder->frames % MYY_RECORDER_KEYFRAME_INTERVAL) == 0);
+	struct myy_rec_frame header = {
+		.magic = MYY_REC_FRAME_MAGIC,
+		.type = keyframe ? MYY_REC_KEYFRAME : MYY_REC_DELTA,
+		.frame = frame,
+		.timestamp_ns = timestamp_ns,
+	};
+
+	if (keyframe && recorder->n_keyframes == recorder->index_capacity) {
+		uint32_t const capacity = recorder->index_capacity
+			? recorder->index_capacity * 2 : 64;
+		struct myy_rec_index_entry * __restrict const index = realloc(
+			recorder->index, capacity * sizeof(*index));
+		if (index == NULL)
+			return -1;
+		recorder->index = index;
+		recorder->index_capacity = capacity;
+	}
+
+	pthread_mutex_lock(&recorder->lock);
+	recorder->src = src;
+	recorder->src_stride = src_stride;
+	recorder->keyframe = keyframe;
+	recorder->workers_done = 0;
+	atomic_store(&recorder->next_tile, 0);
+	recorder->generation++;
+	pthread_cond_broadcast(&recorder->work_cond);
+	while (recorder->workers_done < recorder->n_workers)
+		pthread_cond_wait(&recorder->done_cond, &recorder->lock);
+	pthread_mutex_unlock(&recorder->lock);
+
+	int n_iov = 1;
+	for (uint32_t t = 0; t < recorder->n_tiles; t++) {
+		struct myy_recorder_tile * __restrict const tile = recorder->tiles + t;
+		if (!tile->stored)
+			continue;
+		recorder->iov[n_iov].iov_base = &tile->header;
+		recorder->iov[n_iov].iov_len  = sizeof(tile->header);
+		recorder->iov[n_iov+1].iov_base = tile->data;
+		recorder->iov[n_iov+1].iov_len  = tile->header.size;
+		header.payload_size += sizeof(tile->header) + tile->header.size;
+		header.n_tiles++;
+		n_iov += 2;
+	}
+	recorder->iov[0].iov_base = &header;
+	recorder->iov[0].iov_len  = sizeof(header);
+
+	/* The workers already stored this frame as the reference.
+	 * If it doesn't reach the file, drop what was written of it and
+	 * start again from a keyframe, or every following delta would
+	 * decode against the wrong frame. */
+	if (!myy_writev_all(recorder->fd, recorder->iov, n_iov)) {
+		LOG_ERROR("Could not write the frame %u into the recording : %m",
+			frame);
+		recorder->force_keyframe = true;
+		if (ftruncate(recorder->fd, (off_t) recorder->offset) != 0
+		    || lseek(recorder->fd, (off_t) recorder->offset, SEEK_SET) < 0)
+			LOG_ERROR("Could not drop the partial frame %u : %m", frame);
+		return -1;
+	}
+	recorder->force_keyframe = false;
+
+	if (keyframe) {
+		struct myy_rec_index_entry * __restrict const entry =
+			recorder->index + recorder->n_keyframes++;
+		entry->offset = recorder->offset;
+		entry->timestamp_ns = timestamp_ns;
+		entry->frame = recorder->frames;
+		entry->reserved = 0;
+	}
+	recorder->offset += sizeof(header) + header.payload_size;
+	recorder->raw_bytes += (uint64_t) recorder->width * recorder->height * 4;
+	recorder->frames++;
+	return 0;
+}
+
+/* Writes the index, and closes the file */
+static void myy_recorder_close(struct myy_recorder * __restrict const recorder)
+{
+	struct myy_rec_trailer const trailer = {
+		.magic = MYY_REC_TRAILER_MAGIC,
+		.index_offset = recorder->offset,
+		.n_keyframes = recorder->n_keyframes,
+		.n_frames = recorder->frames,
+	};
+	struct iovec iov[2] = {
+		{ recorder->index, recorder->n_keyframes * sizeof(*recorder->index) },
+		{ (void *) &trailer, sizeof(trailer) },
+	};
+
+	if (recorder->fd < 0)
+		return;
+
+	pthread_mutex_lock(&recorder->lock);
+	recorder->quit = true;
+	pthread_cond_broadcast(&recorder->work_cond);
+	pthread_mutex_unlock(&recorder->lock);
+	for (uint32_t w = 0; w < recorder->n_workers; w++) {
+		pthread_join(recorder->workers[w].thread, NULL);
+		free(recorder->workers[w].scratch);
+	}
+
+	if (!myy_writev_all(recorder->fd, iov, 2) || close(recorder->fd) != 0)
+		LOG_ERROR("Could not finish the recording : %m");
+	else
+		LOGF("Recorded %u frames, %u keyframes. "
+		     "%.1f MiB, from %.1f MiB of pixels",
+			recorder->frames, recorder->n_keyframes,
+			(recorder->offset + iov[0].iov_len + sizeof(trailer)) / 1048576.0,
+			recorder->raw_bytes / 1048576.0);
+
+	for (uint32_t t = 0; t < recorder->n_tiles; t++)
+		free(recorder->tiles[t].data);
+	free(recorder->index);
+	free(recorder->iov);
+	free(recorder->tiles);
+	free(recorder->previous);
+	pthread_cond_destroy(&recorder->done_cond);
+	pthread_cond_destroy(&recorder->work_cond);
+	pthread_mutex_destroy(&recorder->lock);
+	recorder->fd = -1;
+}
+
+/* Frame export.
+ * Captured frames are copied, top to bottom, into a memfd shared
+ * with other processes. See myy_frame_export.h for the protocol and
+ * the reader side.
+ * The memfd is handed to whoever connects to the Unix socket. The
+ * socket is polled by the frame loop.
+ * Publishing is done by the capture writer thread. */
+struct myy_frame_export {
+	bool enabled;
+	int memfd;
+	int listen_fd;
+	uint8_t * map;
+	size_t map_size;
+	struct myy_export_shared * shared;
+	char socket_path[108];
+	uint32_t clients;
+};
+
+static struct myy_frame_export myy_frame_export;
+
+/* Returns a non-blocking socket listening on path, or -1.
+ * A socket left behind by a previous run is replaced. Anything else
+ * living at that path is left alone, and the call fails. */
+static int myy_unix_listen(
+	char const * __restrict const path,
+	int const type,
+	int const backlog)
+{
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	struct stat previous;
+
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		LOG_ERROR("Socket path too long : %s", path);
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+
+	if (lstat(path, &previous) == 0) {
+		if (!S_ISSOCK(previous.st_mode)) {
+			LOG_ERROR("%s exists and is not a socket. Not replacing it.",
+				path);
+			return -1;
+		}
+		unlink(path);
+	}
+
+	int const fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0
+	    || bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0
+	    || listen(fd, backlog) != 0)
+	{
+		LOG_ERROR("Could not listen on %s : %m", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int myy_frame_export_init(
+	struct myy_frame_export * __restrict const export,
+	char const * __restrict const socket_path,
+	uint32_t const width,
+	uint32_t const height)
+{
+	uint32_t const stride = width * 4;
+	size_t const slot_size = myy_export_slot_size(stride, height);
+	size_t const slots_offset = myy_export_slots_offset();
+
+	memset(export, 0, sizeof(*export));
+	export->memfd = -1;
+	export->listen_fd = -1;
+	export->map_size = slots_offset + MYY_EXPORT_SLOTS * slot_size;
+
+	if (strlen(socket_path) >= sizeof(export->socket_path)) {
+		LOG_ERROR("Export socket path too long : %s", socket_path);
+		return -1;
+	}
+	strcpy(export->socket_path, socket_path);
+
+	export->memfd = memfd_create("myy-frame-export",
+		MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (export->memfd < 0) {
+		LOG_ERROR("memfd_create failed : %m");
+		goto error;
+	}
+	/* Readers can then trust the size */
+	if (ftruncate(export->memfd, export->map_size) != 0
+	    || fcntl(export->memfd, F_ADD_SEALS,
+	             F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+	{
+		LOG_ERROR("Could not size the export memfd : %m");
+		goto error;
+	}
+
+	export->map = mmap(NULL, export->map_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, export->memfd, 0);
+	if (export->map == MAP_FAILED) {
+		LOG_ERROR("Could not map the export memfd : %m");
+		export->map = NULL;
+		goto error;
+	}
+
+	export->shared = (struct myy_export_shared *) export->map;
+	export->shared->magic = MYY_EXPORT_MAGIC;
+	export->shared->version = MYY_EXPORT_VERSION;
+	export->shared->width = width;
+	export->shared->height = height;
+	export->shared->stride = stride;
+	export->shared->format = MYY_EXPORT_FORMAT_RGBA8;
+	export->shared->n_slots = MYY_EXPORT_SLOTS;
+	export->shared->slot_size = slot_size;
+	export->shared->slots_offset = slots_offset;
+	atomic_init(&export->shared->published, 0);
+
+	export->listen_fd = myy_unix_listen(socket_path, SOCK_STREAM, 8);
+	if (export->listen_fd < 0)
+		goto error;
+
+	LOGF("Exporting %ux%u frames through %s", width, height, socket_path);
+	export->enabled = true;
+	return 0;
+
+error:
+	if (export->listen_fd >= 0)
+		close(export->listen_fd);
+	if (export->map != NULL)
+		munmap(export->map, export->map_size);
+	if (export->memfd >= 0)
+		close(export->memfd);
+	memset(export, 0, sizeof(*export));
+	return -1;
+}
+
+/* Sends size bytes of data, with fd attached (SCM_RIGHTS).
+ * Also used by the compositor mode. */
+static bool myy_send_fd(
+	int const socket_fd,
+	int const fd,
+	void const * __restrict const data,
+	size_t const size)
+{
+	struct iovec iov = { (void *) data, size };
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = sizeof(control.buffer),
+	};
+
+	memset(&control, 0, sizeof(control));
+	struct cmsghdr * __restrict const cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	return sendmsg(socket_fd, &message, MSG_NOSIGNAL) == (ssize_t) size;
+}
+
+/* Receives size bytes, and up to max_fds fds attached to them
+ * (SCM_RIGHTS). The fds can come in several control messages. Extra
+ * fds are closed.
+ * Returns the number of fds received, or -1 if the message is
+ * incomplete or the peer is gone. */
+static int myy_receive_fds(
+	int const socket_fd,
+	void * __restrict const data,
+	size_t const size,
+	int * __restrict const fds,
+	uint32_t const max_fds)
+{
+	struct iovec iov = { data, size };
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int) * 4)];
+	} control;
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = CMSG_SPACE(sizeof(int) * max_fds),
+	};
+	int n_fds = 0;
+
+	assert(max_fds <= 4);
+	ssize_t const received =
+		recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+
+	for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&message);
+	     received > 0 && cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&message, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		uint32_t const n_attached =
+			(cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (uint32_t a = 0; a < n_attached; a++) {
+			int attached;
+			memcpy(&attached, CMSG_DATA(cmsg) + a * sizeof(int),
+				sizeof(int));
+			if ((uint32_t) n_fds < max_fds)
+				fds[n_fds++] = attached;
+			else
+				close(attached);
+		}
+	}
+
+	if (received != (ssize_t) size) {
+		for (int f = 0; f < n_fds; f++)
+			close(fds[f]);
+		return -1;
+	}
+	return n_fds;
+}
+
+/* Frame loop source. Hands the memfd to every new client. */
+static void myy_frame_export_source_cb(
+	int const fd,
+	short const revents,
+	void * const user_data)
+{
+	struct myy_frame_export * __restrict const export = user_data;
+	int client;
+
+	(void) revents;
+	while ((client = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		char const byte = 0;
+		if (myy_send_fd(client, export->memfd, &byte, 1))
+			export->clients++;
+		else
+			LOG_ERROR("Could not send the frames memfd : %m");
+		close(client);
+	}
+}
+
+/* src points to the first row to export. Negative strides flip. */
+static void myy_frame_export_publish(
+	struct myy_frame_export * __restrict const export,
+	uint8_t const * __restrict src,
+	ptrdiff_t const src_stride,
+	uint32_t const frame,
+	uint64_t const timestamp_ns)
+{
+	struct myy_export_shared * __restrict const shared = export->shared;
+	uint32_t const published =
+		atomic_load_explicit(&shared->published, memory_order_relaxed);
+	/* The oldest frame goes away */
+	uint32_t const slot_index = published % shared->n_slots;
+	struct myy_export_slot * __restrict const slot = shared->slots + slot_index;
+	uint8_t * __restrict dst =
+		export->map + shared->slots_offset + slot_index * shared->slot_size;
+	uint32_t const sequence =
+		atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+
+	atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	for (uint32_t row = 0; row < shared->height; row++) {
+		memcpy(dst, src, shared->stride);
+		dst += shared->stride;
+		src += src_stride;
+	}
+	slot->frame = frame;
+	slot->timestamp_ns = timestamp_ns;
+
+	atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+	atomic_store_explicit(&shared->published, published + 1, memory_order_release);
+	/* Not FUTEX_PRIVATE : the readers are other processes */
+	syscall(SYS_futex, &shared->published, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void myy_frame_export_deinit(
+	struct myy_frame_export * __restrict const export)
+{
+	if (!export->enabled)
+		return;
+
+	/* Readers keep their own mapping. They just stop receiving
+	 * new frames. */
+	LOGF("Export : %u frames published, %u clients served",
+		atomic_load(&export->shared->published), export->clients);
+	close(export->listen_fd);
+	unlink(export->socket_path);
+	munmap(export->map, export->map_size);
+	close(export->memfd);
+	memset(export, 0, sizeof(*export));
+}
+
+/* Render/scanout split.
+ * On multi-GPU machines, the scene can be rendered on one GPU
+ * (--render-device) while another one, the one driving the display,
+ * only scans the frames out.
+ * The render device draws into a pbuffer. Frames come back through
+ * the asynchronous capture, and its writer thread converts them into
+ * two dumb buffers of the display device, flipped with atomic
+ * commits. The commit blocks the writer thread until the vblank,
+ * not the render thread. The render thread is throttled instead
+ * (myy_scanout_throttle), so that it doesn't draw frames the display
+ * would never show.
+ * The hop, from the frame being queued for readback to its flip, is
+ * reported by the telemetry. */
+#define MYY_SCANOUT_BUFFERS (2)
+/* Never wait longer than that for the display */
+#define MYY_SCANOUT_THROTTLE_MS (100)
+
+struct myy_scanout {
+	bool enabled;
+	myy_drm_infos_t * drm;
+	struct myy_drm_dumb_buffer buffers[MYY_SCANOUT_BUFFERS];
+	uint32_t back;
+	/* Its own request. The pool of the DRM infos belongs to the
+	 * main thread. */
+	drmModeAtomicReqPtr request;
+	/* Written by the capture writer thread */
+	_Atomic uint32_t flips;
+	_Atomic uint32_t failed;
+	/* Futex word. Frames flipped or failed. */
+	_Atomic uint32_t presented;
+	_Atomic uint64_t hop_ns_total;
+	_Atomic uint64_t hop_ns_max;
+};
+
+static struct myy_scanout myy_scanout;
+
+/* The display device must be set up (nvidia_prepare_drm_for_streams) */
+static int myy_scanout_init(
+	struct myy_scanout * __restrict const scanout,
+	myy_drm_infos_t * __restrict const drm)
+{
+	memset(scanout, 0, sizeof(*scanout));
+	scanout->drm = drm;
+
+	scanout->request = drmModeAtomicAlloc();
+	if (scanout->request == NULL) {
+		LOG_ERROR("Could not allocate the scanout atomic request");
+		return -1;
+	}
+
+	for (uint32_t b = 0; b < MYY_SCANOUT_BUFFERS; b++) {
+		if (!drm_dumb_buffer_create(drm->fd, drm->width, drm->height,
+			DRM_FORMAT_XRGB8888, true, scanout->buffers + b))
+		{
+			LOG_ERROR("Could not allocate the scanout buffers");
+			goto no_buffers;
+		}
+	}
+
+	scanout->enabled = true;
+	return 0;
+
+no_buffers:
+	for (uint32_t b = 0; b < MYY_SCANOUT_BUFFERS; b++)
+		drm_dumb_buffer_destroy(drm->fd, scanout->buffers + b);
+	drmModeAtomicFree(scanout->request);
+	scanout->request = NULL;
+	return -1;
+}
+
+/* Capture writer thread.
+ * src points to the top row, RGBA. Negative strides flip. */
+static void myy_scanout_present(
+	struct myy_scanout * __restrict const scanout,
+	uint8_t const * __restrict const src,
+	ptrdiff_t const src_stride,
+	uint64_t const frame_time_ns)
+{
+	myy_drm_infos_t * __restrict const drm = scanout->drm;
+	struct myy_drm_dumb_buffer * __restrict const back =
+		scanout->buffers + scanout->back;
+
+	myy_convert_swizzle(src, src_stride, back->map, back->pitch,
+		drm->width, drm->height);
+
+	/* No myy_set_atomic_add_prop here. Logging every frame would
+	 * cost more than the commit itself. */
+	drmModeAtomicSetCursor(scanout->request, 0);
+	drmModeAtomicAddProperty(scanout->request, drm->plane_id,
+		drm->props_ids.plane.fb_id, back->fb_id);
+	if (myy_drm_atomic_commit(drm, scanout->request, 0, NULL) != 0) {
+		atomic_fetch_add(&scanout->failed, 1);
+		goto presented;
+	}
+
+	uint64_t const hop_ns = myy_clock_ns() - frame_time_ns;
+	uint64_t max_ns = atomic_load(&scanout->hop_ns_max);
+	while (hop_ns > max_ns
+	       && !atomic_compare_exchange_weak(&scanout->hop_ns_max,
+			&max_ns, hop_ns));
+	atomic_fetch_add(&scanout->hop_ns_total, hop_ns);
+	atomic_fetch_add(&scanout->flips, 1);
+	scanout->back = (scanout->back + 1) % MYY_SCANOUT_BUFFERS;
+
+presented:
+	atomic_fetch_add_explicit(&scanout->presented, 1, memory_order_release);
+	syscall(SYS_futex, &scanout->presented, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Once the capture writer thread is gone */
+static void myy_scanout_deinit(struct myy_scanout * __restrict const scanout)
+{
+	if (!scanout->enabled)
+		return;
+
+	uint32_t const flips = atomic_load(&scanout->flips);
+	LOGF("Scanout : %u frames flipped, %u failed, hop %.2f ms on average",
+		flips, atomic_load(&scanout->failed),
+		flips ? atomic_load(&scanout->hop_ns_total) / (flips * 1e6) : 0.0);
+	for (uint32_t b = 0; b < MYY_SCANOUT_BUFFERS; b++)
+		drm_dumb_buffer_destroy(scanout->drm->fd, scanout->buffers + b);
+	drmModeAtomicFree(scanout->request);
+	memset(scanout, 0, sizeof(*scanout));
+}
+
+/* Writeback.
+ * Some KMS drivers (vkms, and a few display engines of SoCs) expose
+ * writeback connectors : routed to a CRTC, they write the output of
+ * the CRTC, every plane composed, into a framebuffer.
+ * With --writeback, the capture uses one instead of reading the GL
+ * frames back. Each captured frame is a writeback job, queued with
+ * a non-blocking commit (WRITEBACK_FB_ID), and an out-fence
+ * (WRITEBACK_OUT_FENCE_PTR) that the capture polls, like the GL
+ * fences. The GPU is not involved at all, and the overlays (video,
+ * client buffers) are captured too.
+ * A job writes what the CRTC scans out at the next vblank : usually
+ * the frame before the one just drawn.
+ * With a render device, the connector is the one of the display
+ * device. The scanout keeps its GL readback, and the writeback gets
+ * its own capture (myy_writeback_capture), a few frames behind.
+ */
+#define MYY_WRITEBACK_TIMEOUT_MS (100)
+
+struct myy_writeback {
+	bool enabled;
+	myy_drm_infos_t * drm;
+	uint32_t connector_id;
+	struct {
+		uint32_t crtc_id;
+		uint32_t fb_id;
+		uint32_t out_fence_ptr;
+	} props;
+	uint32_t fourcc;
+	/* Byte order of fourcc, in memory */
+	enum myy_pixel_order order;
+	uint32_t jobs;
+	uint32_t busy;
+};
+
+static struct myy_writeback myy_writeback;
+
+/* Routes the writeback connector to our CRTC, or away from it with
+ * crtc_id 0. Changing the routing is a modeset, so this is done once,
+ * with a blocking commit. */
+static int myy_writeback_route(
+	struct myy_writeback * __restrict const writeback,
+	uint32_t const crtc_id)
+{
+	myy_drm_infos_t * __restrict const drm = writeback->drm;
+	struct myy_drm_atomic_slot * __restrict const slot =
+		myy_drm_atomic_get(drm);
+	if (slot == NULL)
+		return -1;
+
+	myy_set_atomic_add_prop(slot->request, writeback->connector_id,
+		writeback->props.crtc_id, crtc_id);
+	int const ret = myy_drm_atomic_commit(drm, slot->request,
+		DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	myy_drm_atomic_put(drm, slot);
+	if (ret != 0) {
+		LOG_ERROR("Could not route the writeback connector : %s",
+			strerror(-ret));
+		return -1;
+	}
+	return 0;
+}
+
+/* The CRTC must be running (nvidia_prepare_drm_for_streams) */
+static int myy_writeback_init(
+	struct myy_writeback * __restrict const writeback,
+	myy_drm_infos_t * __restrict const drm)
+{
+	uint32_t const connector_id = drm->writeback_connector_id;
+	struct myy_kms_prop_id const connector_props[] = {
+		{ "CRTC_ID",                 &writeback->props.crtc_id       },
+		{ "WRITEBACK_FB_ID",         &writeback->props.fb_id         },
+		{ "WRITEBACK_OUT_FENCE_PTR", &writeback->props.out_fence_ptr },
+	};
+	/* RGBX order first : what the capture writers take as is */
+	static uint32_t const preferred[] = {
+		DRM_FORMAT_XBGR8888, DRM_FORMAT_ABGR8888,
+		DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888,
+	};
+	drmModePropertyBlobRes * __restrict blob = NULL;
+	int formats_found = 0;
+	char fourcc_name[5];
+
+	memset(writeback, 0, sizeof(*writeback));
+	writeback->drm = drm;
+	writeback->connector_id = connector_id;
+
+	if (connector_id == 0) {
+		LOG_ERROR("No writeback connector reaches our CRTC");
+		return -1;
+	}
+
+	if (!myy_drm_kms_get_prop_ids(drm->fd, connector_id,
+		DRM_MODE_OBJECT_CONNECTOR, connector_props,
+		ARRAY_SIZE(connector_props)))
+		return -1;
+
+	uint64_t const blob_id = drm_get_property(drm->fd, connector_id,
+		DRM_MODE_OBJECT_CONNECTOR, "WRITEBACK_PIXEL_FORMATS",
+		&formats_found);
+	if (formats_found)
+		blob = drmModeGetPropertyBlob(drm->fd, (uint32_t) blob_id);
+	if (blob != NULL) {
+		uint32_t const * __restrict const formats = blob->data;
+		uint32_t const n_formats = blob->length / sizeof(uint32_t);
+		for (uint32_t p = 0; p < ARRAY_SIZE(preferred); p++) {
+			for (uint32_t f = 0; f < n_formats; f++) {
+				if (formats[f] == preferred[p])
+					writeback->fourcc = preferred[p];
+			}
+			if (writeback->fourcc)
+				break;
+		}
+		drmModeFreePropertyBlob(blob);
+	}
+
+	if (writeback->fourcc == 0) {
+		LOG_ERROR("The writeback connector can't write 32 bits RGB");
+		return -1;
+	}
+	writeback->order = ((writeback->fourcc == DRM_FORMAT_XBGR8888)
+		| (writeback->fourcc == DRM_FORMAT_ABGR8888))
+		? MYY_PIXELS_RGBX : MYY_PIXELS_BGRX;
+
+	if (myy_writeback_route(writeback, drm->crtc_id) != 0)
+		return -1;
+
+	myy_fourcc_to_str(writeback->fourcc, fourcc_name);
+	LOGF("Capturing through the writeback connector %u, as %s",
+		connector_id, fourcc_name);
+	writeback->enabled = true;
+	return 0;
+}
+
+/* Render thread. Asks the CRTC to write its next frame into fb_id.
+ * Returns the out-fence, signaled once the frame is written, or -1. */
+static int myy_writeback_queue(
+	struct myy_writeback * __restrict const writeback,
+	uint32_t const fb_id)
+{
+	myy_drm_infos_t * __restrict const drm = writeback->drm;
+	int32_t out_fence = -1;
+	struct myy_drm_atomic_slot * __restrict const slot =
+		myy_drm_atomic_get(drm);
+	if (slot == NULL)
+		return -1;
+
+	/* Not myy_set_atomic_add_prop : one job per captured frame.
+	 * The kernel writes the fence fd while committing. */
+	drmModeAtomicReq * __restrict const req = slot->request;
+	drmModeAtomicAddProperty(req, writeback->connector_id,
+		writeback->props.crtc_id, drm->crtc_id);
+	drmModeAtomicAddProperty(req, writeback->connector_id,
+		writeback->props.fb_id, fb_id);
+	drmModeAtomicAddProperty(req, writeback->connector_id,
+		writeback->props.out_fence_ptr, (uint64_t) (uintptr_t) &out_fence);
+	int const ret = myy_drm_atomic_commit(drm, req,
+		DRM_MODE_ATOMIC_NONBLOCK, NULL);
+	myy_drm_atomic_put(drm, slot);
+
+	if (ret != 0) {
+		/* A flip is still pending on the CRTC */
+		if (ret == -EBUSY)
+			writeback->busy++;
+		else
+			LOG_ERROR("Could not queue the writeback job : %s",
+				strerror(-ret));
+		return -1;
+	}
+
+	writeback->jobs++;
+	return out_fence;
+}
+
+/* Once the capture is done with the buffers */
+static void myy_writeback_deinit(
+	struct myy_writeback * __restrict const writeback)
+{
+	if (!writeback->enabled)
+		return;
+
+	myy_writeback_route(writeback, 0);
+	LOGF("Writeback : %u jobs, %u refused (flip pending)",
+		writeback->jobs, writeback->busy);
+	memset(writeback, 0, sizeof(*writeback));
+}
+
+/* Frame capture.
+ *
+ * glReadPixels into client memory waits for the GPU to finish the
+ * frame, then copies it, while the render thread sits there doing
+ * nothing. Not something to do every frame.
+ *
+ * With OpenGL ES 3.x, pixels can be read into a pixel pack buffer
+ * instead. glReadPixels then only queues a copy and returns.
+ * A fence is inserted right after it, and checked on the following
+ * frames without waiting. Once signaled, the buffer is mapped and
+ * handed, as is, to the writer thread, which writes it into a PAM
+ * file with one big writev (rows are flipped through the iovecs, no
+ * copy involved). Once written, the buffer is unmapped and reused.
+ *
+ * The buffers form a small ring. If every buffer is still busy when
+ * a frame should be captured, that frame is dropped, instead of
+ * waiting : captures never change the frame pacing.
+ *
+ * Without ES 3.x, the capture falls back to a synchronous
+ * glReadPixels, with a warning, since that one DOES stall.
+ *
+ * With a writeback connector (see myy_writeback), the slots are dumb
+ * buffers written by the display engine, and the out-fences replace
+ * the GL fences.
+ */
+#define MYY_CAPTURE_RING (4)
+/* Rows converted at once by the RGB24 capture path */
+#define MYY_CAPTURE_BAND_ROWS (16)
+
+/* PAM files are written straight from the mapped buffers.
+ * The other formats are raw frames, for encoders and QA tools,
+ * converted by the writer thread. YUV frames use BT.709. */
+enum myy_capture_format {
+	MYY_CAPTURE_PAM,
+	MYY_CAPTURE_RGB24,
+	MYY_CAPTURE_NV12,
+	MYY_CAPTURE_I420,
+	MYY_CAPTURE_RECORDING,
+	MYY_CAPTURE_FORMATS
+};
+
+static char const * const myy_capture_format_names[MYY_CAPTURE_FORMATS] = {
+	[MYY_CAPTURE_PAM]   = "pam",
+	[MYY_CAPTURE_RGB24] = "rgb24",
+	[MYY_CAPTURE_NV12]  = "nv12",
+	[MYY_CAPTURE_I420]  = "i420",
+	[MYY_CAPTURE_RECORDING] = "rec",
+};
+#define MYY_GL_PIXEL_PACK_BUFFER (0x88EB)
+#define MYY_GL_STREAM_READ (0x88E1)
+
+enum myy_capture_slot_state {
+	MYY_CAPTURE_SLOT_FREE,
+	MYY_CAPTURE_SLOT_READING, /* Waiting for the GPU */
+	MYY_CAPTURE_SLOT_WRITING, /* Owned by the writer thread */
+	MYY_CAPTURE_SLOT_WRITTEN, /* Waiting to be unmapped */
+};
+
+struct myy_capture_slot {
+	enum myy_capture_slot_state state;
+	uint32_t frame;
+	uint64_t time_ns;
+	GLuint pbo;
+	GLsync fence;
+	uint8_t * pixels; /* Mapped, or client memory without PBOs */
+	/* Top row of pixels. GL rows go bottom to top. */
+	uint8_t const * top_row;
+	ptrdiff_t stride;
+	/* Writeback only */
+	struct myy_drm_dumb_buffer buffer;
+	int out_fence;
+};
+
+struct myy_capture {
+	bool enabled;
+	bool use_pbo;
+	uint32_t every;
+	uint32_t width, height;
+	char dir[256];
+	bool write_files;
+	enum myy_capture_format format;
+	struct myy_frame_export * export;
+	struct myy_scanout * scanout;
+	struct myy_writeback * writeback;
+	uint8_t * converted; /* Writer thread only */
+	/* Writer thread only. Writeback frames in B,G,R,X order are
+	 * swizzled there first, unless written as raw frames. */
+	uint8_t * swizzled;
+	size_t converted_size;
+	struct myy_recorder recorder;
+	struct myy_capture_slot slots[MYY_CAPTURE_RING];
+
+	PFNGLMAPBUFFERRANGEEXTPROC glMapBufferRange;
+	PFNGLUNMAPBUFFEROESPROC glUnmapBuffer;
+	PFNGLFENCESYNCAPPLEPROC glFenceSync;
+	PFNGLCLIENTWAITSYNCAPPLEPROC glClientWaitSync;
+	PFNGLDELETESYNCAPPLEPROC glDeleteSync;
+
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool quit;
+
+	uint32_t captured;
+	uint32_t dropped;
+	uint32_t written;
+	uint32_t failed;
+};
+
+static struct myy_capture myy_capture;
+/* With --render-device and --writeback, myy_capture only feeds the
+ * scanout. This one captures, through the writeback connector of the
+ * display device, what the scanout shows, for the files and the
+ * export. */
+static struct myy_capture myy_writeback_capture;
+
+/* Converts the frame, flipped, and writes it as one raw block */
+static bool myy_capture_write_converted(
+	struct myy_capture const * __restrict const capture,
+	uint8_t const * __restrict const top_row,
+	ptrdiff_t const stride,
+	enum myy_pixel_order const order,
+	int const fd)
+{
+	uint32_t const width = capture->width;
+	uint32_t const height = capture->height;
+	ptrdiff_t const scratch_stride = (ptrdiff_t) width * 4;
+	struct myy_yuv420_image image;
+
+	switch (capture->format) {
+	case MYY_CAPTURE_RGB24:
+		/* The RGB24 kernel takes B,G,R,X, like writeback frames */
+		if (order == MYY_PIXELS_BGRX) {
+			myy_convert_xrgb_to_rgb24(top_row, stride,
+				capture->converted, (ptrdiff_t) width * 3, width, height);
+			break;
+		}
+		/* Rendered frames are swizzled into a scratch band first,
+		 * small enough to stay in the cache. */
+		for (uint32_t row = 0; row < height; row += MYY_CAPTURE_BAND_ROWS) {
+			uint8_t * __restrict const scratch =
+				capture->converted + capture->converted_size;
+			uint32_t const rows = (height - row < MYY_CAPTURE_BAND_ROWS)
+				? height - row : MYY_CAPTURE_BAND_ROWS;
+			myy_convert_swizzle(top_row + row * stride, stride,
+				scratch, scratch_stride, width, rows);
+			myy_convert_xrgb_to_rgb24(scratch, scratch_stride,
+				capture->converted + (size_t) row * width * 3,
+				(ptrdiff_t) width * 3, width, rows);
+		}
+		break;
+	case MYY_CAPTURE_NV12:
+	case MYY_CAPTURE_I420:
+		myy_yuv420_image_layout(&image,
+			(capture->format == MYY_CAPTURE_NV12)
+			? MYY_YUV420_NV12 : MYY_YUV420_I420,
+			capture->converted, width, height);
+		myy_convert_to_yuv420(top_row, stride, order,
+			MYY_YUV_BT709, width, height, &image);
+		break;
+	default:
+		return false;
+	}
+
+	struct iovec iov = { capture->converted, capture->converted_size };
+	return myy_writev_all(fd, &iov, 1);
+}
+
+static bool myy_capture_write_slot(
+	struct myy_capture const * __restrict const capture,
+	struct myy_capture_slot const * __restrict const slot,
+	uint8_t const * __restrict const top_row,
+	ptrdiff_t const stride,
+	enum myy_pixel_order const order)
+{
+	char path[300];
+	char header[128];
+	uint32_t const height = capture->height;
+	size_t const row_size = (size_t) capture->width * 4;
+	bool written = false;
+	struct iovec * __restrict const iov =
+		malloc((height + 1) * sizeof(struct iovec));
+
+	if (iov == NULL)
+		return false;
+
+	snprintf(path, sizeof(path), "%s/frame-%08u.%s",
+		capture->dir, slot->frame, myy_capture_format_names[capture->format]);
+	int const header_size = snprintf(header, sizeof(header),
+		"P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\n"
+		"TUPLTYPE RGB_ALPHA\nENDHDR\n",
+		capture->width, height);
+
+	/* Image files go top to bottom */
+	iov[0].iov_base = header;
+	iov[0].iov_len  = header_size;
+	for (uint32_t row = 0; row < height; row++) {
+		iov[row+1].iov_base = (void *) (top_row + row * stride);
+		iov[row+1].iov_len  = row_size;
+	}
+
+	int const fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		written = (capture->format == MYY_CAPTURE_PAM)
+			? myy_writev_all(fd, iov, height + 1)
+			: myy_capture_write_converted(
+				capture, top_row, stride, order, fd);
+		written &= (close(fd) == 0);
+	}
+	if (!written)
+		LOG_ERROR("Could not write %s : %m", path);
+
+	free(iov);
+	return written;
+}
+
+static void * myy_capture_writer_thread(void * user_data)
+{
+	struct myy_capture * __restrict const capture = user_data;
+
+	pthread_mutex_lock(&capture->lock);
+	while (true) {
+		struct myy_capture_slot * __restrict slot = NULL;
+		for (uint32_t s = 0; s < MYY_CAPTURE_RING; s++) {
+			struct myy_capture_slot * __restrict const candidate =
+				capture->slots + s;
+			if (candidate->state == MYY_CAPTURE_SLOT_WRITING
+			    && (slot == NULL || candidate->frame < slot->frame))
+			{
+				slot = candidate;
+			}
+		}
+
+		if (slot == NULL) {
+			/* Leave only once everything is written */
+			if (capture->quit)
+				break;
+			pthread_cond_wait(&capture->cond, &capture->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&capture->lock);
+		uint8_t const * __restrict top_row = slot->top_row;
+		ptrdiff_t stride = slot->stride;
+		enum myy_pixel_order order = MYY_PIXELS_RGBX;
+		bool written = true;
+		/* The raw formats convert from B,G,R,X directly.
+		 * Everything else wants R,G,B,A. */
+		bool const needs_rgba =
+			(capture->scanout != NULL) | (capture->export != NULL)
+			| (capture->write_files
+			   & ((capture->format == MYY_CAPTURE_PAM)
+			      | (capture->format == MYY_CAPTURE_RECORDING)));
+		if (capture->swizzled != NULL && !needs_rgba)
+			order = MYY_PIXELS_BGRX;
+		else if (capture->swizzled != NULL) {
+			myy_convert_swizzle(top_row, stride,
+				capture->swizzled, capture->width * 4,
+				capture->width, capture->height);
+			top_row = capture->swizzled;
+			stride  = capture->width * 4;
+		}
+		if (capture->scanout != NULL) {
+			myy_scanout_present(capture->scanout,
+				top_row, stride, slot->time_ns);
+		}
+		if (capture->export != NULL) {
+			myy_frame_export_publish(capture->export,
+				top_row, stride, slot->frame, slot->time_ns);
+		}
+		if (capture->write_files) {
+			written = (capture->format == MYY_CAPTURE_RECORDING)
+				? myy_recorder_add_frame(&capture->recorder,
+					top_row, stride, slot->frame, slot->time_ns) == 0
+				: myy_capture_write_slot(
+					capture, slot, top_row, stride, order);
+		}
+		pthread_mutex_lock(&capture->lock);
+
+		capture->written += written;
+		capture->failed  += !written;
+		slot->state = MYY_CAPTURE_SLOT_WRITTEN;
+	}
+	pthread_mutex_unlock(&capture->lock);
+
+	return NULL;
+}
+
+/* What the writer thread needs to write the files */
+static int myy_capture_files_init(struct myy_capture * __restrict const capture)
+{
+	uint32_t const width = capture->width;
+	uint32_t const height = capture->height;
+	struct myy_yuv420_image layout;
+
+	/* Before the recorder opens its file in there */
+	if (!myy_mkdir_p(capture->dir)) {
+		LOG_ERROR("Could not create the capture directory %s : %m",
+			capture->dir);
+		return -1;
+	}
+
+	switch (capture->format) {
+	case MYY_CAPTURE_RGB24:
+		capture->converted_size = (size_t) width * height * 3;
+		break;
+	case MYY_CAPTURE_NV12:
+	case MYY_CAPTURE_I420:
+		if ((width | height) & 1) {
+			LOG_ERROR("%ux%u frames cannot be captured as YUV 4:2:0",
+				width, height);
+			return -1;
+		}
+		capture->converted_size = myy_yuv420_image_layout(
+			&layout, MYY_YUV420_NV12, NULL, width, height);
+		break;
+	case MYY_CAPTURE_RECORDING: {
+		char path[300];
+		snprintf(path, sizeof(path), "%s/capture.myyrec", capture->dir);
+		return myy_recorder_open(&capture->recorder, path, width, height);
+	}
+	default:
+		break;
+	}
+
+	if (capture->converted_size) {
+		/* + one scratch band */
+		capture->converted = malloc(capture->converted_size
+			+ (size_t) width * 4 * MYY_CAPTURE_BAND_ROWS);
+		if (capture->converted == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+/* Render thread, with the render context current. */
+static int myy_capture_init(
+	struct myy_capture * __restrict const capture,
+	uint32_t const every,
+	char const * __restrict const dir,
+	enum myy_capture_format const format,
+	bool const write_files,
+	struct myy_frame_export * __restrict const export,
+	struct myy_scanout * __restrict const scanout,
+	struct myy_writeback * __restrict const writeback,
+	uint32_t const width,
+	uint32_t const height)
+{
+	size_t const frame_size = (size_t) width * height * 4;
+	char const * __restrict const gl_version =
+		(char const *) glGetString(GL_VERSION);
+
+	memset(capture, 0, sizeof(*capture));
+	capture->recorder.fd = -1;
+	if (every == 0)
+		return 0;
+
+	capture->every  = every;
+	capture->width  = width;
+	capture->height = height;
+	capture->format = format;
+	capture->write_files = write_files;
+	capture->export = export;
+	capture->scanout = scanout;
+	capture->writeback = writeback;
+	snprintf(capture->dir, sizeof(capture->dir), "%s", dir ? dir : ".");
+	if (write_files && myy_capture_files_init(capture) != 0)
+		goto no_dir;
+
+	capture->glMapBufferRange = (PFNGLMAPBUFFERRANGEEXTPROC)
+		eglGetProcAddress("glMapBufferRange");
+	capture->glUnmapBuffer = (PFNGLUNMAPBUFFEROESPROC)
+		eglGetProcAddress("glUnmapBuffer");
+	capture->glFenceSync = (PFNGLFENCESYNCAPPLEPROC)
+		eglGetProcAddress("glFenceSync");
+	capture->glClientWaitSync = (PFNGLCLIENTWAITSYNCAPPLEPROC)
+		eglGetProcAddress("glClientWaitSync");
+	capture->glDeleteSync = (PFNGLDELETESYNCAPPLEPROC)
+		eglGetProcAddress("glDeleteSync");
+
+	capture->use_pbo =
+		(writeback == NULL)
+		&& (gl_version != NULL)
+		&& (strncmp(gl_version, "OpenGL ES 3", 11) == 0)
+		&& capture->glMapBufferRange && capture->glUnmapBuffer
+		&& capture->glFenceSync && capture->glClientWaitSync
+		&& capture->glDeleteSync;
+
+	for (uint32_t s = 0; s < MYY_CAPTURE_RING; s++) {
+		struct myy_capture_slot * __restrict const slot = capture->slots + s;
+		slot->out_fence = -1;
+		if (writeback != NULL) {
+			if (!drm_dumb_buffer_create(writeback->drm->fd, width, height,
+				writeback->fourcc, true, &slot->buffer))
+				goto no_buffers;
+			slot->pixels  = slot->buffer.map;
+			slot->top_row = slot->buffer.map;
+			slot->stride  = slot->buffer.pitch;
+		}
+		else if (capture->use_pbo) {
+			glGenBuffers(1, &slot->pbo);
+			glBindBuffer(MYY_GL_PIXEL_PACK_BUFFER, slot->pbo);
+			glBufferData(MYY_GL_PIXEL_PACK_BUFFER, frame_size, NULL,
+				MYY_GL_STREAM_READ);
+		}
+		else {
+			slot->pixels = malloc(frame_size);
+			if (slot->pixels == NULL)
+				goto no_buffers;
+		}
+	}
+	if (capture->use_pbo)
+		glBindBuffer(MYY_GL_PIXEL_PACK_BUFFER, 0);
+	else if (writeback == NULL)
+		LOGF("No OpenGL ES 3.x. Frames will be captured synchronously, "
+		     "and the frame rate WILL suffer.");
+
+	if (writeback != NULL && writeback->order == MYY_PIXELS_BGRX) {
+		capture->swizzled = malloc(frame_size);
+		if (capture->swizzled == NULL)
+			goto no_buffers;
+	}
+
+	pthread_mutex_init(&capture->lock, NULL);
+	pthread_cond_init(&capture->cond, NULL);
+	if (pthread_create(&capture->writer, NULL,
+		myy_capture_writer_thread, capture) != 0)
+	{
+		LOG_ERROR("Could not start the capture writer thread");
+		goto no_writer;
+	}
+
+	if (write_files)
+		LOGF("Capturing every %u frame(s) into %s, as %ux%u %s",
+			every, capture->dir, width, height,
+			myy_capture_format_names[format]);
+	capture->enabled = true;
+	return 0;
+
+no_writer:
+	pthread_cond_destroy(&capture->cond);
+	pthread_mutex_destroy(&capture->lock);
+no_buffers:
+	for (uint32_t s = 0; s < MYY_CAPTURE_RING; s++) {
+		if (capture->slots[s].pbo)
+			glDeleteBuffers(1, &capture->slots[s].pbo);
+		if (writeback != NULL)
+			drm_dumb_buffer_destroy(writeback->drm->fd,
+				&capture->slots[s].buffer);
+		else if (!capture->use_pbo)
+			free(capture->slots[s].pixels);
+	}
+	free(capture->swizzled);
+no_dir:
+	myy_recorder_close(&capture->recorder);
+	free(capture->converted);
+	memset(capture, 0, sizeof(*capture));
+	return -1;
+}
+
+/* Waits for the pixels of a slot being read back, if wait is set.
+ * Returns the next state of the slot : still READING, WRITING once
+ * the pixels are available, or FREE if the read back failed.
+ * Only the render thread moves a slot out of READING, so this is
+ * called without the capture lock. */
+static enum myy_capture_slot_state myy_capture_slot_collect(
+	struct myy_capture * __restrict const capture,
+	struct myy_capture_slot * __restrict const slot,
+	bool const wait)
+{
+	if (capture->writeback != NULL) {
+		struct pollfd fence = { .fd = slot->out_fence, .events = POLLIN };
+		int const ready = poll(&fence, 1,
+			wait ? MYY_WRITEBACK_TIMEOUT_MS : 0);
+		if (ready == 0 && !wait)
+			return MYY_CAPTURE_SLOT_READING;
+
+		close(slot->out_fence);
+		slot->out_fence = -1;
+		if (ready != 1) {
+			LOG_ERROR("The writeback of frame %u never completed",
+				slot->frame);
+			return MYY_CAPTURE_SLOT_FREE;
+		}
+		return MYY_CAPTURE_SLOT_WRITING;
+	}
+
+	GLenum const status = capture->glClientWaitSync(
+		slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT_APPLE,
+		wait ? GL_TIMEOUT_IGNORED_APPLE : 0);
+	if (status == GL_TIMEOUT_EXPIRED_APPLE)
+		return MYY_CAPTURE_SLOT_READING;
+
+	capture->glDeleteSync(slot->fence);
+	slot->fence = NULL;
+	slot->pixels = NULL;
+	if (status != GL_WAIT_FAILED_APPLE) {
+		myy_gl_bind_buffer(MYY_GL_PIXEL_PACK_BUFFER, slot->pbo);
+		slot->pixels = capture->glMapBufferRange(
+			MYY_GL_PIXEL_PACK_BUFFER, 0,
+			(GLsizeiptr) capture->width * capture->height * 4,
+			GL_MAP_READ_BIT_EXT);
+	}
+	if (slot->pixels == NULL) {
+		LOG_ERROR("Could not map the captured frame %u", slot->frame);
+		return MYY_CAPTURE_SLOT_FREE;
+	}
+	slot->top_row = slot->pixels
+		+ (capture->height - 1) * capture->width * 4;
+	slot->stride = -(ptrdiff_t) capture->width * 4;
+	return MYY_CAPTURE_SLOT_WRITING;
+}
+
+/* Moves the slots forward. Never waits, unless wait is set.
+ * The lock is not held while waiting, so the writer thread can keep
+ * going meanwhile. */
+static void myy_capture_poll(
+	struct myy_capture * __restrict const capture,
+	bool const wait)
+{
+	if (!capture->enabled)
+		return;
+
+	for (uint32_t s = 0; s < MYY_CAPTURE_RING; s++) {
+		struct myy_capture_slot * __restrict const slot = capture->slots + s;
+
+		pthread_mutex_lock(&capture->lock);
+		bool const reading = (slot->state == MYY_CAPTURE_SLOT_READING);
+		if (slot->state == MYY_CAPTURE_SLOT_WRITTEN) {
+			if (capture->use_pbo) {
+				myy_gl_bind_buffer(MYY_GL_PIXEL_PACK_BUFFER, slot->pbo);
+				capture->glUnmapBuffer(MYY_GL_PIXEL_PACK_BUFFER);
+				slot->pixels = NULL;
+			}
+			slot->state = MYY_CAPTURE_SLOT_FREE;
+		}
+		pthread_mutex_unlock(&capture->lock);
+
+		if (!reading)
+			continue;
+
+		enum myy_capture_slot_state const next =
+			myy_capture_slot_collect(capture, slot, wait);
+		if (next == MYY_CAPTURE_SLOT_READING)
+			continue;
+
+		pthread_mutex_lock(&capture->lock);
+		slot->state = next;
+		if (next == MYY_CAPTURE_SLOT_WRITING)
+			pthread_cond_signal(&capture->cond);
+		else
+			capture->failed++;
+		pthread_mutex_unlock(&capture->lock);
+	}
+}
+
+/* To call after drawing the frame, before swapping the buffers. */
+static void myy_capture_frame(
+	struct myy_capture * __restrict const capture,
+	uint32_t const frame)
+{
+	struct myy_capture_slot * __restrict slot = NULL;
+
+	if (!capture->enabled || (frame % capture->every) != 0)
+		return;
+
+	pthread_mutex_lock(&capture->lock);
+	for (uint32_t s = 0; s < MYY_CAPTURE_RING; s++) {
+		if (capture->slots[s].state == MYY_CAPTURE_SLOT_FREE) {
+			slot = capture->slots + s;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&capture->lock);
+
+	if (slot == NULL) {
+		capture->dropped++;
+		return;
+	}
+
+	if (capture->writeback != NULL) {
+		slot->out_fence = myy_writeback_queue(
+			capture->writeback, slot->buffer.fb_id);
+		if (slot->out_fence < 0) {
+			capture->dropped++;
+			return;
+		}
+	}
+
+	slot->frame = frame;
+	slot->time_ns = myy_clock_ns();
+	capture->captured++;
+
+	/* The writer thread scans the slots states under the lock */
+	if (capture->writeback != NULL) {
+		pthread_mutex_lock(&capture->lock);
+		slot->state = MYY_CAPTURE_SLOT_READING;
+		pthread_mutex_unlock(&capture->lock);
+	}
+	else if (capture->use_pbo) {
+		myy_gl_bind_buffer(MYY_GL_PIXEL_PACK_BUFFER, slot->pbo);
+		glReadPixels(0, 0, capture->width, capture->height,
+			GL_RGBA, GL_UNSIGNED_BYTE, (void *) 0);
+		myy_gl_bind_buffer(MYY_GL_PIXEL_PACK_BUFFER, 0);
+		slot->fence = capture->glFenceSync(
+			GL_SYNC_GPU_COMMANDS_COMPLETE_APPLE, 0);
+		pthread_mutex_lock(&capture->lock);
+		slot->state = MYY_CAPTURE_SLOT_READING;
+		pthread_mutex_unlock(&capture->lock);
+	}
+	else {
+		glReadPixels(0, 0, capture->width, capture->height,
+			GL_RGBA, GL_UNSIGNED_BYTE, slot->pixels);
+		slot->top_row = slot->pixels
+			+ (capture->height - 1) * capture->width * 4;
+		slot->stride = -(ptrdiff_t) capture->width * 4;
+		pthread_mutex_lock(&capture->lock);
+		slot->state = MYY_CAPTURE_SLOT_WRITING;
+		pthread_cond_signal(&capture->cond);
+		pthread_mutex_unlock(&capture->lock);
+	}
+}
+
+/* Waits for every pending capture to be written */
+static void myy_capture_deinit(struct myy_capture * __restrict const capture)
+{
+	if (!capture->enabled)
+		return;
+
+	myy_capture_poll(capture, true);
+	pthread_mutex_lock(&capture->lock);
+	capture->quit = true;
+	pthread_cond_signal(&capture->cond);
+	pthread_mutex_unlock(&capture->lock);
+	pthread_join(capture->writer, NULL);
+	myy_capture_poll(capture, false);
+	myy_recorder_close(&capture->recorder);
+
+	for (uint32_t s = 0; s < MYY_CAPTURE_RING; s++) {
+		if (capture->writeback != NULL)
+			drm_dumb_buffer_destroy(capture->writeback->drm->fd,
+				&capture->slots[s].buffer);
+		else if (capture->use_pbo)
+			myy_gl_delete_buffers(1, &capture->slots[s].pbo);
+		else
+			free(capture->slots[s].pixels);
+	}
+	pthread_cond_destroy(&capture->cond);
+	pthread_mutex_destroy(&capture->lock);
+	free(capture->converted);
+	free(capture->swizzled);
+
+	LOGF("Capture : %u frames captured, %u written, %u failed, "
+	     "%u dropped (every buffer busy)",
+		capture->captured, capture->written, capture->failed,
+		capture->dropped);
+	memset(capture, 0, sizeof(*capture));
+}
+
+/* Render thread, with the scanout enabled. Waits until no more than
+ * one captured frame is waiting for the display.
+ * The frames only reach the writer thread through myy_capture_poll,
+ * so the wait is done here rather than in the scanout section. */
+static void myy_scanout_throttle(
+	struct myy_scanout * __restrict const scanout,
+	struct myy_capture * __restrict const capture)
+{
+	struct timespec const timeout = {
+		.tv_sec = 0,
+		.tv_nsec = MYY_SCANOUT_THROTTLE_MS * 1000000L
+	};
+
+	while (true) {
+		uint32_t const presented = atomic_load_explicit(
+			&scanout->presented, memory_order_acquire);
+		if ((uint32_t) (capture->captured - presented) < MYY_SCANOUT_BUFFERS)
+			return;
+		myy_capture_poll(capture, true);
+		/* A frame lost on the way shouldn't block us forever */
+		if (syscall(SYS_futex, &scanout->presented, FUTEX_WAIT,
+			presented, &timeout, NULL, 0) != 0 && errno == ETIMEDOUT)
+			return;
+	}
+}
+
+/* Telemetry.
+ * Counters accumulated over a reporting interval, and printed
+ * every "interval" frames. An interval of 0 disables the reports,
+ * but the counters are still maintained.
+ */
+struct myy_telemetry {
+	uint32_t interval;
+	uint32_t frames;
+	uint64_t interval_start_ns;
+	uint64_t gl_calls;
+	uint64_t gl_redundant;
+	uint64_t draw_commands;
+	uint64_t draw_batches;
+	uint64_t visible_instances;
+	uint64_t instances;
+	uint64_t heap_allocations_start;
+	uint64_t arena_allocations;
+	uint64_t arena_overflows;
+	/* The scanout counters are cumulative */
+	uint32_t scanout_flips_start;
+	uint64_t scanout_hop_ns_start;
+};
+
+static struct myy_telemetry myy_telemetry;
+
+static void myy_telemetry_init(uint32_t const interval)
+{
+	memset(&myy_telemetry, 0, sizeof(myy_telemetry));
+	myy_telemetry.interval = interval;
+	myy_telemetry.interval_start_ns = myy_clock_ns();
+	myy_telemetry.heap_allocations_start = myy_heap_counters.allocations;
+	myy_telemetry.scanout_flips_start = atomic_load(&myy_scanout.flips);
+	myy_telemetry.scanout_hop_ns_start =
+		atomic_load(&myy_scanout.hop_ns_total);
+}
+
+static void myy_telemetry_frame_end(
+	struct myy_scene const * __restrict const scene)
+{
+	struct myy_telemetry * __restrict const t = &myy_telemetry;
+
+	t->frames++;
+	t->gl_calls      += myy_gl.frame.calls;
+	t->gl_redundant  += myy_gl.frame.redundant;
+	t->draw_commands += scene->renderer.stats.commands;
+	t->draw_batches  += scene->renderer.stats.batches;
+	t->visible_instances += scene->cubes.n_visible;
+	t->instances         += scene->cubes.count;
+	t->arena_allocations += myy_frame_arena.allocations;
+	t->arena_overflows   += myy_frame_arena.overflow_allocations;
+
+	if ((t->interval == 0) || (t->frames < t->interval))
+		return;
+
+	uint64_t const now_ns = myy_clock_ns();
+	double const seconds = (now_ns - t->interval_start_ns) / 1e9;
+	double const frames = t->frames;
+
+	LOGF("[Telemetry] %u frames, %.1f FPS\n"
+		"\tGL calls / frame       : %.1f\n"
+		"\tRedundant (filtered)   : %.1f (%.1f%%)\n"
+		"\tDraw commands / frame  : %.1f\n"
+		"\tBatches / frame        : %.1f\n"
+		"\tVisible instances      : %.1f / %.1f\n"
+		"\tArena allocs / frame   : %.1f (%.1f from the heap, "
+		"high water %zu KiB)\n"
+		"\tHeap allocs / frame    : %.2f%s\n"
+		"\tCaptured frames        : %u (%u dropped)",
+		t->frames, frames / seconds,
+		t->gl_calls / frames,
+		t->gl_redundant / frames,
+		t->gl_calls ? (100.0 * t->gl_redundant / t->gl_calls) : 0.0,
+		t->draw_commands / frames,
+		t->draw_batches / frames,
+		t->visible_instances / frames,
+		t->instances / frames,
+		t->arena_allocations / frames,
+		t->arena_overflows / frames,
+		myy_frame_arena.high_water / 1024,
+		(myy_heap_counters.allocations - t->heap_allocations_start) / frames,
+#if defined(MYY_HEAP_COUNTERS)
+		"",
+#else
+		" (not counted in this build)",
+#endif
+		myy_capture.captured, myy_capture.dropped);
+
+	if (myy_scanout.enabled) {
+		uint32_t const flips =
+			atomic_load(&myy_scanout.flips) - t->scanout_flips_start;
+		uint64_t const hop_ns = atomic_load(&myy_scanout.hop_ns_total)
+			- t->scanout_hop_ns_start;
+		uint64_t const max_ns = atomic_exchange(&myy_scanout.hop_ns_max, 0);
+		LOGF("\tScanout hop            : %.2f ms, %.2f ms max "
+		     "(%u frames flipped, %u failed so far)",
+			flips ? hop_ns / (flips * 1e6) : 0.0, max_ns / 1e6,
+			flips, atomic_load(&myy_scanout.failed));
+	}
+
+	uint32_t const interval = t->interval;
+	myy_telemetry_init(interval);
+}
+
+/* Render on demand.
+ *
+ * Redrawing and swapping an image that didn't change since the last
+ * vblank is just a nice way to heat up the room.
+ * When running "on demand", the loop only renders when the scene is
+ * marked dirty. Otherwise, it sleeps in poll() on its event sources
+ * (wake-up eventfd, signals and whatever was registered with
+ * myy_frame_loop_add_source), until something happens or until the
+ * keep-alive period expires.
+ *
+ * The keep-alive frame ensures that something is still pushed
+ * through the EGLStream from time to time, for the few consumers
+ * that get nervous when nothing comes for too long.
+ * A keep-alive rate of 0 disables it.
+ */
+#define MYY_FRAME_LOOP_MAX_SOURCES (8)
+#define MYY_DEFAULT_KEEPALIVE_HZ (1)
+#define MYY_DEFAULT_DEPTH_BITS (16)
+#define MYY_DEFAULT_BENCH_INSTANCES (100000)
+/* Frames during which the arena can still grow */
+#define MYY_ZERO_ALLOC_WARMUP_FRAMES (60)
+
+typedef void (*myy_frame_loop_source_cb)(
+	int fd, short revents, void * user_data);
+
+struct myy_frame_loop_source {
+	int fd;
+	myy_frame_loop_source_cb callback;
+	void * user_data;
+};
+
+struct myy_frame_loop {
+	atomic_bool dirty;
+	bool running;
+	bool on_demand;
+	/* Abort if building a frame allocates after the warm-up */
+	bool assert_zero_alloc;
+	int wake_fd;
+	int signal_fd;
+	int keepalive_ms;
+	uint64_t last_frame_ns;
+	/* To free the placeholder framebuffer once the stream displays
+	 * its frames. NULL if there's nothing to watch. */
+	myy_drm_infos_t * drm;
+	uint32_t n_sources;
+	struct myy_frame_loop_source sources[MYY_FRAME_LOOP_MAX_SOURCES];
+};
+
+/* Can be called from any thread. */
+static void myy_frame_loop_mark_dirty(
+	struct myy_frame_loop * __restrict const loop)
+{
+	bool const was_dirty = atomic_exchange(&loop->dirty, true);
+	if (!was_dirty & (loop->wake_fd >= 0)) {
+		uint64_t const one = 1;
+		/* Only fails if the counter overflows, in which case
+		 * the loop is already awake anyway. */
+		ssize_t const written = write(loop->wake_fd, &one, sizeof(one));
+		(void) written;
+	}
+}
+
+static void myy_frame_loop_wake_cb(void * loop)
+{
+	myy_frame_loop_mark_dirty(loop);
+}
+
+static bool myy_frame_loop_add_source(
+	struct myy_frame_loop * __restrict const loop,
+	int const fd,
+	myy_frame_loop_source_cb const callback,
+	void * const user_data)
+{
+	if (loop->n_sources >= MYY_FRAME_LOOP_MAX_SOURCES) {
+		LOG_ERROR("Too many event sources registered on the frame loop");
+		return false;
+	}
+
+	struct myy_frame_loop_source * __restrict const source =
+		loop->sources + loop->n_sources;
+	source->fd        = fd;
+	source->callback  = callback;
+	source->user_data = user_data;
+	loop->n_sources++;
+	return true;
+}
+
+/* Can be called from a source callback */
+static void myy_frame_loop_remove_source(
+	struct myy_frame_loop * __restrict const loop,
+	int const fd)
+{
+	for (uint32_t s = 0; s < loop->n_sources; s++) {
+		if (loop->sources[s].fd != fd)
+			continue;
+		loop->n_sources--;
+		memmove(loop->sources + s, loop->sources + s + 1,
+			(loop->n_sources - s) * sizeof(loop->sources[0]));
+		return;
+	}
+}
+
+static int myy_frame_loop_init(
+	struct myy_frame_loop * __restrict const loop,
+	bool const on_demand,
+	uint32_t const keepalive_hz)
+{
+	sigset_t signals;
+
+	atomic_init(&loop->dirty, true); /* The first frame is always due */
+	loop->running       = true;
+	loop->on_demand     = on_demand;
+	loop->keepalive_ms  = (keepalive_hz > 0) ? (int) (1000 / keepalive_hz) : -1;
+	loop->last_frame_ns = 0;
+	loop->n_sources     = 0;
+	loop->signal_fd     = -1;
+	loop->assert_zero_alloc = false;
+	loop->drm           = NULL;
+
+	loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (loop->wake_fd < 0) {
+		LOG_ERROR("Could not create the wake-up eventfd : %m");
+		goto no_wake_fd;
+	}
+
+	/* Handle SIGINT/SIGTERM like any other event, so that we can
+	 * leave the loop and clean up, instead of dying mid-frame. */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &signals, NULL) != 0) {
+		LOG_ERROR("Could not block SIGINT/SIGTERM : %m");
+		goto could_not_block_signals;
+	}
+
+	loop->signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (loop->signal_fd < 0) {
+		LOG_ERROR("Could not create the signalfd : %m");
+		goto no_signal_fd;
+	}
+
+	return 0;
+
+no_signal_fd:
+	sigprocmask(SIG_UNBLOCK, &signals, NULL);
+could_not_block_signals:
+	close(loop->wake_fd);
+	loop->wake_fd = -1;
+no_wake_fd:
+	return -1;
+}
+
+static void myy_frame_loop_deinit(
+	struct myy_frame_loop * __restrict const loop)
+{
+	if (loop->signal_fd >= 0)
+		close(loop->signal_fd);
+	if (loop->wake_fd >= 0)
+		close(loop->wake_fd);
+	loop->signal_fd = -1;
+	loop->wake_fd   = -1;
+}
+
+/* Returns the poll() timeout to use, in milliseconds.
+ * 0 when a frame is due right now, -1 when we can sleep forever. */
+static int myy_frame_loop_timeout(
+	struct myy_frame_loop const * __restrict const loop)
+{
+	if (!loop->on_demand || atomic_load(&loop->dirty))
+		return 0;
+
+	if (loop->keepalive_ms < 0)
+		return -1;
+
+	uint64_t const elapsed_ms =
+		(myy_clock_ns() - loop->last_frame_ns) / 1000000;
+	return (elapsed_ms >= (uint64_t) loop->keepalive_ms)
+		? 0
+		: (int) (loop->keepalive_ms - elapsed_ms);
+}
+
+/* Sleeps until something happens, and dispatch the events.
+ * Returns true when a frame should be rendered. */
+static bool myy_frame_loop_wait(
+	struct myy_frame_loop * __restrict const loop)
+{
+	struct pollfd fds[MYY_FRAME_LOOP_MAX_SOURCES + 2];
+	/* Callbacks can add or remove sources */
+	struct myy_frame_loop_source sources[MYY_FRAME_LOOP_MAX_SOURCES];
+	uint32_t const n_sources = loop->n_sources;
+	nfds_t const n_fds = n_sources + 2;
+
+	memcpy(sources, loop->sources, n_sources * sizeof(sources[0]));
+
+	fds[0].fd = loop->wake_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = loop->signal_fd;
+	fds[1].events = POLLIN;
+	for (uint32_t s = 0; s < n_sources; s++) {
+		fds[s+2].fd = sources[s].fd;
+		fds[s+2].events = POLLIN;
+	}
+
+	int const timeout = myy_frame_loop_timeout(loop);
+	int const n_ready = poll(fds, n_fds, timeout);
+
+	if (n_ready < 0) {
+		if (errno != EINTR)
+			LOG_ERROR("poll failed : %m");
+		return false;
+	}
+
+	if (fds[0].revents & POLLIN) {
+		uint64_t wakes;
+		ssize_t const got = read(loop->wake_fd, &wakes, sizeof(wakes));
+		(void) got;
+	}
+
+	if (fds[1].revents & POLLIN) {
+		struct signalfd_siginfo info;
+		if (read(loop->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+			LOGF("Received signal %u. Leaving.", info.ssi_signo);
+			loop->running = false;
+			return false;
+		}
+	}
+
+	for (uint32_t s = 0; s < n_sources; s++) {
+		short const revents = fds[s+2].revents;
+		if (revents)
+			sources[s].callback(sources[s].fd, revents, sources[s].user_data);
+	}
+
+	/* A callback may have ended the loop */
+	if (!loop->running)
+		return false;
+
+	/* Keep-alive expired ? Then push the same frame again */
+	if (myy_frame_loop_timeout(loop) == 0)
+		atomic_store(&loop->dirty, true);
+
+	return !loop->on_demand || atomic_load(&loop->dirty);
+}
+
+static void myy_frame_loop_run(
+	struct myy_frame_loop * __restrict const loop,
+	myy_opengl_infos_t const * __restrict const gl,
+	struct myy_scene * __restrict const scene)
+{
+	uint32_t i = 0;
+
+	while (loop->running) {
+		if (!myy_frame_loop_wait(loop))
+			continue;
+
+		/* Clear the flag before drawing, so that updates
+		 * happening while we draw trigger another frame. */
+		atomic_store(&loop->dirty, false);
+
+		myy_arena_reset(&myy_frame_arena);
+		uint64_t const allocations = myy_heap_counters.allocations;
+		myy_heap_counting_set(true);
+		bool const animated = draw(scene, i++);
+		myy_heap_counting_set(false);
+
+		if (loop->assert_zero_alloc
+		    && (i > MYY_ZERO_ALLOC_WARMUP_FRAMES)
+		    && (myy_heap_counters.allocations != allocations))
+		{
+			LOG_ERROR("Frame %u did %" PRIu64 " heap allocations !",
+				i, myy_heap_counters.allocations - allocations);
+			abort();
+		}
+
+		/* Outside the counted window : the capture is mostly
+		 * driver calls (read back, fences, mapping). The writer
+		 * thread has its own counters, never counted here. */
+		myy_capture_poll(&myy_capture, false);
+		myy_capture_frame(&myy_capture, i - 1);
+		myy_capture_poll(&myy_writeback_capture, false);
+		myy_capture_frame(&myy_writeback_capture, i - 1);
+		if (myy_scanout.enabled)
+			myy_scanout_throttle(&myy_scanout, &myy_capture);
+
+		if (!eglSwapBuffers(gl->display, gl->surface)) {
+			LOG_ERROR(
+				"Could not swap the buffers !? CALL THE POLICE !\n"
+				"Error : %d", eglGetError());
+		}
+		loop->last_frame_ns = myy_clock_ns();
+		myy_telemetry_frame_end(scene);
+
+		/* The stream usually takes over with its first frames.
+		 * After that, check once in a while, in case the mode
+		 * changed. */
+		if (loop->drm != NULL && loop->drm->framebuffer_id != 0
+		    && ((i <= MYY_DRM_PLACEHOLDER_EARLY_CHECKS)
+		        | (i % MYY_DRM_PLACEHOLDER_CHECK_FRAMES == 0)))
+			drm_placeholder_release(loop->drm);
+
+		if (animated)
+			atomic_store(&loop->dirty, true);
+	}
+}
+
+/* Video overlay.
+ * With --video=SOURCE, frames decoded on the CPU are shown on an
+ * overlay plane, scaled to fit the screen. They are decoded straight
+ * into a ring of NV12 dumb buffers : the plane does the colour
+ * conversion and the scaling, and the GPU never sees them.
+ * SOURCE is either :
+ * - nv12:WxH@FPS:FILE or i420:WxH@FPS:FILE : raw 4:2:0 frames, back
+ *   to back (ffmpeg -f rawvideo -pix_fmt nv12). Played in a loop.
+ * - bars:WxH@FPS : scrolling colour bars, drawn in RGBA and converted
+ *   with the capture converters. Costs about what a software decoder
+ *   would.
+ *
+ * Presentation follows the vblank events of our CRTC, read from the
+ * DRM fd by the frame loop. At each vblank, the newest decoded frame
+ * due before the middle of the next refresh period is flipped, and
+ * the older ones are dropped. When the decoder is late, the current
+ * frame stays on screen.
+ * A buffer goes back to the decoder once the flip replacing it has
+ * completed.
+ */
+#define MYY_VIDEO_BUFFERS  (4)
+#define MYY_VIDEO_MAX_SIZE (8192)
+#define MYY_VIDEO_MAX_FPS  (240)
+
+enum myy_video_source {
+	MYY_VIDEO_NV12,
+	MYY_VIDEO_I420,
+	MYY_VIDEO_BARS,
+};
+
+enum myy_video_slot_state {
+	MYY_VIDEO_SLOT_FREE,
+	MYY_VIDEO_SLOT_DECODING,
+	MYY_VIDEO_SLOT_READY,
+	MYY_VIDEO_SLOT_FLIPPING,
+	MYY_VIDEO_SLOT_ON_SCREEN,
+};
+
+struct myy_video_slot {
+	enum myy_video_slot_state state;
+	struct myy_drm_dumb_buffer buffer;
+	uint32_t frame;
+	uint64_t pts_ns;
+};
+
+struct myy_video {
+	bool enabled;
+	myy_drm_infos_t * drm;
+	struct myy_frame_loop * loop;
+	struct myy_drm_overlay overlay;
+	enum myy_video_source source;
+	FILE * file;
+	uint32_t width, height;
+	uint64_t frame_ns;
+	/* One frame, as read from the file, or drawn in RGBA */
+	uint8_t * staging;
+	size_t staging_size;
+
+	/* Render thread */
+	int32_t crtc_x, crtc_y;
+	uint32_t crtc_w, crtc_h;
+	uint64_t refresh_ns;
+	/* When PTS 0 is due. 0 until the first frame is shown. */
+	uint64_t start_ns;
+	/* Of the last frame committed */
+	uint64_t shown_pts_ns;
+	bool stopped;
+	uint32_t shown, dropped, busy, starved;
+	uint64_t pacing_ns_total;
+
+	pthread_mutex_t lock;
+	pthread_cond_t decode_cond;
+	pthread_t decoder;
+	bool quit;
+	/* Set by the decoder thread when it gives up */
+	bool decoder_failed;
+	/* Decoder thread */
+	uint32_t next_frame;
+	struct myy_video_slot slots[MYY_VIDEO_BUFFERS];
+};
+
+static struct myy_video myy_video;
+
+/* Fits the video in the current mode, keeping its aspect ratio */
+static void myy_video_fit(struct myy_video * __restrict const video)
+{
+	myy_drm_infos_t const * __restrict const drm = video->drm;
+	drmModeModeInfo const * __restrict const mode = &drm->mode;
+	uint64_t const w = video->width, h = video->height;
+
+	if (w * drm->height > h * drm->width) {
+		video->crtc_w = drm->width;
+		video->crtc_h = (uint32_t) (drm->width * h / w);
+	}
+	else {
+		video->crtc_w = (uint32_t) (drm->height * w / h);
+		video->crtc_h = drm->height;
+	}
+	video->crtc_x = (int32_t) (drm->width  - video->crtc_w) / 2;
+	video->crtc_y = (int32_t) (drm->height - video->crtc_h) / 2;
+
+	/* clock is in kHz */
+	video->refresh_ns = (mode->clock != 0)
+		? (uint64_t) mode->htotal * mode->vtotal * 1000000 / mode->clock
+		: 16666667;
+}
+
+static bool myy_video_parse(
+	struct myy_video * __restrict const video,
+	char const * __restrict const spec,
+	char const * __restrict * __restrict const path)
+{
+	uint32_t fps = 0;
+	int consumed = 0;
+
+	if (strncmp(spec, "nv12:", 5) == 0)
+		video->source = MYY_VIDEO_NV12;
+	else if (strncmp(spec, "i420:", 5) == 0)
+		video->source = MYY_VIDEO_I420;
+	else if (strncmp(spec, "bars:", 5) == 0)
+		video->source = MYY_VIDEO_BARS;
+	else
+		goto invalid;
+
+	if (sscanf(spec + 5, "%ux%u@%u%n",
+		&video->width, &video->height, &fps, &consumed) != 3)
+		goto invalid;
+
+	char const * __restrict const rest = spec + 5 + consumed;
+	*path = NULL;
+	if (video->source == MYY_VIDEO_BARS) {
+		if (*rest != '\0')
+			goto invalid;
+	}
+	else if (rest[0] == ':' && rest[1] != '\0') {
+		*path = rest + 1;
+	}
+	else {
+		goto invalid;
+	}
+
+	if ((video->width == 0) | (video->height == 0)
+	    | ((video->width | video->height) & 1)
+	    | (video->width > MYY_VIDEO_MAX_SIZE)
+	    | (video->height > MYY_VIDEO_MAX_SIZE)
+	    | (fps == 0) | (fps > MYY_VIDEO_MAX_FPS))
+	{
+		LOG_ERROR("%s : the size must be even and at most %u, "
+			"and the rate at most %u fps",
+			spec, MYY_VIDEO_MAX_SIZE, MYY_VIDEO_MAX_FPS);
+		return false;
+	}
+
+	video->frame_ns = 1000000000ull / fps;
+	return true;
+
+invalid:
+	LOG_ERROR("Invalid video source : %s\n"
+		"Expected nv12:WxH@FPS:FILE, i420:WxH@FPS:FILE or bars:WxH@FPS",
+		spec);
+	return false;
+}
+
+static void myy_video_draw_bars(
+	struct myy_video * __restrict const video,
+	uint32_t const frame)
+{
+	static uint8_t const colors[8][4] = {
+		{ 235, 235, 235, 255 }, { 235, 235,  16, 255 },
+		{  16, 235, 235, 255 }, {  16, 235,  16, 255 },
+		{ 235,  16, 235, 255 }, { 235,  16,  16, 255 },
+		{  16,  16, 235, 255 }, {  16,  16,  16, 255 },
+	};
+	uint32_t const width = video->width;
+	uint32_t const bar_width = (width >= 8) ? width / 8 : 1;
+	/* One screen width every 4 seconds */
+	uint32_t const shift = (uint32_t) ((uint64_t) frame * video->frame_ns
+		* width / 4000000000ull);
+	uint8_t * __restrict row = video->staging;
+
+	for (uint32_t x = 0; x < width; x++)
+		memcpy(row + x * 4, colors[((x + shift) / bar_width) & 7], 4);
+	for (uint32_t y = 1; y < video->height; y++)
+		memcpy(row + (size_t) y * width * 4, row, (size_t) width * 4);
+}
+
+/* Reads the next frame into the staging buffer. Loops at the end. */
+static bool myy_video_read(struct myy_video * __restrict const video)
+{
+	size_t const size = video->staging_size;
+
+	if (fread(video->staging, 1, size, video->file) == size)
+		return true;
+
+	rewind(video->file);
+	if (fread(video->staging, 1, size, video->file) == size)
+		return true;
+
+	LOG_ERROR("Not even one %ux%u frame in the video file",
+		video->width, video->height);
+	return false;
+}
+
+/* Decoder thread */
+static bool myy_video_decode(
+	struct myy_video * __restrict const video,
+	struct myy_video_slot * __restrict const slot)
+{
+	struct myy_drm_dumb_buffer const * __restrict const buffer =
+		&slot->buffer;
+	uint32_t const width  = video->width;
+	uint32_t const height = video->height;
+	uint8_t * __restrict const y  = buffer->map;
+	uint8_t * __restrict const uv = buffer->map + buffer->chroma_offset;
+
+	if (video->source == MYY_VIDEO_BARS) {
+		struct myy_yuv420_image const image = {
+			.y = y, .u = uv, .v = uv + 1,
+			.y_stride = buffer->pitch, .uv_stride = buffer->pitch,
+			.chroma_step = 2,
+		};
+		myy_video_draw_bars(video, video->next_frame);
+		if (myy_convert_to_yuv420(video->staging, width * 4,
+			MYY_PIXELS_RGBX, MYY_YUV_BT709, width, height, &image) != 0)
+			return false;
+	}
+	else {
+		struct myy_yuv420_image frame;
+		myy_yuv420_image_layout(&frame,
+			(video->source == MYY_VIDEO_NV12)
+				? MYY_YUV420_NV12 : MYY_YUV420_I420,
+			video->staging, width, height);
+		if (!myy_video_read(video))
+			return false;
+
+		for (uint32_t row = 0; row < height; row++)
+			memcpy(y + (size_t) row * buffer->pitch,
+				frame.y + row * frame.y_stride, width);
+		for (uint32_t row = 0; row < height / 2; row++) {
+			uint8_t * __restrict const dst = uv + (size_t) row * buffer->pitch;
+			uint8_t const * __restrict const u = frame.u + row * frame.uv_stride;
+			uint8_t const * __restrict const v = frame.v + row * frame.uv_stride;
+			if (frame.chroma_step == 2) {
+				memcpy(dst, u, width);
+				continue;
+			}
+			for (uint32_t x = 0; x < width / 2; x++) {
+				dst[x*2+0] = u[x];
+				dst[x*2+1] = v[x];
+			}
+		}
+	}
+
+	slot->frame  = video->next_frame;
+	slot->pts_ns = video->next_frame * video->frame_ns;
+	video->next_frame++;
+	return true;
+}
+
+static void * myy_video_decoder_thread(void * user_data)
+{
+	struct myy_video * __restrict const video = user_data;
+
+	pthread_mutex_lock(&video->lock);
+	while (!video->quit) {
+		struct myy_video_slot * __restrict slot = NULL;
+		for (uint32_t s = 0; s < MYY_VIDEO_BUFFERS; s++) {
+			if (video->slots[s].state == MYY_VIDEO_SLOT_FREE) {
+				slot = video->slots + s;
+				break;
+			}
+		}
+
+		if (slot == NULL) {
+			pthread_cond_wait(&video->decode_cond, &video->lock);
+			continue;
+		}
+
+		slot->state = MYY_VIDEO_SLOT_DECODING;
+		pthread_mutex_unlock(&video->lock);
+
+		bool const decoded = myy_video_decode(video, slot);
+
+		pthread_mutex_lock(&video->lock);
+		slot->state = decoded ? MYY_VIDEO_SLOT_READY : MYY_VIDEO_SLOT_FREE;
+		if (!decoded) {
+			/* The render thread stops the video once the
+			 * frames already decoded are shown */
+			LOG_ERROR("Could not decode the video frame %u. "
+				"Video stopped.", video->next_frame);
+			video->decoder_failed = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&video->lock);
+
+	return NULL;
+}
+
+static void myy_video_request_vblank(struct myy_video * __restrict const video)
+{
+	uint32_t const crtc = (video->drm->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT)
+		& DRM_VBLANK_HIGH_CRTC_MASK;
+	drmVBlank vblank = {
+		.request = {
+			.type = (drmVBlankSeqType)
+				(DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT | crtc),
+			.sequence = 1,
+			.signal = (unsigned long) video,
+		}
+	};
+
+	if (drmWaitVBlank(video->drm->fd, &vblank) != 0) {
+		LOG_ERROR("Could not wait for the vblank : %m. Video stopped.");
+		video->stopped = true;
+	}
+}
+
+/* Render thread. flipped when our last commit just reached the
+ * screen, at vblank_ns. */
+static void myy_video_vblank(
+	struct myy_video * __restrict const video,
+	uint64_t const vblank_ns,
+	bool const flipped)
+{
+	uint64_t const next_ns = vblank_ns + video->refresh_ns;
+	uint64_t const deadline_ns = next_ns + video->refresh_ns / 2;
+	struct myy_video_slot * __restrict show = NULL;
+	bool freed = false;
+
+	pthread_mutex_lock(&video->lock);
+	for (uint32_t s = 0; s < MYY_VIDEO_BUFFERS; s++) {
+		struct myy_video_slot * __restrict const slot = video->slots + s;
+		if (!flipped)
+			break;
+		if (slot->state == MYY_VIDEO_SLOT_ON_SCREEN) {
+			slot->state = MYY_VIDEO_SLOT_FREE;
+			freed = true;
+		}
+		else if (slot->state == MYY_VIDEO_SLOT_FLIPPING) {
+			uint64_t const due_ns = video->start_ns + slot->pts_ns;
+			slot->state = MYY_VIDEO_SLOT_ON_SCREEN;
+			video->pacing_ns_total += (vblank_ns > due_ns)
+				? vblank_ns - due_ns : due_ns - vblank_ns;
+		}
+	}
+
+	/* The first frame shown sets the clock */
+	if (video->start_ns == 0) {
+		for (uint32_t s = 0; s < MYY_VIDEO_BUFFERS; s++) {
+			struct myy_video_slot * __restrict const slot = video->slots + s;
+			if (slot->state == MYY_VIDEO_SLOT_READY
+			    && (show == NULL || slot->pts_ns < show->pts_ns))
+				show = slot;
+		}
+		if (show != NULL)
+			video->start_ns = next_ns - show->pts_ns;
+	}
+
+	for (uint32_t s = 0; s < MYY_VIDEO_BUFFERS; s++) {
+		struct myy_video_slot * __restrict const slot = video->slots + s;
+		if (slot->state == MYY_VIDEO_SLOT_READY
+		    && video->start_ns + slot->pts_ns <= deadline_ns
+		    && (show == NULL || slot->pts_ns > show->pts_ns))
+			show = slot;
+	}
+
+	/* Too late for these ones */
+	for (uint32_t s = 0; s < MYY_VIDEO_BUFFERS; s++) {
+		struct myy_video_slot * __restrict const slot = video->slots + s;
+		if (show != NULL && slot->state == MYY_VIDEO_SLOT_READY
+		    && slot->pts_ns < show->pts_ns)
+		{
+			slot->state = MYY_VIDEO_SLOT_FREE;
+			video->dropped++;
+			freed = true;
+		}
+	}
+	if (freed)
+		pthread_cond_signal(&video->decode_cond);
+	bool ended = video->decoder_failed;
+	for (uint32_t s = 0; s < MYY_VIDEO_BUFFERS; s++)
+		ended &= (video->slots[s].state != MYY_VIDEO_SLOT_READY);
+	pthread_mutex_unlock(&video->lock);
+
+	/* Nothing left to show, and nothing will come */
+	if (ended) {
+		/* Blocking : waits for a pending flip, if any */
+		drm_overlay_commit(video->drm, &video->overlay,
+			0, 0, 0, 0, 0, 0, 0, 0, NULL);
+		video->stopped = true;
+		return;
+	}
+
+	/* Showing a frame for several vblanks is normal. Not having the
+	 * next one decoded when it's due is not. */
+	if (show == NULL) {
+		video->starved += (video->start_ns != 0)
+			&& (video->start_ns + video->shown_pts_ns + video->frame_ns
+			    <= deadline_ns);
+		goto next_vblank;
+	}
+
+	int const ret = drm_overlay_commit(video->drm, &video->overlay,
+		show->buffer.fb_id, video->width, video->height,
+		video->crtc_x, video->crtc_y, video->crtc_w, video->crtc_h,
+		DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, video);
+	if (ret == 0) {
+		pthread_mutex_lock(&video->lock);
+		show->state = MYY_VIDEO_SLOT_FLIPPING;
+		pthread_mutex_unlock(&video->lock);
+		video->shown_pts_ns = show->pts_ns;
+		video->shown++;
+		return;
+	}
+
+	/* Another commit on the CRTC is still pending. Retry next vblank. */
+	if (ret != -EBUSY) {
+		LOG_ERROR("The overlay plane refused the video frame : %s. "
+			"Video stopped.", strerror(-ret));
+		video->stopped = true;
+		return;
+	}
+	video->busy++;
+
+next_vblank:
+	myy_video_request_vblank(video);
+}
+
+static void myy_video_vblank_handler(
+	int const fd,
+	unsigned int const sequence,
+	unsigned int const tv_sec,
+	unsigned int const tv_usec,
+	void * const user_data)
+{
+	(void) fd;
+	(void) sequence;
+	if (user_data != NULL)
+		myy_video_vblank(user_data,
+			tv_sec * 1000000000ull + tv_usec * 1000ull, false);
+}
+
+static void myy_video_flip_handler(
+	int const fd,
+	unsigned int const sequence,
+	unsigned int const tv_sec,
+	unsigned int const tv_usec,
+	void * const user_data)
+{
+	(void) fd;
+	(void) sequence;
+	if (user_data != NULL)
+		myy_video_vblank(user_data,
+			tv_sec * 1000000000ull + tv_usec * 1000ull, true);
+}
+
+/* Frame loop source, on the DRM fd */
+static void myy_video_drm_cb(
+	int const fd,
+	short const revents,
+	void * const user_data)
+{
+	drmEventContext context = {
+		.version = 2,
+		.vblank_handler = myy_video_vblank_handler,
+		.page_flip_handler = myy_video_flip_handler,
+	};
+
+	(void) revents;
+	(void) user_data;
+	if (drmHandleEvent(fd, &context) != 0)
+		LOG_ERROR("Could not read the DRM events : %m");
+}
+
+static int myy_video_init(
+	struct myy_video * __restrict const video,
+	char const * __restrict const spec,
+	myy_drm_infos_t * __restrict const drm,
+	struct myy_frame_loop * __restrict const loop)
+{
+	char const * path = NULL;
+	uint32_t n_buffers = 0;
+
+	memset(video, 0, sizeof(*video));
+	video->drm  = drm;
+	video->loop = loop;
+
+	if (!myy_video_parse(video, spec, &path))
+		goto invalid_source;
+
+	/* Dumb buffers have a linear layout */
+	if (!drm_overlay_find(drm, DRM_FORMAT_NV12, DRM_FORMAT_MOD_LINEAR,
+		&video->overlay))
+	{
+		LOG_ERROR("No overlay plane can scan out NV12 frames");
+		goto no_overlay;
+	}
+
+	if (path != NULL) {
+		video->file = fopen(path, "rb");
+		if (video->file == NULL) {
+			LOG_ERROR("Could not open %s : %m", path);
+			goto no_file;
+		}
+	}
+
+	video->staging_size = (video->source == MYY_VIDEO_BARS)
+		? (size_t) video->width * video->height * 4
+		: (size_t) video->width * video->height * 3 / 2;
+	video->staging = malloc(video->staging_size);
+	if (video->staging == NULL)
+		goto no_staging;
+
+	for (; n_buffers < MYY_VIDEO_BUFFERS; n_buffers++) {
+		if (!drm_dumb_buffer_create(drm->fd,
+			video->width, video->height, DRM_FORMAT_NV12, true,
+			&video->slots[n_buffers].buffer))
+		{
+			LOG_ERROR("Could not allocate the video buffers");
+			goto no_buffers;
+		}
+	}
+
+	pthread_mutex_init(&video->lock, NULL);
+	pthread_cond_init(&video->decode_cond, NULL);
+	if (pthread_create(&video->decoder, NULL,
+		myy_video_decoder_thread, video) != 0)
+	{
+		LOG_ERROR("Could not start the video decoder thread");
+		goto no_decoder;
+	}
+
+	if (!myy_frame_loop_add_source(loop, drm->fd, myy_video_drm_cb, video))
+		goto no_source;
+
+	myy_video_fit(video);
+	myy_video_request_vblank(video);
+	if (video->stopped)
+		goto no_vblank;
+
+	LOGF("Playing %s on plane %u, shown at %ux%u+%d+%d",
+		spec, video->overlay.plane_id,
+		video->crtc_w, video->crtc_h, video->crtc_x, video->crtc_y);
+	video->enabled = true;
+	return 0;
+
+no_vblank:
+	myy_frame_loop_remove_source(loop, drm->fd);
+no_source:
+	pthread_mutex_lock(&video->lock);
+	video->quit = true;
+	pthread_cond_signal(&video->decode_cond);
+	pthread_mutex_unlock(&video->lock);
+	pthread_join(video->decoder, NULL);
+no_decoder:
+	pthread_cond_destroy(&video->decode_cond);
+	pthread_mutex_destroy(&video->lock);
+no_buffers:
+	for (uint32_t b = 0; b < n_buffers; b++)
+		drm_dumb_buffer_destroy(drm->fd, &video->slots[b].buffer);
+	free(video->staging);
+no_staging:
+	if (video->file != NULL)
+		fclose(video->file);
+no_file:
+	drm_overlay_release(&video->overlay);
+no_overlay:
+invalid_source:
+	memset(video, 0, sizeof(*video));
+	return -1;
+}
+
+static void myy_video_deinit(struct myy_video * __restrict const video)
+{
+	if (!video->enabled)
+		return;
+
+	pthread_mutex_lock(&video->lock);
+	video->quit = true;
+	pthread_cond_signal(&video->decode_cond);
+	pthread_mutex_unlock(&video->lock);
+	pthread_join(video->decoder, NULL);
+
+	/* Blocking : waits for a pending flip, if any */
+	drm_overlay_commit(video->drm, &video->overlay,
+		0, 0, 0, 0, 0, 0, 0, 0, NULL);
+	myy_frame_loop_remove_source(video->loop, video->drm->fd);
+
+	LOGF("Video : %u frames shown, %u dropped, %u late, "
+	     "%u commits retried. %.2f ms from the PTS on average",
+		video->shown, video->dropped, video->starved, video->busy,
+		video->shown ? video->pacing_ns_total / (video->shown * 1e6) : 0.0);
+
+	for (uint32_t b = 0; b < MYY_VIDEO_BUFFERS; b++)
+		drm_dumb_buffer_destroy(video->drm->fd, &video->slots[b].buffer);
+	pthread_cond_destroy(&video->decode_cond);
+	pthread_mutex_destroy(&video->lock);
+	free(video->staging);
+	if (video->file != NULL)
+		fclose(video->file);
+	drm_overlay_release(&video->overlay);
+	memset(video, 0, sizeof(*video));
+}
+
+/* Runtime commands, read line by line from stdin.
+ * Handy to tweak things while the display is running, without
+ * restarting everything.
+ */
+struct myy_commands_context {
+	myy_drm_infos_t * drm;
+	struct myy_frame_loop * loop;
+	struct myy_scene * scene;
+	struct myy_frame_loop_source * source;
+	myy_opengl_infos_t * gl;
+	struct myy_nvidia_functions const * nvidia;
+	/* Reads can stop in the middle of a line. The start of the line
+	 * waits here for the rest. */
+	char pending[256];
+	uint32_t n_pending;
+	/* The current line didn't fit in pending. Drop it up to its end. */
+	bool skip_line;
+};
+
+/* Parses up to max_values floats separated by spaces or commas.
+ * Returns the number of values parsed. */
+static uint32_t myy_parse_floats(
+	char const * __restrict str,
+	float * __restrict const values,
+	uint32_t const max_values)
+{
+	uint32_t n = 0;
+	while (n < max_values) {
+		char * end;
+		float const value = strtof(str, &end);
+		if (end == str)
+			break;
+		values[n++] = value;
+		str = end;
+		while ((*str == ',') | (*str == ' '))
+			str++;
+	}
+	return n;
+}
+
+/* Exactly 9 values. A 10th one means the matrix is wrong too. */
+static bool myy_parse_ctm(
+	char const * __restrict const str,
+	float * __restrict const ctm)
+{
+	float values[10];
+	if (myy_parse_floats(str, values, ARRAY_SIZE(values)) != 9)
+		return false;
+	memcpy(ctm, values, 9 * sizeof(float));
+	return true;
+}
+
+static void myy_command_execute(
+	struct myy_commands_context * __restrict const context,
+	char const * __restrict const line)
+{
+	struct myy_color_profile profile = context->drm->color.profile;
+	bool color_changed = true;
+
+	if (strncmp(line, "gamma ", 6) == 0) {
+		profile.gamma = strtof(line+6, NULL);
+	}
+	else if (strncmp(line, "degamma ", 8) == 0) {
+		profile.degamma = strtof(line+8, NULL);
+	}
+	else if (strncmp(line, "ctm ", 4) == 0) {
+		/* Keep the current matrix rather than dropping it */
+		profile.has_ctm = myy_parse_ctm(line+4, profile.ctm);
+		if (!profile.has_ctm) {
+			color_changed = false;
+			LOG_ERROR("ctm expects 9 values");
+		}
+	}
+	else if (strcmp(line, "color off") == 0) {
+		memset(&profile, 0, sizeof(profile));
+	}
+	else if (strncmp(line, "texture ", 8) == 0) {
+		color_changed = false;
+		myy_scene_load_backdrop(context->scene, line+8);
+	}
+	else if ((strcmp(line, "pause") == 0) | (strcmp(line, "resume") == 0)) {
+		color_changed = false;
+		myy_scene_set_paused(context->scene, line[0] == 'p');
+		myy_frame_loop_mark_dirty(context->loop);
+	}
+	else if (strcmp(line, "modes") == 0) {
+		color_changed = false;
+		drm_list_modes(context->drm);
+	}
+	else if ((strncmp(line, "mode ", 5) == 0) & myy_scanout.enabled) {
+		/* The scanout buffers and the pbuffer are sized at startup */
+		color_changed = false;
+		LOG_ERROR("Modes can't be switched with --render-device");
+	}
+	else if ((strncmp(line, "mode ", 5) == 0) & myy_writeback.enabled)
+	{
+		/* Writeback buffers must have the size of the mode */
+		color_changed = false;
+		LOG_ERROR("Modes can't be switched with --writeback");
+	}
+	else if (strncmp(line, "mode ", 5) == 0) {
+		char * end;
+		uint32_t const mode_index = strtoul(line+5, &end, 10);
+		/* Captures and exports have their size set at startup.
+		 * Keep rendering at that size. */
+		bool const scaled = (strcmp(end, " scaled") == 0)
+			|| myy_capture.enabled || myy_frame_export.enabled;
+
+		color_changed = false;
+		if (myy_display_set_mode(context->nvidia, context->drm,
+			context->gl, mode_index, scaled) == 0)
+		{
+			myy_scene_resize(context->scene,
+				context->drm->width, context->drm->height);
+			if (myy_video.enabled)
+				myy_video_fit(&myy_video);
+			myy_frame_loop_mark_dirty(context->loop);
+		}
+		else if (context->gl->surface == EGL_NO_SURFACE) {
+			LOG_ERROR("Nothing left to draw into. Leaving.");
+			context->loop->running = false;
+		}
+	}
+	else {
+		color_changed = false;
+		LOG_ERROR(
+			"Unknown command \"%s\". Known commands :\n"
+			"  gamma G | degamma G | ctm a b c d e f g h i | color off\n"
+			"  texture FILE.ppm | texture checker:SIZE | texture gradient:SIZE\n"
+			"  pause | resume\n"
+			"  modes | mode N | mode N scaled",
+			line);
+	}
+
+	if (color_changed && !myy_drm_color_apply(context->drm, &profile))
+		LOG_ERROR("Could not apply the colour profile");
+}
+
+static void myy_commands_source_cb(
+	int const fd,
+	short const revents,
+	void * const user_data)
+{
+	struct myy_commands_context * __restrict const context = user_data;
+	char * __restrict const pending = context->pending;
+	size_t const capacity = sizeof(context->pending) - 1;
+	ssize_t const n_read =
+		read(fd, pending + context->n_pending, capacity - context->n_pending);
+
+	/* With POLLHUP, what was written before the hang up can still be
+	 * read. Only stop once read says there's nothing left. */
+	(void) revents;
+	if (n_read <= 0) {
+		/* A last command without its newline */
+		if ((context->n_pending > 0) & !context->skip_line) {
+			pending[context->n_pending] = '\0';
+			myy_command_execute(context, pending);
+		}
+		context->n_pending = 0;
+		/* stdin closed. Stop listening, or poll will keep
+		 * waking us up for nothing. */
+		context->source->fd = -1;
+		return;
+	}
+
+	context->n_pending += n_read;
+	pending[context->n_pending] = '\0';
+
+	char * line = pending;
+	char * newline;
+	while ((newline = strchr(line, '\n')) != NULL) {
+		*newline = '\0';
+		if (context->skip_line)
+			context->skip_line = false;
+		else if (*line != '\0')
+			myy_command_execute(context, line);
+		line = newline + 1;
+	}
+
+	size_t const rest = context->n_pending - (line - pending);
+	if (rest == capacity) {
+		if (!context->skip_line)
+			LOG_ERROR("Command longer than %zu characters, ignored",
+				capacity);
+		context->skip_line = true;
+		context->n_pending = 0;
+		return;
+	}
+	memmove(pending, line, rest);
+	context->n_pending = rest;
+}
+
+static void myy_commands_listen(
+	struct myy_frame_loop * __restrict const loop,
+	struct myy_commands_context * __restrict const context)
+{
+	uint32_t const source_index = loop->n_sources;
+	if (myy_frame_loop_add_source(
+		loop, STDIN_FILENO, myy_commands_source_cb, context))
+	{
+		context->source = loop->sources + source_index;
+	}
+}
+
+/* CPU only benchmark of the instance kernels. No DRM, no EGL.
+ * Every kernel set supported by this CPU is run on the same random
+ * instances, and checked against the scalar version. */
+#define MYY_BENCH_MIN_NS (200000000ull)
+
+static float myy_bench_random(uint32_t * __restrict const state)
+{
+	/* xorshift32. Good enough to scatter boxes around. */
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return (x >> 8) / (float) (1 << 24);
+}
+
+static bool myy_bench_same_vertices(
+	struct myy_vertex const * __restrict const a,
+	struct myy_vertex const * __restrict const b,
+	size_t const n_vertices)
+{
+	for (size_t v = 0; v < n_vertices; v++) {
+		/* FMA kernels round differently */
+		bool const same =
+			(fabsf(a[v].x - b[v].x) <= 1e-3f)
+			& (fabsf(a[v].y - b[v].y) <= 1e-3f)
+			& (fabsf(a[v].z - b[v].z) <= 1e-3f)
+			& (memcmp(&a[v].r, &b[v].r, 4) == 0);
+		if (!same)
+			return false;
+	}
+	return true;
+}
+
+static int myy_bench_cull(uint32_t const n_instances)
+{
+	struct myy_instances instances;
+	struct myy_frustum frustum;
+	uint32_t * __restrict reference_spheres = NULL;
+	uint32_t * __restrict reference_aabbs = NULL;
+	struct myy_vertex * __restrict reference_vertices = NULL;
+	struct myy_vertex * __restrict vertices = NULL;
+	uint32_t n_reference_spheres, n_reference_aabbs;
+	uint32_t random_state = 0x12345678;
+	int ret = -1;
+
+	if (myy_instances_init(&instances, n_instances) != 0)
+		return -1;
+
+	for (uint32_t i = 0; i < n_instances; i++) {
+		float const size = 0.5f + 2.0f * myy_bench_random(&random_state);
+		instances.x[i] = 400.0f * myy_bench_random(&random_state) - 200.0f;
+		instances.y[i] = 400.0f * myy_bench_random(&random_state) - 200.0f;
+		instances.z[i] = 400.0f * myy_bench_random(&random_state) - 200.0f;
+		instances.radius[i]   = size * sqrtf(3.0f);
+		instances.extent_x[i] = size;
+		instances.extent_y[i] = size;
+		instances.extent_z[i] = size;
+		instances.colors[i] = random_state;
+		struct myy_mat4 const model = myy_mat4_model(
+			6.3f * myy_bench_random(&random_state),
+			6.3f * myy_bench_random(&random_state),
+			instances.x[i], instances.y[i], instances.z[i]);
+		myy_instances_set_matrix(&instances, i, &model);
+	}
+	instances.count = n_instances;
+
+	struct myy_mat4 const projection =
+		myy_mat4_perspective(0.8f, 16.0f / 9.0f, 0.5f, 300.0f);
+	struct myy_mat4 const view =
+		myy_mat4_model(0.2f, 0.4f, 0.0f, 0.0f, -50.0f);
+	struct myy_mat4 const view_projection =
+		myy_mat4_multiply(&projection, &view);
+	myy_frustum_from_matrix(&frustum, &view_projection);
+
+	reference_spheres = malloc(n_instances * sizeof(uint32_t));
+	reference_aabbs   = malloc(n_instances * sizeof(uint32_t));
+	if (reference_spheres == NULL || reference_aabbs == NULL)
+		goto out;
+
+	n_reference_spheres = myy_cull_scalar(
+		&frustum, &instances, MYY_CULL_SPHERES, reference_spheres);
+	n_reference_aabbs = myy_cull_scalar(
+		&frustum, &instances, MYY_CULL_AABBS, reference_aabbs);
+
+	size_t const n_vertices =
+		(size_t) n_reference_spheres * myy_cube_mesh.n_vertices;
+	size_t const vertices_size = n_vertices * sizeof(struct myy_vertex);
+	reference_vertices = malloc(vertices_size + 1);
+	vertices = malloc(vertices_size + 1);
+	if (reference_vertices == NULL || vertices == NULL)
+		goto out;
+	myy_transform_scalar(&instances, reference_spheres,
+		n_reference_spheres, &myy_cube_mesh, reference_vertices);
+
+	LOGF("%u instances. %u visible spheres, %u visible AABBs",
+		n_instances, n_reference_spheres, n_reference_aabbs);
+	LOGF("%-8s %14s %14s %16s", "kernels",
+		"spheres Mi/s", "AABBs Mi/s", "transform GB/s");
+
+	ret = 0;
+	for (uint32_t k = 0; k < MYY_SIMD_KERNELS_COUNT; k++) {
+		struct myy_simd_kernels const * __restrict const kernels =
+			myy_simd_kernels_available + k;
+		double rates[3];
+
+		if (!myy_simd_kernels_supported(kernels))
+			continue;
+
+		for (uint32_t test = 0; test < 3; test++) {
+			uint64_t const start_ns = myy_clock_ns();
+			uint64_t elapsed_ns;
+			uint32_t runs = 0;
+			do {
+				if (test < 2) {
+					instances.n_visible = kernels->cull(&frustum, &instances,
+						(test == 0) ? MYY_CULL_SPHERES : MYY_CULL_AABBS,
+						instances.visible);
+				}
+				else {
+					kernels->transform(&instances, reference_spheres,
+						n_reference_spheres, &myy_cube_mesh, vertices);
+				}
+				runs++;
+				elapsed_ns = myy_clock_ns() - start_ns;
+			} while (elapsed_ns < MYY_BENCH_MIN_NS);
+
+			rates[test] = (test < 2)
+				? (double) n_instances * runs / (elapsed_ns / 1e3)
+				: (double) vertices_size * runs / elapsed_ns;
+
+			bool const valid = (test < 2)
+				? (instances.n_visible ==
+				   ((test == 0) ? n_reference_spheres : n_reference_aabbs))
+				  && memcmp(instances.visible,
+				            (test == 0) ? reference_spheres : reference_aabbs,
+				            instances.n_visible * sizeof(uint32_t)) == 0
+				: myy_bench_same_vertices(
+				      vertices, reference_vertices, n_vertices);
+			if (!valid) {
+				LOG_ERROR("%s kernels : test %u gives different results "
+				          "than the scalar ones !", kernels->name, test);
+				ret = -1;
+			}
+		}
+
+		LOGF("%-8s %14.1f %14.1f %16.2f",
+			kernels->name, rates[0], rates[1], rates[2]);
+	}
+
+out:
+	free(vertices);
+	free(reference_vertices);
+	free(reference_aabbs);
+	free(reference_spheres);
+	myy_instances_free(&instances);
+	return ret;
+}
+
+/* CPU only benchmark of the pixel conversion kernels, on a
+ * width x height frame. Results are checked against the scalar
+ * kernels, byte for byte. */
+#define MYY_DEFAULT_BENCH_WIDTH  (3840)
+#define MYY_DEFAULT_BENCH_HEIGHT (2160)
+
+enum myy_bench_conversion {
+	MYY_BENCH_SWIZZLE,
+	MYY_BENCH_RGB24,
+	MYY_BENCH_NV12,
+	MYY_BENCH_I420,
+	MYY_BENCH_CONVERSIONS
+};
+
+static void myy_bench_convert_run(
+	struct myy_simd_kernels const * __restrict const kernels,
+	enum myy_bench_conversion const conversion,
+	uint8_t const * __restrict const src,
+	uint8_t * __restrict const dst,
+	uint32_t const width,
+	uint32_t const height)
+{
+	struct myy_yuv_coefs coefs;
+	struct myy_yuv420_image image;
+	size_t const stride = (size_t) width * 4;
+
+	switch (conversion) {
+	case MYY_BENCH_SWIZZLE:
+		for (uint32_t row = 0; row < height; row++)
+			kernels->swizzle(src + row * stride, dst + row * stride, width);
+		break;
+	case MYY_BENCH_RGB24:
+		for (uint32_t row = 0; row < height; row++)
+			kernels->rgb24(src + row * stride, dst + row * width * 3, width);
+		break;
+	case MYY_BENCH_NV12:
+	case MYY_BENCH_I420:
+		myy_yuv_coefs_get(&coefs, MYY_YUV_BT709, MYY_PIXELS_BGRX);
+		myy_yuv420_image_layout(&image,
+			(conversion == MYY_BENCH_NV12) ? MYY_YUV420_NV12 : MYY_YUV420_I420,
+			dst, width, height);
+		for (uint32_t row = 0; row < height; row += 2) {
+			kernels->yuv420(src + row * stride, src + (row + 1) * stride,
+				width, &coefs,
+				image.y + row * image.y_stride,
+				image.y + (row + 1) * image.y_stride,
+				image.u + (row / 2) * image.uv_stride,
+				image.v + (row / 2) * image.uv_stride,
+				image.chroma_step);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static int myy_bench_convert(uint32_t const width, uint32_t const height)
+{
+	static char const * const names[MYY_BENCH_CONVERSIONS] = {
+		"swizzle", "rgb24", "nv12", "i420"
+	};
+	struct myy_simd_kernels const * __restrict const scalar =
+		myy_simd_kernels_available + MYY_SIMD_KERNELS_COUNT - 1;
+	size_t const frame_size = (size_t) width * height * 4;
+	uint8_t * __restrict const src = malloc(frame_size);
+	uint8_t * __restrict const dst = malloc(frame_size);
+	uint8_t * __restrict const reference = malloc(frame_size);
+	uint32_t random_state = 0x9e3779b9;
+	int ret = -1;
+
+	if ((width | height) & 1 || width == 0 || height == 0) {
+		LOG_ERROR("The frame size must be even, not %ux%u", width, height);
+		goto out;
+	}
+	if (src == NULL || dst == NULL || reference == NULL)
+		goto out;
+
+	/* Noise, with a few saturated pixels for the clamping */
+	for (size_t b = 0; b < frame_size; b++) {
+		myy_bench_random(&random_state);
+		src[b] = (b % 97 == 0) ? 255 : (uint8_t) random_state;
+	}
+
+	LOGF("%ux%u frames. GB/s of source pixels, and frames per second",
+		width, height);
+	LOGF("%-8s %16s %16s %16s %16s", "kernels",
+		names[0], names[1], names[2], names[3]);
+
+	ret = 0;
+	for (uint32_t k = 0; k < MYY_SIMD_KERNELS_COUNT; k++) {
+		struct myy_simd_kernels const * __restrict const kernels =
+			myy_simd_kernels_available + k;
+		char results[MYY_BENCH_CONVERSIONS][24];
+
+		if (!myy_simd_kernels_supported(kernels))
+			continue;
+
+		for (uint32_t c = 0; c < MYY_BENCH_CONVERSIONS; c++) {
+			uint64_t const start_ns = myy_clock_ns();
+			uint64_t elapsed_ns;
+			uint32_t runs = 0;
+
+			memset(dst, 0, frame_size);
+			do {
+				myy_bench_convert_run(kernels, c, src, dst, width, height);
+				runs++;
+				elapsed_ns = myy_clock_ns() - start_ns;
+			} while (elapsed_ns < MYY_BENCH_MIN_NS);
+
+			snprintf(results[c], sizeof(results[c]), "%6.2f (%5.0f)",
+				(double) frame_size * runs / elapsed_ns,
+				runs / (elapsed_ns / 1e9));
+
+			memset(reference, 0, frame_size);
+			myy_bench_convert_run(scalar, c, src, reference, width, height);
+			if (memcmp(dst, reference, frame_size) != 0) {
+				LOG_ERROR("%s kernels : %s gives different results "
+				          "than the scalar one !", kernels->name, names[c]);
+				ret = -1;
+			}
+		}
+
+		LOGF("%-8s %16s %16s %16s %16s", kernels->name,
+			results[0], results[1], results[2], results[3]);
+	}
+
+out:
+	free(reference);
+	free(dst);
+	free(src);
+	return ret;
+}
+
+/* Recording self-check.
+ * Records synthetic frames, then reads the file back with the
+ * record_extract reader and compares every frame byte for byte.
+ * The frames mix still periods, a moving square and noise bursts,
+ * so that keyframes, deltas, skipped tiles and raw tiles all show up.
+ * The sizes are not multiples of the tile size, for the edge tiles. */
+#define MYY_DEFAULT_CHECK_FRAMES (300)
+#define MYY_CHECK_WIDTH  (333)
+#define MYY_CHECK_HEIGHT (200)
+
+static void myy_check_recording_frame(
+	uint8_t * __restrict const pixels,
+	uint32_t const width,
+	uint32_t const height,
+	uint32_t const f)
+{
+	/* Still for a few frames, every now and then */
+	uint32_t const t = (f % 50 < 40) ? f : f - (f % 50 - 39);
+	uint32_t const square_x = (t * 7) % width;
+	uint32_t const square_y = (t * 3) % height;
+	uint32_t random_state = 0x9e3779b9 ^ t;
+
+	for (uint32_t y = 0; y < height; y++) {
+		for (uint32_t x = 0; x < width; x++) {
+			uint8_t * __restrict const p = pixels + ((size_t) y * width + x) * 4;
+			bool const in_square =
+				(x - square_x < 48) & (y - square_y < 48);
+			p[0] = (uint8_t) (x + t);
+			p[1] = (uint8_t) (y * 2);
+			p[2] = in_square ? 255 : (uint8_t) ((x ^ y) >> 2);
+			p[3] = 255;
+			/* Noise bursts barely compress, and end up stored raw */
+			if ((t % 64 == 13) & (y < 70)) {
+				myy_bench_random(&random_state);
+				p[0] = (uint8_t) random_state;
+				p[1] = (uint8_t) (random_state >> 8);
+			}
+		}
+	}
+}
+
+static int myy_check_recording(uint32_t const n_frames)
+{
+	uint32_t const width = MYY_CHECK_WIDTH;
+	uint32_t const height = MYY_CHECK_HEIGHT;
+	size_t const frame_size = (size_t) width * height * 4;
+	ptrdiff_t const stride = (ptrdiff_t) width * 4;
+	size_t const max_tile =
+		(size_t) MYY_RECORDER_TILE_SIZE * MYY_RECORDER_TILE_SIZE * 4;
+	char path[] = "/tmp/myy-check-XXXXXX";
+	struct myy_recorder recorder;
+	struct myy_rec_file rec;
+	uint32_t mismatches = 0;
+	int ret = -1;
+
+	memset(&rec, 0, sizeof(rec));
+	uint8_t * __restrict const pixels = malloc(frame_size);
+	uint8_t * __restrict const flipped = malloc(frame_size);
+	uint8_t * __restrict const decoded = calloc(frame_size, 1);
+	uint8_t * __restrict const tile_data = malloc(max_tile);
+	uint8_t * __restrict const compressed = malloc(myy_lz_bound(max_tile));
+	int const fd = mkstemp(path);
+	if (fd < 0) {
+		LOG_ERROR("Could not create %s : %m", path);
+		goto out;
+	}
+	close(fd);
+	if (!pixels || !flipped || !decoded || !tile_data || !compressed)
+		goto out;
+
+	if (myy_recorder_open(&recorder, path, width, height))
+		goto out;
+	for (uint32_t f = 0; f < n_frames; f++) {
+		myy_check_recording_frame(pixels, width, height, f);
+		/* Every other frame goes through the OpenGL, bottom to top,
+		 * path of the capture. */
+		int added;
+		if (f & 1) {
+			for (uint32_t y = 0; y < height; y++)
+				memcpy(flipped + (height - 1 - y) * stride,
+					pixels + y * stride, stride);
+			added = myy_recorder_add_frame(&recorder,
+				flipped + (height - 1) * stride, -stride, f, f * 16666667ull);
+		}
+		else {
+			added = myy_recorder_add_frame(&recorder,
+				pixels, stride, f, f * 16666667ull);
+		}
+		if (added) {
+			myy_recorder_close(&recorder);
+			goto out;
+		}
+	}
+	myy_recorder_close(&recorder);
+
+	rec.file = fopen(path, "rb");
+	if (rec.file == NULL
+	    || myy_rec_read_at(rec.file, 0, &rec.header, sizeof(rec.header))
+	    || myy_rec_scan(&rec))
+	{
+		LOG_ERROR("Could not read %s back", path);
+		goto out;
+	}
+	if (rec.n_frames != n_frames
+	    || rec.header.width != width || rec.header.height != height)
+	{
+		LOG_ERROR("Read back %u frames of %ux%u, instead of %u of %ux%u",
+			rec.n_frames, rec.header.width, rec.header.height,
+			n_frames, width, height);
+		goto out;
+	}
+
+	uint64_t offset = sizeof(rec.header);
+	for (uint32_t f = 0; f < n_frames; f++) {
+		offset = myy_rec_apply_frame(&rec, offset, decoded, tile_data, compressed);
+		if (offset == 0) {
+			LOG_ERROR("Could not decode the frame %u", f);
+			goto out;
+		}
+		myy_check_recording_frame(pixels, width, height, f);
+		mismatches += (memcmp(decoded, pixels, frame_size) != 0);
+	}
+
+	/* An interrupted recording : no index, and half of the last frame */
+	fclose(rec.file);
+	free(rec.keyframes);
+	memset(&rec, 0, sizeof(rec));
+	if (truncate(path, (off_t) (offset - 1)) != 0) {
+		LOG_ERROR("Could not truncate %s : %m", path);
+		goto out;
+	}
+	rec.file = fopen(path, "rb");
+	if (rec.file == NULL
+	    || myy_rec_read_at(rec.file, 0, &rec.header, sizeof(rec.header))
+	    || myy_rec_scan(&rec)
+	    || rec.n_frames != n_frames - 1)
+	{
+		LOG_ERROR("The truncated recording should have %u frames, not %u",
+			n_frames - 1, rec.n_frames);
+		goto out;
+	}
+
+	LOGF("%u frames of %ux%u recorded and read back. %u mismatches",
+		n_frames, width, height, mismatches);
+	ret = (mismatches == 0) ? 0 : -1;
+
+out:
+	if (rec.file != NULL)
+		fclose(rec.file);
+	free(rec.keyframes);
+	unlink(path);
+	free(compressed);
+	free(tile_data);
+	free(decoded);
+	free(flipped);
+	free(pixels);
+	return ret;
+}
+
+struct myy_options {
+	bool on_demand;
+	uint32_t keepalive_hz;
+	struct myy_color_profile color;
+	struct myy_egl_config_needs config_needs;
+	uint32_t n_cubes;
+	uint32_t stats_interval;
+	char const * backdrop;
+	uint32_t bench_cull;
+	uint32_t bench_convert_width, bench_convert_height;
+	uint32_t check_recording;
+	bool assert_zero_alloc;
+	uint32_t capture_every;
+	char const * capture_dir;
+	enum myy_capture_format capture_format;
+	char const * export_socket;
+	uint32_t reinit_cycles;
+	char const * splash;
+	char const * device_bus_id;
+	char const * render_bus_id;
+	char const * compositor_socket;
+	char const * client_socket;
+	char const * dmabuf_socket;
+	char const * video;
+	bool writeback;
+};
+
+static void myy_print_usage(char const * __restrict const program_name)
+{
+	LOG_ERROR(
+		"Usage : %s [options]\n"
+		"  -d, --on-demand        Only render when the scene changes\n"
+		"  -k, --keepalive=HZ     Minimum frame rate in on-demand mode\n"
+		"                         (0 disables it, default : %u)\n"
+		"  -g, --gamma=G          Gamma correction done by the CRTC\n"
+		"  -G, --degamma=G        Degamma curve applied by the CRTC\n"
+		"  -c, --ctm=a,b,...,i    3x3 colour matrix applied by the CRTC\n"
+		"      --depth=BITS       Depth buffer bits needed (default : %d)\n"
+		"      --no-depth         Same as --depth=0\n"
+		"      --stencil=BITS     Stencil buffer bits needed\n"
+		"      --msaa=SAMPLES     Multisampling samples needed\n"
+		"      --alpha            Need an alpha channel\n"
+		"      --rgb565           Accept 16 bits RGB565 framebuffers\n"
+		"  -n, --cubes=N          Number of spinning cubes (stress test)\n"
+		"  -s, --stats=FRAMES     Print telemetry every FRAMES frames\n"
+		"  -t, --texture=SOURCE   Backdrop image, loaded in the background.\n"
+		"                         A P6 PPM file, checker:SIZE or gradient:SIZE\n"
+		"      --splash=SOURCE    Image shown while EGL starts. Same sources\n"
+		"                         as --texture\n"
+		"      --device=BUS_ID    Use the GPU on this PCI bus (01:00.0).\n"
+		"                         Default : the first one with a display\n"
+		"      --render-device=BUS_ID Render on this GPU, and send the\n"
+		"                         frames to the --device one for display\n"
+		"      --compositor=SOCKET Only set the mode, and let another\n"
+		"                         process render into the plane stream\n"
+		"      --client=SOCKET    Render into the stream of a compositor\n"
+		"      --assert-zero-alloc Abort if building a frame allocates\n"
+		"                         heap memory, after %u warm-up frames\n"
+		"      --capture-every=N  Save one frame every N frames, without\n"
+		"                         stalling the rendering\n"
+		"      --capture-dir=DIR  Where to save the frames (default : .)\n"
+		"      --capture-format=F pam (default), or raw rgb24, nv12, i420,\n"
+		"                         or rec : one compressed recording\n"
+		"      --export=SOCKET    Share the frames with other processes,\n"
+		"                         through a memfd handed over SOCKET\n"
+		"                         (every frame, or every --capture-every)\n"
+		"      --writeback        Capture the CRTC output with a writeback\n"
+		"                         connector, instead of reading back the\n"
+		"                         GL frames\n"
+		"      --dmabuf=SOCKET    Show the dma-buf buffers other processes\n"
+		"                         send over SOCKET, full screen\n"
+		"      --video=SOURCE     Play a video on an overlay plane.\n"
+		"                         nv12:WxH@FPS:FILE, i420:WxH@FPS:FILE\n"
+		"                         (raw frames) or bars:WxH@FPS\n"
+		"      --bench-cull[=N]   Benchmark the culling and transform\n"
+		"                         kernels on N instances (default : %u)\n"
+		"                         then exit\n"
+		"      --bench-convert[=WxH] Benchmark the pixel conversion\n"
+		"                         kernels on WxH frames (default : %ux%u)\n"
+		"                         then exit\n"
+		"      --check-recording[=N] Record N synthetic frames (default : %u),\n"
+		"                         compare them with what is read back,\n"
+		"                         then exit\n"
+		"      --reinit-cycles=N  Bring the whole DRM and EGL stack up\n"
+		"                         and down N times, check for leaks\n"
+		"                         then exit\n"
+		"  -h, --help             Show this help",
+		program_name, MYY_DEFAULT_KEEPALIVE_HZ, MYY_DEFAULT_DEPTH_BITS,
+		MYY_ZERO_ALLOC_WARMUP_FRAMES, MYY_DEFAULT_BENCH_INSTANCES,
+		MYY_DEFAULT_BENCH_WIDTH, MYY_DEFAULT_BENCH_HEIGHT,
+		MYY_DEFAULT_CHECK_FRAMES);
+}
+
+static int myy_parse_options(
+	int const argc,
+	char * const * const argv,
+	struct myy_options * __restrict const options)
+{
+	struct option const long_options[] = {
+		{ "on-demand", no_argument,       NULL, 'd' },
+		{ "keepalive", required_argument, NULL, 'k' },
+		{ "gamma",     required_argument, NULL, 'g' },
+		{ "degamma",   required_argument, NULL, 'G' },
+		{ "ctm",       required_argument, NULL, 'c' },
+		{ "depth",     required_argument, NULL, 'D' },
+		{ "no-depth",  no_argument,       NULL, 'N' },
+		{ "stencil",   required_argument, NULL, 'S' },
+		{ "msaa",      required_argument, NULL, 'M' },
+		{ "alpha",     no_argument,       NULL, 'A' },
+		{ "rgb565",    no_argument,       NULL, 'R' },
+		{ "cubes",     required_argument, NULL, 'n' },
+		{ "stats",     required_argument, NULL, 's' },
+		{ "texture",   required_argument, NULL, 't' },
+		{ "bench-cull", optional_argument, NULL, 'C' },
+		{ "bench-convert", optional_argument, NULL, 'V' },
+		{ "check-recording", optional_argument, NULL, 'Q' },
+		{ "assert-zero-alloc", no_argument, NULL, 'Z' },
+		{ "capture-every", required_argument, NULL, 'E' },
+		{ "capture-dir", required_argument, NULL, 'O' },
+		{ "capture-format", required_argument, NULL, 'F' },
+		{ "export", required_argument, NULL, 'X' },
+		{ "reinit-cycles", required_argument, NULL, 'I' },
+		{ "splash", required_argument, NULL, 'P' },
+		{ "device", required_argument, NULL, 'B' },
+		{ "render-device", required_argument, NULL, 'W' },
+		{ "compositor", required_argument, NULL, 'Y' },
+		{ "client", required_argument, NULL, 'J' },
+		{ "dmabuf", required_argument, NULL, 'U' },
+		{ "video", required_argument, NULL, 'H' },
+		{ "writeback", no_argument, NULL, 'K' },
+		{ "help",      no_argument,       NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+
+	options->on_demand    = false;
+	options->keepalive_hz = MYY_DEFAULT_KEEPALIVE_HZ;
+	memset(&options->color, 0, sizeof(options->color));
+	memset(&options->config_needs, 0, sizeof(options->config_needs));
+	options->config_needs.depth_bits = MYY_DEFAULT_DEPTH_BITS;
+	options->n_cubes = 1;
+	options->stats_interval = 0;
+	options->backdrop = NULL;
+	options->bench_cull = 0;
+	options->bench_convert_width  = 0;
+	options->bench_convert_height = 0;
+	options->check_recording = 0;
+	options->assert_zero_alloc = false;
+	options->capture_every = 0;
+	options->capture_dir = NULL;
+	options->capture_format = MYY_CAPTURE_PAM;
+	options->export_socket = NULL;
+	options->reinit_cycles = 0;
+	options->splash = NULL;
+	options->device_bus_id = NULL;
+	options->render_bus_id = NULL;
+	options->compositor_socket = NULL;
+	options->client_socket = NULL;
+	options->dmabuf_socket = NULL;
+	options->video = NULL;
+	options->writeback = false;
+
+	while ((opt = getopt_long(
+		argc, argv, "dk:g:G:c:n:s:t:h", long_options, NULL)) != -1)
+	{
+		switch (opt) {
+		case 'd':
+			options->on_demand = true;
+			break;
+		case 'k':
+			options->keepalive_hz = strtoul(optarg, NULL, 10);
+			break;
+		case 'g':
+			options->color.gamma = strtof(optarg, NULL);
+			break;
+		case 'G':
+			options->color.degamma = strtof(optarg, NULL);
+			break;
+		case 'c':
+			options->color.has_ctm =
+				myy_parse_ctm(optarg, options->color.ctm);
+			if (!options->color.has_ctm) {
+				LOG_ERROR("--ctm expects 9 values");
+				return -1;
+			}
+			break;
+		case 'D':
+			options->config_needs.depth_bits = strtol(optarg, NULL, 10);
+			break;
+		case 'N':
+			options->config_needs.depth_bits = 0;
+			break;
+		case 'S':
+			options->config_needs.stencil_bits = strtol(optarg, NULL, 10);
+			break;
+		case 'M':
+			options->config_needs.samples = strtol(optarg, NULL, 10);
+			break;
+		case 'A':
+			options->config_needs.alpha = true;
+			break;
+		case 'R':
+			options->config_needs.allow_rgb565 = true;
+			break;
+		case 'n':
+			options->n_cubes = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			options->stats_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			options->backdrop = optarg;
+			break;
+		case 'Z':
+			options->assert_zero_alloc = true;
+#if !defined(MYY_HEAP_COUNTERS)
+			LOGF("--assert-zero-alloc : heap allocations are not "
+				"counted in this build (see MYY_HEAP_COUNTERS)");
+#endif
+			break;
+		case 'E':
+			options->capture_every = strtoul(optarg, NULL, 10);
+			break;
+		case 'O':
+			options->capture_dir = optarg;
+			break;
+		case 'X':
+			options->export_socket = optarg;
+			break;
+		case 'I':
+			options->reinit_cycles = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			options->splash = optarg;
+			break;
+		case 'B':
+			options->device_bus_id = optarg;
+			break;
+		case 'W':
+			options->render_bus_id = optarg;
+			break;
+		case 'Y':
+			options->compositor_socket = optarg;
+			break;
+		case 'J':
+			options->client_socket = optarg;
+			break;
+		case 'U':
+			options->dmabuf_socket = optarg;
+			break;
+		case 'H':
+			options->video = optarg;
+			break;
+		case 'K':
+			options->writeback = true;
+			break;
+		case 'F':
+			options->capture_format = MYY_CAPTURE_FORMATS;
+			for (uint32_t f = 0; f < MYY_CAPTURE_FORMATS; f++) {
+				if (strcmp(optarg, myy_capture_format_names[f]) == 0)
+					options->capture_format = f;
+			}
+			if (options->capture_format == MYY_CAPTURE_FORMATS) {
+				LOG_ERROR("Unknown capture format %s", optarg);
+				return -1;
+			}
+			break;
+		case 'C':
+			options->bench_cull = optarg
+				? strtoul(optarg, NULL, 10)
+				: MYY_DEFAULT_BENCH_INSTANCES;
+			break;
+		case 'V':
+			options->bench_convert_width  = MYY_DEFAULT_BENCH_WIDTH;
+			options->bench_convert_height = MYY_DEFAULT_BENCH_HEIGHT;
+			if (optarg && sscanf(optarg, "%ux%u",
+				&options->bench_convert_width,
+				&options->bench_convert_height) != 2)
+			{
+				LOG_ERROR("--bench-convert expects WIDTHxHEIGHT");
+				return -1;
+			}
+			break;
+		case 'Q':
+			options->check_recording = optarg
+				? strtoul(optarg, NULL, 10)
+				: MYY_DEFAULT_CHECK_FRAMES;
+			break;
+		case 'h':
+		default:
+			myy_print_usage(argv[0]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Startup.
+ * As soon as the DRM node is open, the EGL display, context and the
+ * scene (shaders included) are prepared on another thread, with the
+ * context current without any surface.
+ * Meanwhile, the splash is drawn into the dumb buffer and displayed
+ * by the modeset. It stays on screen until the first frame goes
+ * through the EGLStream.
+ * The stream needs the CRTC to run, so it's created on the main
+ * thread after the modeset, once the startup thread has released
+ * the context. Without EGL_KHR_surfaceless_context, the scene is
+ * prepared there too, after the stream.
+ * With a render device, the context draws into a pbuffer on that
+ * device instead, and nothing is connected to the display one. */
+struct myy_egl_startup {
+	pthread_t thread;
+	struct myy_nvidia_functions const * nvidia;
+	EGLDeviceEXT device;
+	/* EGL_NO_DEVICE_EXT to render on the display device */
+	EGLDeviceEXT render_device;
+	myy_drm_infos_t * drm;
+	myy_opengl_infos_t * gl;
+	struct myy_scene * scene;
+	uint32_t n_cubes;
+	/* Results */
+	bool egl_ready;
+	bool scene_ready;
+	/* No surfaceless context. The scene waits for the stream. */
+	bool scene_deferred;
+	uint64_t ready_ns;
+};
+
+static void * myy_egl_startup_thread(void * user_data)
+{
+	struct myy_egl_startup * __restrict const startup = user_data;
+	myy_drm_infos_t const * __restrict const drm = startup->drm;
+
+	myy_opengl_infos_t * __restrict const gl = startup->gl;
+
+	startup->egl_ready = (startup->render_device != EGL_NO_DEVICE_EXT)
+		? (egl_prepare_offscreen_context(startup->nvidia,
+			startup->render_device, drm->width, drm->height, gl) == 0)
+		: (egl_prepare_display_context(startup->nvidia,
+			startup->device, startup->drm, gl) == 0);
+	if (!startup->egl_ready) {
+		LOG_ERROR(
+			"Failed to initialize EGL through NVIDIA means");
+		return NULL;
+	}
+
+	if (gl->surface == EGL_NO_SURFACE
+	    && (!myy_egl_caps_has(&gl->display_caps,
+	                          MYY_EGL_KHR_surfaceless_context)
+	        || !eglMakeCurrent(gl->display,
+	                           EGL_NO_SURFACE, EGL_NO_SURFACE, gl->context)))
+	{
+		LOGF("No surfaceless context. "
+		     "The scene will be prepared after the modeset.");
+		startup->scene_deferred = true;
+		return NULL;
+	}
+
+	startup->scene_ready = (myy_scene_init(startup->scene, gl,
+		drm->width, drm->height, startup->n_cubes) == 0);
+	if (!startup->scene_ready)
+		LOG_ERROR("Could not prepare the scene");
+
+	eglMakeCurrent(gl->display,
+		EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglReleaseThread();
+	return NULL;
+}
+
+static int myy_egl_startup_begin(
+	struct myy_egl_startup * __restrict const startup)
+{
+	startup->egl_ready      = false;
+	startup->scene_ready    = false;
+	startup->scene_deferred = false;
+	if (pthread_create(&startup->thread, NULL,
+		myy_egl_startup_thread, startup) != 0)
+	{
+		LOG_ERROR("Could not start the EGL startup thread");
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns 0 if everything is ready and current on this thread.
+ * crtc_ready tells whether the modeset went through. The stream is
+ * only attached to the plane after it. */
+static int myy_egl_startup_end(
+	struct myy_egl_startup * __restrict const startup,
+	bool const crtc_ready)
+{
+	myy_opengl_infos_t * __restrict const gl = startup->gl;
+	myy_drm_infos_t const * __restrict const drm = startup->drm;
+
+	pthread_join(startup->thread, NULL);
+	if (!startup->egl_ready)
+		return -1;
+
+	/* The bound API is per thread */
+	eglBindAPI(EGL_OPENGL_ES_API);
+	if (gl->surface != EGL_NO_SURFACE) {
+		if (!eglMakeCurrent(gl->display,
+			gl->surface, gl->surface, gl->context))
+		{
+			LOG_EGL_ERROR("Could not make the context current again");
+			return -1;
+		}
+	}
+	else if (!crtc_ready
+	         || egl_attach_stream_surface(startup->nvidia, drm, gl) != 0)
+	{
+		return -1;
+	}
+
+	if (startup->scene_deferred) {
+		startup->scene_ready = (myy_scene_init(startup->scene, gl,
+			drm->width, drm->height, startup->n_cubes) == 0);
+		if (!startup->scene_ready)
+			LOG_ERROR("Could not prepare the scene");
+	}
+
+	startup->ready_ns = myy_clock_ns();
+	return startup->scene_ready ? 0 : -1;
+}
+
+/* The splash.
+ * Decoded on its own thread while the mode is set, so the modeset
+ * doesn't wait for it. It is then painted into the dumb buffer, which
+ * is already on screen by then. Same sources as the backdrop. */
+struct myy_splash {
+	pthread_t thread;
+	bool started;
+	bool decoded;
+	struct myy_texture_job job;
+};
+
+static void * myy_splash_decode_thread(void * user_data)
+{
+	struct myy_splash * __restrict const splash = user_data;
+	splash->decoded = myy_texture_decode(&splash->job);
+	return NULL;
+}
+
+static void myy_splash_begin(
+	struct myy_splash * __restrict const splash,
+	char const * __restrict const source)
+{
+	memset(splash, 0, sizeof(*splash));
+	if (source == NULL)
+		return;
+
+	snprintf(splash->job.source, sizeof(splash->job.source), "%s", source);
+	splash->started = (pthread_create(&splash->thread, NULL,
+		myy_splash_decode_thread, splash) == 0);
+	if (!splash->started)
+		LOG_ERROR("Could not start decoding the splash %s", source);
+}
+
+/* The image is centered, and cropped if it doesn't fit.
+ * Does nothing but waiting for the decoder if the dumb buffer isn't
+ * mapped. */
+static void myy_splash_end(
+	struct myy_splash * __restrict const splash,
+	myy_drm_infos_t const * __restrict const drm)
+{
+	uint8_t * __restrict const pixels = drm->dumb_map;
+	uint32_t const pitch  = drm->dumb_pitch;
+	uint32_t const width  = drm->width;
+	uint32_t const height = drm->height;
+
+	if (!splash->started)
+		return;
+
+	pthread_join(splash->thread, NULL);
+	splash->started = false;
+
+	struct myy_texture_job const job = splash->job;
+	if (!splash->decoded) {
+		LOG_ERROR("Could not decode the splash %s", job.source);
+		return;
+	}
+	if (pixels == NULL) {
+		free(job.pixels);
+		return;
+	}
+
+	uint32_t const copy_width  = (job.width  < width)  ? job.width  : width;
+	uint32_t const copy_height = (job.height < height) ? job.height : height;
+	uint32_t const src_x = (job.width  - copy_width)  / 2;
+	uint32_t const src_y = (job.height - copy_height) / 2;
+	uint32_t const dst_x = (width  - copy_width)  / 2;
+	uint32_t const dst_y = (height - copy_height) / 2;
+	ptrdiff_t const src_stride = (ptrdiff_t) job.width * 4;
+
+	/* RGBA to XRGB8888 (B, G, R, X in memory) */
+	myy_convert_swizzle(
+		job.pixels + src_y * src_stride + src_x * 4, src_stride,
+		pixels + (size_t) dst_y * pitch + dst_x * 4, pitch,
+		copy_width, copy_height);
+
+	free(job.pixels);
+}
+
+/* Client buffers (dma-buf).
+ * With --dmabuf=SOCKET, other processes (video decoders, camera
+ * pipelines, ...) can show their buffers without any copy. For each
+ * frame, a client sends a myy_dmabuf_desc, with the dma-buf fds of
+ * its planes attached (SCM_RIGHTS). One fd is enough when every
+ * plane lives in the same dma-buf.
+ *
+ * The buffer is shown full screen, above the scene :
+ * - on an overlay plane, when one can scan out its format and
+ *   modifier (see the plane formats index). GL isn't involved at all.
+ * - otherwise, imported as an EGLImage (EGL_EXT_image_dma_buf_import)
+ *   and drawn as the client layer of the scene.
+ *
+ * Clients cycle through a few buffers, so the imports (framebuffer,
+ * EGLImage and texture) are cached by buffer identity : the inode of
+ * the dma-buf. Showing a buffer again then only costs a commit, or a
+ * draw.
+ * Buffers are referenced until the client disconnects. A client
+ * should not write into a buffer before having sent two other ones.
+ * One client at a time.
+ */
+#define MYY_DMABUF_MAGIC      (0x46424d44u) /* "DMBF" */
+#define MYY_DMABUF_VERSION    (1)
+#define MYY_DMABUF_MAX_PLANES (4)
+#define MYY_DMABUF_CACHE_SIZE (8)
+
+struct myy_dmabuf_desc {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t fourcc;
+	uint32_t n_planes;
+	/* DRM_FORMAT_MOD_INVALID for an implicit layout */
+	uint64_t modifier;
+	uint32_t offsets[MYY_DMABUF_MAX_PLANES];
+	uint32_t pitches[MYY_DMABUF_MAX_PLANES];
+};
+
+struct myy_dmabuf_entry {
+	bool used;
+	/* Identity of the buffer */
+	dev_t dev;
+	ino_t ino;
+	struct myy_dmabuf_desc desc;
+	int fds[MYY_DMABUF_MAX_PLANES];
+	uint32_t n_fds;
+	uint64_t last_use;
+	/* Imported on the first use of each path */
+	EGLImageKHR image;
+	GLuint texture;
+	bool gl_failed;
+	uint32_t fb_id;
+	/* No plane can scan it out, or it can't be a framebuffer */
+	bool fb_failed;
+	/* The overlay plane that refused it. Others may take it. */
+	uint32_t fb_refused_plane;
+};
+
+struct myy_dmabuf_importer {
+	bool enabled;
+	myy_drm_infos_t * drm;
+	struct myy_scene * scene;
+	struct myy_frame_loop * loop;
+	EGLDisplay display;
+	bool gl_import;
+	bool modifiers;
+	PFNEGLCREATEIMAGEKHRPROC eglCreateImageKHR;
+	PFNEGLDESTROYIMAGEKHRPROC eglDestroyImageKHR;
+	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+	struct myy_drm_overlay overlay;
+	/* On the overlay right now. NULL when the overlay is off. */
+	struct myy_dmabuf_entry * scanned_out;
+	char socket_path[108];
+	int listen_fd;
+	int client_fd;
+	uint64_t uses;
+	uint32_t frames, imports, direct, dropped;
+	struct myy_dmabuf_entry entries[MYY_DMABUF_CACHE_SIZE];
+};
+
+static struct myy_dmabuf_importer myy_dmabuf_importer;
+
+static EGLint const myy_dmabuf_plane_attribs[MYY_DMABUF_MAX_PLANES][5] = {
+	{ EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+	  EGL_DMA_BUF_PLANE0_PITCH_EXT,
+	  EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+	{ EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+	  EGL_DMA_BUF_PLANE1_PITCH_EXT,
+	  EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+	{ EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+	  EGL_DMA_BUF_PLANE2_PITCH_EXT,
+	  EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+	{ EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+	  EGL_DMA_BUF_PLANE3_PITCH_EXT,
+	  EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT },
+};
+
+static inline int myy_dmabuf_entry_fd(
+	struct myy_dmabuf_entry const * __restrict const entry,
+	uint32_t const plane)
+{
+	return entry->fds[(plane < entry->n_fds) ? plane : 0];
+}
+
+static bool myy_dmabuf_import_gl(
+	struct myy_dmabuf_importer * __restrict const importer,
+	struct myy_dmabuf_entry * __restrict const entry)
+{
+	struct myy_dmabuf_desc const * __restrict const desc = &entry->desc;
+	bool const explicit_modifier = importer->modifiers
+		&& (desc->modifier != DRM_FORMAT_MOD_INVALID);
+	EGLint attribs[7 + MYY_DMABUF_MAX_PLANES * 10];
+	uint32_t a = 0;
+
+	if (!importer->gl_import)
+		return false;
+
+	attribs[a++] = EGL_WIDTH;
+	attribs[a++] = desc->width;
+	attribs[a++] = EGL_HEIGHT;
+	attribs[a++] = desc->height;
+	attribs[a++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attribs[a++] = desc->fourcc;
+	for (uint32_t p = 0; p < desc->n_planes; p++) {
+		EGLint const * __restrict const names = myy_dmabuf_plane_attribs[p];
+		attribs[a++] = names[0];
+		attribs[a++] = myy_dmabuf_entry_fd(entry, p);
+		attribs[a++] = names[1];
+		attribs[a++] = desc->offsets[p];
+		attribs[a++] = names[2];
+		attribs[a++] = desc->pitches[p];
+		if (explicit_modifier) {
+			attribs[a++] = names[3];
+			attribs[a++] = (EGLint) (desc->modifier & 0xffffffff);
+			attribs[a++] = names[4];
+			attribs[a++] = (EGLint) (desc->modifier >> 32);
+		}
+	}
+	attribs[a++] = EGL_NONE;
+
+	entry->image = importer->eglCreateImageKHR(importer->display,
+		EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+	if (entry->image == EGL_NO_IMAGE_KHR) {
+		LOG_EGL_ERROR("Could not import the client buffer");
+		return false;
+	}
+
+	/* The renderer only knows GL_TEXTURE_2D. Formats that drivers
+	 * only expose as external textures (most YUV ones) fail here,
+	 * and need an overlay plane. */
+	glGenTextures(1, &entry->texture);
+	myy_gl_bind_texture(entry->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	/* Clear the errors left by earlier calls. Bounded, in case the
+	 * driver never stops reporting one (lost context). */
+	for (uint32_t e = 0; e < 16 && glGetError() != GL_NO_ERROR; e++);
+	importer->glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, entry->image);
+	if (glGetError() != GL_NO_ERROR) {
+		LOG_ERROR("The client buffer can't be sampled as a 2D texture");
+		myy_gl_delete_texture(entry->texture);
+		entry->texture = 0;
+		importer->eglDestroyImageKHR(importer->display, entry->image);
+		entry->image = EGL_NO_IMAGE_KHR;
+		return false;
+	}
+
+	return true;
+}
+
+static bool myy_dmabuf_import_fb(
+	struct myy_dmabuf_importer * __restrict const importer,
+	struct myy_dmabuf_entry * __restrict const entry)
+{
+	struct myy_dmabuf_desc const * __restrict const desc = &entry->desc;
+	int const drm_fd = importer->drm->fd;
+	uint32_t handles[4] = {0};
+	uint32_t pitches[4] = {0};
+	uint32_t offsets[4] = {0};
+	uint64_t modifiers[4] = {0};
+	bool const explicit_modifier = (desc->modifier != DRM_FORMAT_MOD_INVALID);
+	bool imported = true;
+
+	for (uint32_t p = 0; p < desc->n_planes; p++) {
+		imported &= (drmPrimeFDToHandle(drm_fd,
+			myy_dmabuf_entry_fd(entry, p), handles + p) == 0);
+		pitches[p]   = desc->pitches[p];
+		offsets[p]   = desc->offsets[p];
+		modifiers[p] = explicit_modifier ? desc->modifier : 0;
+	}
+
+	if (imported && drmModeAddFB2WithModifiers(drm_fd,
+		desc->width, desc->height, desc->fourcc,
+		handles, pitches, offsets, modifiers, &entry->fb_id,
+		explicit_modifier ? DRM_MODE_FB_MODIFIERS : 0) != 0)
+	{
+		LOG_ERROR("Could not make a framebuffer of the client buffer : %m");
+		entry->fb_id = 0;
+	}
 
-	if (!egl_ret) {
-		LOG_ERROR(
-			"Could not the surface current... ???");
-		goto no_egl_make_current_failed;
+	/* The framebuffer holds its own references. Planes sharing a
+	 * dma-buf share their handle, so only close each one once. */
+	for (uint32_t p = 0; p < desc->n_planes; p++) {
+		bool seen = (handles[p] == 0);
+		for (uint32_t q = 0; q < p; q++)
+			seen |= (handles[q] == handles[p]);
+		if (!seen) {
+			struct drm_gem_close gem_close = { .handle = handles[p] };
+			drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+		}
 	}
 
-	myy_gl_conf->display = display;
-	myy_gl_conf->config  = config;
-	myy_gl_conf->context = context;
-	myy_gl_conf->surface = surface;
-	myy_gl_conf->stream  = stream;
-	return 0;
+	return entry->fb_id != 0;
+}
 
-no_egl_make_current_failed:
-	nvidia_egl_destroy_surface(nvidia, display, surface, stream);
-no_egl_surface:
-	eglDestroyContext(display, context);
-no_egl_context:
-no_egl_config:
-no_opengl_es_api:
-	eglTerminate(display);
-cannot_initialize_egl:
-no_egl_display:
-	return -1;
+static void myy_dmabuf_entry_release(
+	struct myy_dmabuf_importer * __restrict const importer,
+	struct myy_dmabuf_entry * __restrict const entry)
+{
+	if (!entry->used)
+		return;
+
+	if (entry->texture) {
+		if (importer->scene->layer_texture == entry->texture)
+			importer->scene->layer_texture = 0;
+		myy_gl_delete_texture(entry->texture);
+	}
+	if (entry->image != EGL_NO_IMAGE_KHR)
+		importer->eglDestroyImageKHR(importer->display, entry->image);
+	if (entry->fb_id)
+		drmModeRmFB(importer->drm->fd, entry->fb_id);
+	for (uint32_t f = 0; f < entry->n_fds; f++)
+		close(entry->fds[f]);
+	memset(entry, 0, sizeof(*entry));
 }
 
-static void egl_destroy_opengl_context(
-	struct myy_nvidia_functions const * __restrict const nvidia,
-	myy_opengl_infos_t * __restrict const myy_gl_conf)
+/* Takes ownership of the fds. Returns the entry of the buffer, or NULL
+ * if it can't be identified. */
+static struct myy_dmabuf_entry * myy_dmabuf_lookup(
+	struct myy_dmabuf_importer * __restrict const importer,
+	struct myy_dmabuf_desc const * __restrict const desc,
+	int const * __restrict const fds,
+	uint32_t const n_fds)
 {
-	nvidia_egl_destroy_surface(
-		nvidia,
-		myy_gl_conf->display,
-		myy_gl_conf->surface,
-		myy_gl_conf->stream);
-	eglDestroyContext(
-		myy_gl_conf->display,
-		myy_gl_conf->context);
-	eglTerminate(
-		myy_gl_conf->display);
+	struct myy_dmabuf_entry * __restrict victim = NULL;
+	struct stat buffer;
+
+	if (fstat(fds[0], &buffer) != 0) {
+		LOG_ERROR("Could not identify the client buffer : %m");
+		goto no_entry;
+	}
+
+	for (uint32_t e = 0; e < MYY_DMABUF_CACHE_SIZE; e++) {
+		struct myy_dmabuf_entry * __restrict const entry =
+			importer->entries + e;
+		if (entry->used
+		    && entry->dev == buffer.st_dev && entry->ino == buffer.st_ino
+		    && memcmp(&entry->desc, desc, sizeof(*desc)) == 0)
+		{
+			/* Same buffer, same layout. What we hold already will do. */
+			for (uint32_t f = 0; f < n_fds; f++)
+				close(fds[f]);
+			entry->last_use = ++importer->uses;
+			return entry;
+		}
+
+		/* Never evict what's being scanned out */
+		if (entry == importer->scanned_out)
+			continue;
+		if (victim == NULL || !entry->used
+		    || (victim->used && entry->last_use < victim->last_use))
+			victim = entry;
+	}
+
+	myy_dmabuf_entry_release(importer, victim);
+	victim->used = true;
+	victim->dev  = buffer.st_dev;
+	victim->ino  = buffer.st_ino;
+	victim->desc = *desc;
+	victim->n_fds = n_fds;
+	memcpy(victim->fds, fds, n_fds * sizeof(int));
+	victim->image = EGL_NO_IMAGE_KHR;
+	victim->last_use = ++importer->uses;
+	importer->imports++;
+	return victim;
+
+no_entry:
+	for (uint32_t f = 0; f < n_fds; f++)
+		close(fds[f]);
+	return NULL;
 }
 
-/* Draw code here */
-static void draw(uint32_t i)
+/* Overlay plane first, client layer otherwise */
+static void myy_dmabuf_show(
+	struct myy_dmabuf_importer * __restrict const importer,
+	struct myy_dmabuf_entry * __restrict const entry)
 {
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glClearColor(0.2f, 0.3f, 0.5f, 1.0f);
+	myy_drm_infos_t * __restrict const drm = importer->drm;
+	struct myy_drm_overlay * __restrict const overlay = &importer->overlay;
+	struct myy_dmabuf_desc const * __restrict const desc = &entry->desc;
+
+	bool direct = !entry->fb_failed;
+
+	if (direct && !myy_drm_plane_formats_supports(&overlay->formats,
+		desc->fourcc, desc->modifier))
+	{
+		/* The current overlay, if any, can't scan this one out.
+		 * Another plane can only be looked for once it is free. */
+		if (importer->scanned_out == NULL) {
+			drm_overlay_release(overlay);
+			drm_overlay_find(drm, desc->fourcc, desc->modifier, overlay);
+			entry->fb_failed = (overlay->plane_id == NO_PLANE_FOUND);
+		}
+		direct = !entry->fb_failed
+			&& myy_drm_plane_formats_supports(&overlay->formats,
+				desc->fourcc, desc->modifier);
+	}
+	direct &= (entry->fb_refused_plane != overlay->plane_id);
+
+	if (direct && !entry->fb_id) {
+		entry->fb_failed = !myy_dmabuf_import_fb(importer, entry);
+		direct = !entry->fb_failed;
+	}
+
+	if (direct) {
+		int const ret = drm_overlay_commit(drm, overlay, entry->fb_id,
+			desc->width, desc->height, 0, 0, drm->width, drm->height,
+			DRM_MODE_ATOMIC_NONBLOCK, NULL);
+		if (ret == 0) {
+			importer->scanned_out = entry;
+			importer->direct++;
+			if (importer->scene->layer_texture) {
+				importer->scene->layer_texture = 0;
+				myy_frame_loop_mark_dirty(importer->loop);
+			}
+			return;
+		}
+		/* The previous flip is still pending. Next frame, then. */
+		if (ret == -EBUSY) {
+			importer->dropped++;
+			return;
+		}
+		LOG_ERROR("The overlay plane %u refused the client buffer : %s",
+			overlay->plane_id, strerror(-ret));
+		entry->fb_refused_plane = overlay->plane_id;
+	}
+
+	if (importer->scanned_out != NULL) {
+		drm_overlay_commit(drm, overlay, 0, 0, 0, 0, 0, 0, 0, 0, NULL);
+		importer->scanned_out = NULL;
+	}
+
+	if (!entry->texture && !entry->gl_failed)
+		entry->gl_failed = !myy_dmabuf_import_gl(importer, entry);
+	importer->scene->layer_texture = entry->texture;
+	myy_frame_loop_mark_dirty(importer->loop);
 }
 
-int egl_check_extensions_client(void)
+static void myy_dmabuf_end_session(
+	struct myy_dmabuf_importer * __restrict const importer)
 {
-	char const * __restrict const extension_names[] = {
-		"EGL_EXT_device_base",
-		"EGL_EXT_device_enumeration",
-		"EGL_EXT_device_query",
-		"EGL_EXT_platform_base",
-		"EGL_EXT_platform_device",
-		(char *) 0
-	};
+	if (importer->client_fd < 0)
+		return;
+
+	if (importer->scanned_out != NULL) {
+		drm_overlay_commit(importer->drm, &importer->overlay,
+			0, 0, 0, 0, 0, 0, 0, 0, NULL);
+		importer->scanned_out = NULL;
+	}
+	for (uint32_t e = 0; e < MYY_DMABUF_CACHE_SIZE; e++)
+		myy_dmabuf_entry_release(importer, importer->entries + e);
+	myy_frame_loop_mark_dirty(importer->loop);
 
-	char const * __restrict const client_extensions_list = 
-		eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
-	return egl_strstr(client_extensions_list, extension_names, "client");
+	myy_frame_loop_remove_source(importer->loop, importer->client_fd);
+	close(importer->client_fd);
+	importer->client_fd = -1;
 }
 
-int nvidia_egl_get_device(
-	struct myy_nvidia_functions * __restrict const myy_nvidia,
-	EGLDeviceEXT * __restrict const ret_device)
+/* Frame loop source. One message per frame. */
+static void myy_dmabuf_client_cb(
+	int const fd,
+	short const revents,
+	void * const user_data)
 {
-	int ret = 0;
-	EGLint n_devices, i;
-	EGLDeviceEXT *devices = NULL;
-	EGLDeviceEXT device = EGL_NO_DEVICE_EXT;
-	EGLBoolean egl_ret;
-	int chosen_device = -1;
+	struct myy_dmabuf_importer * __restrict const importer = user_data;
+	struct myy_dmabuf_desc desc;
+	int fds[MYY_DMABUF_MAX_PLANES];
+
+	(void) revents;
+	int const n_fds = myy_receive_fds(fd, &desc, sizeof(desc),
+		fds, MYY_DMABUF_MAX_PLANES);
+	if (n_fds < 0) {
+		LOGF("dma-buf client left");
+		myy_dmabuf_end_session(importer);
+		return;
+	}
 
-	/* Query how many devices are present. */
-	egl_ret = myy_nvidia->eglQueryDevices(0, NULL, &n_devices);
+	if (n_fds == 0
+	    || desc.magic != MYY_DMABUF_MAGIC
+	    || desc.version != MYY_DMABUF_VERSION
+	    || desc.n_planes == 0 || desc.n_planes > MYY_DMABUF_MAX_PLANES
+	    || desc.width == 0 || desc.height == 0)
+	{
+		LOG_ERROR("Invalid client buffer. Ignored.");
+		for (int f = 0; f < n_fds; f++)
+			close(fds[f]);
+		return;
+	}
 
-	if (!egl_ret) {
-		LOGF("Failed to query EGL devices.");
-		goto out;
+	struct myy_dmabuf_entry * __restrict const entry =
+		myy_dmabuf_lookup(importer, &desc, fds, n_fds);
+	if (entry == NULL)
+		return;
+
+	importer->frames++;
+	myy_dmabuf_show(importer, entry);
+}
+
+/* Frame loop source */
+static void myy_dmabuf_listen_cb(
+	int const fd,
+	short const revents,
+	void * const user_data)
+{
+	struct myy_dmabuf_importer * __restrict const importer = user_data;
+	int client;
+
+	(void) revents;
+	while ((client = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		if (importer->client_fd >= 0) {
+			LOGF("Already showing the buffers of a client. "
+			     "Refusing another one.");
+			close(client);
+			continue;
+		}
+		/* The frame loop logs why */
+		if (!myy_frame_loop_add_source(importer->loop, client,
+			myy_dmabuf_client_cb, importer))
+		{
+			LOG_ERROR("Could not listen to the new dma-buf client");
+			close(client);
+			continue;
+		}
+		importer->client_fd = client;
+		LOGF("dma-buf client connected");
 	}
+}
 
-	if (n_devices < 1) {
-		LOGF("No EGL devices found.");
-		goto out;
+/* Render thread, with the render context current */
+static int myy_dmabuf_importer_init(
+	struct myy_dmabuf_importer * __restrict const importer,
+	char const * __restrict const socket_path,
+	myy_drm_infos_t * __restrict const drm,
+	myy_opengl_infos_t const * __restrict const gl,
+	struct myy_scene * __restrict const scene,
+	struct myy_frame_loop * __restrict const loop)
+{
+	memset(importer, 0, sizeof(*importer));
+	importer->listen_fd = -1;
+	importer->client_fd = -1;
+	importer->drm       = drm;
+	importer->scene     = scene;
+	importer->loop      = loop;
+	importer->display   = gl->display;
+
+	if (strlen(socket_path) >= sizeof(importer->socket_path)) {
+		LOG_ERROR("Socket path too long : %s", socket_path);
+		return -1;
+	}
+	strcpy(importer->socket_path, socket_path);
+
+	importer->eglCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC)
+		eglGetProcAddress("eglCreateImageKHR");
+	importer->eglDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)
+		eglGetProcAddress("eglDestroyImageKHR");
+	importer->glEGLImageTargetTexture2DOES =
+		(PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)
+		eglGetProcAddress("glEGLImageTargetTexture2DOES");
+	importer->gl_import =
+		myy_egl_caps_has(&gl->display_caps, MYY_EGL_EXT_image_dma_buf_import)
+		&& importer->eglCreateImageKHR && importer->eglDestroyImageKHR
+		&& importer->glEGLImageTargetTexture2DOES
+		&& (scene->layer_program >= 0);
+	importer->modifiers = myy_egl_caps_has(&gl->display_caps,
+		MYY_EGL_EXT_image_dma_buf_import_modifiers);
+	if (!importer->gl_import)
+		LOGF("No EGL_EXT_image_dma_buf_import. Client buffers will "
+		     "only be shown on overlay planes.");
+
+	/* Packets keep the messages and their fds together */
+	importer->listen_fd = myy_unix_listen(socket_path, SOCK_SEQPACKET, 4);
+	if (importer->listen_fd < 0)
+		return -1;
+	if (!myy_frame_loop_add_source(loop, importer->listen_fd,
+		myy_dmabuf_listen_cb, importer))
+	{
+		LOG_ERROR("Could not watch %s", socket_path);
+		close(importer->listen_fd);
+		unlink(socket_path);
+		importer->listen_fd = -1;
+		return -1;
 	}
 
-	/* Allocate memory to store that many EGLDeviceEXTs. */
-	devices = calloc(n_devices, sizeof(EGLDeviceEXT));
+	LOGF("Showing client buffers sent to %s", socket_path);
+	importer->enabled = true;
+	return 0;
+}
 
-	if (devices == NULL) {
-		LOGF("Memory allocation failure.");
-		goto out;
+/* Render thread, with the render context current */
+static void myy_dmabuf_importer_deinit(
+	struct myy_dmabuf_importer * __restrict const importer)
+{
+	if (!importer->enabled)
+		return;
+
+	myy_dmabuf_end_session(importer);
+	drm_overlay_release(&importer->overlay);
+	myy_frame_loop_remove_source(importer->loop, importer->listen_fd);
+	close(importer->listen_fd);
+	unlink(importer->socket_path);
+	LOGF("dma-buf : %u frames, %u imports, %u scanned out directly, "
+	     "%u dropped (flip pending)",
+		importer->frames, importer->imports, importer->direct,
+		importer->dropped);
+	memset(importer, 0, sizeof(*importer));
+}
+
+/* Compositor mode.
+ * With --compositor=SOCKET, this process only owns KMS. It sets the
+ * mode, then hands the EGLStream of the plane to another process,
+ * through EGL_KHR_stream_cross_process_fd. That client
+ * (--client=SOCKET) renders straight into the stream : no copy, no
+ * compositing pass, and the client never needs to be DRM master.
+ * A stream has only one producer, so one client is served at a time.
+ * When it leaves, a new stream is created for the next one.
+ *
+ * Protocol : the client connects and receives a myy_compositor_hello,
+ * with the stream fd attached (SCM_RIGHTS). The connection then stays
+ * open for as long as the client uses the stream. Either side closing
+ * it ends the session.
+ */
+#define MYY_COMPOSITOR_MAGIC   (0x504d4f43u) /* "COMP" */
+#define MYY_COMPOSITOR_VERSION (1)
+
+struct myy_compositor_hello {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+};
+
+struct myy_compositor {
+	struct myy_nvidia_functions const * nvidia;
+	PFNEGLGETSTREAMFILEDESCRIPTORKHRPROC eglGetStreamFileDescriptor;
+	EGLDisplay display;
+	myy_drm_infos_t * drm;
+	struct myy_frame_loop * loop;
+	int listen_fd;
+	int client_fd;
+	EGLStreamKHR stream;
+	uint32_t clients;
+};
+
+/* The stream fd can only be retrieved before a consumer is
+ * attached. Returns the fd, or -1. */
+static int myy_compositor_create_stream(
+	struct myy_compositor * __restrict const compositor)
+{
+	EGLint const stream_attribs[] = { EGL_NONE };
+	struct myy_nvidia_functions const * __restrict const nvidia =
+		compositor->nvidia;
+	EGLDisplay const display = compositor->display;
+	EGLOutputLayerEXT layer;
+	EGLStreamKHR stream;
+	int stream_fd;
+
+	if (!nvidia_egl_get_plane_layer(nvidia, display, compositor->drm, &layer))
+		goto no_layer;
+
+	stream = nvidia->eglCreateStream(display, stream_attribs);
+	if (stream == EGL_NO_STREAM_KHR) {
+		LOG_EGL_ERROR("Unable to create stream.");
+		goto no_stream;
 	}
 
-	/* Query the EGLDeviceEXTs. */
-	egl_ret = myy_nvidia->eglQueryDevices(
-		n_devices, devices, &n_devices);
+	stream_fd = compositor->eglGetStreamFileDescriptor(display, stream);
+	if (stream_fd == EGL_NO_FILE_DESCRIPTOR_KHR) {
+		LOG_EGL_ERROR("Could not get a file descriptor for the stream");
+		goto no_stream_fd;
+	}
 
-	if (!egl_ret) {
-		LOGF("Failed to query EGL devices.");
-		goto could_not_query_devices;
+	if (!nvidia->eglStreamConsumerOutput(display, stream, layer)) {
+		LOG_EGL_ERROR("Unable to create EGLOutput stream consumer.");
+		goto no_consumer;
 	}
 
-	char const * __restrict const checked_extensions[] = {
-		"EGL_EXT_device_drm",
-		(char *) 0
-	};
+	compositor->stream = stream;
+	return stream_fd;
 
-	for (i = 0; i < n_devices; i++) {
+no_consumer:
+	close(stream_fd);
+no_stream_fd:
+	nvidia->eglDestroyStream(display, stream);
+no_stream:
+no_layer:
+	return -1;
+}
+
+static void myy_compositor_end_session(
+	struct myy_compositor * __restrict const compositor)
+{
+	if (compositor->client_fd < 0)
+		return;
+
+	myy_frame_loop_remove_source(compositor->loop, compositor->client_fd);
+	close(compositor->client_fd);
+	compositor->client_fd = -1;
+	if (compositor->stream != EGL_NO_STREAM_KHR)
+		compositor->nvidia->eglDestroyStream(
+			compositor->display, compositor->stream);
+	compositor->stream = EGL_NO_STREAM_KHR;
+	/* The client frames replaced it long ago, most of the time */
+	if (compositor->drm->framebuffer_id != 0)
+		drm_placeholder_release(compositor->drm);
+}
+
+/* Frame loop source. The client only ever closes its side. */
+static void myy_compositor_client_cb(
+	int const fd,
+	short const revents,
+	void * const user_data)
+{
+	struct myy_compositor * __restrict const compositor = user_data;
+	char byte;
+
+	if (!(revents & (POLLHUP | POLLERR))
+	    && recv(fd, &byte, 1, MSG_DONTWAIT) != 0)
+		return;
+
+	LOGF("Client left");
+	myy_compositor_end_session(compositor);
+}
 
-		char const * __restrict const device_extensions =
-			myy_nvidia->eglQueryDeviceString(
-				devices[i], EGL_EXTENSIONS);
-		LOGF("Device[%d/%d] - Extensions : \n%s",
-			 i, n_devices, device_extensions);
+/* Frame loop source. Hands a new stream to a new client. */
+static void myy_compositor_listen_cb(
+	int const fd,
+	short const revents,
+	void * const user_data)
+{
+	struct myy_compositor * __restrict const compositor = user_data;
+	int client;
+
+	(void) revents;
+	while ((client = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		struct myy_compositor_hello const hello = {
+			.magic   = MYY_COMPOSITOR_MAGIC,
+			.version = MYY_COMPOSITOR_VERSION,
+			.width   = compositor->drm->width,
+			.height  = compositor->drm->height,
+		};
+
+		if (compositor->client_fd >= 0) {
+			LOGF("Already serving a client. Refusing another one.");
+			close(client);
+			continue;
+		}
+
+		int const stream_fd = myy_compositor_create_stream(compositor);
+		if (stream_fd < 0) {
+			close(client);
+			continue;
+		}
 
-		if (chosen_device < 0)
+		bool const sent =
+			myy_send_fd(client, stream_fd, &hello, sizeof(hello));
+		/* The client has its own copy now */
+		close(stream_fd);
+		compositor->client_fd = client;
+		if (!sent
+		    || !myy_frame_loop_add_source(compositor->loop, client,
+			myy_compositor_client_cb, compositor))
 		{
-			ret = egl_strstr(
-				device_extensions, checked_extensions, "devices");
-			if (ret == 0) {
-				device = devices[i];
-				chosen_device = i;
-			}
-			/* Continue, in order to list all the available
-			 * devices, for demonstration purposes.
-			 */
+			LOG_ERROR("Could not hand the stream over : %m");
+			myy_compositor_end_session(compositor);
+			continue;
 		}
+
+		compositor->clients++;
+		LOGF("Client %u connected", compositor->clients);
 	}
+}
 
-could_not_query_devices:
-	free(devices);
+/* Runs until SIGINT/SIGTERM. The mode must be set already. */
+static int myy_compositor_run(
+	struct myy_nvidia_functions const * __restrict const nvidia,
+	EGLDeviceEXT const device,
+	myy_drm_infos_t * __restrict const drm,
+	char const * __restrict const socket_path)
+{
+	struct myy_compositor compositor = {0};
+	struct myy_egl_caps display_caps;
+	struct myy_frame_loop loop;
+	EGLint major, minor;
+	int ret = -1;
 
-	if (chosen_device >= 0) {
-		LOGVF("Using device %d", chosen_device);
-		ret = 0;
+	compositor.nvidia    = nvidia;
+	compositor.drm       = drm;
+	compositor.loop      = &loop;
+	compositor.listen_fd = -1;
+	compositor.client_fd = -1;
+	compositor.stream    = EGL_NO_STREAM_KHR;
+
+	compositor.display = egl_nvidia_get_display(nvidia, device, drm->fd);
+	if (compositor.display == EGL_NO_DISPLAY
+	    || !eglInitialize(compositor.display, &major, &minor))
+	{
+		LOG_EGL_ERROR("Could not initialize the display");
+		goto no_display;
 	}
 
-out:
-	*ret_device = device;
-	if (device == EGL_NO_DEVICE_EXT) {
-		fprintf(
-			stderr,
-			"No devices supporting the right EGL extensions "
-			"were found.\n");
-		ret = -1;
+	myy_egl_caps_parse(&display_caps,
+		eglQueryString(compositor.display, EGL_EXTENSIONS), "display");
+	compositor.eglGetStreamFileDescriptor =
+		(PFNEGLGETSTREAMFILEDESCRIPTORKHRPROC)
+		eglGetProcAddress("eglGetStreamFileDescriptorKHR");
+	if (!myy_egl_caps_has(&display_caps, MYY_EGL_KHR_stream_cross_process_fd)
+	    || compositor.eglGetStreamFileDescriptor == NULL)
+	{
+		LOG_ERROR("No EGL_KHR_stream_cross_process_fd. "
+		          "Streams can't be shared with other processes.");
+		goto no_cross_process;
 	}
 
+	compositor.listen_fd = myy_unix_listen(socket_path, SOCK_STREAM, 4);
+	if (compositor.listen_fd < 0)
+		goto no_socket;
+
+	/* Only used for its event sources. Nothing is drawn here. */
+	if (myy_frame_loop_init(&loop, true, 0) != 0)
+		goto no_loop;
+	atomic_store(&loop.dirty, false);
+	myy_frame_loop_add_source(&loop, compositor.listen_fd,
+		myy_compositor_listen_cb, &compositor);
+
+	LOGF("Compositing %ux%u. Waiting for clients on %s",
+		drm->width, drm->height, socket_path);
+	while (loop.running)
+		myy_frame_loop_wait(&loop);
+
+	LOGF("Compositor : %u clients served", compositor.clients);
+	myy_compositor_end_session(&compositor);
+	myy_frame_loop_deinit(&loop);
+	ret = 0;
+
+no_loop:
+	unlink(socket_path);
+no_socket:
+	if (compositor.listen_fd >= 0)
+		close(compositor.listen_fd);
+no_cross_process:
+	eglTerminate(compositor.display);
+no_display:
 	return ret;
 }
 
-static void dump_buffer_to_file(
-	uint8_t const * __restrict const buffer, size_t const buffer_size)
+/* Frame loop source, client side. The compositor went away. */
+static void myy_client_socket_cb(
+	int const fd,
+	short const revents,
+	void * const user_data)
 {
-	int file = open("pixel_dump", O_WRONLY|O_CREAT, 0644);
-	if (file > 0) {
-		write(file, buffer, buffer_size);
-		close(file);
+	/* The "running" flag of the frame loop */
+	bool * __restrict const running = user_data;
+	char byte;
+
+	if (!(revents & (POLLHUP | POLLERR))
+	    && recv(fd, &byte, 1, MSG_DONTWAIT) != 0)
+		return;
+
+	LOGF("The compositor is gone. Leaving.");
+	*running = false;
+}
+
+/* Client mode. Renders the scene into the stream of a compositor,
+ * at the size it gives. No DRM involved. */
+static int myy_client_run(
+	struct myy_nvidia_functions const * __restrict const nvidia,
+	EGLDeviceEXT const device,
+	struct myy_options const * __restrict const options)
+{
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	struct myy_compositor_hello hello;
+	myy_opengl_infos_t gl = {0};
+	struct myy_frame_loop loop;
+	struct myy_scene scene;
+	int socket_fd, stream_fd = -1;
+	int ret = -1;
+
+	if (strlen(options->client_socket) >= sizeof(address.sun_path)) {
+		LOG_ERROR("Socket path too long : %s", options->client_socket);
+		return -1;
 	}
-	else {
-		LOG_ERROR(
-			"Could not open pixel_dump for writing : %d\n", file);
+	strcpy(address.sun_path, options->client_socket);
+
+	socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (socket_fd < 0
+	    || connect(socket_fd, (struct sockaddr *) &address,
+	               sizeof(address)) != 0)
+	{
+		LOG_ERROR("Could not connect to %s : %m", options->client_socket);
+		goto no_connection;
+	}
+
+	if (myy_receive_fds(socket_fd, &hello, sizeof(hello), &stream_fd, 1) != 1
+	    || hello.magic != MYY_COMPOSITOR_MAGIC
+	    || hello.version != MYY_COMPOSITOR_VERSION)
+	{
+		LOG_ERROR("No stream received from %s", options->client_socket);
+		goto no_stream;
+	}
+	LOGF("Rendering %ux%u frames for the compositor",
+		hello.width, hello.height);
+
+	if (myy_arena_init(&myy_frame_arena, MYY_FRAME_ARENA_DEFAULT_SIZE)) {
+		LOG_ERROR("Could not allocate the frame arena");
+		goto no_arena;
+	}
+
+	gl.config_needs = options->config_needs;
+	if (egl_prepare_client_context(nvidia, device, stream_fd,
+		hello.width, hello.height, &gl) != 0)
+		goto no_egl;
+	/* The stream holds its own reference */
+	close(stream_fd);
+	stream_fd = -1;
+
+	if (myy_scene_init(&scene, &gl,
+		hello.width, hello.height, options->n_cubes) != 0)
+	{
+		LOG_ERROR("Could not prepare the scene");
+		goto no_scene;
+	}
+
+	if (myy_frame_loop_init(&loop, options->on_demand, options->keepalive_hz))
+		goto no_frame_loop;
+	loop.assert_zero_alloc   = options->assert_zero_alloc;
+	scene.textures.wake      = myy_frame_loop_wake_cb;
+	scene.textures.wake_data = &loop;
+	myy_frame_loop_add_source(&loop, socket_fd, myy_client_socket_cb,
+		&loop.running);
+	if (options->backdrop)
+		myy_scene_load_backdrop(&scene, options->backdrop);
+
+	myy_telemetry_init(options->stats_interval);
+	myy_frame_loop_run(&loop, &gl, &scene);
+	myy_frame_loop_deinit(&loop);
+	ret = 0;
+
+no_frame_loop:
+	myy_scene_deinit(&scene);
+no_scene:
+	egl_destroy_opengl_context(nvidia, &gl);
+no_egl:
+	myy_arena_deinit(&myy_frame_arena);
+no_arena:
+no_stream:
+	if (stream_fd >= 0)
+		close(stream_fd);
+no_connection:
+	if (socket_fd >= 0)
+		close(socket_fd);
+	return ret;
+}
+
+/* Leak check of the display stack lifecycle.
+ * Everything nvidia_drm_open and egl_prepare_opengl_context acquire
+ * is released, N times. The first cycle is not counted : the driver
+ * loads and caches a lot of things the first time.
+ * Kernel objects (FB, dumb buffers, blobs) all hang off the DRM fd
+ * or a driver fd, so they show up in the fd count or the RSS. */
+#define MYY_REINIT_RSS_SLACK (1024 * 1024)
+
+static long myy_proc_fd_count(void)
+{
+	DIR * __restrict const fds = opendir("/proc/self/fd");
+	long count = 0;
+
+	if (fds == NULL)
+		return -1;
+	while (readdir(fds) != NULL)
+		count++;
+	closedir(fds);
+	/* ".", ".." and the one opendir uses */
+	return count - 3;
+}
+
+static long myy_proc_rss(void)
+{
+	FILE * __restrict const statm = fopen("/proc/self/statm", "r");
+	long pages = -1;
+
+	if (statm == NULL)
+		return -1;
+	if (fscanf(statm, "%*d %ld", &pages) != 1)
+		pages = -1;
+	fclose(statm);
+	return (pages < 0) ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+static int myy_reinit_cycles(
+	struct myy_nvidia_functions const * __restrict const nvidia,
+	EGLDeviceEXT const device,
+	struct myy_options const * __restrict const options)
+{
+	uint32_t const cycles = options->reinit_cycles;
+	uint64_t init_ns = 0, deinit_ns = 0, worst_ns = 0;
+	long fds_before = 0, rss_before = 0;
+	int ret = 0;
+
+	for (uint32_t c = 0; c <= cycles; c++) {
+		myy_drm_infos_t drm = {0};
+		myy_opengl_infos_t gl = {0};
+
+		if (c == 1) {
+			fds_before = myy_proc_fd_count();
+			rss_before = myy_proc_rss();
+		}
+
+		drm.color.profile = options->color;
+		gl.config_needs   = options->config_needs;
+
+		uint64_t const start = myy_clock_ns();
+		if (nvidia_drm_open(nvidia, device, &drm)) {
+			LOG_ERROR("Cycle %u : Could not open DRM", c);
+			return -1;
+		}
+		if (nvidia_prepare_drm_for_streams(&drm, false)) {
+			LOG_ERROR("Cycle %u : Could not set the mode", c);
+			nvidia_drm_close(&drm);
+			return -1;
+		}
+		if (egl_prepare_opengl_context(nvidia, device, &drm, &gl)) {
+			LOG_ERROR("Cycle %u : Could not prepare EGL", c);
+			nvidia_drm_close(&drm);
+			return -1;
+		}
+		uint64_t const up = myy_clock_ns();
+		egl_destroy_opengl_context(nvidia, &gl);
+		nvidia_drm_close(&drm);
+		uint64_t const down = myy_clock_ns();
+
+		if (c == 0)
+			continue;
+		init_ns   += up - start;
+		deinit_ns += down - up;
+		if (down - start > worst_ns)
+			worst_ns = down - start;
+	}
+
+	if (cycles == 0)
+		return 0;
+
+	long const fds_after = myy_proc_fd_count();
+	long const rss_after = myy_proc_rss();
+
+	LOGF("[Reinit] %u cycles : init %.3f ms, deinit %.3f ms on average, "
+		"worst cycle %.3f ms",
+		cycles,
+		init_ns / (cycles * 1e6), deinit_ns / (cycles * 1e6),
+		worst_ns / 1e6);
+	LOGF("[Reinit] Open fds : %ld -> %ld, RSS : %ld KiB -> %ld KiB",
+		fds_before, fds_after, rss_before / 1024, rss_after / 1024);
+
+	if (fds_after > fds_before) {
+		LOG_ERROR("[Reinit] %ld file descriptors leaked",
+			fds_after - fds_before);
+		ret = -1;
+	}
+	if (rss_after - rss_before > MYY_REINIT_RSS_SLACK) {
+		LOG_ERROR("[Reinit] RSS grew by %ld KiB",
+			(rss_after - rss_before) / 1024);
+		ret = -1;
 	}
+	return ret;
 }
 
 int main(int argc, char *argv[])
 {
-	uint32_t i = 0;
 	int ret;
 	struct myy_nvidia_functions myy_nvidia = {0};
 	myy_drm_infos_t drm = {0};
 	myy_opengl_infos_t gl = {0};
 	EGLDeviceEXT nvidia_device;
+	EGLDeviceEXT render_device = EGL_NO_DEVICE_EXT;
+	struct myy_egl_caps client_caps;
+	struct myy_egl_caps device_caps;
+	struct myy_egl_caps render_caps;
+	struct myy_options options;
+	struct myy_frame_loop loop;
+	struct myy_scene scene;
+	struct myy_commands_context commands =
+		{ &drm, &loop, &scene, NULL, &gl, &myy_nvidia, "", 0, false };
+	struct myy_egl_startup startup;
+	struct myy_splash splash;
+	uint64_t const start_ns = myy_clock_ns();
+
+	ret = myy_parse_options(argc, argv, &options);
+	if (ret)
+		return ret;
+
+	if (options.bench_cull)
+		return myy_bench_cull(options.bench_cull);
+
+	if (options.bench_convert_width)
+		return myy_bench_convert(
+			options.bench_convert_width, options.bench_convert_height);
+
+	if (options.check_recording)
+		return myy_check_recording(options.check_recording);
 
 	ret = myy_nvidia_functions_prepare(&myy_nvidia);
 	if (ret) {
@@ -1775,7 +12797,7 @@ int main(int argc, char *argv[])
 		return ret;
 	}
 
-	ret = egl_check_extensions_client();
+	ret = egl_check_extensions_client(&client_caps);
 	if (ret) {
 		LOG_ERROR(
 			"... You got the right drivers but not the right "
@@ -1786,7 +12808,8 @@ int main(int argc, char *argv[])
 		return ret;
 	}
 
-	ret = nvidia_egl_get_device(&myy_nvidia, &nvidia_device);
+	ret = nvidia_egl_get_device(&myy_nvidia, options.device_bus_id,
+		&nvidia_device, &device_caps);
 	if (ret) {
 		LOG_ERROR(
 			"Something went wrong while trying to prepare the "
@@ -1796,29 +12819,195 @@ int main(int argc, char *argv[])
 		return ret;
 	}
 
+	if (options.render_bus_id) {
+		ret = nvidia_egl_get_device(&myy_nvidia, options.render_bus_id,
+			&render_device, &render_caps);
+		if (ret) {
+			LOG_ERROR("No render device on bus %s", options.render_bus_id);
+			return ret;
+		}
+	}
+
+	if (options.reinit_cycles)
+		return myy_reinit_cycles(&myy_nvidia, nvidia_device, &options);
+
+	if (options.client_socket)
+		return myy_client_run(&myy_nvidia, nvidia_device, &options);
+
+	ret = myy_arena_init(&myy_frame_arena, MYY_FRAME_ARENA_DEFAULT_SIZE);
+	if (ret) {
+		LOG_ERROR("Could not allocate the frame arena");
+		goto no_arena;
+	}
+
+	drm.color.profile = options.color;
 	ret = nvidia_drm_open(&myy_nvidia, nvidia_device, &drm);
 	if (ret) {
 		LOG_ERROR(
 			"Failed to initialize DRM through NVIDIA means");
-		return ret;
+		goto no_drm;
 	}
 
-	ret = egl_prepare_opengl_context(
-		&myy_nvidia, nvidia_device, &drm, &gl);
+	myy_splash_begin(&splash, options.splash);
+
+	if (options.compositor_socket) {
+		ret = nvidia_prepare_drm_for_streams(&drm, splash.started);
+		myy_splash_end(&splash, &drm);
+		if (ret == 0)
+			ret = myy_compositor_run(&myy_nvidia, nvidia_device, &drm,
+				options.compositor_socket);
+		goto no_startup;
+	}
+
+	gl.config_needs = options.config_needs;
+	startup.nvidia  = &myy_nvidia;
+	startup.device  = nvidia_device;
+	startup.render_device = render_device;
+	startup.drm     = &drm;
+	startup.gl      = &gl;
+	startup.scene   = &scene;
+	startup.n_cubes = options.n_cubes;
+	ret = myy_egl_startup_begin(&startup);
 	if (ret) {
+		myy_splash_end(&splash, &drm);
+		goto no_startup;
+	}
+
+	ret = nvidia_prepare_drm_for_streams(&drm, splash.started);
+	if (ret)
 		LOG_ERROR(
-			"Failed to initialize EGL through NVIDIA means");
-		return ret;
+			"Could not connect NVIDIA EGL Streams to the DRM "
+			"subsystem");
+	else
+		LOGF("First pixels on screen after %.2f ms",
+			(myy_clock_ns() - start_ns) / 1e6);
+	myy_splash_end(&splash, &drm);
+
+	ret = myy_egl_startup_end(&startup, ret == 0);
+	if (!startup.egl_ready)
+		goto no_egl;
+	if (!startup.scene_ready)
+		goto no_scene;
+	if (ret)
+		goto no_frame_loop;
+	LOGF("EGL, the stream and the scene ready after %.2f ms",
+		(startup.ready_ns - start_ns) / 1e6);
+
+	ret = myy_frame_loop_init(
+		&loop, options.on_demand, options.keepalive_hz);
+	if (ret) {
+		LOG_ERROR("Could not prepare the frame loop");
+		goto no_frame_loop;
 	}
 
-	while (1) {
-		draw(i++);
-		if (!eglSwapBuffers(gl.display, gl.surface)) {
-			LOG_ERROR(
-				"Could not swap the buffers !? CALL THE POLICE !\n"
-				"Error : %d", eglGetError());
+	loop.assert_zero_alloc   = options.assert_zero_alloc;
+	loop.drm                 = &drm;
+	scene.textures.wake      = myy_frame_loop_wake_cb;
+	scene.textures.wake_data = &loop;
+	if (options.backdrop)
+		myy_scene_load_backdrop(&scene, options.backdrop);
+
+	if (options.export_socket) {
+		if (myy_frame_export_init(&myy_frame_export,
+			options.export_socket, drm.width, drm.height) == 0)
+			myy_frame_loop_add_source(&loop, myy_frame_export.listen_fd,
+				myy_frame_export_source_cb, &myy_frame_export);
+		else
+			LOG_ERROR("Frames will not be exported");
+	}
+
+	if (options.dmabuf_socket) {
+		if (myy_dmabuf_importer_init(&myy_dmabuf_importer,
+			options.dmabuf_socket, &drm, &gl, &scene, &loop) != 0)
+			LOG_ERROR("Client buffers will not be shown");
+	}
+
+	/* Both would fight over the same overlay plane */
+	if (options.video && myy_dmabuf_importer.enabled)
+		LOG_ERROR("--video and --dmabuf both need the overlay plane. "
+		          "No video.");
+	else if (options.video
+	         && myy_video_init(&myy_video, options.video, &drm, &loop) != 0)
+		LOG_ERROR("The video will not be played");
+
+	/* Every frame goes through the capture to reach the display */
+	if (render_device != EGL_NO_DEVICE_EXT) {
+		ret = myy_scanout_init(&myy_scanout, &drm);
+		if (ret)
+			goto no_scanout;
+		if (options.capture_every > 1 && !options.writeback)
+			LOGF("--capture-every ignored : every frame is captured "
+			     "for the scanout");
+	}
+
+	/* With a render device, drm is the display device, the one
+	 * the scanout flips on */
+	if (options.writeback
+	    && !options.capture_every && !myy_frame_export.enabled)
+		LOG_ERROR("--writeback needs --capture-every or --export");
+	else if (options.writeback && myy_writeback_init(&myy_writeback, &drm) != 0)
+		LOG_ERROR("No writeback. Frames will be read back from GL.");
+
+	/* The scanout needs the GL frames themselves. The writeback then
+	 * gets its own capture, for the files and the export. */
+	bool const writeback_beside_scanout =
+		myy_scanout.enabled & myy_writeback.enabled;
+
+	if (options.capture_every || myy_frame_export.enabled
+	    || myy_scanout.enabled)
+	{
+		uint32_t const every = (options.capture_every && !myy_scanout.enabled)
+			? options.capture_every
+			: 1;
+		ret = myy_capture_init(&myy_capture, every,
+			options.capture_dir, options.capture_format,
+			(options.capture_every != 0) & !writeback_beside_scanout,
+			(myy_frame_export.enabled & !writeback_beside_scanout)
+				? &myy_frame_export : NULL,
+			myy_scanout.enabled ? &myy_scanout : NULL,
+			(myy_writeback.enabled & !writeback_beside_scanout)
+				? &myy_writeback : NULL,
+			drm.width, drm.height);
+		if (ret) {
+			LOG_ERROR("Frames will not be captured");
+			if (myy_scanout.enabled)
+				goto no_capture;
 		}
 	}
 
+	if (writeback_beside_scanout
+	    && myy_capture_init(&myy_writeback_capture,
+			options.capture_every ? options.capture_every : 1,
+			options.capture_dir, options.capture_format,
+			options.capture_every != 0,
+			myy_frame_export.enabled ? &myy_frame_export : NULL,
+			NULL, &myy_writeback,
+			drm.width, drm.height) != 0)
+		LOG_ERROR("The writeback frames will not be captured");
+
+	myy_telemetry_init(options.stats_interval);
+	myy_commands_listen(&loop, &commands);
+	myy_frame_loop_run(&loop, &gl, &scene);
+
+	myy_capture_deinit(&myy_writeback_capture);
+	myy_capture_deinit(&myy_capture);
+no_capture:
+	myy_writeback_deinit(&myy_writeback);
+	myy_scanout_deinit(&myy_scanout);
+no_scanout:
+	myy_video_deinit(&myy_video);
+	myy_dmabuf_importer_deinit(&myy_dmabuf_importer);
+	myy_frame_loop_deinit(&loop);
+	myy_frame_export_deinit(&myy_frame_export);
+no_frame_loop:
+	myy_scene_deinit(&scene);
+no_scene:
+	egl_destroy_opengl_context(&myy_nvidia, &gl);
+no_egl:
+no_startup:
+	nvidia_drm_close(&drm);
+no_drm:
+	myy_arena_deinit(&myy_frame_arena);
+no_arena:
 	return ret;
 }
@@ -0,0 +1,286 @@
+/* Frame export, shared by eglstreams (--export=SOCKET) and the
+ * processes reading its frames.
+ *
+ * eglstreams publishes the captured frames into a ring of slots,
+ * in a memfd. Readers connect to the Unix socket, receive the memfd
+ * and map it, read-only. Frames are then read where they are, no
+ * copy involved.
+ *
+ * The writer never waits for the readers. It always overwrites the
+ * oldest slot. Each slot is protected by a sequence counter, odd
+ * while the slot is being written : a reader checks the counter
+ * before and after using the pixels, to know if the frame was
+ * overwritten in the meantime (myy_export_reader_still_valid).
+ * With MYY_EXPORT_SLOTS slots, a reader has a few frames worth of
+ * time to use a frame before that happens.
+ *
+ * "published" is incremented after each frame, and readers sleep on
+ * it with a futex.
+ *
+ * Reader side usage :
+ *
+ *   struct myy_export_reader reader;
+ *   struct myy_export_frame frame;
+ *   myy_export_reader_connect(&reader, "/tmp/eglstreams.sock");
+ *   while (myy_export_reader_wait(&reader, &frame, 1000) == 0) {
+ *       use(frame.pixels, frame.width, frame.height, frame.stride);
+ *       if (!myy_export_reader_still_valid(&reader, &frame))
+ *           forget_what_was_done_with_it();
+ *   }
+ *   myy_export_reader_close(&reader);
+ *
+ * syscall() is only declared with _DEFAULT_SOURCE, which -std=gnu11
+ * (GCC default) defines.
+ */
+
+#ifndef MYY_FRAME_EXPORT_H
+#define MYY_FRAME_EXPORT_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define MYY_EXPORT_MAGIC   (0x5845594du) /* "MYEX" */
+#define MYY_EXPORT_VERSION (1)
+#define MYY_EXPORT_SLOTS   (4)
+/* Pixels of every slot start on their own page */
+#define MYY_EXPORT_ALIGNMENT (4096)
+
+/* RGBA8, rows from top to bottom */
+#define MYY_EXPORT_FORMAT_RGBA8 (1)
+
+struct myy_export_slot {
+	/* Odd while being written */
+	_Atomic uint32_t sequence;
+	uint32_t frame;
+	uint64_t timestamp_ns;
+	uint8_t padding[48]; /* One cache line per slot */
+};
+
+struct myy_export_shared {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t format;
+	uint32_t n_slots;
+	/* Futex word. Number of frames published so far.
+	 * The last one is in slots[(published - 1) % n_slots]. */
+	_Atomic uint32_t published;
+	uint64_t slot_size;
+	uint64_t slots_offset; /* From the start of the mapping */
+	uint8_t padding[16];
+	struct myy_export_slot slots[MYY_EXPORT_SLOTS];
+};
+
+static inline size_t myy_export_slot_size(uint32_t const stride, uint32_t const height)
+{
+	size_t const size = (size_t) stride * height;
+	return (size + MYY_EXPORT_ALIGNMENT - 1) & ~(size_t) (MYY_EXPORT_ALIGNMENT - 1);
+}
+
+static inline size_t myy_export_slots_offset(void)
+{
+	size_t const size = sizeof(struct myy_export_shared);
+	return (size + MYY_EXPORT_ALIGNMENT - 1) & ~(size_t) (MYY_EXPORT_ALIGNMENT - 1);
+}
+
+/* Reader library */
+
+struct myy_export_reader {
+	int fd;
+	uint8_t const * map;
+	size_t map_size;
+	struct myy_export_shared const * shared;
+	/* Last "published" value seen */
+	uint32_t seen;
+	/* Frames published but never returned by myy_export_reader_wait */
+	uint64_t skipped;
+};
+
+struct myy_export_frame {
+	uint8_t const * pixels;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t frame;
+	uint64_t timestamp_ns;
+	uint32_t slot;
+	uint32_t sequence;
+};
+
+static inline int myy_export_receive_fd(int const socket_fd)
+{
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr message = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = sizeof(control.buffer),
+	};
+	int fd = -1;
+
+	if (recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC) <= 0)
+		return -1;
+
+	struct cmsghdr * const cmsg = CMSG_FIRSTHDR(&message);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+	return fd;
+}
+
+static inline int myy_export_reader_connect(
+	struct myy_export_reader * __restrict const reader,
+	char const * __restrict const socket_path)
+{
+	struct sockaddr_un address = { .sun_family = AF_UNIX };
+	int socket_fd;
+
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = -1;
+
+	if (strlen(socket_path) >= sizeof(address.sun_path))
+		return -1;
+	strcpy(address.sun_path, socket_path);
+
+	socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (socket_fd < 0)
+		return -1;
+	if (connect(socket_fd, (struct sockaddr *) &address, sizeof(address)) == 0)
+		reader->fd = myy_export_receive_fd(socket_fd);
+	close(socket_fd);
+	if (reader->fd < 0)
+		return -1;
+
+	/* Map the header first, to know the size of the whole thing */
+	struct myy_export_shared const * header = mmap(NULL,
+		sizeof(*header), PROT_READ, MAP_SHARED, reader->fd, 0);
+	if (header == MAP_FAILED)
+		goto error;
+	bool const valid =
+		header->magic == MYY_EXPORT_MAGIC
+		&& header->version == MYY_EXPORT_VERSION
+		&& header->n_slots > 0 && header->n_slots <= MYY_EXPORT_SLOTS;
+	size_t const map_size = header->slots_offset
+		+ header->n_slots * header->slot_size;
+	munmap((void *) header, sizeof(*header));
+	if (!valid)
+		goto error;
+
+	reader->map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, reader->fd, 0);
+	if (reader->map == MAP_FAILED)
+		goto error;
+	reader->map_size = map_size;
+	reader->shared = (struct myy_export_shared const *) reader->map;
+	/* Only frames published from now on are new */
+	reader->seen = atomic_load_explicit(
+		&reader->shared->published, memory_order_acquire);
+	return 0;
+
+error:
+	close(reader->fd);
+	reader->fd = -1;
+	reader->map = NULL;
+	return -1;
+}
+
+/* Waits for a frame newer than the last one returned, then returns
+ * the newest one. Frames published in between are skipped.
+ * timeout_ms < 0 waits forever.
+ * Returns 0 on success, -1 on timeout or error. */
+static inline int myy_export_reader_wait(
+	struct myy_export_reader * __restrict const reader,
+	struct myy_export_frame * __restrict const frame,
+	int const timeout_ms)
+{
+	struct myy_export_shared const * __restrict const shared = reader->shared;
+	struct timespec timeout = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000L
+	};
+
+	while (true) {
+		uint32_t const published =
+			atomic_load_explicit(&shared->published, memory_order_acquire);
+
+		if (published == reader->seen) {
+			/* Returns at once if published changed since */
+			long const ret = syscall(SYS_futex, &shared->published,
+				FUTEX_WAIT, published, (timeout_ms < 0) ? NULL : &timeout,
+				NULL, 0);
+			if (ret != 0 && errno == ETIMEDOUT)
+				return -1;
+			if (ret != 0 && errno != EAGAIN && errno != EINTR)
+				return -1;
+			continue;
+		}
+
+		uint32_t const slot_index = (published - 1) % shared->n_slots;
+		struct myy_export_slot const * __restrict const slot =
+			shared->slots + slot_index;
+		uint32_t const sequence =
+			atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		/* Being rewritten already. A newer frame is coming. */
+		if (sequence & 1)
+			continue;
+
+		frame->pixels = reader->map + shared->slots_offset
+			+ slot_index * shared->slot_size;
+		frame->width  = shared->width;
+		frame->height = shared->height;
+		frame->stride = shared->stride;
+		frame->frame  = slot->frame;
+		frame->timestamp_ns = slot->timestamp_ns;
+		frame->slot = slot_index;
+		frame->sequence = sequence;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->sequence, memory_order_relaxed)
+		    != sequence)
+			continue;
+
+		reader->skipped += (uint32_t) (published - reader->seen) - 1;
+		reader->seen = published;
+		return 0;
+	}
+}
+
+/* True if the frame pixels were not overwritten while being used.
+ * Call it after reading them. */
+static inline bool myy_export_reader_still_valid(
+	struct myy_export_reader const * __restrict const reader,
+	struct myy_export_frame const * __restrict const frame)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(
+		&reader->shared->slots[frame->slot].sequence, memory_order_relaxed)
+		== frame->sequence;
+}
+
+static inline void myy_export_reader_close(
+	struct myy_export_reader * __restrict const reader)
+{
+	if (reader->map != NULL)
+		munmap((void *) reader->map, reader->map_size);
+	if (reader->fd >= 0)
+		close(reader->fd);
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = -1;
+}
+
+#endif
@@ -0,0 +1,429 @@
+/* Recording format, shared by eglstreams (--capture-format=rec) and
+ * record_extract.
+ *
+ * A recording is a stream of frames, cut into tiles.
+ * Keyframes store every tile. Other frames only store the tiles that
+ * changed since the previous frame, XORed with the previous content :
+ * the unchanged pixels of a changed tile become zeroes, which the LZ
+ * codec below eats for breakfast.
+ *
+ * File layout (native endianness, so little endian in practice) :
+ *
+ *   myy_rec_header
+ *   For each frame :
+ *     myy_rec_frame
+ *     For each stored tile :
+ *       myy_rec_tile
+ *       tile data (size bytes)
+ *   myy_rec_index_entry * n_keyframes
+ *   myy_rec_trailer
+ *
+ * The index and the trailer are only written when the recording
+ * ends properly. Without them, the frames can still be found by
+ * walking the file from the start, using payload_size.
+ *
+ * Tiles are numbered left to right, top to bottom. Rows go top to
+ * bottom. Tiles on the right and bottom edges can be smaller than
+ * tile_size. A tile data is its pixels, rows after rows, without
+ * padding.
+ */
+
+#ifndef MYY_RECORDING_H
+#define MYY_RECORDING_H 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h> // off_t
+
+#define MYY_REC_MAGIC         "MYYREC01"
+#define MYY_REC_TRAILER_MAGIC "MYRINDEX"
+#define MYY_REC_FRAME_MAGIC   (0x4652594du) /* "MYRF" */
+#define MYY_REC_FORMAT_RGBA8  (1)
+
+struct myy_rec_header {
+	char magic[8];
+	uint32_t width;
+	uint32_t height;
+	uint32_t tile_size;
+	uint32_t format;
+	uint32_t keyframe_interval;
+	uint32_t reserved;
+};
+
+enum myy_rec_frame_type {
+	MYY_REC_KEYFRAME = 0,
+	MYY_REC_DELTA    = 1,
+};
+
+struct myy_rec_frame {
+	uint32_t magic;
+	uint32_t type;
+	/* The frame number of the renderer. Frames are numbered by their
+	 * position in the file, everywhere else. */
+	uint32_t frame;
+	uint32_t n_tiles;
+	uint64_t timestamp_ns;
+	/* Everything after this header, up to the next frame */
+	uint64_t payload_size;
+};
+
+enum myy_rec_tile_mode {
+	MYY_REC_TILE_RAW = 0,
+	MYY_REC_TILE_LZ  = 1,
+};
+
+struct myy_rec_tile {
+	uint32_t index;
+	uint32_t size;
+	uint32_t mode;
+	uint32_t reserved;
+};
+
+struct myy_rec_index_entry {
+	uint64_t offset; /* Of the myy_rec_frame */
+	uint64_t timestamp_ns;
+	uint32_t frame;  /* Position in the file */
+	uint32_t reserved;
+};
+
+struct myy_rec_trailer {
+	char magic[8];
+	uint64_t index_offset;
+	uint32_t n_keyframes;
+	uint32_t n_frames;
+};
+
+/* LZ codec.
+ *
+ * Byte oriented LZ77, same sequence layout as LZ4 blocks :
+ * - A token. High nibble : number of literals. Low nibble : match
+ *   length - 4. 15 means "more", followed by bytes that are added
+ *   until one of them is not 255.
+ * - The literals.
+ * - The match offset, 2 bytes, little endian. Absent from the last
+ *   sequence, which only has literals.
+ *
+ * No entropy coding. It is made for speed, on tiles that are mostly
+ * zeroes or flat colours.
+ */
+#define MYY_LZ_HASH_BITS   (12)
+#define MYY_LZ_MIN_MATCH   (4)
+#define MYY_LZ_MAX_OFFSET  (65535)
+/* The last literals are never part of a match. Keeps the
+ * compressor loops simple. */
+#define MYY_LZ_LAST_LITERALS (5)
+#define MYY_LZ_MATCH_LIMIT   (12)
+
+static inline uint32_t myy_lz_read32(uint8_t const * __restrict const p)
+{
+	uint32_t value;
+	memcpy(&value, p, 4);
+	return value;
+}
+
+static inline uint32_t myy_lz_hash(uint32_t const sequence)
+{
+	return (sequence * 2654435761u) >> (32 - MYY_LZ_HASH_BITS);
+}
+
+/* Worst case size, for incompressible data */
+static inline size_t myy_lz_bound(size_t const size)
+{
+	return size + size / 255 + 16;
+}
+
+static inline uint8_t * myy_lz_put_length(
+	uint8_t * __restrict out,
+	size_t length)
+{
+	while (length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = (uint8_t) length;
+	return out;
+}
+
+/* Returns NULL when the sequence would not fit */
+static inline uint8_t * myy_lz_put_sequence(
+	uint8_t * __restrict out,
+	uint8_t const * __restrict const out_end,
+	uint8_t const * __restrict const literals,
+	size_t const n_literals,
+	size_t const offset,
+	size_t const match_length)
+{
+	size_t const needed =
+		1 + n_literals / 255 + 1 + n_literals + 2 + match_length / 255 + 1;
+	uint8_t * __restrict const token = out;
+
+	if ((size_t) (out_end - out) < needed)
+		return NULL;
+
+	out++;
+	*token = (uint8_t) (((n_literals >= 15) ? 15 : n_literals) << 4);
+	if (n_literals >= 15)
+		out = myy_lz_put_length(out, n_literals - 15);
+	memcpy(out, literals, n_literals);
+	out += n_literals;
+
+	if (match_length == 0)
+		return out;
+
+	size_t const coded_length = match_length - MYY_LZ_MIN_MATCH;
+	*out++ = (uint8_t) (offset & 0xff);
+	*out++ = (uint8_t) (offset >> 8);
+	*token |= (uint8_t) ((coded_length >= 15) ? 15 : coded_length);
+	if (coded_length >= 15)
+		out = myy_lz_put_length(out, coded_length - 15);
+	return out;
+}
+
+/* Returns the compressed size, or 0 if it does not fit in
+ * capacity. Nothing is worth compressing if it grows anyway. */
+static inline size_t myy_lz_compress(
+	uint8_t const * __restrict const in,
+	size_t const size,
+	uint8_t * __restrict const out,
+	size_t const capacity)
+{
+	uint32_t table[1 << MYY_LZ_HASH_BITS];
+	uint8_t * __restrict op = out;
+	uint8_t const * __restrict const out_end = out + capacity;
+	size_t anchor = 0;
+	size_t ip = 0;
+
+	memset(table, 0, sizeof(table));
+
+	if (size > MYY_LZ_MATCH_LIMIT) {
+		size_t const limit = size - MYY_LZ_MATCH_LIMIT;
+		size_t const match_end = size - MYY_LZ_LAST_LITERALS;
+
+		while (ip < limit) {
+			uint32_t const sequence = myy_lz_read32(in + ip);
+			uint32_t const h = myy_lz_hash(sequence);
+			size_t const ref = table[h];
+			table[h] = (uint32_t) ip;
+
+			if (ref >= ip || ip - ref > MYY_LZ_MAX_OFFSET
+			    || myy_lz_read32(in + ref) != sequence)
+			{
+				/* Go faster over data that does not compress */
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			size_t length = MYY_LZ_MIN_MATCH;
+			while (ip + length < match_end && in[ref + length] == in[ip + length])
+				length++;
+
+			op = myy_lz_put_sequence(op, out_end,
+				in + anchor, ip - anchor, ip - ref, length);
+			if (op == NULL)
+				return 0;
+
+			ip += length;
+			anchor = ip;
+		}
+	}
+
+	op = myy_lz_put_sequence(op, out_end, in + anchor, size - anchor, 0, 0);
+	return (op != NULL) ? (size_t) (op - out) : 0;
+}
+
+static inline int myy_lz_get_length(
+	uint8_t const * __restrict * __restrict const ip,
+	uint8_t const * __restrict const in_end,
+	size_t * __restrict const length)
+{
+	uint8_t byte;
+	do {
+		if (*ip >= in_end)
+			return -1;
+		byte = *(*ip)++;
+		*length += byte;
+	} while (byte == 255);
+	return 0;
+}
+
+/* Returns the decompressed size, or -1 on corrupted data.
+ * Never reads or writes out of bounds. */
+static inline long myy_lz_decompress(
+	uint8_t const * __restrict const in,
+	size_t const size,
+	uint8_t * __restrict const out,
+	size_t const capacity)
+{
+	uint8_t const * __restrict ip = in;
+	uint8_t const * __restrict const in_end = in + size;
+	size_t op = 0;
+
+	while (ip < in_end) {
+		uint8_t const token = *ip++;
+		size_t n_literals = token >> 4;
+
+		if (n_literals == 15 && myy_lz_get_length(&ip, in_end, &n_literals))
+			return -1;
+		if ((size_t) (in_end - ip) < n_literals || capacity - op < n_literals)
+			return -1;
+		memcpy(out + op, ip, n_literals);
+		ip += n_literals;
+		op += n_literals;
+
+		/* Last sequence */
+		if (ip == in_end)
+			break;
+
+		if (in_end - ip < 2)
+			return -1;
+		size_t const offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t length = token & 15;
+		if (length == 15 && myy_lz_get_length(&ip, in_end, &length))
+			return -1;
+		length += MYY_LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > op || capacity - op < length)
+			return -1;
+		/* Overlapping copies are the point (runs), so byte by byte */
+		for (size_t i = 0; i < length; i++, op++)
+			out[op] = out[op - offset];
+	}
+
+	return (long) op;
+}
+
+/* Reader, used by record_extract and by the eglstreams recording
+ * self-check. */
+struct myy_rec_file {
+	FILE * file;
+	struct myy_rec_header header;
+	struct myy_rec_index_entry * keyframes;
+	uint32_t n_keyframes;
+	uint32_t n_frames;
+	bool indexed;
+};
+
+static inline int myy_rec_read_at(
+	FILE * __restrict const file,
+	uint64_t const offset,
+	void * __restrict const data,
+	size_t const size)
+{
+	if (fseeko(file, (off_t) offset, SEEK_SET) != 0)
+		return -1;
+	return (fread(data, 1, size, file) == size) ? 0 : -1;
+}
+
+/* Walks every frame header, from the start. For recordings that
+ * were interrupted. Stops at the first incomplete frame. */
+static inline int myy_rec_scan(struct myy_rec_file * __restrict const rec)
+{
+	uint64_t offset = sizeof(rec->header);
+	uint32_t capacity = 0;
+	struct myy_rec_frame frame;
+
+	if (fseeko(rec->file, 0, SEEK_END) != 0)
+		return -1;
+	uint64_t const file_size = ftello(rec->file);
+
+	while (myy_rec_read_at(rec->file, offset, &frame, sizeof(frame)) == 0
+	       && frame.magic == MYY_REC_FRAME_MAGIC)
+	{
+		uint64_t const next = offset + sizeof(frame) + frame.payload_size;
+		/* Is the whole frame there ? */
+		if (next > file_size)
+			break;
+
+		if (frame.type == MYY_REC_KEYFRAME) {
+			if (rec->n_keyframes == capacity) {
+				capacity = capacity ? capacity * 2 : 64;
+				struct myy_rec_index_entry * const keyframes = realloc(
+					rec->keyframes, capacity * sizeof(*keyframes));
+				if (keyframes == NULL)
+					return -1;
+				rec->keyframes = keyframes;
+			}
+			struct myy_rec_index_entry * const entry =
+				rec->keyframes + rec->n_keyframes++;
+			entry->offset = offset;
+			entry->timestamp_ns = frame.timestamp_ns;
+			entry->frame = rec->n_frames;
+			entry->reserved = 0;
+		}
+		rec->n_frames++;
+		offset = next;
+	}
+	return 0;
+}
+
+/* Applies the frame at offset to pixels, which must hold the frame
+ * before it, unless it is a keyframe. Returns the offset of the next
+ * frame, or 0 if the frame is missing or corrupted. */
+static inline uint64_t myy_rec_apply_frame(
+	struct myy_rec_file const * __restrict const rec,
+	uint64_t const offset,
+	uint8_t * __restrict const pixels,
+	uint8_t * __restrict const tile_data,
+	uint8_t * __restrict const compressed)
+{
+	struct myy_rec_header const * __restrict const h = &rec->header;
+	uint32_t const tiles_x = (h->width  + h->tile_size - 1) / h->tile_size;
+	uint32_t const tiles_y = (h->height + h->tile_size - 1) / h->tile_size;
+	size_t const max_tile = (size_t) h->tile_size * h->tile_size * 4;
+	struct myy_rec_frame frame;
+	uint64_t position = offset + sizeof(frame);
+
+	if (myy_rec_read_at(rec->file, offset, &frame, sizeof(frame))
+	    || frame.magic != MYY_REC_FRAME_MAGIC)
+		return 0;
+
+	for (uint32_t t = 0; t < frame.n_tiles; t++) {
+		struct myy_rec_tile tile;
+		if (myy_rec_read_at(rec->file, position, &tile, sizeof(tile))
+		    || tile.index >= tiles_x * tiles_y
+		    || tile.size > myy_lz_bound(max_tile))
+			return 0;
+		position += sizeof(tile);
+
+		uint32_t const x = (tile.index % tiles_x) * h->tile_size;
+		uint32_t const y = (tile.index / tiles_x) * h->tile_size;
+		uint32_t const width  =
+			(h->width  - x < h->tile_size) ? h->width  - x : h->tile_size;
+		uint32_t const height =
+			(h->height - y < h->tile_size) ? h->height - y : h->tile_size;
+		size_t const row_size = (size_t) width * 4;
+		size_t const tile_size = row_size * height;
+
+		if (myy_rec_read_at(rec->file, position, compressed, tile.size))
+			return 0;
+		position += tile.size;
+
+		if (tile.mode == MYY_REC_TILE_RAW && tile.size == tile_size) {
+			memcpy(tile_data, compressed, tile_size);
+		}
+		else if (tile.mode != MYY_REC_TILE_LZ
+		         || myy_lz_decompress(compressed, tile.size,
+		                              tile_data, tile_size) != (long) tile_size)
+			return 0;
+
+		uint8_t * __restrict row = pixels + ((size_t) y * h->width + x) * 4;
+		for (uint32_t r = 0; r < height; r++, row += (size_t) h->width * 4) {
+			uint8_t const * __restrict const in = tile_data + r * row_size;
+			if (frame.type == MYY_REC_KEYFRAME) {
+				memcpy(row, in, row_size);
+			}
+			else {
+				for (size_t b = 0; b < row_size; b++)
+					row[b] ^= in[b];
+			}
+		}
+	}
+
+	return position;
+}
+
+#endif
@@ -0,0 +1,311 @@
+// gcc -O2 -o record_extract record_extract.c
+
+/* Extracts frames from the recordings written by
+ * eglstreams --capture-format=rec
+ *
+ *   record_extract capture.myyrec
+ *     Lists the frames and keyframes.
+ *   record_extract capture.myyrec N output.png
+ *   record_extract capture.myyrec N output.rgba
+ *     Extracts the Nth frame of the recording (from 0), as a PNG or
+ *     as raw RGBA pixels.
+ *
+ * Frames are rebuilt from the closest keyframe before them.
+ * Recordings that were not closed properly have no index. The
+ * frames are then found by walking the whole file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "myy_recording.h"
+
+#define LOG_ERROR(fmt, ...) \
+	fprintf(stderr, "[record_extract] " fmt "\n", ##__VA_ARGS__)
+
+static int myy_rec_open(
+	struct myy_rec_file * __restrict const rec,
+	char const * __restrict const path)
+{
+	struct myy_rec_trailer trailer;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->file = fopen(path, "rb");
+	if (rec->file == NULL) {
+		LOG_ERROR("Could not open %s", path);
+		return -1;
+	}
+
+	if (myy_rec_read_at(rec->file, 0, &rec->header, sizeof(rec->header))
+	    || memcmp(rec->header.magic, MYY_REC_MAGIC, 8) != 0
+	    || rec->header.format != MYY_REC_FORMAT_RGBA8
+	    || rec->header.tile_size == 0)
+	{
+		LOG_ERROR("%s is not a recording this tool understands", path);
+		goto error;
+	}
+
+	if (fseeko(rec->file, -(off_t) sizeof(trailer), SEEK_END) == 0
+	    && fread(&trailer, sizeof(trailer), 1, rec->file) == 1
+	    && memcmp(trailer.magic, MYY_REC_TRAILER_MAGIC, 8) == 0)
+	{
+		size_t const index_size =
+			trailer.n_keyframes * sizeof(*rec->keyframes);
+		rec->keyframes = malloc(index_size + 1);
+		if (rec->keyframes != NULL
+		    && myy_rec_read_at(rec->file, trailer.index_offset,
+		                       rec->keyframes, index_size) == 0)
+		{
+			rec->n_keyframes = trailer.n_keyframes;
+			rec->n_frames = trailer.n_frames;
+			rec->indexed = true;
+			return 0;
+		}
+		free(rec->keyframes);
+		rec->keyframes = NULL;
+	}
+
+	LOG_ERROR("No index in %s. Walking through the frames...", path);
+	if (myy_rec_scan(rec) == 0)
+		return 0;
+
+error:
+	fclose(rec->file);
+	return -1;
+}
+
+/* PNG, without zlib : the pixels are stored in uncompressed
+ * deflate blocks. Big files, but any viewer opens them. */
+static uint32_t myy_crc_table[256];
+
+static void myy_crc_init(void)
+{
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+		myy_crc_table[n] = c;
+	}
+}
+
+static uint32_t myy_crc_update(
+	uint32_t crc,
+	uint8_t const * __restrict const data,
+	size_t const size)
+{
+	for (size_t i = 0; i < size; i++)
+		crc = myy_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static void myy_put_be32(uint8_t * __restrict const out, uint32_t const value)
+{
+	out[0] = value >> 24;
+	out[1] = value >> 16;
+	out[2] = value >> 8;
+	out[3] = value;
+}
+
+static int myy_png_chunk(
+	FILE * __restrict const file,
+	char const * __restrict const type,
+	uint8_t const * __restrict const data,
+	uint32_t const size)
+{
+	uint8_t header[8], footer[4];
+	myy_put_be32(header, size);
+	memcpy(header + 4, type, 4);
+	uint32_t crc = myy_crc_update(0xffffffffu, header + 4, 4);
+	crc = myy_crc_update(crc, data, size) ^ 0xffffffffu;
+	myy_put_be32(footer, crc);
+
+	bool const written =
+		fwrite(header, 8, 1, file) == 1
+		&& (size == 0 || fwrite(data, size, 1, file) == 1)
+		&& fwrite(footer, 4, 1, file) == 1;
+	return written ? 0 : -1;
+}
+
+static int myy_write_png(
+	char const * __restrict const path,
+	uint8_t const * __restrict const pixels,
+	uint32_t const width,
+	uint32_t const height)
+{
+	static uint8_t const signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+	};
+	size_t const row_size = (size_t) width * 4;
+	size_t const raw_size = (row_size + 1) * height; /* + filter byte */
+	size_t const n_blocks = (raw_size + 65534) / 65535;
+	size_t const idat_size = 2 + raw_size + n_blocks * 5 + 4;
+	uint8_t ihdr[13];
+	int ret = -1;
+
+	uint8_t * __restrict const raw = malloc(raw_size);
+	uint8_t * __restrict const idat = malloc(idat_size);
+	FILE * __restrict const file = fopen(path, "wb");
+	if (raw == NULL || idat == NULL || file == NULL) {
+		LOG_ERROR("Could not write %s", path);
+		goto out;
+	}
+
+	for (uint32_t y = 0; y < height; y++) {
+		raw[y * (row_size + 1)] = 0; /* No filter */
+		memcpy(raw + y * (row_size + 1) + 1, pixels + y * row_size, row_size);
+	}
+
+	/* zlib stream : header, stored blocks, adler32 */
+	uint8_t * __restrict out = idat;
+	uint32_t a = 1, b = 0;
+	*out++ = 0x78;
+	*out++ = 0x01;
+	for (size_t done = 0; done < raw_size; ) {
+		size_t const block = (raw_size - done > 65535) ? 65535 : raw_size - done;
+		*out++ = (done + block == raw_size); /* BFINAL, stored */
+		*out++ = block & 0xff;
+		*out++ = block >> 8;
+		*out++ = ~block & 0xff;
+		*out++ = (~block >> 8) & 0xff;
+		memcpy(out, raw + done, block);
+		for (size_t i = 0; i < block; i++) {
+			a = (a + raw[done + i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		out += block;
+		done += block;
+	}
+	myy_put_be32(out, (b << 16) | a);
+
+	myy_put_be32(ihdr, width);
+	myy_put_be32(ihdr + 4, height);
+	ihdr[8]  = 8; /* Bits per channel */
+	ihdr[9]  = 6; /* RGBA */
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = 0;
+
+	myy_crc_init();
+	if (fwrite(signature, 8, 1, file) == 1
+	    && myy_png_chunk(file, "IHDR", ihdr, sizeof(ihdr)) == 0
+	    && myy_png_chunk(file, "IDAT", idat, idat_size) == 0
+	    && myy_png_chunk(file, "IEND", NULL, 0) == 0)
+		ret = 0;
+	else
+		LOG_ERROR("Could not write %s", path);
+
+out:
+	if (file != NULL && fclose(file) != 0)
+		ret = -1;
+	free(idat);
+	free(raw);
+	return ret;
+}
+
+static int myy_rec_list(struct myy_rec_file const * __restrict const rec)
+{
+	printf("%ux%u, %u frames, %u keyframes (one every %u frames)%s\n",
+		rec->header.width, rec->header.height,
+		rec->n_frames, rec->n_keyframes, rec->header.keyframe_interval,
+		rec->indexed ? "" : ", not indexed");
+	for (uint32_t k = 0; k < rec->n_keyframes; k++) {
+		printf("  keyframe : frame %6u at offset %12" PRIu64 ", %.3f s\n",
+			rec->keyframes[k].frame, rec->keyframes[k].offset,
+			(rec->keyframes[k].timestamp_ns
+			 - rec->keyframes[0].timestamp_ns) / 1e9);
+	}
+	return 0;
+}
+
+static int myy_rec_extract(
+	struct myy_rec_file const * __restrict const rec,
+	uint32_t const wanted,
+	char const * __restrict const output)
+{
+	struct myy_rec_header const * __restrict const h = &rec->header;
+	size_t const frame_size = (size_t) h->width * h->height * 4;
+	size_t const max_tile = (size_t) h->tile_size * h->tile_size * 4;
+	struct myy_rec_index_entry const * __restrict keyframe = NULL;
+	int ret = -1;
+
+	if (wanted >= rec->n_frames) {
+		LOG_ERROR("There are only %u frames", rec->n_frames);
+		return -1;
+	}
+	for (uint32_t k = 0; k < rec->n_keyframes; k++) {
+		if (rec->keyframes[k].frame <= wanted)
+			keyframe = rec->keyframes + k;
+	}
+	if (keyframe == NULL) {
+		LOG_ERROR("No keyframe before the frame %u", wanted);
+		return -1;
+	}
+
+	uint8_t * __restrict const pixels = calloc(frame_size, 1);
+	uint8_t * __restrict const tile_data = malloc(max_tile);
+	uint8_t * __restrict const compressed = malloc(myy_lz_bound(max_tile));
+	if (pixels == NULL || tile_data == NULL || compressed == NULL)
+		goto out;
+
+	uint64_t offset = keyframe->offset;
+	for (uint32_t f = keyframe->frame; f <= wanted && offset; f++) {
+		uint64_t const next =
+			myy_rec_apply_frame(rec, offset, pixels, tile_data, compressed);
+		if (next == 0)
+			LOG_ERROR("The frame %u, at offset %" PRIu64 ", is corrupted",
+				f, offset);
+		offset = next;
+	}
+	if (offset == 0)
+		goto out;
+
+	size_t const length = strlen(output);
+	if (length > 4 && strcmp(output + length - 4, ".png") == 0) {
+		ret = myy_write_png(output, pixels, h->width, h->height);
+	}
+	else {
+		FILE * __restrict const file = fopen(output, "wb");
+		ret = (file != NULL && fwrite(pixels, frame_size, 1, file) == 1) ? 0 : -1;
+		if (file != NULL && fclose(file) != 0)
+			ret = -1;
+		if (ret)
+			LOG_ERROR("Could not write %s", output);
+	}
+	if (ret == 0)
+		printf("Frame %u (from the keyframe %u) -> %s\n",
+			wanted, keyframe->frame, output);
+
+out:
+	free(compressed);
+	free(tile_data);
+	free(pixels);
+	return ret;
+}
+
+int main(int argc, char ** argv)
+{
+	struct myy_rec_file rec;
+	int ret;
+
+	if (argc != 2 && argc != 4) {
+		fprintf(stderr,
+			"Usage : %s RECORDING [FRAME OUTPUT.png|OUTPUT.rgba]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (myy_rec_open(&rec, argv[1]))
+		return 1;
+
+	ret = (argc == 2)
+		? myy_rec_list(&rec)
+		: myy_rec_extract(&rec, strtoul(argv[2], NULL, 10), argv[3]);
+
+	free(rec.keyframes);
+	fclose(rec.file);
+	return ret ? 1 : 0;
+}
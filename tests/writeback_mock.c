@@ -0,0 +1,345 @@
+/* Writeback capture, checked against a fake KMS device.
+ *
+ * No display, no GPU : the libdrm calls used by the dumb buffers and
+ * the atomic commits are replaced below. The fake device keeps every
+ * dumb buffer in one memfd. A commit setting WRITEBACK_FB_ID copies
+ * the framebuffer the plane scans out into the writeback one, then
+ * hands out a signalled out-fence (an eventfd).
+ *
+ * Both configurations are checked :
+ * - --writeback alone, the capture queues the jobs itself ;
+ * - --writeback with --render-device, the scanout flips the frames
+ *   and myy_writeback_capture captures what it shows.
+ * Each frame is written as PAM, and compared with the RGBA pixels
+ * presented.
+ *
+ * Build, from the top directory :
+ *   cc -std=gnu11 -O1 -o writeback_mock tests/writeback_mock.c \
+ *     $(pkg-config --cflags --libs libdrm egl glesv2) -lm -pthread
+ * Run :
+ *   ./writeback_mock /tmp/writeback_mock
+ */
+#define main eglstreams_main
+#include "../eglstreams.c"
+#undef main
+
+#include <sys/eventfd.h>
+
+#define MOCK_WIDTH  (8)
+#define MOCK_HEIGHT (4)
+#define MOCK_PITCH  (MOCK_WIDTH * 4 + 32)
+#define MOCK_BUFFER_SIZE (4096)
+#define MOCK_BUFFERS (16)
+#define MOCK_FRAMES (3)
+
+#define MOCK_PROP_PLANE_FB_ID (20)
+#define MOCK_PROP_WB_CRTC_ID (31)
+#define MOCK_PROP_WB_FB_ID (32)
+#define MOCK_PROP_WB_OUT_FENCE_PTR (33)
+
+struct mock_prop {
+	uint32_t object_id;
+	uint32_t property_id;
+	uint64_t value;
+};
+
+struct _drmModeAtomicReq {
+	struct mock_prop props[16];
+	int cursor;
+};
+
+static int mock_memfd = -1;
+static uint32_t mock_handles;
+/* Framebuffer scanned out by the plane */
+static uint32_t mock_shown_fb;
+static uint32_t mock_writeback_jobs;
+
+static uint8_t * mock_fb_memory(uint32_t const fb_id)
+{
+	return mmap(NULL, MOCK_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED, mock_memfd, (off_t) (fb_id - 100) * MOCK_BUFFER_SIZE);
+}
+
+drmModeAtomicReqPtr drmModeAtomicAlloc(void)
+{
+	return calloc(1, sizeof(struct _drmModeAtomicReq));
+}
+
+void drmModeAtomicFree(drmModeAtomicReqPtr req)
+{
+	free(req);
+}
+
+void drmModeAtomicSetCursor(drmModeAtomicReqPtr req, int cursor)
+{
+	req->cursor = cursor;
+}
+
+int drmModeAtomicGetCursor(drmModeAtomicReqPtr req)
+{
+	return req->cursor;
+}
+
+int drmModeAtomicAddProperty(drmModeAtomicReqPtr req,
+	uint32_t object_id, uint32_t property_id, uint64_t value)
+{
+	if (req->cursor == ARRAY_SIZE(req->props))
+		return -ENOMEM;
+	req->props[req->cursor++] = (struct mock_prop) {
+		object_id, property_id, value };
+	return req->cursor;
+}
+
+int drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req,
+	uint32_t flags, void * user_data)
+{
+	uint32_t writeback_fb = 0;
+	int32_t * out_fence = NULL;
+
+	for (int p = 0; p < req->cursor; p++) {
+		struct mock_prop const * __restrict const prop = req->props + p;
+		switch (prop->property_id) {
+		case MOCK_PROP_PLANE_FB_ID:
+			mock_shown_fb = prop->value;
+			break;
+		case MOCK_PROP_WB_FB_ID:
+			writeback_fb = prop->value;
+			break;
+		case MOCK_PROP_WB_OUT_FENCE_PTR:
+			out_fence = (int32_t *) (uintptr_t) prop->value;
+			break;
+		}
+	}
+
+	if (writeback_fb == 0)
+		return 0;
+	if (out_fence == NULL)
+		return -EINVAL;
+
+	/* "Compose" : the plane only, B,G,R,X */
+	uint8_t * __restrict const dst = mock_fb_memory(writeback_fb);
+	if (mock_shown_fb != 0) {
+		uint8_t * __restrict const src = mock_fb_memory(mock_shown_fb);
+		memcpy(dst, src, MOCK_BUFFER_SIZE);
+		munmap(src, MOCK_BUFFER_SIZE);
+	}
+	else {
+		for (uint32_t b = 0; b < MOCK_BUFFER_SIZE; b += 4)
+			memcpy(dst + b, (uint8_t const []) { 3, 2, 1, 0 }, 4);
+	}
+	munmap(dst, MOCK_BUFFER_SIZE);
+
+	*out_fence = eventfd(1, EFD_CLOEXEC);
+	mock_writeback_jobs++;
+	return 0;
+}
+
+int drmIoctl(int fd, unsigned long request, void * arg)
+{
+	if (request == DRM_IOCTL_MODE_CREATE_DUMB) {
+		struct drm_mode_create_dumb * __restrict const create = arg;
+		if (mock_handles == MOCK_BUFFERS)
+			return -1;
+		create->handle = ++mock_handles;
+		create->pitch  = MOCK_PITCH;
+		create->size   = (uint64_t) create->pitch * create->height;
+		return 0;
+	}
+	if (request == DRM_IOCTL_MODE_MAP_DUMB) {
+		struct drm_mode_map_dumb * __restrict const map = arg;
+		map->offset = (uint64_t) map->handle * MOCK_BUFFER_SIZE;
+		return 0;
+	}
+	return 0;
+}
+
+int drmModeAddFB(int fd, uint32_t width, uint32_t height,
+	uint8_t depth, uint8_t bpp, uint32_t pitch, uint32_t bo_handle,
+	uint32_t * buf_id)
+{
+	*buf_id = 100 + bo_handle;
+	return 0;
+}
+
+int drmModeAddFB2(int fd, uint32_t width, uint32_t height,
+	uint32_t pixel_format, uint32_t const bo_handles[4],
+	uint32_t const pitches[4], uint32_t const offsets[4],
+	uint32_t * buf_id, uint32_t flags)
+{
+	*buf_id = 100 + bo_handles[0];
+	return 0;
+}
+
+int drmModeRmFB(int fd, uint32_t buffer_id)
+{
+	return 0;
+}
+
+static void mock_frame_pixels(
+	uint8_t * __restrict const rgba,
+	uint32_t const frame)
+{
+	for (uint32_t p = 0; p < MOCK_WIDTH * MOCK_HEIGHT; p++) {
+		rgba[p*4+0] = frame * 40 + p;
+		rgba[p*4+1] = 0x80 + p;
+		rgba[p*4+2] = 0xf0 - p;
+		rgba[p*4+3] = 0xff;
+	}
+}
+
+/* The PAM file of frame, against the pixels that frame showed */
+static bool mock_check_pam(
+	char const * __restrict const dir,
+	uint32_t const frame,
+	uint32_t const shown)
+{
+	uint8_t expected[MOCK_WIDTH * MOCK_HEIGHT * 4];
+	char contents[512];
+	char path[300];
+	bool ok = false;
+
+	snprintf(path, sizeof(path), "%s/frame-%08u.pam", dir, frame);
+	FILE * __restrict const file = fopen(path, "rb");
+	if (file == NULL) {
+		LOG_ERROR("No %s", path);
+		return false;
+	}
+	size_t const size = fread(contents, 1, sizeof(contents), file);
+	fclose(file);
+
+	mock_frame_pixels(expected, shown);
+	char const * __restrict const end = memmem(
+		contents, size, "ENDHDR\n", 7);
+	if (end == NULL)
+		LOG_ERROR("%s : no PAM header", path);
+	else if ((size_t) (contents + size - (end + 7)) != sizeof(expected))
+		LOG_ERROR("%s : %zu bytes of pixels", path,
+			(size_t) (contents + size - (end + 7)));
+	else if (memcmp(end + 7, expected, sizeof(expected)) != 0)
+		LOG_ERROR("%s : not the pixels of frame %u", path, shown);
+	else
+		ok = true;
+	return ok;
+}
+
+static void mock_device_init(myy_drm_infos_t * __restrict const drm)
+{
+	mock_memfd = memfd_create("mock-kms", MFD_CLOEXEC);
+	ftruncate(mock_memfd, (off_t) (MOCK_BUFFERS + 1) * MOCK_BUFFER_SIZE);
+	mock_handles = 0;
+	mock_shown_fb = 0;
+	mock_writeback_jobs = 0;
+
+	memset(drm, 0, sizeof(*drm));
+	drm->fd = mock_memfd;
+	drm->crtc_id = 7;
+	drm->plane_id = 8;
+	drm->width = MOCK_WIDTH;
+	drm->height = MOCK_HEIGHT;
+	drm->props_ids.plane.fb_id = MOCK_PROP_PLANE_FB_ID;
+	pthread_mutex_init(&drm->commit_lock, NULL);
+	myy_drm_atomic_pool_init(drm);
+
+	memset(&myy_writeback, 0, sizeof(myy_writeback));
+	myy_writeback.enabled = true;
+	myy_writeback.drm = drm;
+	myy_writeback.connector_id = 9;
+	myy_writeback.props.crtc_id = MOCK_PROP_WB_CRTC_ID;
+	myy_writeback.props.fb_id = MOCK_PROP_WB_FB_ID;
+	myy_writeback.props.out_fence_ptr = MOCK_PROP_WB_OUT_FENCE_PTR;
+	myy_writeback.fourcc = DRM_FORMAT_XRGB8888;
+	myy_writeback.order = MYY_PIXELS_BGRX;
+}
+
+static void mock_device_deinit(myy_drm_infos_t * __restrict const drm)
+{
+	myy_drm_atomic_pool_deinit(drm);
+	pthread_mutex_destroy(&drm->commit_lock);
+	close(mock_memfd);
+	mock_memfd = -1;
+}
+
+/* --writeback : the capture queues its own jobs */
+static bool mock_writeback_alone(char const * __restrict const dir)
+{
+	myy_drm_infos_t drm;
+	bool ok = true;
+
+	mock_device_init(&drm);
+	if (myy_capture_init(&myy_capture, 1, dir, MYY_CAPTURE_PAM, true,
+		NULL, NULL, &myy_writeback, MOCK_WIDTH, MOCK_HEIGHT) != 0)
+		return false;
+
+	/* Someone else's frames on the plane. Shown as they are. */
+	struct myy_drm_dumb_buffer plane;
+	if (!drm_dumb_buffer_create(drm.fd, MOCK_WIDTH, MOCK_HEIGHT,
+		DRM_FORMAT_XRGB8888, true, &plane))
+		return false;
+	mock_shown_fb = plane.fb_id;
+	for (uint32_t f = 0; f < MOCK_FRAMES; f++) {
+		uint8_t rgba[MOCK_WIDTH * MOCK_HEIGHT * 4];
+		mock_frame_pixels(rgba, f);
+		myy_convert_swizzle(rgba, MOCK_WIDTH * 4, plane.map, plane.pitch,
+			MOCK_WIDTH, MOCK_HEIGHT);
+		myy_capture_frame(&myy_capture, f);
+		myy_capture_poll(&myy_capture, true);
+	}
+	myy_capture_deinit(&myy_capture);
+
+	for (uint32_t f = 0; f < MOCK_FRAMES; f++)
+		ok &= mock_check_pam(dir, f, f);
+	LOGF("--writeback : %u jobs", mock_writeback_jobs);
+	drm_dumb_buffer_destroy(drm.fd, &plane);
+	mock_device_deinit(&drm);
+	return ok & (mock_writeback_jobs == MOCK_FRAMES);
+}
+
+/* --writeback --render-device : the scanout flips, on the capture
+ * writer thread in the program, and the writeback captures the
+ * flipped frames */
+static bool mock_writeback_beside_scanout(char const * __restrict const dir)
+{
+	myy_drm_infos_t drm;
+	bool ok = true;
+
+	mock_device_init(&drm);
+	if (myy_scanout_init(&myy_scanout, &drm) != 0)
+		return false;
+	if (myy_capture_init(&myy_writeback_capture, 1, dir, MYY_CAPTURE_PAM,
+		true, NULL, NULL, &myy_writeback, MOCK_WIDTH, MOCK_HEIGHT) != 0)
+		return false;
+
+	for (uint32_t f = 0; f < MOCK_FRAMES; f++) {
+		uint8_t rgba[MOCK_WIDTH * MOCK_HEIGHT * 4];
+		mock_frame_pixels(rgba, f);
+		myy_scanout_present(&myy_scanout, rgba, MOCK_WIDTH * 4,
+			myy_clock_ns());
+		myy_capture_frame(&myy_writeback_capture, f);
+		myy_capture_poll(&myy_writeback_capture, true);
+	}
+	myy_capture_deinit(&myy_writeback_capture);
+
+	for (uint32_t f = 0; f < MOCK_FRAMES; f++)
+		ok &= mock_check_pam(dir, f, f);
+	LOGF("--writeback --render-device : %u flips, %u jobs",
+		atomic_load(&myy_scanout.flips), mock_writeback_jobs);
+	ok &= (atomic_load(&myy_scanout.flips) == MOCK_FRAMES);
+	myy_scanout_deinit(&myy_scanout);
+	mock_device_deinit(&drm);
+	return ok & (mock_writeback_jobs == MOCK_FRAMES);
+}
+
+int main(int argc, char ** argv)
+{
+	char alone[256], beside[256];
+	char const * __restrict const dir =
+		(argc > 1) ? argv[1] : "/tmp/writeback_mock";
+
+	snprintf(alone, sizeof(alone), "%s/alone", dir);
+	snprintf(beside, sizeof(beside), "%s/beside-scanout", dir);
+
+	bool const ok = mock_writeback_alone(alone)
+		& mock_writeback_beside_scanout(beside);
+	LOGF("%s", ok ? "OK" : "FAILED");
+	return ok ? 0 : 1;
+}